@@ -0,0 +1,46 @@
+#ifndef __FEGA_BENCH_H_INCLUDED__
+#define __FEGA_BENCH_H_INCLUDED__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Helpers shared by the benchmarks */
+
+static inline uint64_t
+bench_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t
+bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Keeps the compiler from dropping the work done on p */
+#define bench_clobber(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+static inline int
+bench_cmp_u64(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/* Sorts the samples in place */
+static inline uint64_t
+bench_percentile(uint64_t* samples, size_t n, unsigned int p)
+{
+  if(n == 0) return 0;
+  qsort(samples, n, sizeof(uint64_t), bench_cmp_u64);
+  size_t i = (n * p + 99) / 100;
+  return samples[(i == 0)?0:(i - 1)];
+}
+
+#endif /* !__FEGA_BENCH_H_INCLUDED__ */
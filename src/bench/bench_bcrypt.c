@@ -0,0 +1,328 @@
+/*
+ * bcrypt throughput of the blowfish/ code built into pam_ega_auth.so
+ *
+ *   - checks every BF_body() kernel this CPU can run against the known-answer
+ *     vectors (what used to be the TEST build of blowfish/wrapper.c)
+ *   - hashes/sec per kernel and cost factor, on one core
+ *   - hashes/sec with 1 to N threads at one cost factor, with the kernel
+ *     pam_ega_auth.so would pick, to show how it scales across cores
+ *
+ * Usage: bench_bcrypt [-c min_cost-max_cost] [-s scaling cost] [-t seconds per run] [-j max threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "blowfish/ow-crypt.h"
+#include "blowfish/crypt_blowfish.h"
+#include "bench/bench.h"
+
+static const char *tests[][3] = {
+	{"$2a$05$CCCCCCCCCCCCCCCCCCCCC.E5YPO9kmyuRGyh0XouQYb4YMJKvyOeW",
+		"U*U"},
+	{"$2a$05$CCCCCCCCCCCCCCCCCCCCC.VGOzA784oUp/Z0DY336zx7pLYAy0lwK",
+		"U*U*"},
+	{"$2a$05$XXXXXXXXXXXXXXXXXXXXXOAcXxm9kjPGEMsLznoKqmqw7tc8WCx4a",
+		"U*U*U"},
+	{"$2a$05$abcdefghijklmnopqrstuu5s2v8.iXieOjg/.AySBTTZIIVFJeBui",
+		"0123456789abcdefghijklmnopqrstuvwxyz"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+		"chars after 72 are ignored"},
+	{"$2x$05$/OK.fbVrR/bpIqNJ5ianF.CE5elHaaO4EbggVDjb8P19RukzXSM3e",
+		"\xa3"},
+	{"$2x$05$/OK.fbVrR/bpIqNJ5ianF.CE5elHaaO4EbggVDjb8P19RukzXSM3e",
+		"\xff\xff\xa3"},
+	{"$2y$05$/OK.fbVrR/bpIqNJ5ianF.CE5elHaaO4EbggVDjb8P19RukzXSM3e",
+		"\xff\xff\xa3"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.nqd1wy.pTMdcvrRWxyiGL2eMz.2a85.",
+		"\xff\xff\xa3"},
+	{"$2b$05$/OK.fbVrR/bpIqNJ5ianF.CE5elHaaO4EbggVDjb8P19RukzXSM3e",
+		"\xff\xff\xa3"},
+	{"$2y$05$/OK.fbVrR/bpIqNJ5ianF.Sa7shbm4.OzKpvFnX1pQLmQW96oUlCq",
+		"\xa3"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.Sa7shbm4.OzKpvFnX1pQLmQW96oUlCq",
+		"\xa3"},
+	{"$2b$05$/OK.fbVrR/bpIqNJ5ianF.Sa7shbm4.OzKpvFnX1pQLmQW96oUlCq",
+		"\xa3"},
+	{"$2x$05$/OK.fbVrR/bpIqNJ5ianF.o./n25XVfn6oAPaUvHe.Csk4zRfsYPi",
+		"1\xa3" "345"},
+	{"$2x$05$/OK.fbVrR/bpIqNJ5ianF.o./n25XVfn6oAPaUvHe.Csk4zRfsYPi",
+		"\xff\xa3" "345"},
+	{"$2x$05$/OK.fbVrR/bpIqNJ5ianF.o./n25XVfn6oAPaUvHe.Csk4zRfsYPi",
+		"\xff\xa3" "34" "\xff\xff\xff\xa3" "345"},
+	{"$2y$05$/OK.fbVrR/bpIqNJ5ianF.o./n25XVfn6oAPaUvHe.Csk4zRfsYPi",
+		"\xff\xa3" "34" "\xff\xff\xff\xa3" "345"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.ZC1JEJ8Z4gPfpe1JOr/oyPXTWl9EFd.",
+		"\xff\xa3" "34" "\xff\xff\xff\xa3" "345"},
+	{"$2y$05$/OK.fbVrR/bpIqNJ5ianF.nRht2l/HRhr6zmCp9vYUvvsqynflf9e",
+		"\xff\xa3" "345"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.nRht2l/HRhr6zmCp9vYUvvsqynflf9e",
+		"\xff\xa3" "345"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.6IflQkJytoRVc1yuaNtHfiuq.FRlSIS",
+		"\xa3" "ab"},
+	{"$2x$05$/OK.fbVrR/bpIqNJ5ianF.6IflQkJytoRVc1yuaNtHfiuq.FRlSIS",
+		"\xa3" "ab"},
+	{"$2y$05$/OK.fbVrR/bpIqNJ5ianF.6IflQkJytoRVc1yuaNtHfiuq.FRlSIS",
+		"\xa3" "ab"},
+	{"$2x$05$6bNw2HLQYeqHYyBfLMsv/OiwqTymGIGzFsA4hOTWebfehXHNprcAS",
+		"\xd1\x91"},
+	{"$2x$05$6bNw2HLQYeqHYyBfLMsv/O9LIGgn8OMzuDoHfof8AQimSGfcSWxnS",
+		"\xd0\xc1\xd2\xcf\xcc\xd8"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.swQOIzjOiJ9GHEPuhEkvqrUyvWhEMx6",
+		"\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+		"\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+		"\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+		"\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+		"\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+		"\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+		"chars after 72 are ignored as usual"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.R9xrDjiycxMbQE2bp.vgqlYpW5wx2yy",
+		"\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55"
+		"\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55"
+		"\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55"
+		"\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55"
+		"\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55"
+		"\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55\xaa\x55"},
+	{"$2a$05$/OK.fbVrR/bpIqNJ5ianF.9tQZzcJfm3uj2NvJ/n5xkhpqLrMpWCe",
+		"\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff"
+		"\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff"
+		"\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff"
+		"\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff"
+		"\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff"
+		"\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff\x55\xaa\xff"},
+	{"$2a$05$CCCCCCCCCCCCCCCCCCCCC.7uG0VCzI2bS7j6ymqJi9CdcdxiRTWNy",
+		""},
+	{"*0", "", "$2a$03$CCCCCCCCCCCCCCCCCCCCC."},
+	{"*0", "", "$2a$32$CCCCCCCCCCCCCCCCCCCCC."},
+	{"*0", "", "$2c$05$CCCCCCCCCCCCCCCCCCCCC."},
+	{"*0", "", "$2z$05$CCCCCCCCCCCCCCCCCCCCC."},
+	{"*0", "", "$2`$05$CCCCCCCCCCCCCCCCCCCCC."},
+	{"*0", "", "$2{$05$CCCCCCCCCCCCCCCCCCCCC."},
+	{"*1", "", "*0"},
+	{NULL}
+};
+
+#define which				tests[0]
+
+static const char* kernels[] = { "x86-64-bmi2", "x86-64", "x86", "generic", NULL };
+
+static volatile int running;
+
+/* Known-answer tests, for the kernel currently in use */
+static int
+check_vectors(void)
+{
+  int i;
+  char o_buf[61];
+
+  for (i = 0; tests[i][0]; i++) {
+    const char *hash = tests[i][0];
+    const char *key = tests[i][1];
+    const char *setting = tests[i][2];
+    const char *p;
+
+    if(setting) continue; /* invalid settings, see check_api */
+
+    p = crypt_rn(key, hash, o_buf, sizeof(o_buf));
+    if(!p || strcmp(p, hash)){
+      printf("FAILED (crypt_rn/%d)\n", i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* The wrapper API: output sizes, invalid settings, crypt_ra and crypt_gensalt */
+static int
+check_api(void)
+{
+  void *data = NULL;
+  int size = 0x12345678;
+  char *setting1, *setting2;
+  int i;
+
+  for (i = 0; tests[i][0]; i++) {
+    const char *hash = tests[i][0];
+    const char *key = tests[i][1];
+    const char *setting = tests[i][2];
+    const char *p;
+    int ok = !setting || strlen(hash) >= 30;
+    int o_size;
+    char s_buf[30], o_buf[61];
+    if (!setting) {
+      memcpy(s_buf, hash, sizeof(s_buf) - 1);
+      s_buf[sizeof(s_buf) - 1] = 0;
+      setting = s_buf;
+    }
+
+    errno = 0;
+    p = crypt(key, setting);
+    if ((!ok && !errno) || strcmp(p, hash)) {
+      printf("FAILED (crypt/%d)\n", i);
+      return 1;
+    }
+
+    if (ok && strcmp(crypt(key, hash), hash)) {
+      printf("FAILED (crypt/%d)\n", i);
+      return 1;
+    }
+
+    for (o_size = -1; o_size <= (int)sizeof(o_buf); o_size++) {
+      int ok_n = ok && o_size == (int)sizeof(o_buf);
+      const char *x = "abc";
+      strcpy(o_buf, x);
+      if (o_size >= 3) {
+	x = "*0";
+	if (setting[0] == '*' && setting[1] == '0')
+	  x = "*1";
+      }
+      errno = 0;
+      p = crypt_rn(key, setting, o_buf, o_size);
+      if ((ok_n && (!p || strcmp(p, hash))) ||
+	  (!ok_n && (!errno || p || strcmp(o_buf, x)))) {
+	printf("FAILED (crypt_rn/%d)\n", i);
+	return 1;
+      }
+    }
+
+    errno = 0;
+    p = crypt_ra(key, setting, &data, &size);
+    if ((ok && (!p || strcmp(p, hash))) ||
+	(!ok && (!errno || p || strcmp((char *)data, hash)))) {
+      printf("FAILED (crypt_ra/%d)\n", i);
+      return 1;
+    }
+  }
+
+  setting1 = crypt_gensalt(which[0], 12, data, size);
+  if (!setting1 || strncmp(setting1, "$2a$12$", 7)) {
+    puts("FAILED (crypt_gensalt)\n");
+    return 1;
+  }
+
+  setting2 = crypt_gensalt_ra(setting1, 12, data, size);
+  if (strcmp(setting1, setting2)) {
+    puts("FAILED (crypt_gensalt_ra/1)\n");
+    return 1;
+  }
+
+  (*(char *)data)++;
+  setting1 = crypt_gensalt_ra(setting2, 12, data, size);
+  if (!strcmp(setting1, setting2)) {
+    puts("FAILED (crypt_gensalt_ra/2)\n");
+    return 1;
+  }
+
+  free(setting1);
+  free(setting2);
+  free(data);
+  return 0;
+}
+
+/* Hashes "U*U" at the given cost until told to stop, returns the count */
+static void*
+run(void* arg)
+{
+  char setting[30], o_buf[61];
+  unsigned long count = 0;
+
+  snprintf(setting, sizeof(setting), "$2b$%02d$CCCCCCCCCCCCCCCCCCCCC.", (int)(intptr_t)arg);
+  do {
+    if(!crypt_rn("U*U", setting, o_buf, sizeof(o_buf))){
+      printf("FAILED (crypt_rn/%s)\n", setting);
+      return NULL;
+    }
+    count++;
+  } while (running);
+
+  return (void*)(uintptr_t)count;
+}
+
+/* Aggregated hashes per second over nthreads */
+static double
+measure(int cost, int nthreads, unsigned int seconds)
+{
+  pthread_t t[nthreads];
+  unsigned long count = 0;
+  void* retval;
+  int i, started = 0;
+
+  running = 1;
+  uint64_t start = bench_now_us();
+  for(i = 0; i < nthreads; i++, started++)
+    if(pthread_create(&t[i], NULL, run, (void*)(intptr_t)cost)){ perror("pthread_create"); break; }
+  sleep(seconds);
+  running = 0;
+  for(i = 0; i < started; i++){
+    if(pthread_join(t[i], &retval) || !retval){ count = 0; break; }
+    count += (uintptr_t)retval;
+  }
+  uint64_t elapsed = bench_now_us() - start;
+  return (elapsed && count)?(double)count * 1000000 / elapsed:0;
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, i, j;
+  int min_cost = 5, max_cost = 10, scaling_cost = 8;
+  unsigned int seconds = 1;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = (ncpu > 0)?(int)ncpu * 2:2;
+  const char* selected;
+
+  while((opt = getopt(argc, argv, "c:s:t:j:")) != -1){
+    switch(opt){
+    case 'c': if(sscanf(optarg, "%d-%d", &min_cost, &max_cost) == 1) max_cost = min_cost; break;
+    case 's': scaling_cost = atoi(optarg); break;
+    case 't': seconds = atoi(optarg); break;
+    case 'j': max_threads = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-c min_cost-max_cost] [-s scaling cost] [-t seconds per run] [-j max threads]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(min_cost < 4 || max_cost > 31 || min_cost > max_cost || scaling_cost < 4 || scaling_cost > 31 ||
+     !seconds || max_threads < 1){
+    fprintf(stderr, "Invalid arguments\n");
+    return 2;
+  }
+
+  selected = _crypt_blowfish_kernel();
+  if(!selected){ printf("FAILED (self-test)\n"); return 1; }
+  printf("Selected kernel: %s, %ld CPU(s) online\n", selected, ncpu);
+
+  if(check_api()) return 1;
+
+  printf("\n%-12s", "kernel");
+  for(j = min_cost; j <= max_cost; j++) printf("  cost %2d", j);
+  printf("   (hashes/sec, 1 thread)\n");
+
+  for(i = 0; kernels[i]; i++){
+    if(_crypt_blowfish_use_kernel(kernels[i])) continue; /* not built or not supported */
+    if(check_vectors()) return 1;
+    printf("%-12s", kernels[i]);
+    fflush(stdout);
+    for(j = min_cost; j <= max_cost; j++){
+      printf(" %8.1f", measure(j, 1, seconds));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+
+  _crypt_blowfish_use_kernel(selected);
+
+  printf("\n%-8s %12s %10s   (%s, cost %d)\n", "threads", "hashes/sec", "speedup", selected, scaling_cost);
+  double single = 0;
+  for(j = 1; j <= max_threads; j *= 2){
+    double rate = measure(scaling_cost, j, seconds);
+    if(j == 1) single = rate;
+    printf("%-8d %12.1f %9.2fx\n", j, rate, single?rate / single:0);
+    fflush(stdout);
+  }
+
+  return 0;
+}
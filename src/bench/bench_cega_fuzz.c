@@ -0,0 +1,167 @@
+/*
+ * Feeds cega_resolve with hostile responses from a local stand-in for CentralEGA,
+ * and reports how long each lookup took and how much memory it used.
+ *
+ * Each scenario runs in its own process, so that the peak RSS is its own.
+ *
+ * Usage: bench_cega_fuzz [-n iterations] [-s max_response_size] [-t max_tokens] [-T timeout]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cega.h"
+#include "bench/bench.h"
+#include "bench/mock_http.h"
+
+#define VALID_USER "{\"username\":\"john\",\"uid\":1,\"passwordHash\":\"$2b$10$abcdefghijklmnopqrstuu5sNcnGrjEaf0Vh4ZPYgWjqN4F3WVz2i\"," \
+                   "\"sshPublicKeys\":[\"ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIB john@ega\"],\"gecos\":\"John\",\"lastChanged\":17000}"
+
+static int
+handler(struct mock_conn *c, const char* path, void* data)
+{
+  char chunk[65536];
+  memset(chunk, 'x', sizeof(chunk));
+
+  if(!strcmp(path, "/valid"))
+    return mock_http_reply(c, 200, VALID_USER, strlen(VALID_USER));
+
+  if(!strcmp(path, "/big-content-length")){ /* announces 1GB, then streams */
+    const char* h = "HTTP/1.1 200 OK\r\nContent-Length: 1073741824\r\n\r\n";
+    if(mock_http_send(c, h, strlen(h))) return 1;
+    while(!mock_http_send(c, chunk, sizeof(chunk)));
+    return 1;
+  }
+
+  if(!strcmp(path, "/big-unannounced")){ /* no length, streams until the client gives up */
+    const char* h = "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n";
+    if(mock_http_send(c, h, strlen(h))) return 1;
+    while(!mock_http_send(c, chunk, sizeof(chunk)));
+    return 1;
+  }
+
+  if(!strcmp(path, "/slow-drip")){ /* one byte every 100ms */
+    const char* h = "HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n";
+    if(mock_http_send(c, h, strlen(h))) return 1;
+    while(!mock_http_send(c, "{", 1)) usleep(100000);
+    return 1;
+  }
+
+  if(!strcmp(path, "/token-bomb")){ /* small enough, but full of tokens */
+    size_t max = *(size_t*)data;
+    size_t len = 0, n;
+    char* body = malloc(max);
+    if(!body) return 1;
+    len += sprintf(body, "{\"username\":\"john\",\"a\":[0");
+    for(n = len; n + 4 < max; n += 2) { body[n] = ','; body[n+1] = '0'; }
+    len = n;
+    body[len++] = ']';
+    body[len++] = '}';
+    int rc = mock_http_reply(c, 200, body, len);
+    free(body);
+    return rc;
+  }
+
+  if(!strncmp(path, "/random/", 8)){ /* JSON-ish garbage */
+    static const char alphabet[] = "{}[]\":,0123456789abcdefnulltrue \\";
+    unsigned int seed = (unsigned int)strtoul(path + 8, NULL, 10);
+    size_t len = rand_r(&seed) % 4096, i;
+    for(i = 0; i < len; i++) chunk[i] = alphabet[rand_r(&seed) % (sizeof(alphabet) - 1)];
+    return mock_http_reply(c, 200, chunk, len);
+  }
+
+  return mock_http_reply(c, 404, "", 0);
+}
+
+static int
+noop(struct fega_user *user)
+{
+  return 0;
+}
+
+static void
+run_scenario(unsigned short port, const char* scenario, int iterations)
+{
+  fflush(stdout); /* or the child prints it again */
+  pid_t pid = fork();
+  if(pid < 0){ perror("fork"); exit(1); }
+  if(pid > 0){ waitpid(pid, NULL, 0); return; }
+
+  char endpoint[64], path[64];
+  double total = 0.0, worst = 0.0;
+  int i, failures = 0;
+
+  snprintf(endpoint, sizeof(endpoint), "http://127.0.0.1:%u%%s", port); /* the scenario is the "username" */
+  options->cega_endpoint_username[0] = endpoint;
+  options->cega_endpoint_username_count = 1;
+
+  for(i = 0; i < iterations; i++){
+    if(!strcmp(scenario, "/random"))
+      snprintf(path, sizeof(path), "/random/%d", i);
+    else
+      snprintf(path, sizeof(path), "%s", scenario);
+    uint64_t start = bench_now_us();
+    if(cega_resolve_username(path, false, noop)) failures++;
+    double elapsed = (bench_now_us() - start) / 1e3;
+    total += elapsed;
+    if(elapsed > worst) worst = elapsed;
+  }
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-20s %6d %8d %10.2f %10.2f %10ld\n", scenario, iterations, failures, total / iterations, worst, ru.ru_maxrss);
+  fflush(stdout);
+  _exit(0);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, iterations = 20;
+  struct mock_http srv = { .handler = handler };
+
+  options = calloc(1, sizeof(options_t));
+  if(!options) return 1;
+  options->cega_creds = "user:password";
+  options->cega_max_response_size = 65536;
+  options->cega_max_tokens = 1024;
+  options->cega_timeout = 2;
+
+  while((opt = getopt(argc, argv, "n:s:t:T:")) != -1){
+    switch(opt){
+    case 'n': iterations = atoi(optarg); break;
+    case 's': options->cega_max_response_size = strtoul(optarg, NULL, 10); break;
+    case 't': options->cega_max_tokens = strtoul(optarg, NULL, 10); break;
+    case 'T': options->cega_timeout = atol(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-n iterations] [-s max_response_size] [-t max_tokens] [-T timeout]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(iterations <= 0) iterations = 1;
+
+  signal(SIGPIPE, SIG_IGN);
+  srv.data = &options->cega_max_response_size;
+  if(mock_http_start(&srv)){ perror("mock server"); return 1; }
+
+  printf("max_response_size = %zu bytes | max_tokens = %u | timeout = %lds\n",
+	 options->cega_max_response_size, options->cega_max_tokens, options->cega_timeout);
+  printf("%-20s %6s %8s %10s %10s %10s\n", "scenario", "runs", "failures", "avg (ms)", "max (ms)", "maxrss(kB)");
+
+  run_scenario(srv.port, "/valid", iterations);
+  run_scenario(srv.port, "/random", iterations * 10);
+  run_scenario(srv.port, "/token-bomb", iterations);
+  run_scenario(srv.port, "/big-content-length", iterations);
+  run_scenario(srv.port, "/big-unannounced", iterations);
+  run_scenario(srv.port, "/slow-drip", 1);
+
+  mock_http_stop(&srv);
+  return 0; /* options are freed when the cache is closed */
+}
@@ -0,0 +1,108 @@
+/*
+ * Compares the per-lookup latency of cega_resolve over
+ *   - TCP + TLS (a new handshake per lookup, as in production)
+ *   - plain TCP
+ *   - a unix socket to a local stand-in (cega_unix_socket), as with a sidecar proxy
+ *
+ * Usage: bench_cega_transport [-n lookups] [-d server delay in us]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cega.h"
+#include "bench/bench.h"
+#include "bench/mock_http.h"
+
+#define VALID_USER "{\"username\":\"john\",\"uid\":1,\"passwordHash\":\"$2b$10$abcdefghijklmnopqrstuu5sNcnGrjEaf0Vh4ZPYgWjqN4F3WVz2i\"," \
+                   "\"sshPublicKeys\":[\"ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIB john@ega\"],\"gecos\":\"John\",\"lastChanged\":17000}"
+
+static int
+handler(struct mock_conn *c, const char* path, void* data)
+{
+  useconds_t delay = *(useconds_t*)data;
+  if(delay) usleep(delay);
+  return mock_http_reply(c, 200, VALID_USER, strlen(VALID_USER));
+}
+
+static int
+noop(struct fega_user *user)
+{
+  return 0;
+}
+
+static void
+run(const char* name, const char* endpoint, const char* unix_socket, uint64_t* samples, int n)
+{
+  int i, failures = 0;
+  uint64_t total = 0;
+
+  options->cega_endpoint_username[0] = (char*)endpoint;
+  options->cega_endpoint_username_count = 1;
+  options->cega_unix_socket = (char*)unix_socket;
+
+  for(i = 0; i < n; i++){
+    uint64_t start = bench_now_us();
+    if(cega_resolve_username("john", false, noop)) failures++;
+    samples[i] = bench_now_us() - start;
+    total += samples[i];
+  }
+
+  uint64_t p50 = bench_percentile(samples, n, 50);
+  uint64_t p99 = bench_percentile(samples, n, 99);
+  printf("%-12s %6d %8d %10.1f %10lu %10lu\n", name, n, failures, (double)total / n,
+	 (unsigned long)p50, (unsigned long)p99);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, n = 500;
+  useconds_t delay = 0;
+  char socket_path[64], tls_endpoint[64], tcp_endpoint[64];
+
+  while((opt = getopt(argc, argv, "n:d:")) != -1){
+    switch(opt){
+    case 'n': n = atoi(optarg); break;
+    case 'd': delay = (useconds_t)atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-n lookups] [-d server delay in us]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(n <= 0) n = 1;
+
+  options = calloc(1, sizeof(options_t));
+  uint64_t* samples = malloc(n * sizeof(uint64_t));
+  if(!options || !samples) return 1;
+  options->cega_creds = "user:password";
+  options->cega_max_response_size = 65536;
+  options->cega_max_tokens = 1024;
+  options->cega_timeout = 10;
+
+  signal(SIGPIPE, SIG_IGN);
+  snprintf(socket_path, sizeof(socket_path), "/tmp/ega-bench-%d.sock", getpid());
+
+  struct mock_http tls  = { .handler = handler, .data = &delay, .tls = true };
+  struct mock_http tcp  = { .handler = handler, .data = &delay };
+  struct mock_http uds  = { .handler = handler, .data = &delay, .unix_path = socket_path };
+  if(mock_http_start(&tls) || mock_http_start(&tcp) || mock_http_start(&uds)){ perror("mock server"); return 1; }
+
+  snprintf(tls_endpoint, sizeof(tls_endpoint), "https://127.0.0.1:%u/users/%%s", tls.port);
+  snprintf(tcp_endpoint, sizeof(tcp_endpoint), "http://127.0.0.1:%u/users/%%s", tcp.port);
+
+  printf("%-12s %6s %8s %10s %10s %10s\n", "transport", "runs", "failures", "avg (us)", "p50 (us)", "p99 (us)");
+  run("tcp+tls", tls_endpoint, NULL, samples, n);
+  run("tcp", tcp_endpoint, NULL, samples, n);
+  run("unix", "http://localhost/users/%s", socket_path, samples, n);
+
+  mock_http_stop(&tls);
+  mock_http_stop(&tcp);
+  mock_http_stop(&uds);
+  free(samples);
+  return 0; /* options are freed when the cache is closed */
+}
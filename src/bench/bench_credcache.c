@@ -0,0 +1,128 @@
+/*
+ * Login CPU saved per reconnect by the credential cache of pam_ega_auth.so
+ *
+ * A client reconnecting with the same password is authenticated
+ * through pam_sm_authenticate, with cred_cache_ttl=0 (every login pays the hash)
+ * and with the cache on (the first login pays and stores the entry, the reconnects hit).
+ * Reports the CPU time (user + system) per login in both cases, and the difference,
+ * for a few hash settings.
+ *
+ * pam_auth.c is linked in directly, against the libpam stand-in of pam_stub.c.
+ * The cache is the node's (root-only) one: the user name is unique to this run.
+ *
+ * Usage: bench_credcache [-n reconnects] [-h hash setting]...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <crypt.h>
+
+#include "bench/bench.h"
+#include "bench/pam_stub.h"
+
+#define PASSWORD "s3cr3t"
+#define MAX_SETTINGS 8
+
+static const char* default_settings[] = {
+  "$2b$10$CCCCCCCCCCCCCCCCCCCCC.",
+  "$6$rounds=5000$benchsaltbenchsa",
+  "$5$rounds=5000$benchsaltbenchsa",
+  NULL
+};
+
+static uint64_t
+cpu_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int
+login(const char* user, const char* password, const char* ttl_arg)
+{
+  const char* args[] = { "hash_slots=0", "tarpit_free=0", ttl_arg };
+  struct pam_handle pamh;
+
+  pam_stub_start(&pamh, user, password);
+  int rc = pam_sm_authenticate(&pamh, 0, sizeof(args) / sizeof(args[0]), args);
+  pam_stub_end(&pamh);
+  return rc;
+}
+
+/* CPU µs per login, over n logins */
+static double
+measure(const char* user, const char* ttl_arg, unsigned int n, int* failed)
+{
+  unsigned int i;
+
+  uint64_t start = cpu_now_us();
+  for(i = 0; i < n; i++){
+    int rc = login(user, PASSWORD, ttl_arg);
+    if(rc != PAM_SUCCESS){ printf("FAILED (pam_sm_authenticate: %d)\n", rc); *failed = 1; return 0; }
+  }
+  return (double)(cpu_now_us() - start) / n;
+}
+
+int
+main(int argc, char** argv)
+{
+  const char* settings[MAX_SETTINGS + 1];
+  unsigned int n = 50;
+  int opt, i, nsettings = 0, failed = 0;
+  char user[64];
+
+  while((opt = getopt(argc, argv, "n:h:")) != -1){
+    switch(opt){
+    case 'n': n = atoi(optarg); break;
+    case 'h': if(nsettings < MAX_SETTINGS) settings[nsettings++] = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-n reconnects] [-h hash setting]...\n", argv[0]);
+      return 2;
+    }
+  }
+  if(n < 2){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+  if(!nsettings) for(; default_settings[nsettings]; nsettings++) settings[nsettings] = default_settings[nsettings];
+  settings[nsettings] = NULL;
+
+  printf("%u logins per run, CPU time (user + system) per login\n\n", n);
+  printf("%-36s %12s %12s %12s %12s\n", "hash", "no cache", "first login", "reconnect", "saved");
+
+  for(i = 0; settings[i]; i++){
+    char* hash = crypt(PASSWORD, settings[i]);
+    if(!hash || *hash == '*'){ fprintf(stderr, "Unsupported hash setting: %s\n", settings[i]); return 2; }
+    pam_stub_hash = strdup(hash);
+
+    /* A user name of our own, so that the first login is a miss */
+    snprintf(user, sizeof(user), "bench-credcache-%d-%d", (int)getpid(), i);
+
+    double off = measure(user, "cred_cache_ttl=0", n, &failed);
+    double miss = measure(user, "cred_cache_ttl=60", 1, &failed); /* stores the entry */
+    double hit = measure(user, "cred_cache_ttl=60", n, &failed);
+    if(failed) return 1;
+
+    /* A wrong password must not hit */
+    if(login(user, PASSWORD "x", "cred_cache_ttl=60") == PAM_SUCCESS){
+      printf("FAILED (wrong password accepted)\n");
+      return 1;
+    }
+
+    /* Nor the right one, once the shadow entry holds another hash */
+    free(pam_stub_hash);
+    pam_stub_hash = strdup(hash);
+    pam_stub_hash[strlen(pam_stub_hash) - 1] ^= 1;
+    if(login(user, PASSWORD, "cred_cache_ttl=60") == PAM_SUCCESS){
+      printf("FAILED (entry used after a change of sp_pwdp)\n");
+      return 1;
+    }
+
+    printf("%-36.36s %10.1fus %10.1fus %10.1fus %10.1fus %7.1f%%\n", settings[i], off, miss, hit, off - hit,
+	   (off > 0)?(off - hit) * 100 / off:0);
+    fflush(stdout);
+    free(pam_stub_hash);
+  }
+
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Login storm: n processes arrive within a short window and each verifies
+ * a bcrypt password, as pam_ega_auth.so does, once without and once with
+ * the node-wide hash semaphore (hashlimit.c).
+ *
+ * Reports the login latency percentiles, from arrival to verdict,
+ * and the number of logins turned away after max_wait.
+ *
+ * Usage: bench_hashlimit [-n clients] [-c bcrypt cost] [-s slots] [-w arrival window in ms] [-W max wait in ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "hashlimit.h"
+#include "blowfish/crypt_blowfish.h"
+#include "bench/bench.h"
+
+#define TIMED_OUT UINT64_MAX
+
+static void
+client(uint64_t arrival, unsigned int slots, long max_wait, const char* setting, uint64_t* result)
+{
+  char output[64];
+  uint64_t now = bench_now_us();
+
+  if(arrival > now) usleep(arrival - now);
+
+  int slot = hashlimit_acquire(slots, max_wait);
+  if(slot == HASHLIMIT_TIMEOUT || slot == HASHLIMIT_FULL){ *result = TIMED_OUT; return; }
+
+  _crypt_blowfish_rn("U*U", setting, output, sizeof(output));
+  hashlimit_release(slot);
+
+  *result = bench_now_us() - arrival;
+}
+
+static void
+run(const char* name, int n, unsigned int slots, long window, long max_wait, const char* setting, uint64_t* results)
+{
+  int i, done = 0, timeouts = 0;
+  uint64_t start = bench_now_us() + 100000; /* let everyone fork first */
+  uint64_t* samples = malloc(n * sizeof(uint64_t));
+
+  fflush(stdout);
+  for(i = 0; i < n; i++){
+    uint64_t arrival = start + (uint64_t)window * 1000 * i / n;
+    pid_t pid = fork();
+    if(pid == 0){ client(arrival, slots, max_wait, setting, &results[i]); _exit(0); }
+    if(pid < 0){ perror("fork"); results[i] = TIMED_OUT; }
+  }
+  while(wait(NULL) > 0);
+
+  for(i = 0; i < n; i++){
+    if(results[i] == TIMED_OUT) timeouts++;
+    else samples[done++] = results[i];
+  }
+
+  printf("%-14s %6d %8d %10lu %10lu %10lu %10lu\n", name, done, timeouts,
+	 (unsigned long)bench_percentile(samples, done, 50) / 1000,
+	 (unsigned long)bench_percentile(samples, done, 90) / 1000,
+	 (unsigned long)bench_percentile(samples, done, 99) / 1000,
+	 (unsigned long)bench_percentile(samples, done, 100) / 1000);
+  free(samples);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, n = 64, cost = 8;
+  long window = 200, max_wait = 10000;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int slots = (ncpu > 0)?ncpu:1;
+  char setting[30];
+
+  while((opt = getopt(argc, argv, "n:c:s:w:W:")) != -1){
+    switch(opt){
+    case 'n': n = atoi(optarg); break;
+    case 'c': cost = atoi(optarg); break;
+    case 's': slots = atoi(optarg); break;
+    case 'w': window = atol(optarg); break;
+    case 'W': max_wait = atol(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-n clients] [-c bcrypt cost] [-s slots] [-w arrival window in ms] [-W max wait in ms]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(n < 1 || cost < 4 || cost > 31 || slots < 1 || window < 0 || max_wait < 0){
+    fprintf(stderr, "Invalid arguments\n");
+    return 2;
+  }
+
+  snprintf(setting, sizeof(setting), "$2b$%02d$CCCCCCCCCCCCCCCCCCCCC.", cost);
+
+  uint64_t* results = mmap(NULL, n * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(results == MAP_FAILED){ perror("mmap"); return 1; }
+
+  printf("%d logins arriving within %ld ms, bcrypt cost %d, %ld CPU(s)\n\n", n, window, cost, ncpu);
+  printf("%-14s %6s %8s %10s %10s %10s %10s\n", "", "logins", "refused", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+  run("no limit", n, 0, window, max_wait, setting, results);
+
+  char name[32];
+  snprintf(name, sizeof(name), "%u slot(s)", slots);
+  run(name, n, slots, window, max_wait, setting, results);
+
+  munmap(results, n * sizeof(uint64_t));
+  return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ * What sshd pays, per connection, to get the public keys of an EGA user
+ *
+ *   - command: AuthorizedKeysCommand, ie fork+exec of ega_ssh_keys, which loads
+ *              its config, opens the cache and queries it
+ *   - command %f: the same, but only the key with the fingerprint sshd passes,
+ *              from the keys_fingerprint index. It prints one line, instead of all the keys
+ *              of the user, for sshd to parse (try -k 300)
+ *   - file:    AuthorizedKeysFile, on the files of "ega_ssh_keys -e": the path checks
+ *              of StrictModes (a stat per directory), then reading the file
+ *
+ * and what the export costs: all the users at first, none when nothing changed,
+ * and 1% of them after their keys changed.
+ *
+ * Like bench_lookup, it writes its own config file, cache and authorized_keys_dir
+ * in a temporary directory, and re-executes itself with EGA_AUTH_CONFIG pointing to it.
+ * It runs ./ega_ssh_keys (or -x path): run it from src/.
+ *
+ * Usage: bench_keys [-u cached users] [-k keys per user] [-n connections] [-x ega_ssh_keys]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sqlite3.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "fingerprint.h"
+#include "bench/bench.h"
+
+#define PWDH "$2b$10$abcdefghijklmnopqrstuu5sNcnGrjEaf0Vh4ZPYgWjqN4F3WVz2i"
+
+extern char **environ;
+
+static const char* keys_exec = "./ega_ssh_keys";
+
+static void
+pubkey(char* buf, size_t len, unsigned long user, unsigned int key)
+{
+  snprintf(buf, len, "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAI%08lu%04uZl0nnKx2rjOm5xT0wVq3ZPC user%lu@bench", user, key, user);
+}
+
+/* Another connection, one transaction (see bench_micro) */
+static int
+fill(const char* db_path, unsigned long users, unsigned int keys, unsigned long every, unsigned int extra)
+{
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt_users = NULL, *stmt_keys = NULL;
+  char user[32], key[160], fp[FINGERPRINT_LENGTH];
+  unsigned long i;
+  unsigned int k;
+  int rc = 1;
+
+  if(sqlite3_open(db_path, &db) != SQLITE_OK) goto BAILOUT;
+  sqlite3_exec(db, "PRAGMA synchronous = OFF; BEGIN;", NULL, NULL, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO users (username,uid,pwdh,last_changed,gecos,expires) VALUES(?1,?2,?3,17000,'Bench',?4);",
+		     -1, &stmt_users, NULL);
+  sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO keys (uid,pubkey,fingerprint) VALUES(?1,?2,?3);", -1, &stmt_keys, NULL);
+  if(!stmt_users || !stmt_keys) goto BAILOUT;
+
+  for(i = 0; i < users; i += every){
+    snprintf(user, sizeof(user), "user%lu", i);
+    sqlite3_bind_text(stmt_users, 1, user, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt_users, 2, options->uid_shift + 1 + i);
+    sqlite3_bind_blob(stmt_users, 3, PWDH, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt_users, 4, (unsigned int)time(NULL) + 86400);
+    if(sqlite3_step(stmt_users) != SQLITE_DONE) goto BAILOUT;
+    sqlite3_reset(stmt_users);
+    for(k = 0; k < keys + extra; k++){
+      pubkey(key, sizeof(key), i, k);
+      sqlite3_bind_int(stmt_keys, 1, options->uid_shift + 1 + i);
+      sqlite3_bind_text(stmt_keys, 2, key, -1, SQLITE_TRANSIENT);
+      if(!fingerprint_pubkey(key, fp)) goto BAILOUT;
+      sqlite3_bind_text(stmt_keys, 3, fp, -1, SQLITE_TRANSIENT);
+      if(sqlite3_step(stmt_keys) != SQLITE_DONE) goto BAILOUT;
+      sqlite3_reset(stmt_keys);
+    }
+  }
+  rc = (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK)?0:1;
+
+BAILOUT:
+  if(rc) fprintf(stderr, "Could not fill the cache: %s\n", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt_users);
+  sqlite3_finalize(stmt_keys);
+  sqlite3_close(db);
+  return rc;
+}
+
+/* Runs ega_ssh_keys arg [fingerprint], and counts the lines it prints (or prints them, with echo) */
+static int
+run_keys(const char* arg, const char* fp, bool echo)
+{
+  int fds[2], status, lines = 0;
+  posix_spawn_file_actions_t actions;
+  char buf[4096];
+  ssize_t n;
+  pid_t pid;
+
+  char* argv[] = { (char*)keys_exec, (char*)arg, (char*)fp, NULL };
+  if(pipe(fds)) return -1;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+  if(posix_spawn(&pid, keys_exec, &actions, NULL, argv, environ)){ close(fds[0]); close(fds[1]); return -1; }
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+
+  while((n = read(fds[0], buf, sizeof(buf))) > 0){
+    ssize_t i;
+    if(echo) fwrite(buf, 1, n, stdout);
+    for(i = 0; i < n; i++) if(buf[i] == '\n') lines++;
+  }
+  close(fds[0]);
+  if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) return -1;
+  return lines;
+}
+
+/* As sshd does it: every directory of the path checked, then the lines read */
+static int
+read_file(const char* path)
+{
+  char dir[PATH_MAX], line[8192];
+  struct stat st;
+  int lines = 0;
+
+  FILE* fp = fopen(path, "r");
+  if(!fp) return -1;
+  if(fstat(fileno(fp), &st) || !S_ISREG(st.st_mode)){ fclose(fp); return -1; }
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  char* slash;
+  while((slash = strrchr(dir, '/')) && slash != dir){
+    *slash = '\0';
+    if(stat(dir, &st) || (st.st_mode & 022)) break;
+  }
+
+  while(fgets(line, sizeof(line), fp)) if(*line != '#' && *line != '\n') lines++;
+  fclose(fp);
+  return lines;
+}
+
+static void
+report(const char* name, uint64_t* samples, int n, int failures)
+{
+  uint64_t total = 0;
+  int i;
+  for(i = 0; i < n; i++) total += samples[i];
+  uint64_t p50 = bench_percentile(samples, n, 50);
+  uint64_t p99 = bench_percentile(samples, n, 99);
+  printf("%-22s %6d %8d %10.1f %10lu %10lu\n", name, n, failures, (double)total / n,
+	 (unsigned long)p50, (unsigned long)p99);
+  fflush(stdout);
+}
+
+static void
+export(const char* name)
+{
+  printf("%-22s ", name);
+  fflush(stdout);
+  uint64_t start = bench_now_us();
+  int rc = run_keys("-e", NULL, true);
+  uint64_t elapsed = bench_now_us() - start;
+  if(rc < 0) printf("failed\n");
+  printf("%-22s %.1f ms\n", "", elapsed / 1000.0);
+  fflush(stdout);
+}
+
+/* Config file, cache and keys directory in a fresh directory, then exec ourselves again */
+static int
+setup(char** argv)
+{
+  char dir[] = "/tmp/ega-bench-keys-XXXXXX", path[128];
+
+  if(!mkdtemp(dir) || chmod(dir, 0755)){ perror("mkdtemp"); return 1; }
+  snprintf(path, sizeof(path), "%s/keys", dir);
+  if(mkdir(path, 0755)){ perror(path); return 1; }
+
+  snprintf(path, sizeof(path), "%s/auth.conf", dir);
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); return 1; }
+  fprintf(fp,
+	  "cega_endpoint_username = http://127.0.0.1:1/users/%%s?idType=username\n"
+	  "cega_endpoint_uid = http://127.0.0.1:1/users/%%u?idType=uid\n"
+	  "cega_creds = user:password\n"
+	  "gid = %u\n"
+	  "homedir_prefix = /ega/inbox\n"
+	  "db_path = %s/users.db\n"
+	  "authorized_keys_dir = %s/keys\n",
+	  (unsigned int)getgid(), dir, dir);
+  fclose(fp);
+
+  setenv("EGA_AUTH_CONFIG", path, 1);
+  setenv("EGA_BENCH_KEYS_DIR", dir, 1);
+
+  execv("/proc/self/exe", argv);
+  perror("execv");
+  return 1;
+}
+
+static void
+cleanup(const char* dir)
+{
+  char path[PATH_MAX];
+  struct dirent *entry;
+
+  snprintf(path, sizeof(path), "%s/keys", dir);
+  DIR* d = opendir(path);
+  if(d){
+    while((entry = readdir(d))) if(*entry->d_name != '.' || strlen(entry->d_name) > 2) unlinkat(dirfd(d), entry->d_name, 0);
+    closedir(d);
+  }
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/auth.conf", dir); unlink(path);
+  snprintf(path, sizeof(path), "%s/users.db", dir); unlink(path);
+  rmdir(dir);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, i, n = 500, failures;
+  unsigned long users = 10000;
+  unsigned int keys = 2;
+  char user[64], path[PATH_MAX], key[160], fp[FINGERPRINT_LENGTH];
+
+  while((opt = getopt(argc, argv, "u:k:n:x:")) != -1){
+    switch(opt){
+    case 'u': users = strtoul(optarg, NULL, 10); break;
+    case 'k': keys = strtoul(optarg, NULL, 10); break;
+    case 'n': n = atoi(optarg); break;
+    case 'x': keys_exec = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-u cached users] [-k keys per user] [-n connections] [-x ega_ssh_keys]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(users < 100 || keys < 1 || n < 1){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+  if(access(keys_exec, X_OK)){ fprintf(stderr, "%s: %s (make bench-keys, from src/)\n", keys_exec, strerror(errno)); return 1; }
+
+  const char* dir = getenv("EGA_BENCH_KEYS_DIR");
+  if(!dir) return setup(argv);
+
+  if(!loadconfig() || !cache_open()){ fprintf(stderr, "Could not load %s\n", getenv("EGA_AUTH_CONFIG")); return 1; }
+  if(fill(options->db_path, users, keys, 1, 0)) return 1;
+
+  printf("%lu cached users, %u keys each\n\n", users, keys);
+  export("export, all:");
+  export("export, unchanged:");
+  if(fill(options->db_path, users, keys, 100, 1)) return 1; /* a new key for 1% of them */
+  export("export, 1% changed:");
+
+  uint64_t* samples = malloc(n * sizeof(uint64_t));
+  if(!samples) return 1;
+
+  printf("\n%-22s %6s %8s %10s %10s %10s\n", "route", "runs", "failures", "avg (us)", "p50 (us)", "p99 (us)");
+
+  srandom(42);
+  for(i = 0, failures = 0; i < n; i++){
+    snprintf(user, sizeof(user), "user%lu", (unsigned long)random() % users);
+    uint64_t start = bench_now_us();
+    if(run_keys(user, NULL, false) < (int)keys) failures++;
+    samples[i] = bench_now_us() - start;
+  }
+  report("command", samples, n, failures);
+
+  srandom(42);
+  for(i = 0, failures = 0; i < n; i++){
+    unsigned long u = (unsigned long)random() % users;
+    snprintf(user, sizeof(user), "user%lu", u);
+    pubkey(key, sizeof(key), u, keys - 1); /* the last one: not first in the output either */
+    fingerprint_pubkey(key, fp);
+    uint64_t start = bench_now_us();
+    if(run_keys(user, fp, false) != 1) failures++;
+    samples[i] = bench_now_us() - start;
+  }
+  report("command %f", samples, n, failures);
+
+  srandom(42);
+  for(i = 0, failures = 0; i < n; i++){
+    snprintf(path, sizeof(path), "%s/user%lu", options->keys_dir, (unsigned long)random() % users);
+    uint64_t start = bench_now_us();
+    if(read_file(path) < (int)keys) failures++;
+    samples[i] = bench_now_us() - start;
+  }
+  report("file", samples, n, failures);
+
+  free(samples);
+  cleanup(dir);
+  return 0; /* options are freed when the cache is closed */
+}
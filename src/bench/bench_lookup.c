@@ -0,0 +1,172 @@
+/*
+ * Per-authentication password hash lookup latency, as pam_ega_auth.so does it
+ *
+ *   - nss:    getspnam_r, through nsswitch ("shadow: files ega"): a scan of
+ *             /etc/shadow, then libnss_ega.so.2 and its cache
+ *   - direct: lookup_getspnam_r, the "direct" mode of pam_ega_auth.so,
+ *             straight to the same cache
+ *
+ * for users found in the cache, and for users only CentralEGA knows
+ * (a local stand-in, answering after -d us), which are then cached.
+ *
+ * The benchmark writes its own config file and cache in a temporary directory,
+ * and re-executes itself with EGA_AUTH_CONFIG pointing to it, and with
+ * LD_LIBRARY_PATH=. so that glibc loads ./libnss_ega.so.2: run it from src/.
+ *
+ * Usage: bench_lookup [-u cached users] [-n lookups] [-d CentralEGA delay in us]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <nss.h>
+#include <shadow.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "lookup.h"
+#include "bench/bench.h"
+#include "bench/mock_cega.h"
+
+#define PWDH "$2b$10$abcdefghijklmnopqrstuu5sNcnGrjEaf0Vh4ZPYgWjqN4F3WVz2i"
+
+static int
+nss_lookup(const char* user, char* buffer, size_t buflen)
+{
+  struct spwd sp, *result = NULL;
+  int rc = getspnam_r(user, &sp, buffer, buflen, &result);
+  return (rc == 0 && result && !strcmp(result->sp_pwdp, PWDH))?0:1;
+}
+
+static int
+direct_lookup(const char* user, char* buffer, size_t buflen)
+{
+  struct spwd sp;
+  int rc = lookup_getspnam_r(user, &sp, buffer, buflen);
+  return (rc == LOOKUP_FOUND && !strcmp(sp.sp_pwdp, PWDH))?0:1;
+}
+
+static void
+run(const char* name, int (*lookup)(const char*, char*, size_t), const char* fmt, int offset,
+    int users, uint64_t* samples, int n)
+{
+  char user[64], buffer[1024];
+  int i, failures = 0;
+  uint64_t total = 0;
+
+  for(i = 0; i < n; i++){
+    snprintf(user, sizeof(user), fmt, offset + ((users)?(int)(random() % users):i));
+    uint64_t start = bench_now_us();
+    if(lookup(user, buffer, sizeof(buffer))) failures++;
+    samples[i] = bench_now_us() - start;
+    total += samples[i];
+  }
+
+  uint64_t p50 = bench_percentile(samples, n, 50);
+  uint64_t p99 = bench_percentile(samples, n, 99);
+  printf("%-22s %6d %8d %10.1f %10lu %10lu\n", name, n, failures, (double)total / n,
+	 (unsigned long)p50, (unsigned long)p99);
+  fflush(stdout);
+}
+
+/* Config file and cache in a fresh directory, then exec ourselves again */
+static int
+setup(char** argv, useconds_t delay)
+{
+  char dir[] = "/tmp/ega-bench-lookup-XXXXXX", path[128];
+  static struct mock_cega cega;
+
+  if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+  cega.uid_base = 500000;
+  cega.pwdh = PWDH;
+  cega.delay = delay;
+  if(mock_cega_spawn(&cega)) return 1;
+
+  snprintf(path, sizeof(path), "%s/auth.conf", dir);
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); return 1; }
+  mock_cega_write_config(&cega, fp);
+  fprintf(fp,
+	  "gid = %u\n"
+	  "homedir_prefix = /ega/inbox\n"
+	  "db_path = %s/users.db\n",
+	  (unsigned int)getgid(), dir);
+  fclose(fp);
+
+  setenv("EGA_AUTH_CONFIG", path, 1);
+  setenv("EGA_BENCH_LOOKUP_DIR", dir, 1);
+  setenv("LD_LIBRARY_PATH", ".", 0);
+
+  execv("/proc/self/exe", argv);
+  perror("execv");
+  return 1;
+}
+
+static void
+cleanup(const char* dir)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "%s/auth.conf", dir); unlink(path);
+  snprintf(path, sizeof(path), "%s/users.db", dir); unlink(path);
+  rmdir(dir);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, i, users = 1000, n = 2000;
+  useconds_t delay = 0;
+  char user[64];
+
+  while((opt = getopt(argc, argv, "u:n:d:")) != -1){
+    switch(opt){
+    case 'u': users = atoi(optarg); break;
+    case 'n': n = atoi(optarg); break;
+    case 'd': delay = (useconds_t)atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-u cached users] [-n lookups] [-d CentralEGA delay in us]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(users < 1 || n < 1){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+
+  const char* dir = getenv("EGA_BENCH_LOOKUP_DIR");
+  if(!dir) return setup(argv, delay);
+
+  signal(SIGPIPE, SIG_IGN);
+  if(!loadconfig() || !cache_open()){ fprintf(stderr, "Could not load %s\n", getenv("EGA_AUTH_CONFIG")); return 1; }
+
+  /* Fill the cache */
+  for(i = 0; i < users; i++){
+    snprintf(user, sizeof(user), "cached%d", i);
+    struct fega_user u = { .uid = options->uid_shift + 1 + i, .username = user, .pwdh = PWDH,
+			   .pubkeys = NULL, .gecos = "Bench", .last_changed = 17000 };
+    if(cache_add_user(&u)){ fprintf(stderr, "Could not fill the cache\n"); return 1; }
+  }
+
+  if(__nss_configure_lookup("shadow", "files ega")){ perror("__nss_configure_lookup"); return 1; }
+  char buffer[1024];
+  if(nss_lookup("cached0", buffer, sizeof(buffer))){
+    fprintf(stderr, "libnss_ega.so.2 did not answer: use make bench-lookup, from src/\n");
+    return 1;
+  }
+
+  uint64_t* samples = malloc(n * sizeof(uint64_t));
+  if(!samples) return 1;
+
+  printf("%d cached users, CentralEGA answering after %u us\n\n", users, (unsigned int)delay);
+  printf("%-22s %6s %8s %10s %10s %10s\n", "route", "runs", "failures", "avg (us)", "p50 (us)", "p99 (us)");
+  srandom(42);
+  run("nss, cached", nss_lookup, "cached%d", 0, users, samples, n);
+  srandom(42);
+  run("direct, cached", direct_lookup, "cached%d", 0, users, samples, n);
+  run("nss, CentralEGA", nss_lookup, "remote%d", 0, 0, samples, n);
+  run("direct, CentralEGA", direct_lookup, "remote%d", n, 0, samples, n);
+
+  free(samples);
+  cleanup(dir);
+  return 0; /* options are freed when the cache is closed */
+}
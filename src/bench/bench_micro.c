@@ -0,0 +1,588 @@
+/*
+ * Microbenchmarks of the lookup path, written as JSON for comparisons across commits
+ *
+ *   - parse_json:  CentralEGA responses with more and more keys,
+ *                  and more and more fields we skip
+ *   - record:      copy2buffer and strjoina, and the passwd record
+ *                  that the cache builds with them, for longer and longer strings
+ *   - config:      loadconfig (readconfig and the buffer doubling), on config
+ *                  files from the minimal one to one with all the replicas
+ *   - cache:       each cache_get* function, on caches of 1k rows up to -m rows
+ *                  (10 times more each step), for random users it holds,
+ *                  and for users it does not, then cache_add_user of new users
+ *                  (a miss, inserted). With the backend of -b (sqlite | lmdb).
+ *   - trace:       an event in the trace ring, a lookup's start and end events,
+ *                  a counter and a timer of the stats, and a cache hit in the access
+ *                  counts, as recorded on every lookup. They go to the node's own
+ *                  ring, stats and counts.
+ *
+ * Each case runs in batches of at least -t ms, -r times: we report the median
+ * and the fastest batch, in ns per call.
+ *
+ * Like bench_lookup, it writes its own config file and cache in a temporary directory,
+ * and re-executes itself with EGA_AUTH_CONFIG pointing to it.
+ *
+ * Usage: bench_micro [-o results.json] [-l label] [-m max cache rows] [-t ms per batch] [-r batches] [-b backend]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <sqlite3.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "json.h"
+#include "lookup.h"
+#include "stats.h"
+#include "trace.h"
+#include "hotset.h"
+#include "bench/bench.h"
+
+#define PWDH "$2b$10$abcdefghijklmnopqrstuu5sNcnGrjEaf0Vh4ZPYgWjqN4F3WVz2i"
+#define PUBKEY "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIGtFT0vD6Rr8PsLnqE3iZzl0nnKx2rjOm5xT0wVq3ZPC"
+#define NAMES 4096 /* random picks, drawn before the runs */
+#define ADDED_UIDS 2000000000U /* for cache_add_user: away from the rows, whichever their count */
+
+static struct {
+  unsigned int batch_ms;
+  unsigned int batches;
+  FILE* json;
+  bool first;
+} run_conf = { 200, 5, NULL, true };
+
+/* One call of the measured function, with its context and the iteration number */
+typedef void (*bench_fn)(void* ctx, uint64_t i);
+
+/*
+ * Finds how many calls fill a batch, then times the batches.
+ * Prints a line, and appends an entry to the JSON results.
+ */
+static void
+measure(const char* group, const char* name, const char* params, bench_fn fn, void* ctx)
+{
+  uint64_t n = 1, i, b, elapsed;
+  uint64_t *batches = malloc(run_conf.batches * sizeof(uint64_t)); /* ns per call, x1000 */
+  if(!batches) return;
+
+  /* Calibration (and warm-up) */
+  for(;;){
+    uint64_t start = bench_now_ns();
+    for(i = 0; i < n; i++) fn(ctx, i);
+    elapsed = bench_now_ns() - start;
+    if(elapsed >= run_conf.batch_ms * 1000000ULL / 4) break;
+    n *= 2;
+  }
+  n = n * (run_conf.batch_ms * 1000000ULL) / ((elapsed)?elapsed:1) + 1;
+
+  for(b = 0; b < run_conf.batches; b++){
+    uint64_t start = bench_now_ns();
+    for(i = 0; i < n; i++) fn(ctx, i);
+    batches[b] = (bench_now_ns() - start) * 1000 / n;
+  }
+
+  uint64_t best = batches[0];
+  for(b = 1; b < run_conf.batches; b++) if(batches[b] < best) best = batches[b];
+  uint64_t median = bench_percentile(batches, run_conf.batches, 50);
+
+  printf("%-10s %-24s %-56s %12.1f %12.1f\n", group, name, params, median / 1000.0, best / 1000.0);
+  fflush(stdout);
+
+  fprintf(run_conf.json, "%s\n    { \"group\": \"%s\", \"name\": \"%s\", \"params\": { %s },"
+	  " \"calls\": %lu, \"batches\": %u, \"ns_per_call\": %.1f, \"ns_per_call_min\": %.1f }",
+	  (run_conf.first)?"":",", group, name, params,
+	  (unsigned long)n, run_conf.batches, median / 1000.0, best / 1000.0);
+  run_conf.first = false;
+  free(batches);
+}
+
+/*
+ * parse_json
+ */
+struct json_ctx {
+  char* json;
+  int len;
+};
+
+static void
+bench_parse_json(void* ctx, uint64_t i)
+{
+  struct json_ctx *c = ctx;
+  struct fega_user user = { .uid = 0 };
+  parse_json(c->json, c->len, 1 << 20, &user);
+  bench_clobber(user.pwdh);
+  fega_user_free(&user);
+}
+
+/* A CentralEGA answer with nkeys public keys and nextra fields we do not know about */
+static char*
+make_response(int nkeys, int nextra, int* tokens)
+{
+  size_t size = 512 + nkeys * (sizeof(PUBKEY) + 32) + nextra * 64;
+  char* json = malloc(size);
+  int k, len;
+
+  if(!json) return NULL;
+  len = snprintf(json, size, "{\"username\":\"john\",\"uid\":1,\"passwordHash\":\"%s\",\"gecos\":\"John Smith\","
+		 "\"lastChanged\":17000,\"sshPublicKeys\":[", PWDH);
+  for(k = 0; k < nkeys; k++)
+    len += snprintf(json + len, size - len, "%s\"%s john%d@ega\"", (k)?",":"", PUBKEY, k);
+  len += snprintf(json + len, size - len, "]");
+  for(k = 0; k < nextra; k++)
+    len += snprintf(json + len, size - len, ",\"field%d\":\"some value we skip\"", k);
+  snprintf(json + len, size - len, "}");
+  *tokens = 1 + 6 * 2 + nkeys + nextra * 2;
+  return json;
+}
+
+static void
+run_parse_json(void)
+{
+  int keys[] = { 0, 1, 8, 64 };
+  int extra[] = { 0, 32, 256 };
+  char params[128];
+  unsigned int k, e;
+
+  for(k = 0; k < ELEMENTSOF(keys); k++)
+    for(e = 0; e < ELEMENTSOF(extra); e++){
+      struct json_ctx c;
+      struct fega_user user = { .uid = 0 };
+      int tokens;
+      if(!(c.json = make_response(keys[k], extra[e], &tokens))) return;
+      c.len = strlen(c.json);
+      if(parse_json(c.json, c.len, 1 << 20, &user) || !user.pwdh){ fprintf(stderr, "Invalid response: %s\n", c.json); exit(1); }
+      fega_user_free(&user);
+
+      snprintf(params, sizeof(params), "\"bytes\": %d, \"tokens\": %d, \"keys\": %d, \"skipped\": %d",
+	       c.len, tokens, keys[k], extra[e]);
+      measure("parse_json", "parse_json", params, bench_parse_json, &c);
+      free(c.json);
+    }
+}
+
+/*
+ * copy2buffer, strjoina, and the passwd record of cache_getpwnam_r
+ */
+struct record_ctx {
+  char* value; /* a string of that length */
+  char buffer[4096];
+};
+
+static void
+bench_copy2buffer(void* ctx, uint64_t i)
+{
+  struct record_ctx *c = ctx;
+  char *buffer = c->buffer, *dest;
+  size_t buflen = sizeof(c->buffer);
+  copy2buffer(c->value, &dest, &buffer, &buflen);
+  bench_clobber(dest);
+}
+
+static void
+bench_strjoina(void* ctx, uint64_t i)
+{
+  struct record_ctx *c = ctx;
+  char* s = strjoina("/ega/inbox", "/", c->value);
+  bench_clobber(s);
+}
+
+static void
+bench_pwd_record(void* ctx, uint64_t i)
+{
+  struct record_ctx *c = ctx;
+  struct passwd pw;
+  char *buffer = c->buffer;
+  size_t buflen = sizeof(c->buffer);
+
+  pw.pw_name = c->value;
+  copy2buffer("x", &(pw.pw_passwd), &buffer, &buflen);
+  copy2buffer(c->value, &(pw.pw_gecos), &buffer, &buflen); /* gecos as long as the name */
+  char* homedir = strjoina(options->homedir_prefix, "/", pw.pw_name);
+  copy2buffer(homedir, &(pw.pw_dir), &buffer, &buflen);
+  copy2buffer(options->shell, &(pw.pw_shell), &buffer, &buflen);
+  bench_clobber(&pw);
+}
+
+static void
+run_record(void)
+{
+  int lengths[] = { 8, 64, 512 };
+  char params[128];
+  unsigned int l;
+  static struct record_ctx c;
+
+  for(l = 0; l < ELEMENTSOF(lengths); l++){
+    if(!(c.value = malloc(lengths[l] + 1))) return;
+    memset(c.value, 'a', lengths[l]);
+    c.value[lengths[l]] = '\0';
+    snprintf(params, sizeof(params), "\"length\": %d", lengths[l]);
+    measure("record", "copy2buffer", params, bench_copy2buffer, &c);
+    measure("record", "strjoina", params, bench_strjoina, &c);
+    measure("record", "passwd", params, bench_pwd_record, &c);
+    free(c.value);
+  }
+}
+
+/*
+ * loadconfig, on our own config files: the options of the cache are set aside meanwhile
+ */
+static void
+bench_loadconfig(void* ctx, uint64_t i)
+{
+  options = NULL;
+  if(!loadconfig()){ fprintf(stderr, "Could not load %s\n", (char*)ctx); exit(1); }
+  cleanconfig();
+}
+
+static void
+run_config(const char* dir)
+{
+  const char* names[] = { "minimal", "sample", "replicas" };
+  char path[256], params[128];
+  unsigned int k, r;
+  options_t *saved = options;
+  char *saved_path = strdup(getenv("EGA_AUTH_CONFIG"));
+
+  for(k = 0; k < ELEMENTSOF(names); k++){
+    snprintf(path, sizeof(path), "%s/%s.conf", dir, names[k]);
+    FILE* fp = fopen(path, "w");
+    if(!fp){ perror(path); exit(1); }
+    if(k == 1) /* the options of auth.conf.sample, with their comments */
+      for(r = 0; r < 30; r++) fprintf(fp, "# Some comment, about the option below, as in auth.conf.sample\n");
+    fprintf(fp, "cega_endpoint_username = http://cega/users/%%s?idType=username\n"
+		"cega_endpoint_uid = http://cega/users/%%u?idType=uid\n"
+		"cega_creds = user:password\n"
+		"gid = 997\n"
+		"homedir_prefix = /ega/inbox\n"
+		"db_path = /run/ega-users.db\n");
+    if(k >= 1)
+      fprintf(fp, "cega_hedge_percentile = 95\ncega_max_response_size = 65536\ncega_max_tokens = 1024\n"
+		  "cega_timeout = 10\ncega_dns_pinning = no\ncega_rate_limit = 50\ncega_rate_burst = 10\n"
+		  "cega_rate_max_wait = 200\nverify_hostname = yes\nverify_peer = yes\ncacertfile = /etc/ega/CA.cert\n"
+		  "certfile = /etc/ega/ssl.cert\nkeyfile = /etc/ega/ssl.key\nuid_shift = 1000\nshell = /bin/aspshell-r\n"
+		  "shadow_min = 0\nshadow_max = 99999\nshadow_warn = 7\nuse_cache = yes\ncache_ttl = 86400\n");
+    if(k == 2) /* all the replicas, and their long URLs: the buffer doubles */
+      for(r = 1; r < CEGA_ENDPOINTS_MAX; r++)
+	fprintf(fp, "cega_endpoint_username = https://cega-replica-%u.ega.example.org:8443/lega/v1/legas/users/%%s?idType=username\n"
+		    "cega_endpoint_uid = https://cega-replica-%u.ega.example.org:8443/lega/v1/legas/users/%%u?idType=uid\n", r, r);
+    long bytes = ftell(fp);
+    fclose(fp);
+
+    setenv("EGA_AUTH_CONFIG", path, 1);
+    snprintf(params, sizeof(params), "\"config\": \"%s\", \"bytes\": %ld", names[k], bytes);
+    measure("config", "loadconfig", params, bench_loadconfig, path);
+    unlink(path);
+  }
+
+  setenv("EGA_AUTH_CONFIG", saved_path, 1);
+  free(saved_path);
+  options = saved;
+}
+
+/*
+ * cache_get*, on the cache filled up to the given number of rows
+ */
+struct cache_ctx {
+  char names[NAMES][32];
+  uid_t uids[NAMES];
+  bool found; /* what we expect */
+  char buffer[1024];
+};
+
+static inline void
+check(struct cache_ctx *c, int rc)
+{
+  if(rc != ((c->found)?0:1)){ fprintf(stderr, "Unexpected cache answer: %d\n", rc); exit(1); }
+}
+
+static void
+bench_getpwnam(void* ctx, uint64_t i)
+{
+  struct cache_ctx *c = ctx;
+  struct passwd pw;
+  check(c, cache_getpwnam_r(c->names[i % NAMES], &pw, c->buffer, sizeof(c->buffer), false));
+}
+
+static void
+bench_getpwuid(void* ctx, uint64_t i)
+{
+  struct cache_ctx *c = ctx;
+  struct passwd pw;
+  check(c, cache_getpwuid_r(c->uids[i % NAMES], &pw, c->buffer, sizeof(c->buffer), false));
+}
+
+static void
+bench_getspnam(void* ctx, uint64_t i)
+{
+  struct cache_ctx *c = ctx;
+  struct spwd sp;
+  check(c, cache_getspnam_r(c->names[i % NAMES], &sp, c->buffer, sizeof(c->buffer), false));
+}
+
+static void
+bench_getuser(void* ctx, uint64_t i)
+{
+  struct cache_ctx *c = ctx;
+  struct passwd pw;
+  struct spwd sp;
+  check(c, cache_getuser_r(c->names[i % NAMES], &pw, &sp, c->buffer, sizeof(c->buffer), false));
+}
+
+static void
+bench_get_addresses(void* ctx, uint64_t i)
+{
+  struct cache_ctx *c = ctx;
+  check(c, cache_get_addresses("cega", 443, c->buffer, sizeof(c->buffer)));
+}
+
+/* A user CentralEGA just returned, as after a miss: one transaction each */
+static void
+bench_add_user(void* ctx, uint64_t i)
+{
+  static unsigned long added = 0;
+  struct cache_ctx *c = ctx;
+  struct fega_user user = { .uid = ADDED_UIDS + added, .pwdh = PWDH, .gecos = "Bench", .last_changed = 17000 };
+
+  snprintf(c->buffer, sizeof(c->buffer), "added%lu", added++);
+  user.username = c->buffer;
+  if(cache_add_user(&user)){ fprintf(stderr, "Could not insert %s\n", user.username); exit(1); }
+}
+
+/* Through the backend, in batches: one transaction each */
+static int
+fill_backend(unsigned long from, unsigned long to)
+{
+  static struct fega_user users[1000];
+  static char names[1000][32];
+  unsigned long i;
+  size_t n = 0;
+
+  for(i = from; i < to; i++){
+    snprintf(names[n], sizeof(names[n]), "user%lu", i);
+    users[n] = (struct fega_user){ .username = names[n], .uid = options->uid_shift + 1 + i, .pwdh = PWDH, .gecos = "Bench", .last_changed = 17000 };
+    if(++n == ELEMENTSOF(users) || i + 1 == to){
+      if(cache_add_users(users, n)){ fprintf(stderr, "Could not fill the cache\n"); return 1; }
+      n = 0;
+    }
+  }
+  return 0;
+}
+
+/* Another connection, one transaction: going through cache_add_user would take hours at 1M rows */
+static int
+fill(const char* db_path, unsigned long from, unsigned long to)
+{
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt = NULL;
+  char user[32];
+  unsigned long i;
+  int rc = 1;
+
+  if(sqlite3_open(db_path, &db) != SQLITE_OK) goto BAILOUT;
+  sqlite3_exec(db, "PRAGMA synchronous = OFF; BEGIN;", NULL, NULL, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO users (username,uid,pwdh,last_changed,gecos,expires) VALUES(?1,?2,?3,17000,'Bench',?4);",
+		     -1, &stmt, NULL);
+  if(!stmt) goto BAILOUT;
+  for(i = from; i < to; i++){
+    snprintf(user, sizeof(user), "user%lu", i);
+    sqlite3_bind_text(stmt, 1, user, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, options->uid_shift + 1 + i);
+    sqlite3_bind_blob(stmt, 3, PWDH, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, (unsigned int)time(NULL) + 86400);
+    if(sqlite3_step(stmt) != SQLITE_DONE) goto BAILOUT;
+    sqlite3_reset(stmt);
+  }
+  rc = (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK)?0:1;
+
+BAILOUT:
+  if(rc) fprintf(stderr, "Could not fill the cache: %s\n", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return rc;
+}
+
+static void
+run_cache(unsigned long max_rows)
+{
+  static struct cache_ctx c;
+  unsigned long rows, filled = 0;
+  const char* backend = cache_backend_name();
+  char params[128];
+  int k;
+
+  if(cache_add_addresses("cega", 443, "127.0.0.1", 86400)){ fprintf(stderr, "Could not pin an address\n"); exit(1); }
+  c.found = true;
+  snprintf(params, sizeof(params), "\"backend\": \"%s\", \"rows\": 1", backend);
+  measure("cache", "cache_get_addresses", params, bench_get_addresses, &c);
+
+  srandom(42);
+  for(rows = 1000; rows <= max_rows; rows *= 10){
+    if((strcmp(backend, "sqlite"))?fill_backend(filled, rows):fill(options->db_path, filled, rows)) exit(1);
+    filled = rows;
+
+    for(k = 0; k < NAMES; k++){
+      unsigned long i = random() % rows;
+      snprintf(c.names[k], sizeof(c.names[k]), "user%lu", i);
+      c.uids[k] = options->uid_shift + 1 + i;
+    }
+    c.found = true;
+    snprintf(params, sizeof(params), "\"backend\": \"%s\", \"rows\": %lu, \"found\": true", backend, rows);
+    measure("cache", "cache_getpwnam_r", params, bench_getpwnam, &c);
+    measure("cache", "cache_getpwuid_r", params, bench_getpwuid, &c);
+    measure("cache", "cache_getspnam_r", params, bench_getspnam, &c);
+    measure("cache", "cache_getuser_r", params, bench_getuser, &c);
+
+    /* Users only CentralEGA knows */
+    for(k = 0; k < NAMES; k++){
+      snprintf(c.names[k], sizeof(c.names[k]), "nobody%d", k);
+      c.uids[k] = options->uid_shift + 1 + rows + k;
+    }
+    c.found = false;
+    snprintf(params, sizeof(params), "\"backend\": \"%s\", \"rows\": %lu, \"found\": false", backend, rows);
+    measure("cache", "cache_getpwnam_r", params, bench_getpwnam, &c);
+    measure("cache", "cache_getpwuid_r", params, bench_getpwuid, &c);
+    measure("cache", "cache_add_user", params, bench_add_user, &c);
+  }
+}
+
+/*
+ * What every lookup records, whether anyone looks or not
+ */
+static void
+bench_trace_event(void* ctx, uint64_t i)
+{
+  trace_event(TRACE_CACHE, 0, i);
+}
+
+static void
+bench_trace_lookup(void* ctx, uint64_t i)
+{
+  trace_begin(STATS_NSS, TRACE_GETPWNAM, (const char*)ctx, -1);
+  trace_end(LOOKUP_FOUND);
+}
+
+static void
+bench_stats_count(void* ctx, uint64_t i)
+{
+  stats_count(STATS_LOOKUPS);
+}
+
+static void
+bench_stats_time(void* ctx, uint64_t i)
+{
+  stats_time(STATS_LOOKUP, i & 1023);
+}
+
+static void
+bench_hotset_hit(void* ctx, uint64_t i)
+{
+  hotset_hit((const char*)ctx);
+}
+
+static void
+run_trace(void)
+{
+  measure("trace", "trace_event", "", bench_trace_event, NULL);
+  measure("trace", "trace_begin+end", "\"username\": \"john.smith\"", bench_trace_lookup, "john.smith");
+  measure("trace", "stats_count", "", bench_stats_count, NULL);
+  measure("trace", "stats_time", "", bench_stats_time, NULL);
+  measure("trace", "hotset_hit", "\"username\": \"john.smith\"", bench_hotset_hit, "john.smith");
+}
+
+/* Config file and cache in a fresh directory, then exec ourselves again */
+static int
+setup(char** argv, const char* backend)
+{
+  char dir[] = "/tmp/ega-bench-micro-XXXXXX", path[128];
+
+  if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+
+  snprintf(path, sizeof(path), "%s/auth.conf", dir);
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); return 1; }
+  fprintf(fp,
+	  "cega_endpoint_username = http://127.0.0.1:1/users/%%s?idType=username\n"
+	  "cega_endpoint_uid = http://127.0.0.1:1/users/%%u?idType=uid\n"
+	  "cega_creds = user:password\n"
+	  "gid = %u\n"
+	  "homedir_prefix = /ega/inbox\n"
+	  "db_path = %s/users.db\n"
+	  "cache_backend = %s\n"
+	  "cache_refresh_budget = 60\n", /* for hotset_hit */
+	  (unsigned int)getgid(), dir, backend);
+  fclose(fp);
+
+  setenv("EGA_AUTH_CONFIG", path, 1);
+  setenv("EGA_BENCH_MICRO_DIR", dir, 1);
+
+  execv("/proc/self/exe", argv);
+  perror("execv");
+  return 1;
+}
+
+static void
+cleanup(const char* dir)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "%s/auth.conf", dir); unlink(path);
+  snprintf(path, sizeof(path), "%s/users.db", dir); unlink(path);
+  snprintf(path, sizeof(path), "%s/users.db-lock", dir); unlink(path); /* lmdb */
+  rmdir(dir);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt;
+  unsigned long max_rows = 1000000;
+  const char* output = "bench.json";
+  const char* label = "";
+  const char* backend = "sqlite";
+  struct utsname un;
+
+  while((opt = getopt(argc, argv, "o:l:m:t:r:b:")) != -1){
+    switch(opt){
+    case 'o': output = optarg; break;
+    case 'l': label = optarg; break;
+    case 'm': max_rows = strtoul(optarg, NULL, 10); break;
+    case 't': run_conf.batch_ms = strtoul(optarg, NULL, 10); break;
+    case 'r': run_conf.batches = strtoul(optarg, NULL, 10); break;
+    case 'b': backend = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-o results.json] [-l label] [-m max cache rows] [-t ms per batch] [-r batches] [-b backend]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(run_conf.batch_ms < 1 || run_conf.batches < 1 || strchr(label, '"') || strchr(label, '\\') || strchr(backend, '"')){
+    fprintf(stderr, "Invalid arguments\n");
+    return 2;
+  }
+
+  const char* dir = getenv("EGA_BENCH_MICRO_DIR");
+  if(!dir) return setup(argv, backend);
+
+  if(!loadconfig() || !cache_open()){ fprintf(stderr, "Could not load %s (cache backend %s)\n", getenv("EGA_AUTH_CONFIG"), backend); cleanup(dir); return 1; }
+
+  run_conf.json = fopen(output, "w");
+  if(!run_conf.json){ perror(output); return 1; }
+  uname(&un);
+  fprintf(run_conf.json, "{\n  \"benchmark\": \"bench_micro\",\n  \"label\": \"%s\",\n  \"timestamp\": %lu,\n"
+	  "  \"machine\": \"%s\",\n  \"sqlite\": \"%s\",\n  \"backend\": \"%s\",\n  \"batch_ms\": %u,\n  \"results\": [",
+	  label, (unsigned long)time(NULL), un.machine, sqlite3_libversion(), cache_backend_name(), run_conf.batch_ms);
+
+  printf("%-10s %-24s %-56s %12s %12s\n", "group", "name", "params", "ns/call", "min ns/call");
+  run_parse_json();
+  run_record();
+  run_config(dir);
+  run_cache(max_rows);
+  run_trace();
+
+  fprintf(run_conf.json, "\n  ]\n}\n");
+  fclose(run_conf.json);
+  printf("\nResults written to %s\n", output);
+  cleanup(dir);
+  return 0; /* options are freed when the cache is closed */
+}
@@ -0,0 +1,312 @@
+/*
+ * Load generator for libnss_ega.so.2, against the mock CentralEGA
+ *
+ * -P processes each dlopen the NSS module, as every sshd child does,
+ * and run -T threads calling _nss_ega_getpwnam_r, _nss_ega_getpwuid_r
+ * and _nss_ega_getspnam_r (in turn, or only those in -m) for random users,
+ * -x % of which CentralEGA does not know.
+ *
+ * Unless -c gives an existing auth.conf, it writes one (and the cache)
+ * in a temporary directory and points EGA_AUTH_CONFIG to it, before loading the module.
+ * The cache starts empty.
+ *
+ * With -W, the config has cache_write_behind = yes, and ./ega_cache_writer runs
+ * during the load (as root, from src/): the misses append to the journal,
+ * instead of writing to the cache.
+ *
+ * With -s N, the cache is split over N db files (cache_shards = N).
+ * With -b, the cache uses that backend (cache_backend = sqlite | lmdb).
+ *
+ * Reports, per function, the answers and the latency, the lookups per second,
+ * and the share of them answered without a CentralEGA request (the cache hit ratio).
+ *
+ * Usage: bench_nss_load [-P processes] [-T threads] [-n lookups per thread] [-u users] [-x % unknown]
+ *                       [-m pwnam,pwuid,spnam] [-l module] [-c auth.conf]
+ *                       [-d delay in us] [-j jitter in us] [-e % errors] [-t % truncated] [-S] [-W] [-s shards] [-b backend]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <nss.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bench/bench.h"
+#include "bench/mock_cega.h"
+
+#define UID_SHIFT 10000 /* the default of config.c */
+
+enum { OP_PWNAM, OP_PWUID, OP_SPNAM, OPS };
+static const char* op_names[OPS] = { "pwnam", "pwuid", "spnam" };
+
+enum { ANS_SUCCESS, ANS_NOTFOUND, ANS_TRYAGAIN, ANS_UNAVAIL, ANSWERS };
+
+typedef enum nss_status (*getpwnam_r_t)(const char*, struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*getpwuid_r_t)(uid_t, struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*getspnam_r_t)(const char*, struct spwd*, char*, size_t, int*);
+
+static getpwnam_r_t ega_getpwnam_r;
+static getpwuid_r_t ega_getpwuid_r;
+static getspnam_r_t ega_getspnam_r;
+
+/* Shared with the processes */
+struct shared {
+  uint64_t answers[OPS][ANSWERS];
+  uint64_t slots;        /* next free sample */
+  struct sample { uint8_t op; uint64_t us; } samples[];
+};
+static struct shared *shared = NULL;
+
+static struct {
+  int threads;
+  long n;
+  unsigned int users;
+  unsigned int unknown;
+  unsigned int uid_base;
+  bool ops[OPS];
+} conf;
+
+static void*
+thread(void* arg)
+{
+  unsigned int seed = (unsigned int)(uintptr_t)arg;
+  char name[64], buffer[1024];
+  struct passwd pw;
+  struct spwd sp;
+  int op = 0, errnop;
+  long k;
+
+  for(k = 0; k < conf.n; k++){
+    while(!conf.ops[op]) op = (op + 1) % OPS;
+
+    unsigned int i = rand_r(&seed) % conf.users;
+    bool unknown = ((unsigned int)rand_r(&seed) % 100) < conf.unknown;
+    if(unknown) snprintf(name, sizeof(name), "nobody%u_", i); /* not ending with a number: 404 */
+    else        snprintf(name, sizeof(name), "user%u", i);
+    if(unknown) i += conf.users;
+
+    enum nss_status st = NSS_STATUS_UNAVAIL;
+    uint64_t start = bench_now_us();
+    switch(op){
+    case OP_PWNAM: st = ega_getpwnam_r(name, &pw, buffer, sizeof(buffer), &errnop); break;
+    case OP_PWUID: st = ega_getpwuid_r(UID_SHIFT + conf.uid_base + i, &pw, buffer, sizeof(buffer), &errnop); break;
+    case OP_SPNAM: st = ega_getspnam_r(name, &sp, buffer, sizeof(buffer), &errnop); break;
+    }
+    uint64_t us = bench_now_us() - start;
+
+    int ans = (st == NSS_STATUS_SUCCESS)?ANS_SUCCESS:(st == NSS_STATUS_NOTFOUND)?ANS_NOTFOUND:
+              (st == NSS_STATUS_TRYAGAIN)?ANS_TRYAGAIN:ANS_UNAVAIL;
+    __atomic_add_fetch(&shared->answers[op][ans], 1, __ATOMIC_RELAXED);
+    uint64_t slot = __atomic_fetch_add(&shared->slots, 1, __ATOMIC_RELAXED);
+    shared->samples[slot].op = op;
+    shared->samples[slot].us = us;
+
+    op = (op + 1) % OPS;
+  }
+  return NULL;
+}
+
+/* One process: loads the module, and runs the threads */
+static void
+process(const char* module, int p)
+{
+  pthread_t *threads = calloc(conf.threads, sizeof(pthread_t));
+  int t;
+
+  void* handle = dlopen(module, RTLD_NOW | RTLD_LOCAL);
+  if(!handle){ fprintf(stderr, "%s\n", dlerror()); _exit(1); }
+  ega_getpwnam_r = (getpwnam_r_t)dlsym(handle, "_nss_ega_getpwnam_r");
+  ega_getpwuid_r = (getpwuid_r_t)dlsym(handle, "_nss_ega_getpwuid_r");
+  ega_getspnam_r = (getspnam_r_t)dlsym(handle, "_nss_ega_getspnam_r");
+  if(!threads || !ega_getpwnam_r || !ega_getpwuid_r || !ega_getspnam_r){ fprintf(stderr, "Not the EGA NSS module: %s\n", module); _exit(1); }
+
+  for(t = 0; t < conf.threads; t++)
+    if(pthread_create(&threads[t], NULL, thread, (void*)(uintptr_t)(p * 7919 + t * 104729 + 1))){ perror("pthread_create"); break; }
+  while(t-- > 0) pthread_join(threads[t], NULL);
+  _exit(0);
+}
+
+static void
+report(uint64_t elapsed, const struct mock_cega *cega)
+{
+  uint64_t total = shared->slots;
+  uint64_t *samples = malloc(((total)?total:1) * sizeof(uint64_t));
+  int op;
+
+  if(!samples) return;
+  printf("%-6s %8s %8s %8s %8s %8s %10s %10s %10s\n", "lookup", "calls", "found", "notfound", "tryagain",
+	 "unavail", "avg (us)", "p50 (us)", "p99 (us)");
+  for(op = 0; op <= OPS; op++){
+    size_t n = 0, i;
+    uint64_t sum = 0;
+    for(i = 0; i < total; i++){
+      if(op < OPS && shared->samples[i].op != op) continue;
+      samples[n++] = shared->samples[i].us;
+      sum += shared->samples[i].us;
+    }
+    if(op < OPS && !n) continue;
+    uint64_t *a = (op < OPS)?shared->answers[op]:NULL;
+    if(op == OPS){
+      static uint64_t all[ANSWERS];
+      int o, k;
+      for(o = 0; o < OPS; o++) for(k = 0; k < ANSWERS; k++) all[k] += shared->answers[o][k];
+      a = all;
+    }
+    printf("%-6s %8zu %8lu %8lu %8lu %8lu %10.1f %10lu %10lu\n", (op < OPS)?op_names[op]:"all", n,
+	   (unsigned long)a[ANS_SUCCESS], (unsigned long)a[ANS_NOTFOUND], (unsigned long)a[ANS_TRYAGAIN], (unsigned long)a[ANS_UNAVAIL],
+	   (n)?(double)sum / n:0.0, (unsigned long)bench_percentile(samples, n, 50), (unsigned long)bench_percentile(samples, n, 99));
+  }
+  printf("\n%lu lookups in %.2f s: %.0f lookups/s\n", (unsigned long)total, elapsed / 1e6, total * 1e6 / elapsed);
+
+  if(cega && cega->stats){
+    const struct mock_cega_stats *s = cega->stats;
+    printf("CentralEGA: %lu requests (%lu found, %lu not found, %lu errors, %lu truncated)\n",
+	   (unsigned long)s->requests, (unsigned long)s->found, (unsigned long)s->notfound,
+	   (unsigned long)s->errors, (unsigned long)s->truncated);
+    printf("hit ratio: %.1f%% of the lookups without a request\n",
+	   (total)?100.0 * (1.0 - (double)((s->requests < total)?s->requests:total) / total):0.0);
+  }
+  free(samples);
+}
+
+static int
+write_config(const char* dir, const struct mock_cega *cega, bool write_behind, unsigned int shards, const char* backend, char* path, size_t len)
+{
+  snprintf(path, len, "%s/auth.conf", dir);
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); return 1; }
+  mock_cega_write_config(cega, fp);
+  fprintf(fp,
+	  "gid = %u\n"
+	  "homedir_prefix = /ega/inbox\n"
+	  "db_path = %s/users.db\n"
+	  "cache_write_behind = %s\n"
+	  "cache_shards = %u\n"
+	  "cache_backend = %s\n",
+	  (unsigned int)getgid(), dir, (write_behind)?"yes":"no", shards, backend);
+  fclose(fp);
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, p, processes = 1;
+  const char* module = "./libnss_ega.so.2.0";
+  const char* config = NULL;
+  char* ops = NULL;
+  bool write_behind = false;
+  unsigned int shards = 1, s;
+  const char* backend = "sqlite";
+  pid_t writer = 0;
+  char dir[] = "/tmp/ega-bench-nss-load-XXXXXX", path[128];
+  struct mock_cega cega = { .uid_base = 500000, .pwdh = "$2b$10$abcdefghijklmnopqrstuu5sNcnGrjEaf0Vh4ZPYgWjqN4F3WVz2i" };
+
+  conf.threads = 4;
+  conf.n = 2000;
+  conf.users = 1000;
+  conf.unknown = 5;
+  conf.uid_base = cega.uid_base;
+
+  while((opt = getopt(argc, argv, "P:T:n:u:x:m:l:c:d:j:e:t:SWs:b:")) != -1){
+    switch(opt){
+    case 'P': processes = atoi(optarg); break;
+    case 'T': conf.threads = atoi(optarg); break;
+    case 'n': conf.n = atol(optarg); break;
+    case 'u': conf.users = strtoul(optarg, NULL, 10); break;
+    case 'x': conf.unknown = strtoul(optarg, NULL, 10); break;
+    case 'm': ops = optarg; break;
+    case 'l': module = optarg; break;
+    case 'c': config = optarg; break;
+    case 'd': cega.delay = strtoul(optarg, NULL, 10); break;
+    case 'j': cega.jitter = strtoul(optarg, NULL, 10); break;
+    case 'e': cega.error_rate = strtoul(optarg, NULL, 10); break;
+    case 't': cega.truncate_rate = strtoul(optarg, NULL, 10); break;
+    case 'S': cega.tls = true; break;
+    case 'W': write_behind = true; break;
+    case 's': shards = strtoul(optarg, NULL, 10); break;
+    case 'b': backend = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-P processes] [-T threads] [-n lookups per thread] [-u users] [-x %% unknown]\n"
+	      "          [-m pwnam,pwuid,spnam] [-l module] [-c auth.conf]\n"
+	      "          [-d delay in us] [-j jitter in us] [-e %% errors] [-t %% truncated] [-S] [-W] [-s shards] [-b backend]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(processes < 1 || conf.threads < 1 || conf.n < 1 || conf.users < 1 || conf.unknown > 100 || shards < 1){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+
+  for(p = 0; p < OPS; p++) conf.ops[p] = (ops == NULL || strstr(ops, op_names[p]));
+  if(!conf.ops[OP_PWNAM] && !conf.ops[OP_PWUID] && !conf.ops[OP_SPNAM]){ fprintf(stderr, "No lookup in %s\n", ops); return 2; }
+
+  signal(SIGPIPE, SIG_IGN);
+  if(!config){
+    cega.users = conf.users;
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    if(mock_cega_spawn(&cega) || write_config(dir, &cega, write_behind, shards, backend, path, sizeof(path))) return 1;
+    config = path;
+  }
+  setenv("EGA_AUTH_CONFIG", config, 1); /* read by the module when it is loaded */
+
+  if(write_behind){
+    if((writer = fork()) == 0){
+      execl("./ega_cache_writer", "ega_cache_writer", NULL);
+      perror("./ega_cache_writer (make ega_cache_writer, from src/)");
+      _exit(1);
+    }
+    usleep(200000); /* its first heartbeat */
+  }
+
+  uint64_t total = (uint64_t)processes * conf.threads * conf.n;
+  size_t size = sizeof(struct shared) + total * sizeof(struct sample);
+  shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(shared == MAP_FAILED){ perror("mmap"); return 1; }
+
+  printf("%d process(es) x %d thread(s) x %ld lookups, %u users (%u%% unknown)%s", processes, conf.threads, conf.n, conf.users, conf.unknown,
+	 (write_behind)?", write-behind":"");
+  if(shards > 1) printf(", %u cache shards", shards);
+  if(strcmp(backend, "sqlite")) printf(", %s cache", backend);
+  if(cega.stats) printf(", CentralEGA answering after %u+%u us, %u%% errors, %u%% truncated%s",
+			(unsigned int)cega.delay, (unsigned int)cega.jitter, cega.error_rate, cega.truncate_rate, (cega.tls)?", over TLS":"");
+  printf("\n\n");
+  fflush(stdout);
+
+  pid_t *pids = calloc(processes, sizeof(pid_t));
+  if(!pids) return 1;
+  uint64_t start = bench_now_us();
+  for(p = 0; p < processes; p++){
+    pids[p] = fork();
+    if(pids[p] < 0){ perror("fork"); break; }
+    if(pids[p] == 0) process(module, p);
+  }
+  while(p-- > 0) /* not wait(): the mock server is a child too */
+    while(waitpid(pids[p], NULL, 0) < 0 && errno == EINTR);
+  uint64_t elapsed = bench_now_us() - start;
+
+  report(elapsed, (cega.stats)?&cega:NULL);
+
+  if(writer > 0){ /* merges the rest, then exits */
+    fflush(stdout);
+    kill(writer, SIGTERM);
+    while(waitpid(writer, NULL, 0) < 0 && errno == EINTR);
+  }
+
+  if(cega.stats){
+    mock_cega_stop(&cega);
+    snprintf(path, sizeof(path), "%s/auth.conf", dir); unlink(path);
+    snprintf(path, sizeof(path), "%s/users.db", dir); unlink(path);
+    for(s = 1; s < shards; s++){ snprintf(path, sizeof(path), "%s/users.db.%u", dir, s); unlink(path); }
+    snprintf(path, sizeof(path), "%s/users.db-lock", dir); unlink(path); /* lmdb */
+    rmdir(dir);
+  }
+  free(pids);
+  munmap(shared, size);
+  return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * End-to-end login latency, through the real libpam and the built modules
+ *
+ * Writes a private PAM service (with pam_start_confdir, Linux-PAM 1.4+) stacking
+ * ./pam_ega_auth.so, ./pam_ega_acct.so and ./pam_ega_session.so, and runs logins
+ * against a local stand-in for CentralEGA, from -c concurrent workers.
+ *
+ * As sshd does, every login is a fresh process: pam_start (loading the modules),
+ * pam_authenticate, pam_acct_mgmt (creating the home directory), pam_open_session
+ * (chrooting into it, which is why it must run as root) and pam_end.
+ * Reports the latency of each phase, and the logins per second.
+ *
+ * The users are user0 to user<-u - 1>, in turn: the first login of each one
+ * misses the cache and asks CentralEGA.
+ *
+ * Like bench_lookup, it writes its own config file and cache in a temporary directory,
+ * and re-executes itself with EGA_AUTH_CONFIG pointing to it, and LD_LIBRARY_PATH=.
+ * for libnss_ega.so.2 (used when the auth module is not given "direct"): run it from src/.
+ *
+ * Usage: bench_pam_login [-n logins] [-c workers] [-u users] [-d CentralEGA delay in us]
+ *                        [-h hash setting] [-a auth module arguments]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <ftw.h>
+#include <nss.h>
+#include <crypt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#include <security/pam_appl.h>
+
+#include "bench/bench.h"
+#include "bench/mock_cega.h"
+
+#define SERVICE  "ega-bench"
+#define PASSWORD "s3cr3t"
+
+enum { PHASE_START, PHASE_AUTH, PHASE_ACCT, PHASE_SESSION, PHASE_END, PHASES };
+static const char* phase_names[PHASES] = { "pam_start", "pam_authenticate", "pam_acct_mgmt", "pam_open_session", "pam_end" };
+
+#define NOT_RUN UINT64_MAX
+
+/* Shared with the workers and their logins */
+struct shared {
+  uint64_t next;              /* next login to run */
+  uint64_t failures[PHASES];
+  uint64_t samples[][PHASES]; /* us, NOT_RUN when an earlier phase failed */
+};
+static struct shared *shared = NULL;
+
+static char pwdh[CRYPT_OUTPUT_SIZE];
+
+static int
+conversation(int n, const struct pam_message **msg, struct pam_response **resp, void *data)
+{
+  int i;
+  *resp = calloc(n, sizeof(struct pam_response));
+  if(!*resp) return PAM_BUF_ERR;
+  for(i = 0; i < n; i++)
+    if(msg[i]->msg_style == PAM_PROMPT_ECHO_OFF || msg[i]->msg_style == PAM_PROMPT_ECHO_ON)
+      (*resp)[i].resp = strdup(PASSWORD);
+  return PAM_SUCCESS;
+}
+
+/* One login, in the current (child) process */
+static void
+login(uint64_t i, const char* confdir, int users)
+{
+  struct pam_conv conv = { conversation, NULL };
+  pam_handle_t *pamh = NULL;
+  uint64_t *samples = shared->samples[i];
+  char user[64];
+  int p, rc;
+
+  for(p = 0; p < PHASES; p++) samples[p] = NOT_RUN;
+  snprintf(user, sizeof(user), "user%d", (int)(i % users));
+
+#define PHASE(phase, call) do {							\
+    uint64_t start = bench_now_us();						\
+    rc = (call);								\
+    samples[phase] = bench_now_us() - start;					\
+    if(rc != PAM_SUCCESS){							\
+      __atomic_add_fetch(&shared->failures[phase], 1, __ATOMIC_RELAXED);	\
+      goto END;									\
+    }										\
+  } while(0)
+
+  PHASE(PHASE_START, pam_start_confdir(SERVICE, user, &conv, confdir, &pamh));
+  pam_set_item(pamh, PAM_RHOST, "127.0.0.1");
+  PHASE(PHASE_AUTH, pam_authenticate(pamh, 0));
+  PHASE(PHASE_ACCT, pam_acct_mgmt(pamh, 0));
+  PHASE(PHASE_SESSION, pam_open_session(pamh, 0));
+#undef PHASE
+END:
+  if(pamh){
+    uint64_t start = bench_now_us();
+    if(pam_end(pamh, rc) != PAM_SUCCESS) __atomic_add_fetch(&shared->failures[PHASE_END], 1, __ATOMIC_RELAXED);
+    samples[PHASE_END] = bench_now_us() - start;
+  }
+}
+
+static void
+worker(uint64_t n, const char* confdir, int users)
+{
+  uint64_t i;
+  while((i = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED)) < n){
+    pid_t pid = fork();
+    if(pid < 0){ perror("fork"); _exit(1); }
+    if(pid == 0){ login(i, confdir, users); _exit(0); }
+    while(waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+  }
+}
+
+static void
+report(uint64_t n, int workers, uint64_t elapsed)
+{
+  uint64_t *samples = malloc(n * sizeof(uint64_t));
+  uint64_t i, total_us = 0;
+  int p;
+
+  if(!samples) return;
+  printf("%-18s %8s %8s %10s %10s %10s\n", "phase", "runs", "failures", "avg (us)", "p50 (us)", "p99 (us)");
+  for(p = 0; p < PHASES; p++){
+    size_t runs = 0;
+    uint64_t total = 0;
+    for(i = 0; i < n; i++){
+      if(shared->samples[i][p] == NOT_RUN) continue;
+      samples[runs++] = shared->samples[i][p];
+      total += shared->samples[i][p];
+    }
+    total_us += total;
+    printf("%-18s %8zu %8lu %10.1f %10lu %10lu\n", phase_names[p], runs, (unsigned long)shared->failures[p],
+	   (runs)?(double)total / runs:0.0,
+	   (unsigned long)bench_percentile(samples, runs, 50), (unsigned long)bench_percentile(samples, runs, 99));
+  }
+  printf("\n%lu logins in %.2f s, %d worker(s): %.1f logins/s, %.1f ms per login\n",
+	 (unsigned long)n, elapsed / 1e6, workers, n * 1e6 / elapsed, total_us / 1e3 / n);
+  free(samples);
+}
+
+/* The PAM service, using the modules of the current directory */
+static int
+write_service(const char* dir, const char* auth_args)
+{
+  char path[PATH_MAX], module[PATH_MAX];
+  const char* lines[][2] = {
+    { "auth",    "pam_ega_auth.so" },
+    { "account", "pam_ega_acct.so" },
+    { "session", "pam_ega_session.so" },
+  };
+  unsigned int i;
+
+  snprintf(path, sizeof(path), "%s/pam.d", dir);
+  if(mkdir(path, 0755)){ perror(path); return 1; }
+  snprintf(path, sizeof(path), "%s/pam.d/" SERVICE, dir);
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); return 1; }
+  for(i = 0; i < sizeof(lines) / sizeof(lines[0]); i++){
+    if(!realpath(lines[i][1], module)){ perror(lines[i][1]); fclose(fp); return 1; }
+    fprintf(fp, "%-8s required %s %s\n", lines[i][0], module, (i == 0)?auth_args:"");
+  }
+  fclose(fp);
+  return 0;
+}
+
+/* Config file, cache, PAM service and home directories in a fresh directory, then exec ourselves again */
+static int
+setup(char** argv, useconds_t delay, const char* auth_args)
+{
+  char dir[] = "/tmp/ega-bench-pam-login-XXXXXX", path[128];
+  static struct mock_cega cega;
+
+  if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+  snprintf(path, sizeof(path), "%s/inbox", dir);
+  if(mkdir(path, 0755)){ perror(path); return 1; }
+  if(write_service(dir, auth_args)) return 1;
+  cega.uid_base = 500000;
+  cega.pwdh = pwdh;
+  cega.delay = delay;
+  if(mock_cega_spawn(&cega)) return 1;
+
+  snprintf(path, sizeof(path), "%s/auth.conf", dir);
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); return 1; }
+  mock_cega_write_config(&cega, fp);
+  fprintf(fp,
+	  "gid = %u\n"
+	  "homedir_prefix = %s/inbox\n"
+	  "db_path = %s/users.db\n",
+	  (unsigned int)getgid(), dir, dir);
+  fclose(fp);
+
+  setenv("EGA_AUTH_CONFIG", path, 1);
+  setenv("EGA_BENCH_PAM_LOGIN_DIR", dir, 1);
+  setenv("LD_LIBRARY_PATH", ".", 0);
+
+  execv("/proc/self/exe", argv);
+  perror("execv");
+  return 1;
+}
+
+static int
+remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+  return remove(path);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, i, workers = 1, users = 100;
+  uint64_t n = 200;
+  useconds_t delay = 0;
+  const char* setting = "$2b$10$CCCCCCCCCCCCCCCCCCCCC.";
+  const char* auth_args = "direct hash_slots=0 tarpit_free=0";
+  struct crypt_data data;
+
+  while((opt = getopt(argc, argv, "n:c:u:d:h:a:")) != -1){
+    switch(opt){
+    case 'n': n = strtoull(optarg, NULL, 10); break;
+    case 'c': workers = atoi(optarg); break;
+    case 'u': users = atoi(optarg); break;
+    case 'd': delay = (useconds_t)atoi(optarg); break;
+    case 'h': setting = optarg; break;
+    case 'a': auth_args = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-n logins] [-c workers] [-u users] [-d CentralEGA delay in us]\n"
+	      "          [-h hash setting] [-a auth module arguments]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(n < 1 || workers < 1 || users < 1){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+  if(geteuid() != 0){ fprintf(stderr, "The session module chroots: run as root\n"); return 1; }
+
+  memset(&data, 0, sizeof(data));
+  if(!crypt_r(PASSWORD, setting, &data) || data.output[0] == '*'){ fprintf(stderr, "Invalid hash setting: %s\n", setting); return 1; }
+  snprintf(pwdh, sizeof(pwdh), "%s", data.output);
+
+  const char* dir = getenv("EGA_BENCH_PAM_LOGIN_DIR");
+  if(!dir) return setup(argv, delay, auth_args);
+
+  signal(SIGPIPE, SIG_IGN);
+  if(__nss_configure_lookup("passwd", "files ega") || __nss_configure_lookup("shadow", "files ega")){
+    perror("__nss_configure_lookup");
+    return 1;
+  }
+
+  char confdir[PATH_MAX];
+  snprintf(confdir, sizeof(confdir), "%s/pam.d", dir);
+
+  size_t size = sizeof(struct shared) + n * sizeof(shared->samples[0]);
+  shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(shared == MAP_FAILED){ perror("mmap"); return 1; }
+
+  printf("%s, %d users, CentralEGA answering after %u us\n", pwdh, users, (unsigned int)delay);
+  printf("auth module arguments: %s\n\n", auth_args);
+  fflush(stdout);
+
+  pid_t *pids = calloc(workers, sizeof(pid_t));
+  if(!pids) return 1;
+  uint64_t start = bench_now_us();
+  for(i = 0; i < workers; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){ perror("fork"); break; }
+    if(pids[i] == 0){ worker(n, confdir, users); _exit(0); }
+  }
+  while(i-- > 0) /* not wait(): the mock server is a child too */
+    while(waitpid(pids[i], NULL, 0) < 0 && errno == EINTR);
+  uint64_t elapsed = bench_now_us() - start;
+
+  report((shared->next < n)?shared->next:n, workers, elapsed);
+
+  free(pids);
+  munmap(shared, size);
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
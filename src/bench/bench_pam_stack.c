@@ -0,0 +1,259 @@
+/*
+ * Backend queries per login, through the auth, account and session modules
+ *
+ * Each login runs, in its own process as sshd does, pam_sm_authenticate,
+ * pam_sm_acct_mgmt (creating the home directory) and pam_sm_open_session
+ * (chrooting into it), against the libpam stand-in of pam_stub.c, and counts:
+ *
+ *   - NSS calls:   getspnam_r and getpwnam, answered in-process by lookup.c,
+ *                  as libnss_ega.so.2 would
+ *   - cache:       SQLite queries for a user
+ *   - CentralEGA:  requests to the local stand-in, answering after -d us
+ *
+ * with and without the user record shared on the PAM handle (pam_user.c),
+ * with and without the "direct" argument to the auth module,
+ * for users found in the cache, and for users only CentralEGA knows.
+ *
+ * Like bench_lookup, it writes its own config file and cache in a temporary directory,
+ * and re-executes itself with EGA_AUTH_CONFIG pointing to it.
+ * The session module chroots: run it as root.
+ *
+ * Usage: bench_pam_stack [-n logins] [-d CentralEGA delay in us]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ftw.h>
+#include <crypt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <shadow.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "cega.h"
+#include "lookup.h"
+#include "bench/bench.h"
+#include "bench/mock_cega.h"
+#include "bench/pam_stub.h"
+
+#define PASSWORD "s3cr3t"
+#define SETTING  "$5$rounds=1000$benchsaltbenchsa" /* cheap: we count queries, not hashes */
+
+static char pwdh[CRYPT_OUTPUT_SIZE];
+
+/* Shared with the login processes */
+struct counters {
+  uint64_t nss;
+  uint64_t cache;
+  uint64_t cega;
+  uint64_t failures;
+  uint64_t us;
+};
+static struct counters *counters = NULL;
+
+#define COUNT(c) __atomic_add_fetch(&counters->c, 1, __ATOMIC_RELAXED)
+
+/*
+ * Linked with --wrap: the calls from lookup.c land here first
+ */
+int __real_cache_getpwnam_r(const char* username, struct passwd *result, char* buffer, size_t buflen, bool allow_stale);
+int __real_cache_getspnam_r(const char* username, struct spwd *result, char* buffer, size_t buflen, bool allow_stale);
+int __real_cache_getuser_r(const char* username, struct passwd *pw, struct spwd *sp, char* buffer, size_t buflen, bool allow_stale);
+int __real_cega_resolve_username(const char *username, bool stale_ok, int (*cb)(struct fega_user *));
+
+int
+__wrap_cache_getpwnam_r(const char* username, struct passwd *result, char* buffer, size_t buflen, bool allow_stale)
+{
+  COUNT(cache);
+  return __real_cache_getpwnam_r(username, result, buffer, buflen, allow_stale);
+}
+
+int
+__wrap_cache_getspnam_r(const char* username, struct spwd *result, char* buffer, size_t buflen, bool allow_stale)
+{
+  COUNT(cache);
+  return __real_cache_getspnam_r(username, result, buffer, buflen, allow_stale);
+}
+
+int
+__wrap_cache_getuser_r(const char* username, struct passwd *pw, struct spwd *sp, char* buffer, size_t buflen, bool allow_stale)
+{
+  COUNT(cache);
+  return __real_cache_getuser_r(username, pw, sp, buffer, buflen, allow_stale);
+}
+
+int
+__wrap_cega_resolve_username(const char *username, bool stale_ok, int (*cb)(struct fega_user *))
+{
+  COUNT(cega);
+  return __real_cega_resolve_username(username, stale_ok, cb);
+}
+
+/* NSS, as "shadow: ega" and "passwd: ega" */
+static int
+nss_getspnam_r(const char *name, struct spwd *spbuf, char *buf, size_t buflen, struct spwd **spbufp)
+{
+  COUNT(nss);
+  int rc = lookup_getspnam_r(name, spbuf, buf, buflen);
+  *spbufp = (rc == LOOKUP_FOUND)?spbuf:NULL;
+  return (rc == LOOKUP_ERANGE)?ERANGE:0;
+}
+
+struct passwd*
+getpwnam(const char *name)
+{
+  static struct passwd pw;
+  static char buffer[1024];
+
+  COUNT(nss);
+  return (lookup_getpwnam_r(name, &pw, buffer, sizeof(buffer)) == LOOKUP_FOUND)?&pw:NULL;
+}
+
+/* One login, in a child process */
+static void
+login(const char* user, bool direct, bool shared)
+{
+  const char* auth_args[] = { "hash_slots=0", "tarpit_free=0", "direct" };
+  struct pam_handle pamh;
+
+  pid_t pid = fork();
+  if(pid < 0){ perror("fork"); COUNT(failures); return; }
+  if(pid == 0){
+    pam_stub_start(&pamh, user, PASSWORD);
+    pamh.no_data = !shared;
+
+    uint64_t start = bench_now_us();
+    int rc = pam_sm_authenticate(&pamh, 0, (direct)?3:2, auth_args);
+    if(rc == PAM_SUCCESS) rc = pam_sm_acct_mgmt(&pamh, 0, 0, NULL);
+    if(rc == PAM_SUCCESS) rc = pam_sm_open_session(&pamh, 0, 0, NULL);
+    __atomic_add_fetch(&counters->us, bench_now_us() - start, __ATOMIC_RELAXED);
+
+    if(rc != PAM_SUCCESS) COUNT(failures);
+    pam_stub_end(&pamh);
+    _exit(0);
+  }
+  while(waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+}
+
+static void
+run(const char* name, bool direct, bool shared, const char* fmt, int offset, int n)
+{
+  char user[64];
+  int i;
+
+  memset(counters, 0, sizeof(*counters));
+  for(i = 0; i < n; i++){
+    snprintf(user, sizeof(user), fmt, offset + i);
+    login(user, direct, shared);
+  }
+  printf("%-32s %6d %8lu %8.2f %8.2f %10.2f %10.2f %10.1f\n", name, n, (unsigned long)counters->failures,
+	 (double)counters->nss / n, (double)counters->cache / n, (double)counters->cega / n,
+	 (double)(counters->cache + counters->cega) / n, (double)counters->us / n);
+  fflush(stdout);
+}
+
+/* Config file, cache and home directories in a fresh directory, then exec ourselves again */
+static int
+setup(char** argv, useconds_t delay)
+{
+  char dir[] = "/tmp/ega-bench-pam-stack-XXXXXX", path[128];
+  static struct mock_cega cega;
+
+  if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+  snprintf(path, sizeof(path), "%s/inbox", dir);
+  if(mkdir(path, 0755)){ perror(path); return 1; }
+  cega.uid_base = 500000;
+  cega.pwdh = pwdh;
+  cega.delay = delay;
+  if(mock_cega_spawn(&cega)) return 1;
+
+  snprintf(path, sizeof(path), "%s/auth.conf", dir);
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); return 1; }
+  mock_cega_write_config(&cega, fp);
+  fprintf(fp,
+	  "gid = %u\n"
+	  "homedir_prefix = %s/inbox\n"
+	  "db_path = %s/users.db\n",
+	  (unsigned int)getgid(), dir, dir);
+  fclose(fp);
+
+  setenv("EGA_AUTH_CONFIG", path, 1);
+  setenv("EGA_BENCH_PAM_STACK_DIR", dir, 1);
+
+  execv("/proc/self/exe", argv);
+  perror("execv");
+  return 1;
+}
+
+static int
+remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+  return remove(path);
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, i, n = 200;
+  useconds_t delay = 0;
+  char user[64];
+  struct crypt_data data;
+
+  while((opt = getopt(argc, argv, "n:d:")) != -1){
+    switch(opt){
+    case 'n': n = atoi(optarg); break;
+    case 'd': delay = (useconds_t)atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-n logins] [-d CentralEGA delay in us]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(n < 1){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+  if(geteuid() != 0){ fprintf(stderr, "The session module chroots: run as root\n"); return 1; }
+
+  memset(&data, 0, sizeof(data));
+  if(!crypt_r(PASSWORD, SETTING, &data)){ perror("crypt_r"); return 1; }
+  snprintf(pwdh, sizeof(pwdh), "%s", data.output);
+
+  const char* dir = getenv("EGA_BENCH_PAM_STACK_DIR");
+  if(!dir) return setup(argv, delay);
+
+  signal(SIGPIPE, SIG_IGN);
+  if(!loadconfig() || !cache_open()){ fprintf(stderr, "Could not load %s\n", getenv("EGA_AUTH_CONFIG")); return 1; }
+
+  counters = mmap(NULL, sizeof(struct counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(counters == MAP_FAILED){ perror("mmap"); return 1; }
+  pam_stub_getspnam_r = nss_getspnam_r;
+
+  /* Fill the cache */
+  for(i = 0; i < n; i++){
+    snprintf(user, sizeof(user), "cached%d", i);
+    struct fega_user u = { .uid = options->uid_shift + 1 + i, .username = user, .pwdh = pwdh,
+			   .pubkeys = NULL, .gecos = "Bench", .last_changed = 17000 };
+    if(cache_add_user(&u)){ fprintf(stderr, "Could not fill the cache\n"); return 1; }
+  }
+
+  printf("%d logins per run, CentralEGA answering after %u us. Per login:\n\n", n, (unsigned int)delay);
+  printf("%-32s %6s %8s %8s %8s %10s %10s %10s\n", "auth module, user record", "logins", "failures",
+	 "NSS", "cache", "CentralEGA", "backend", "avg (us)");
+  run("nss, not shared, cached",       false, false, "cached%d", 0, n);
+  run("nss, shared, cached",           false, true,  "cached%d", 0, n);
+  run("direct, not shared, cached",    true,  false, "cached%d", 0, n);
+  run("direct, shared, cached",        true,  true,  "cached%d", 0, n);
+  run("nss, not shared, CentralEGA",   false, false, "remote%d", 0 * n, n);
+  run("nss, shared, CentralEGA",       false, true,  "remote%d", 1 * n, n);
+  run("direct, not shared, CentralEGA", true, false, "remote%d", 2 * n, n);
+  run("direct, shared, CentralEGA",    true,  true,  "remote%d", 3 * n, n);
+
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return 0; /* options are freed when the cache is closed */
+}
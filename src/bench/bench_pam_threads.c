@@ -0,0 +1,114 @@
+/*
+ * Authentication throughput of pam_sm_authenticate, from 1 to N threads
+ * of the same process, as in a threaded service authenticating through PAM.
+ *
+ * pam_auth.c is linked in directly, against the in-process stand-in
+ * for libpam of pam_stub.c, which returns a fixed SHA-512 (or any other)
+ * crypt hash, so no NSS lookup is involved.
+ * The tarpit and the hash semaphore are turned off.
+ *
+ * With -S, every call is serialized behind one lock, as callers of the
+ * old crypt() path had to do.
+ *
+ * Usage: bench_pam_threads [-h hash setting] [-t seconds per run] [-j max threads] [-S]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <crypt.h>
+
+#include "bench/bench.h"
+#include "bench/pam_stub.h"
+
+#define PASSWORD "s3cr3t"
+
+static const char* module_args[] = { "hash_slots=0", "tarpit_free=0" };
+
+static volatile int running;
+static int serialize = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void*
+run(void* arg)
+{
+  unsigned long count = 0;
+  struct pam_handle pamh;
+
+  pam_stub_start(&pamh, "john", PASSWORD);
+
+  do {
+    if(serialize) pthread_mutex_lock(&lock);
+    int rc = pam_sm_authenticate(&pamh, 0, sizeof(module_args) / sizeof(module_args[0]), module_args);
+    if(serialize) pthread_mutex_unlock(&lock);
+    if(rc != PAM_SUCCESS){ printf("FAILED (pam_sm_authenticate: %d)\n", rc); pam_stub_end(&pamh); return NULL; }
+    count++;
+  } while(running);
+
+  pam_stub_end(&pamh);
+  return (void*)(uintptr_t)count;
+}
+
+static double
+measure(int nthreads, unsigned int seconds)
+{
+  pthread_t t[nthreads];
+  unsigned long count = 0;
+  void* retval;
+  int i, started = 0;
+
+  running = 1;
+  uint64_t start = bench_now_us();
+  for(i = 0; i < nthreads; i++, started++)
+    if(pthread_create(&t[i], NULL, run, NULL)){ perror("pthread_create"); break; }
+  sleep(seconds);
+  running = 0;
+  for(i = 0; i < started; i++){
+    if(pthread_join(t[i], &retval) || !retval){ count = 0; continue; }
+    count += (uintptr_t)retval;
+  }
+  uint64_t elapsed = bench_now_us() - start;
+  return (elapsed && count)?(double)count * 1000000 / elapsed:0;
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, j;
+  const char* setting = "$6$rounds=5000$benchsaltbenchsa$";
+  unsigned int seconds = 1;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = (ncpu > 0)?(int)ncpu * 2:2;
+
+  while((opt = getopt(argc, argv, "h:t:j:S")) != -1){
+    switch(opt){
+    case 'h': setting = optarg; break;
+    case 't': seconds = atoi(optarg); break;
+    case 'j': max_threads = atoi(optarg); break;
+    case 'S': serialize = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-h hash setting] [-t seconds per run] [-j max threads] [-S]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(!seconds || max_threads < 1){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+
+  char* hash = crypt(PASSWORD, setting);
+  if(!hash || *hash == '*'){ fprintf(stderr, "Unsupported hash setting: %s\n", setting); return 2; }
+  pam_stub_hash = strdup(hash);
+
+  printf("%s, %ld CPU(s)%s\n\n", pam_stub_hash, ncpu, (serialize)?", serialized":"");
+  printf("%-8s %12s %10s\n", "threads", "auths/sec", "speedup");
+
+  double single = 0;
+  for(j = 1; j <= max_threads; j *= 2){
+    double rate = measure(j, seconds);
+    if(j == 1) single = rate;
+    printf("%-8d %12.1f %9.2fx\n", j, rate, single?rate / single:0);
+    fflush(stdout);
+  }
+
+  free(pam_stub_hash);
+  return 0;
+}
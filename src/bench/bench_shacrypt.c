@@ -0,0 +1,232 @@
+/*
+ * SHA-crypt ($5$ and $6$) verifications/sec of the in-tree verifier
+ * built into pam_ega_auth.so, against libc's crypt_r
+ *
+ *   - checks every SHA-256/SHA-512 kernel this CPU can run against
+ *     Drepper's test vectors, then against libc on a corpus of random
+ *     keys, salts and round counts
+ *   - verifications/sec per kernel and round count, on one core,
+ *     next to crypt_r for the same settings
+ *
+ * Usage: bench_shacrypt [-r rounds,rounds,...] [-n corpus size] [-t seconds per run]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <crypt.h>
+
+#include "sha2.h"
+#include "shacrypt.h"
+#include "bench/bench.h"
+
+#define PASSWORD "U*U*U*U"
+#define MAX_ROUNDS_LIST 16
+
+/* From https://www.akkadia.org/drepper/SHA-crypt.txt. NULL: shacrypt_rn leaves it to libc */
+static const char *tests[][3] = {
+  { "$5$saltstring", "Hello world!",
+    "$5$saltstring$5B8vYYiY.CVt1RlTTf8KbXBH3hsxY/GNooZaBBGWEc5" },
+  { "$5$rounds=10000$saltstringsaltstring", "Hello world!", NULL },
+  { "$5$rounds=10000$saltstringsaltst$3xv.VbSHBb41AL9AvLeujZkZRBAwqFMz2.opqey6IcA", "Hello world!",
+    "$5$rounds=10000$saltstringsaltst$3xv.VbSHBb41AL9AvLeujZkZRBAwqFMz2.opqey6IcA" },
+  { "$5$rounds=77777$short", "we have a short salt string but not a short password",
+    "$5$rounds=77777$short$JiO1O3ZpDAxGJeaDIuqCoEFysAe1mZNJRs3pw0KQRd/" },
+  { "$5$rounds=123456$asaltof16chars..", "a short string",
+    "$5$rounds=123456$asaltof16chars..$gP3VQ/6X7UUEW3HkBn2w1/Ptq2jxPyzV/cZKmF/wJvD" },
+  { "$5$rounds=10$roundstoolow", "the minimum number is still observed", NULL },
+  { "$6$saltstring", "Hello world!",
+    "$6$saltstring$svn8UoSVapNtMuq1ukKS4tPQd8iKwSMHWjl/O817G3uBnIFNjnQJuesI68u4OTLiBFdcbYEdFCoEOfaS35inz1" },
+  { "$6$rounds=10000$saltstringsaltstring", "Hello world!", NULL },
+  { "$6$rounds=77777$short", "we have a short salt string but not a short password",
+    "$6$rounds=77777$short$WuQyW2YR.hBNpjjRhpYD/ifIw05xdfeEyQoMxIXbkvr0gge1a1x3yRULJ5CCaUeOxFmtlcGZelFl5CxtgfiAc0" },
+  { "$6$rounds=123456$asaltof16chars..", "a short string",
+    "$6$rounds=123456$asaltof16chars..$BtCwjqMJGx5hrJhZywWvt0RLE8uZ4oPwcelCjmw2kSYu.Ec6ycULevoBK25fs2xXgMNrCzIMVcgEJAstJeonj1" },
+  { "$6$rounds=0100$leadingzero", "leading zeros are left to libc", NULL },
+  { "$7$saltstring", "not ours", NULL },
+  { NULL }
+};
+
+static const char* sha256_kernels[] = { "sha-ni", "generic", NULL };
+static const char* sha512_kernels[] = { "generic", NULL };
+
+static const char b64t[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+static int
+check_vectors(void)
+{
+  char out[SHACRYPT_OUTPUT_SIZE];
+  int i;
+
+  for(i = 0; tests[i][0]; i++){
+    errno = 0;
+    char *p = shacrypt_rn(tests[i][1], tests[i][0], out, sizeof(out));
+    if((tests[i][2] && (!p || strcmp(p, tests[i][2]))) ||
+       (!tests[i][2] && (p || errno != EINVAL))){
+      printf("FAILED (vector %d: %s)\n", i, (p)?p:strerror(errno));
+      return 1;
+    }
+  }
+
+  /* Output too short, by one */
+  if(shacrypt_rn(tests[0][1], tests[0][0], out, strlen(tests[0][2])) || errno != ERANGE){
+    printf("FAILED (short output)\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Random keys (1 to 255 bytes), salts (1 to 16 chars), and round counts, against libc */
+static int
+check_corpus(unsigned int n, unsigned int seed)
+{
+  struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+  char key[256], setting[64], out[SHACRYPT_OUTPUT_SIZE];
+  unsigned int i, j;
+  int rc = 1;
+
+  if(!data){ perror("calloc"); return 1; }
+  srandom(seed);
+
+  for(i = 0; i < n; i++){
+    size_t key_len = 1 + random() % ((i % 8)?32:255);
+    size_t salt_len = 1 + random() % 16;
+    char salt[17];
+
+    for(j = 0; j < key_len; j++) key[j] = 1 + random() % 255;
+    key[key_len] = '\0';
+    for(j = 0; j < salt_len; j++) salt[j] = b64t[random() % 64];
+    salt[salt_len] = '\0';
+
+    if(i % 3) snprintf(setting, sizeof(setting), "$%c$rounds=%ld$%s", (i & 1)?'5':'6', 1000 + random() % 1500, salt);
+    else snprintf(setting, sizeof(setting), "$%c$%s", (i & 1)?'5':'6', salt);
+
+    char *expected = crypt_r(key, setting, data);
+    char *p = shacrypt_rn(key, setting, out, sizeof(out));
+    if(!expected || *expected == '*' || !p || strcmp(p, expected)){
+      printf("FAILED (corpus %u: %s, key length %zu)\n", i, setting, key_len);
+      goto BAILOUT;
+    }
+    /* and the full hash as setting, as pam_ega_auth.so passes it */
+    p = shacrypt_rn(key, expected, out, sizeof(out));
+    if(!p || strcmp(p, expected)){
+      printf("FAILED (corpus %u: %s, from the hash)\n", i, setting);
+      goto BAILOUT;
+    }
+  }
+  rc = 0;
+
+BAILOUT:
+  free(data);
+  return rc;
+}
+
+/* Verifications per second of <setting>, through shacrypt_rn or crypt_r */
+static double
+measure(const char* setting, int use_libc, unsigned int seconds)
+{
+  struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+  char out[SHACRYPT_OUTPUT_SIZE];
+  unsigned long count = 0;
+  uint64_t start = bench_now_us(), deadline = start + seconds * 1000000ULL, now;
+
+  if(!data) return 0;
+  do {
+    char *p = (use_libc)?crypt_r(PASSWORD, setting, data):shacrypt_rn(PASSWORD, setting, out, sizeof(out));
+    if(!p){ count = 0; break; }
+    count++;
+  } while((now = bench_now_us()) < deadline);
+
+  free(data);
+  return (count)?(double)count * 1000000 / (now - start):0;
+}
+
+static int
+run_table(char variant, const char** kernels, int (*use)(const char*), const char* selected,
+	  const unsigned long* rounds, int nrounds, unsigned int seconds)
+{
+  char setting[64];
+  int i, j;
+
+  printf("\n$%c$ %-10s", variant, "kernel");
+  for(j = 0; j < nrounds; j++) printf(" %10lu", rounds[j]);
+  printf("   (verifications/sec per round count, 1 thread)\n");
+
+  for(i = 0; kernels[i]; i++){
+    if(use(kernels[i])) continue; /* not supported on this CPU */
+    if(check_vectors()) return 1;
+    printf("    %-10s", kernels[i]);
+    fflush(stdout);
+    for(j = 0; j < nrounds; j++){
+      snprintf(setting, sizeof(setting), "$%c$rounds=%lu$benchsaltbenchsa", variant, rounds[j]);
+      printf(" %10.1f", measure(setting, 0, seconds));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  use(selected);
+
+  printf("    %-10s", "libc");
+  for(j = 0; j < nrounds; j++){
+    snprintf(setting, sizeof(setting), "$%c$rounds=%lu$benchsaltbenchsa", variant, rounds[j]);
+    printf(" %10.1f", measure(setting, 1, seconds));
+    fflush(stdout);
+  }
+  printf("\n");
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  int opt, i, nrounds = 0;
+  unsigned long rounds[MAX_ROUNDS_LIST];
+  unsigned int seconds = 1, corpus = 2000;
+  const char* list = "1000,5000,20000,100000";
+  char *copy, *tok, *save = NULL;
+
+  while((opt = getopt(argc, argv, "r:n:t:")) != -1){
+    switch(opt){
+    case 'r': list = optarg; break;
+    case 'n': corpus = atoi(optarg); break;
+    case 't': seconds = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-r rounds,rounds,...] [-n corpus size] [-t seconds per run]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  copy = strdup(list);
+  for(tok = strtok_r(copy, ",", &save); tok && nrounds < MAX_ROUNDS_LIST; tok = strtok_r(NULL, ",", &save)){
+    rounds[nrounds] = strtoul(tok, NULL, 10);
+    if(rounds[nrounds] < 1000 || rounds[nrounds] > 999999999){ fprintf(stderr, "Invalid round count: %s\n", tok); return 2; }
+    nrounds++;
+  }
+  free(copy);
+  if(!nrounds || !seconds){ fprintf(stderr, "Invalid arguments\n"); return 2; }
+
+  const char* sha256_selected = sha256_kernel();
+  const char* sha512_selected = sha512_kernel();
+  printf("Selected kernels: SHA-256 %s, SHA-512 %s\n", sha256_selected, sha512_selected);
+
+  /* Every combination of kernels against the vectors and libc */
+  for(i = 0; sha256_kernels[i]; i++){
+    int k;
+    if(sha256_use_kernel(sha256_kernels[i])) continue;
+    for(k = 0; sha512_kernels[k]; k++){
+      if(sha512_use_kernel(sha512_kernels[k])) continue;
+      if(check_vectors() || check_corpus(corpus, 42 + i * 7 + k)) return 1;
+      printf("%s + %s: %zu vectors and %u random settings match libc\n",
+	     sha256_kernels[i], sha512_kernels[k], sizeof(tests) / sizeof(tests[0]) - 1, corpus);
+    }
+  }
+  sha256_use_kernel(sha256_selected);
+  sha512_use_kernel(sha512_selected);
+
+  if(run_table('5', sha256_kernels, sha256_use_kernel, sha256_selected, rounds, nrounds, seconds) ||
+     run_table('6', sha512_kernels, sha512_use_kernel, sha512_selected, rounds, nrounds, seconds))
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "bench/mock_http.h"
+#include "bench/mock_cega.h"
+
+#define COUNT(m, c) __atomic_add_fetch(&(m)->stats->c, 1, __ATOMIC_RELAXED)
+
+static uint64_t threads = 0;
+static __thread uint64_t state = 0;
+
+/* splitmix64: rand_r on seeds as close as thread ids drew very skewed rates */
+static unsigned int
+draw(unsigned int n)
+{
+  if(!state) state = ((uint64_t)getpid() << 32) + __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED);
+  uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (n)?(unsigned int)(z % n):0;
+}
+
+/* The user number in the name, -1 when it is none of ours */
+static long
+user_number(const struct mock_cega *m, const char* name)
+{
+  size_t len = strlen(name), digits = 0;
+  while(digits < len && name[len - digits - 1] >= '0' && name[len - digits - 1] <= '9') digits++;
+  if(!digits || digits > 9) return -1;
+  long i = atol(name + len - digits);
+  return (m->users && i >= m->users)?-1:i;
+}
+
+static int
+handler(struct mock_conn *c, const char* path, void* data)
+{
+  struct mock_cega *m = data;
+  char body[512], id[64], type[16], username[80];
+  long i = -1;
+
+  COUNT(m, requests);
+  if(m->delay || m->jitter) usleep(m->delay + draw(m->jitter));
+
+  if(sscanf(path, "/users/%63[^?]?idType=%15s", id, type) != 2) goto NOTFOUND;
+  if(!strcmp(type, "username")){
+    i = user_number(m, id);
+    snprintf(username, sizeof(username), "%s", id);
+  } else if(!strcmp(type, "uid")){
+    i = strtol(id, NULL, 10) - (long)m->uid_base;
+    if(i < 0 || (m->users && i >= m->users)) i = -1;
+    snprintf(username, sizeof(username), "user%ld", i);
+  }
+  if(i < 0) goto NOTFOUND;
+
+  if(draw(100) < m->error_rate){
+    COUNT(m, errors);
+    return mock_http_reply(c, 500, "{}", 2);
+  }
+
+  int len = snprintf(body, sizeof(body),
+		     "{\"username\":\"%s\",\"uid\":%ld,\"passwordHash\":\"%s\",\"gecos\":\"Synthetic user %ld\",\"lastChanged\":17000}",
+		     username, m->uid_base + i, m->pwdh, i);
+
+  if(draw(100) < m->truncate_rate){
+    char headers[128];
+    COUNT(m, truncated);
+    int hlen = snprintf(headers, sizeof(headers),
+			"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n", len);
+    mock_http_send(c, headers, hlen);
+    mock_http_send(c, body, len / 2);
+    return 1; /* and close */
+  }
+
+  COUNT(m, found);
+  return mock_http_reply(c, 200, body, len);
+
+NOTFOUND:
+  COUNT(m, notfound);
+  return mock_http_reply(c, 404, "", 0);
+}
+
+int
+mock_cega_spawn(struct mock_cega *m)
+{
+  int fds[2];
+
+  m->stats = mmap(NULL, sizeof(struct mock_cega_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(m->stats == MAP_FAILED){ perror("mmap"); m->stats = NULL; return 1; }
+  if(pipe(fds)){ perror("pipe"); return 1; }
+
+  m->pid = fork();
+  if(m->pid < 0){ perror("fork"); return 1; }
+  if(m->pid == 0){
+    static struct mock_http srv;
+    close(fds[0]);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    srv.handler = handler;
+    srv.data = m;
+    srv.tls = m->tls;
+    if(mock_http_start(&srv)) _exit(1);
+    if(write(fds[1], &srv.port, sizeof(srv.port)) != sizeof(srv.port)) _exit(1);
+    close(fds[1]);
+    for(;;) pause();
+  }
+  close(fds[1]);
+  int rc = (read(fds[0], &m->port, sizeof(m->port)) == sizeof(m->port))?0:1;
+  close(fds[0]);
+  if(rc) fprintf(stderr, "Could not start the mock CentralEGA\n");
+  return rc;
+}
+
+void
+mock_cega_stop(struct mock_cega *m)
+{
+  if(m->pid > 0){
+    kill(m->pid, SIGTERM);
+    waitpid(m->pid, NULL, 0);
+    m->pid = 0;
+  }
+}
+
+void
+mock_cega_write_config(const struct mock_cega *m, FILE* fp)
+{
+  const char* scheme = (m->tls)?"https":"http";
+  fprintf(fp,
+	  "cega_endpoint_username = %s://127.0.0.1:%u/users/%%s?idType=username\n"
+	  "cega_endpoint_uid = %s://127.0.0.1:%u/users/%%u?idType=uid\n"
+	  "cega_creds = user:password\n"
+	  "cega_dns_pinning = no\n",
+	  scheme, m->port, scheme, m->port);
+}
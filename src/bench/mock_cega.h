@@ -0,0 +1,56 @@
+#ifndef __FEGA_MOCK_CEGA_H_INCLUDED__
+#define __FEGA_MOCK_CEGA_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * A stand-in for CentralEGA's users endpoint, over mock_http, with the shapes of auth.conf.sample:
+ *
+ *   /users/<username>?idType=username
+ *   /users/<uid>?idType=uid
+ *
+ * The synthetic users are the names ending with a number i below <users>
+ * (user0, user1..., or cached12, remote7 for the benchmarks which need several sets),
+ * with uid <uid_base + i>. With users = 0, every such name exists.
+ * The others get a 404. Everyone has the same password hash.
+ *
+ * Faults can be injected: a delay (plus a uniform jitter), and a share of the requests
+ * answered 500, or cut half-way through the body (then the connection is closed).
+ *
+ * The server runs in a child process, which goes away with the calling thread
+ * (even across an exec). Its counters are in shared memory.
+ */
+struct mock_cega_stats {
+  uint64_t requests;
+  uint64_t found;
+  uint64_t notfound;
+  uint64_t errors;     /* injected */
+  uint64_t truncated;  /* injected */
+};
+
+struct mock_cega {
+  unsigned int users;
+  unsigned int uid_base;
+  const char* pwdh;
+  useconds_t delay;         /* us, for every request */
+  useconds_t jitter;        /* us, up to that much more */
+  unsigned int error_rate;  /* %, answered 500 */
+  unsigned int truncate_rate; /* %, truncated */
+  bool tls;                 /* self-signed: keep verify_peer off */
+
+  /* filled by mock_cega_spawn */
+  unsigned short port;
+  pid_t pid;
+  struct mock_cega_stats *stats;
+};
+
+int mock_cega_spawn(struct mock_cega *m);
+void mock_cega_stop(struct mock_cega *m);
+
+/* The endpoint settings of auth.conf, for this server */
+void mock_cega_write_config(const struct mock_cega *m, FILE* fp);
+
+#endif /* !__FEGA_MOCK_CEGA_H_INCLUDED__ */
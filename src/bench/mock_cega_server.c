@@ -0,0 +1,69 @@
+/*
+ * The mock CentralEGA of the benchmarks, as a standalone server
+ *
+ * Prints the endpoint settings to put in auth.conf, then serves until interrupted,
+ * and prints its counters. For load tests by hand, of libnss_ega.so.2 or of sshd.
+ *
+ * Usage: mock_cega_server [-u users] [-b uid base] [-h password hash]
+ *                         [-d delay in us] [-j jitter in us] [-e % errors] [-t % truncated] [-S]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "bench/mock_cega.h"
+
+static volatile sig_atomic_t done = 0;
+
+static void
+stop(int sig)
+{
+  done = 1;
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mock_cega cega = {
+    .users = 1000,
+    .uid_base = 500000,
+    .pwdh = "$2b$10$abcdefghijklmnopqrstuu5sNcnGrjEaf0Vh4ZPYgWjqN4F3WVz2i",
+  };
+  int opt;
+
+  while((opt = getopt(argc, argv, "u:b:h:d:j:e:t:S")) != -1){
+    switch(opt){
+    case 'u': cega.users = strtoul(optarg, NULL, 10); break;
+    case 'b': cega.uid_base = strtoul(optarg, NULL, 10); break;
+    case 'h': cega.pwdh = optarg; break;
+    case 'd': cega.delay = strtoul(optarg, NULL, 10); break;
+    case 'j': cega.jitter = strtoul(optarg, NULL, 10); break;
+    case 'e': cega.error_rate = strtoul(optarg, NULL, 10); break;
+    case 't': cega.truncate_rate = strtoul(optarg, NULL, 10); break;
+    case 'S': cega.tls = true; break;
+    default:
+      fprintf(stderr, "Usage: %s [-u users] [-b uid base] [-h password hash]\n"
+	      "          [-d delay in us] [-j jitter in us] [-e %% errors] [-t %% truncated] [-S]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  if(mock_cega_spawn(&cega)) return 1;
+
+  printf("# %u users (0: any), user0 has uid %u\n", cega.users, cega.uid_base);
+  mock_cega_write_config(&cega, stdout);
+  fflush(stdout);
+
+  while(!done) pause();
+  mock_cega_stop(&cega);
+
+  struct mock_cega_stats *s = cega.stats;
+  printf("\n%lu requests: %lu found, %lu not found, %lu errors, %lu truncated\n",
+	 (unsigned long)s->requests, (unsigned long)s->found, (unsigned long)s->notfound,
+	 (unsigned long)s->errors, (unsigned long)s->truncated);
+  return 0;
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "mock_http.h"
+
+struct mock_conn {
+  struct mock_http *srv;
+  int fd;
+  SSL *ssl;
+};
+
+int
+mock_http_send(struct mock_conn *c, const void* buf, size_t len)
+{
+  const char* p = buf;
+  while(len > 0){
+    ssize_t n;
+    if(c->ssl){
+      n = SSL_write(c->ssl, p, (int)len);
+    } else {
+      n = send(c->fd, p, len, MSG_NOSIGNAL);
+      if(n < 0 && errno == EINTR) continue;
+    }
+    if(n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int
+mock_http_reply(struct mock_conn *c, int status, const char* body, size_t len)
+{
+  char headers[256];
+  int hlen = snprintf(headers, sizeof(headers),
+		      "HTTP/1.1 %d %s\r\n"
+		      "Content-Type: application/json\r\n"
+		      "Content-Length: %zu\r\n"
+		      "\r\n", status, (status == 200)?"OK":"Error", len);
+  if(mock_http_send(c, headers, hlen)) return -1;
+  return mock_http_send(c, body, len);
+}
+
+static ssize_t
+conn_recv(struct mock_conn *c, char* buf, size_t len)
+{
+  if(c->ssl) return SSL_read(c->ssl, buf, (int)len);
+  ssize_t n;
+  while((n = recv(c->fd, buf, len, 0)) < 0 && errno == EINTR);
+  return n;
+}
+
+/* Reads one request head. Returns the path (in buf) or NULL when the client went away */
+static char*
+read_request(struct mock_conn *c, char* buf, size_t buflen)
+{
+  size_t len = 0;
+  while(len < buflen - 1){
+    ssize_t n = conn_recv(c, buf + len, 1); /* byte per byte: we do not want to eat the next request */
+    if(n <= 0) return NULL;
+    len += n;
+    buf[len] = '\0';
+    if(len >= 4 && !strcmp(buf + len - 4, "\r\n\r\n")) break;
+  }
+  char* path = strchr(buf, ' ');
+  if(!path) return NULL;
+  path++;
+  char* end = strchr(path, ' ');
+  if(end) *end = '\0';
+  return path;
+}
+
+static void*
+serve_connection(void* arg)
+{
+  struct mock_conn *c = arg;
+  char buf[4096];
+  char* path;
+  int one = 1;
+
+  if(!c->srv->unix_path) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if(c->srv->ctx){
+    c->ssl = SSL_new(c->srv->ctx);
+    if(!c->ssl || !SSL_set_fd(c->ssl, c->fd) || SSL_accept(c->ssl) <= 0) goto BAILOUT;
+  }
+
+  while( (path = read_request(c, buf, sizeof(buf))) ){
+    if(c->srv->handler(c, path, c->srv->data)) break;
+  }
+
+BAILOUT:
+  if(c->ssl){ SSL_shutdown(c->ssl); SSL_free(c->ssl); }
+  close(c->fd);
+  free(c);
+  return NULL;
+}
+
+static void*
+accept_loop(void* arg)
+{
+  struct mock_http *srv = arg;
+  for(;;){
+    int fd = accept(srv->fd, NULL, NULL);
+    if(fd < 0){
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      break; /* closed by mock_http_stop */
+    }
+    struct mock_conn *c = calloc(1, sizeof(struct mock_conn));
+    pthread_t t;
+    if(!c){ close(fd); continue; }
+    c->srv = srv;
+    c->fd = fd;
+    if(pthread_create(&t, NULL, serve_connection, c)){ close(fd); free(c); continue; }
+    pthread_detach(t);
+  }
+  return NULL;
+}
+
+/* Self-signed, for localhost. The clients do not verify it. */
+static SSL_CTX*
+tls_context(void)
+{
+  SSL_CTX *ctx = NULL;
+  EVP_PKEY *pkey = EVP_EC_gen("P-256");
+  X509 *x509 = X509_new();
+  if(!pkey || !x509) goto BAILOUT;
+
+  X509_set_version(x509, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+  X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x509), 24 * 3600);
+  X509_set_pubkey(x509, pkey);
+  X509_NAME *name = X509_get_subject_name(x509);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+  X509_set_issuer_name(x509, name);
+  if(!X509_sign(x509, pkey, EVP_sha256())) goto BAILOUT;
+
+  ctx = SSL_CTX_new(TLS_server_method());
+  if(ctx && (SSL_CTX_use_certificate(ctx, x509) != 1 || SSL_CTX_use_PrivateKey(ctx, pkey) != 1)){
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+  }
+
+BAILOUT:
+  if(x509) X509_free(x509);
+  if(pkey) EVP_PKEY_free(pkey);
+  return ctx;
+}
+
+static int
+listen_tcp(struct mock_http *srv)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int one = 1;
+
+  srv->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(srv->fd < 0) return -1;
+  setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0; /* ephemeral */
+
+  if(bind(srv->fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+     listen(srv->fd, 1024) ||
+     getsockname(srv->fd, (struct sockaddr*)&addr, &addrlen)){
+    close(srv->fd);
+    return -1;
+  }
+  srv->port = ntohs(addr.sin_port);
+  return 0;
+}
+
+static int
+listen_unix(struct mock_http *srv)
+{
+  struct sockaddr_un addr;
+
+  if(strlen(srv->unix_path) >= sizeof(addr.sun_path)) return -1;
+  srv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(srv->fd < 0) return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, srv->unix_path);
+  unlink(srv->unix_path);
+
+  if(bind(srv->fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(srv->fd, 1024)){
+    close(srv->fd);
+    return -1;
+  }
+  srv->port = 0;
+  return 0;
+}
+
+int
+mock_http_start(struct mock_http *srv)
+{
+  srv->ctx = NULL;
+  if(srv->tls && !(srv->ctx = tls_context())) return -1;
+
+  if((srv->unix_path)?listen_unix(srv):listen_tcp(srv)) goto FAIL;
+
+  if(pthread_create(&srv->thread, NULL, accept_loop, srv)){ close(srv->fd); goto FAIL; }
+  return 0;
+
+FAIL:
+  if(srv->ctx) SSL_CTX_free(srv->ctx);
+  return -1;
+}
+
+void
+mock_http_stop(struct mock_http *srv)
+{
+  shutdown(srv->fd, SHUT_RDWR);
+  close(srv->fd);
+  pthread_join(srv->thread, NULL);
+  if(srv->unix_path) unlink(srv->unix_path);
+  /* srv->ctx is kept: detached connections might still use it */
+}
@@ -0,0 +1,42 @@
+#ifndef __FEGA_MOCK_HTTP_H_INCLUDED__
+#define __FEGA_MOCK_HTTP_H_INCLUDED__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <openssl/ssl.h>
+
+/*
+ * A minimal HTTP/1.1 server, good enough to stand in for CentralEGA in the benchmarks.
+ *
+ * It listens on 127.0.0.1 (ephemeral port), over TLS with a self-signed certificate when asked,
+ * or on a unix socket when unix_path is set.
+ *
+ * Each connection gets its own thread. The handler answers one request
+ * and returns 0 to keep the connection alive, or non-zero to close it.
+ */
+struct mock_conn;
+
+typedef int (*mock_http_handler)(struct mock_conn *c, const char* path, void* data);
+
+struct mock_http {
+  mock_http_handler handler;
+  void* data;
+  bool tls;
+  const char* unix_path;
+
+  /* filled by mock_http_start */
+  int fd;
+  unsigned short port;
+  SSL_CTX *ctx;
+  pthread_t thread;
+};
+
+int mock_http_start(struct mock_http *srv);
+void mock_http_stop(struct mock_http *srv);
+
+/* Helpers for the handlers. They return -1 when the client went away. */
+int mock_http_send(struct mock_conn *c, const void* buf, size_t len);
+int mock_http_reply(struct mock_conn *c, int status, const char* body, size_t len);
+
+#endif /* !__FEGA_MOCK_HTTP_H_INCLUDED__ */
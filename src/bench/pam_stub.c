@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <shadow.h>
+
+#include "bench/pam_stub.h"
+
+char* pam_stub_hash = NULL;
+int (*pam_stub_getspnam_r)(const char *name, struct spwd *spbuf, char *buf, size_t buflen, struct spwd **spbufp) = NULL;
+
+int
+pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
+{
+  *user = pamh->user;
+  return PAM_SUCCESS;
+}
+
+int
+pam_get_item(const pam_handle_t *pamh, int item_type, const void **item)
+{
+  switch(item_type){
+  case PAM_RHOST:   *item = pamh->rhost; break;
+  case PAM_AUTHTOK: *item = pamh->authtok; break;
+  case PAM_CONV:    *item = &pamh->conv; break;
+  default:          *item = NULL;
+  }
+  return PAM_SUCCESS;
+}
+
+int
+pam_set_item(pam_handle_t *pamh, int item_type, const void *item)
+{
+  if(item_type != PAM_AUTHTOK) return PAM_SUCCESS;
+  free(pamh->authtok);
+  pamh->authtok = (item)?strdup(item):NULL;
+  return PAM_SUCCESS;
+}
+
+int
+pam_set_data(pam_handle_t *pamh, const char *name, void *data,
+	     void (*cleanup)(pam_handle_t *pamh, void *data, int error_status))
+{
+  int i, free_slot = -1;
+
+  if(pamh->no_data){
+    if(cleanup) cleanup(pamh, data, PAM_DATA_SILENT);
+    return PAM_SUCCESS;
+  }
+  for(i = 0; i < PAM_STUB_DATA; i++){
+    if(pamh->data[i].name && !strcmp(pamh->data[i].name, name)){
+      if(pamh->data[i].cleanup) pamh->data[i].cleanup(pamh, pamh->data[i].data, PAM_DATA_SILENT);
+      pamh->data[i].name = NULL;
+    }
+    if(!pamh->data[i].name && free_slot < 0) free_slot = i;
+  }
+  if(free_slot < 0) return PAM_BUF_ERR;
+  pamh->data[free_slot].name = name;
+  pamh->data[free_slot].data = data;
+  pamh->data[free_slot].cleanup = cleanup;
+  return PAM_SUCCESS;
+}
+
+int
+pam_get_data(const pam_handle_t *pamh, const char *name, const void **data)
+{
+  int i;
+  for(i = 0; i < PAM_STUB_DATA; i++){
+    if(pamh->data[i].name && !strcmp(pamh->data[i].name, name)){ *data = pamh->data[i].data; return PAM_SUCCESS; }
+  }
+  *data = NULL;
+  return PAM_NO_MODULE_DATA;
+}
+
+const char*
+pam_strerror(pam_handle_t *pamh, int errnum)
+{
+  return "error";
+}
+
+static int
+conversation(int n, const struct pam_message **msg, struct pam_response **resp, void *data)
+{
+  *resp = calloc(1, sizeof(struct pam_response));
+  (*resp)->resp = strdup((const char*)data);
+  return PAM_SUCCESS;
+}
+
+void
+pam_stub_start(struct pam_handle* pamh, const char* user, const char* password)
+{
+  memset(pamh, 0, sizeof(*pamh));
+  pamh->user = user;
+  pamh->rhost = "127.0.0.1";
+  pamh->password = password;
+  pamh->conv.conv = conversation;
+  pamh->conv.appdata_ptr = (void*)password;
+}
+
+void
+pam_stub_end(struct pam_handle* pamh)
+{
+  int i;
+  for(i = 0; i < PAM_STUB_DATA; i++){
+    if(pamh->data[i].name && pamh->data[i].cleanup) pamh->data[i].cleanup(pamh, pamh->data[i].data, PAM_SUCCESS);
+    pamh->data[i].name = NULL;
+  }
+  free(pamh->authtok);
+  pamh->authtok = NULL;
+}
+
+/* The user's hash, instead of /etc/shadow or libnss_ega */
+int
+getspnam_r(const char *name, struct spwd *spbuf, char *buf, size_t buflen, struct spwd **spbufp)
+{
+  if(pam_stub_getspnam_r) return pam_stub_getspnam_r(name, spbuf, buf, buflen, spbufp);
+
+  size_t len = strlen(pam_stub_hash) + 1;
+  if(len > buflen){ *spbufp = NULL; return ERANGE; }
+  memset(spbuf, 0, sizeof(*spbuf));
+  spbuf->sp_namp = (char*)name;
+  spbuf->sp_pwdp = memcpy(buf, pam_stub_hash, len);
+  *spbufp = spbuf;
+  return 0;
+}
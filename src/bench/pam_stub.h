@@ -0,0 +1,50 @@
+#ifndef __FEGA_BENCH_PAM_STUB_H_INCLUDED__
+#define __FEGA_BENCH_PAM_STUB_H_INCLUDED__
+
+#include <stdbool.h>
+#include <shadow.h>
+
+#define PAM_SM_AUTH
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+/*
+ * A minimal in-process stand-in for libpam, for the benchmarks
+ * which link pam_auth.c directly.
+ *
+ * A PAM handle is just the few items pam_auth.c uses, and the module data.
+ * The conversation answers with the handle's password, and
+ * getspnam_r is overridden to return pam_stub_hash for every user,
+ * so no NSS lookup is involved, unless pam_stub_getspnam_r is set.
+ */
+#define PAM_STUB_DATA 4
+
+struct pam_handle {
+  const char* user;
+  const char* rhost;
+  const char* password; /* what the conversation answers */
+  char* authtok;
+  struct pam_conv conv;
+  bool no_data;         /* pam_set_data drops everything, as if the modules did not share */
+  struct {
+    const char* name;
+    void* data;
+    void (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+  } data[PAM_STUB_DATA];
+};
+
+extern char* pam_stub_hash;
+
+/* When set, getspnam_r asks it instead */
+extern int (*pam_stub_getspnam_r)(const char *name, struct spwd *spbuf, char *buf, size_t buflen, struct spwd **spbufp);
+
+/* A handle for <user> answering <password>. Free it with pam_stub_end */
+void pam_stub_start(struct pam_handle* pamh, const char* user, const char* password);
+void pam_stub_end(struct pam_handle* pamh);
+
+/* From pam_auth.c, pam_acct.c and pam_session.c */
+extern int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv);
+extern int pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char **argv);
+extern int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv);
+
+#endif /* !__FEGA_BENCH_PAM_STUB_H_INCLUDED__ */
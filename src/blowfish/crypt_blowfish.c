@@ -55,15 +55,26 @@
 
 #ifdef __i386__
 #define BF_ASM				1
+#define BF_X86_64			0
 #define BF_SCALE			1
-#elif defined(__x86_64__) || defined(__alpha__) || defined(__hppa__)
+#elif defined(__x86_64__)
 #define BF_ASM				0
+#define BF_X86_64			1
+#define BF_SCALE			1
+#elif defined(__alpha__) || defined(__hppa__)
+#define BF_ASM				0
+#define BF_X86_64			0
 #define BF_SCALE			1
 #else
 #define BF_ASM				0
+#define BF_X86_64			0
 #define BF_SCALE			0
 #endif
 
+#if BF_X86_64
+#include <cpuid.h>
+#endif
+
 typedef unsigned int BF_word;
 typedef signed int BF_word_signed;
 
@@ -77,6 +88,47 @@ typedef struct {
 	BF_key P;
 } BF_ctx;
 
+/*
+ * The BF_body() loop is where all of the 2^cost work happens, so that's the
+ * part with per-CPU implementations.  A NULL body means the inline C (or,
+ * on i386, x86.S) code.  The first kernel in the list which the CPU can run
+ * and which passes the self-test is used for the rest of the process.
+ */
+struct BF_kernel {
+	const char *name;
+	void (*body)(BF_ctx *ctx);
+	int (*usable)(void);
+};
+
+#if BF_X86_64
+extern void _BF_body_x86_64(BF_ctx *ctx);
+extern void _BF_body_x86_64_bmi2(BF_ctx *ctx);
+
+static int BF_has_bmi2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx & bit_BMI2) != 0;
+}
+#endif
+
+static const struct BF_kernel BF_kernels[] = {
+#if BF_X86_64
+	{"x86-64-bmi2", _BF_body_x86_64_bmi2, BF_has_bmi2},
+	{"x86-64", _BF_body_x86_64, NULL},
+#endif
+#if BF_ASM
+	{"x86", NULL, NULL},
+#else
+	{"generic", NULL, NULL},
+#endif
+	{NULL, NULL, NULL}
+};
+
+static const struct BF_kernel *BF_kernel;
+
 /*
  * Magic IV for 64 Blowfish encryptions that we do at the end.
  * The string is "OrpheanBeholderScryDoubt" on big-endian.
@@ -519,9 +571,10 @@ static void BF_swap(BF_word *x, int count)
 
 #if BF_ASM
 #define BF_body() \
+	(void) kernel; \
 	_BF_body_r(&data.ctx);
 #else
-#define BF_body() \
+#define BF_body_C() \
 	L = R = 0; \
 	ptr = data.ctx.P; \
 	do { \
@@ -538,6 +591,13 @@ static void BF_swap(BF_word *x, int count)
 		*(ptr - 2) = L; \
 		*(ptr - 1) = R; \
 	} while (ptr < &data.ctx.S[3][0xFF]);
+
+#define BF_body() \
+	if (kernel->body) \
+		kernel->body(&data.ctx); \
+	else { \
+		BF_body_C(); \
+	}
 #endif
 
 static void BF_set_key(const char *key, BF_key expanded, BF_key initial,
@@ -648,7 +708,7 @@ static const unsigned char flags_by_subtype[26] =
 
 static char *BF_crypt(const char *key, const char *setting,
 	char *output, int size,
-	BF_word min)
+	BF_word min, const struct BF_kernel *kernel)
 {
 #if BF_ASM
 	extern void _BF_body_r(BF_ctx *ctx);
@@ -775,6 +835,9 @@ static char *BF_crypt(const char *key, const char *setting,
 	BF_encode(&output[7 + 22], data.binary.output, 23);
 	output[7 + 22 + 31] = '\0';
 
+/* The S-boxes and the expanded key are derived from the password */
+	explicit_bzero(&data, sizeof(data));
+
 	return output;
 }
 
@@ -805,57 +868,45 @@ int _crypt_output_magic(const char *setting, char *output, int size)
  * from incorrectly-computed hashes - merely fixing whatever broke is not
  * enough.  Thus, a proactive measure like this self-test is needed.
  *
- * 2. We don't want to leave sensitive data from our actual password hash
- * computation on the stack or in registers.  Previous revisions of the code
- * would do explicit cleanups, but simply running the self-test after hash
- * computation is more reliable.
+ * 2. It vets the CPU-specific BF_body() kernels: one that produces a wrong
+ * hash is skipped in favour of the next one down the list, ending with the
+ * portable code.
  *
- * The performance cost of this quick self-test is around 0.6% at the "$2a$08"
- * setting.
+ * Upstream runs it after every hash, which also overwrites the hash's stack.
+ * Here it runs once per process for the kernel in use, and BF_crypt() wipes
+ * its own state instead.  That saves two $2?$00 hashes and a BF_set_key()
+ * pair per call, which matters for threaded callers verifying at low cost.
  */
-char *_crypt_blowfish_rn(const char *key, const char *setting,
-	char *output, int size)
+static int BF_self_test(const struct BF_kernel *kernel)
 {
 	const char *test_key = "8b \xd0\xc1\xd2\xcf\xcc\xd8";
 	const char *test_setting = "$2a$00$abcdefghijklmnopqrstuu";
+	static const char test_subtypes[2] = {'a', 'x'};
 	static const char * const test_hashes[2] =
 		{"i1D709vfamulimlGcq0qq3UvuUasvEa\0\x55", /* 'a', 'b', 'y' */
 		"VUrPmXD6q/nVSSp7pNDhCR9071IfIRe\0\x55"}; /* 'x' */
-	const char *test_hash = test_hashes[0];
-	char *retval;
 	const char *p;
-	int save_errno, ok;
+	int i, ok = 1;
 	struct {
 		char s[7 + 22 + 1];
 		char o[7 + 22 + 31 + 1 + 1 + 1];
 	} buf;
 
-/* Hash the supplied password */
-	_crypt_output_magic(setting, output, size);
-	retval = BF_crypt(key, setting, output, size, 16);
-	save_errno = errno;
+	if (kernel->usable && !kernel->usable())
+		return 0;
 
-/*
- * Do a quick self-test.  It is important that we make both calls to BF_crypt()
- * from the same scope such that they likely use the same stack locations,
- * which makes the second call overwrite the first call's sensitive data on the
- * stack and makes it more likely that any alignment related issues would be
- * detected by the self-test.
- */
-	memcpy(buf.s, test_setting, sizeof(buf.s));
-	if (retval) {
-		unsigned int flags = flags_by_subtype[
-		    (unsigned int)(unsigned char)setting[2] - 'a'];
-		test_hash = test_hashes[flags & 1];
-		buf.s[2] = setting[2];
-	}
-	memset(buf.o, 0x55, sizeof(buf.o));
-	buf.o[sizeof(buf.o) - 1] = 0;
-	p = BF_crypt(test_key, buf.s, buf.o, sizeof(buf.o) - (1 + 1), 1);
+	for (i = 0; i < 2 && ok; i++) {
+		memcpy(buf.s, test_setting, sizeof(buf.s));
+		buf.s[2] = test_subtypes[i];
+		memset(buf.o, 0x55, sizeof(buf.o));
+		buf.o[sizeof(buf.o) - 1] = 0;
+		p = BF_crypt(test_key, buf.s, buf.o, sizeof(buf.o) - (1 + 1), 1,
+		    kernel);
 
-	ok = (p == buf.o &&
-	    !memcmp(p, buf.s, 7 + 22) &&
-	    !memcmp(p + (7 + 22), test_hash, 31 + 1 + 1 + 1));
+		ok = (p == buf.o &&
+		    !memcmp(p, buf.s, 7 + 22) &&
+		    !memcmp(p + (7 + 22), test_hashes[i], 31 + 1 + 1 + 1));
+	}
 
 	{
 		const char *k = "\xff\xa3" "34" "\xff\xff\xff\xa3" "345";
@@ -868,14 +919,72 @@ char *_crypt_blowfish_rn(const char *key, const char *setting,
 		    !memcmp(ai, yi, sizeof(ai));
 	}
 
+	return ok;
+}
+
+/*
+ * Concurrent first calls may each run the self-test; they all arrive at
+ * the same kernel, so the race is harmless.
+ */
+static const struct BF_kernel *BF_select_kernel(void)
+{
+	const struct BF_kernel *kernel;
+	int save_errno;
+
+	kernel = __atomic_load_n(&BF_kernel, __ATOMIC_ACQUIRE);
+	if (kernel)
+		return kernel;
+
+	save_errno = errno;
+	for (kernel = BF_kernels; kernel->name; kernel++)
+		if (BF_self_test(kernel))
+			break;
 	__set_errno(save_errno);
-	if (ok)
-		return retval;
 
-/* Should not happen */
+	if (!kernel->name)
+		return NULL;
+
+	__atomic_store_n(&BF_kernel, kernel, __ATOMIC_RELEASE);
+	return kernel;
+}
+
+const char *_crypt_blowfish_kernel(void)
+{
+	const struct BF_kernel *kernel = BF_select_kernel();
+
+	return kernel ? kernel->name : NULL;
+}
+
+int _crypt_blowfish_use_kernel(const char *name)
+{
+	const struct BF_kernel *kernel;
+
+	for (kernel = BF_kernels; kernel->name; kernel++)
+		if (!strcmp(kernel->name, name))
+			break;
+
+	if (!kernel->name || !BF_self_test(kernel))
+		return -1;
+
+	__atomic_store_n(&BF_kernel, kernel, __ATOMIC_RELEASE);
+	return 0;
+}
+
+char *_crypt_blowfish_rn(const char *key, const char *setting,
+	char *output, int size)
+{
+	const struct BF_kernel *kernel;
+
 	_crypt_output_magic(setting, output, size);
-	__set_errno(EINVAL); /* pretend we don't support this hash type */
-	return NULL;
+
+	kernel = BF_select_kernel();
+	if (!kernel) {
+/* Should not happen */
+		__set_errno(EINVAL); /* pretend we don't support this hash type */
+		return NULL;
+	}
+
+	return BF_crypt(key, setting, output, size, 16, kernel);
 }
 
 char *_crypt_gensalt_blowfish_rn(const char *prefix, unsigned long count,
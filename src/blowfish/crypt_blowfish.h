@@ -23,5 +23,7 @@ extern char *_crypt_blowfish_rn(const char *key, const char *setting,
 extern char *_crypt_gensalt_blowfish_rn(const char *prefix,
 	unsigned long count,
 	const char *input, int size, char *output, int output_size);
+extern const char *_crypt_blowfish_kernel(void);
+extern int _crypt_blowfish_use_kernel(const char *name);
 
 #endif
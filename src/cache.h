@@ -1,27 +1,57 @@
-#ifndef __FEGA_BACKEND_H_INCLUDED__
+#ifndef __FEGA_CACHE_H_INCLUDED__
 #define __FEGA_CACHE_H_INCLUDED__
 
 #include <stdbool.h>
 #include <pwd.h>
 #include <shadow.h>
-#include <sqlite3.h>
-
-#if SQLITE_VERSION_NUMBER < 3024000
-  #error Only SQLite 3.24+ supported
-#endif
 
 #include "config.h"
 #include "json.h"
 
 int cache_add_user(const struct fega_user *user);
+int cache_add_users(const struct fega_user *users, size_t count);
+
+int cache_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen, bool allow_stale);
+int cache_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, bool allow_stale);
+int cache_getspnam_r(const char* username, struct spwd *result, char* buffer, size_t buflen, bool allow_stale);
+int cache_getuser_r(const char* username, struct passwd *pw, struct spwd *sp, char* buffer, size_t buflen, bool allow_stale);
 
-int cache_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen);
-int cache_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen);
-int cache_getspnam_r(const char* username, struct spwd *result, char* buffer, size_t buflen);
+int cache_foreach_pubkeys(const char* username, int (*cb)(const char* username, const char* pubkeys));
+int cache_find_pubkey(const char* username, const char* fingerprint, int (*cb)(const char* pubkey));
 
-bool cache_print_pubkeys(const char* username);
+int cache_get_addresses(const char* host, int port, char* buffer, size_t buflen);
+int cache_add_addresses(const char* host, int port, const char* addresses, unsigned int ttl);
+int cache_del_addresses(const char* host, int port);
 
 bool cache_open(void);
 void cache_close(void);
 
+/* The name of the backend in use, NULL when the cache is not opened */
+const char* cache_backend_name(void);
+
+/*
+ * For the backends: cache_backend in auth.conf picks one, and the functions above
+ * forward to it, with the same return codes. open is called on every cache_open.
+ */
+struct cache_backend {
+  const char* name;
+  bool (*open)(void);
+  void (*close)(void);
+  int (*add_users)(const struct fega_user *users, size_t count);
+  int (*getpwnam_r)(const char* username, struct passwd *result, char *buffer, size_t buflen, bool allow_stale);
+  int (*getpwuid_r)(uid_t uid, struct passwd *result, char *buffer, size_t buflen, bool allow_stale);
+  int (*getspnam_r)(const char* username, struct spwd *result, char* buffer, size_t buflen, bool allow_stale);
+  int (*getuser_r)(const char* username, struct passwd *pw, struct spwd *sp, char* buffer, size_t buflen, bool allow_stale);
+  int (*foreach_pubkeys)(const char* username, int (*cb)(const char* username, const char* pubkeys));
+  int (*find_pubkey)(const char* username, const char* fingerprint, int (*cb)(const char* pubkey));
+  int (*get_addresses)(const char* host, int port, char* buffer, size_t buflen);
+  int (*add_addresses)(const char* host, int port, const char* addresses, unsigned int ttl);
+  int (*del_addresses)(const char* host, int port);
+};
+
+extern const struct cache_backend cache_sqlite; /* cache_sqlite.c */
+#ifdef HAS_LMDB
+extern const struct cache_backend cache_lmdb;   /* cache_lmdb.c, with make LMDB=1 */
+#endif
+
 #endif /* !__FEGA_CACHE_H_INCLUDED__ */
@@ -0,0 +1,632 @@
+#ifdef HAS_LMDB /* make LMDB=1 */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <lmdb.h>
+#include <syslog.h>
+
+#include "utils.h"
+#include "cache.h"
+#include "fingerprint.h"
+
+/*
+ * The cache in LMDB (cache_backend = lmdb): db_path is the data file,
+ * and db_path-lock the table of its readers.
+ *
+ * A lookup takes no lock: its read transaction pins a snapshot of the memory-mapped
+ * B-trees, and the strings are copied from the map straight into the caller's buffer.
+ * The writers take turns, one write transaction at a time, and never wait for the readers.
+ *
+ *   users: username ('\0' included)  -> struct lmdb_user, then its strings
+ *   uids:  uid                       -> username ('\0' included)
+ *   dns:   host:port ('\0' included) -> struct lmdb_dns, then the addresses
+ *
+ * The records are in the byte order of the node: the file is not meant for another one.
+ * cache_shards does not apply: the readers do not need it, and a single file keeps
+ * the writers to one sync per commit.
+ *
+ * The readers register in db_path-lock, so every process doing lookups (id, ls -l, as any user)
+ * must write it: it is rw-rw-rw-, and the data file rw-r--r--, like the sqlite cache.
+ * LMDB would create both with the same mode: the lock file is created first.
+ * A local user can then take or clear reader slots. At worst, that keeps old pages alive
+ * (the file grows, until the inserts fail and the lookups ask CentralEGA),
+ * or lets a lookup read an entry being replaced. Only root writes the data.
+ */
+#define CACHE_LMDB_MAP_SIZE (1UL << 30) /* sparse: the file grows with the data */
+#define CACHE_LMDB_READERS  1024        /* concurrent lookups, all processes together */
+
+#define LMDB_NULL_PWDH  1
+#define LMDB_NULL_GECOS 2
+
+struct lmdb_user {
+  int64_t expires;
+  int64_t last_changed;
+  uint32_t uid;
+  uint16_t nulls;        /* LMDB_NULL_*: NULL, rather than "" */
+  uint16_t nkeys;
+  /* then pwdh, gecos, and for each key (sorted, distinct) its fingerprint ("" when none) and the key: all '\0'-terminated */
+};
+
+struct lmdb_dns {
+  int64_t expires;
+  /* then the addresses, '\0'-terminated */
+};
+
+/* A user record, pointing into the map: valid until the end of the transaction */
+struct lmdb_record {
+  struct lmdb_user h;
+  const char* pwdh;
+  const char* gecos;
+  const char* keys;
+  const char* end;
+};
+
+static MDB_env* env = NULL;
+static pid_t env_pid = 0;
+static MDB_dbi users_dbi, uids_dbi, dns_dbi;
+static pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Root only: the others open what root created */
+static void
+_share_lock_file(void)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  if(geteuid() != 0) return;
+  if(snprintf(path, sizeof(path), "%s-lock", options->db_path) >= (int)sizeof(path)) return;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0666);
+  if(fd < 0){ D1("Could not create %s: %s", path, strerror(errno)); return; }
+  if(!fstat(fd, &st) && st.st_uid == 0 && (st.st_mode & 0777) != 0666 && fchmod(fd, 0666)) /* umask, or an older 0600 one */
+    D1("Could not share %s: %s", path, strerror(errno));
+  close(fd);
+}
+
+static int
+_open_env(unsigned int flags)
+{
+  MDB_txn* txn = NULL;
+  unsigned int create = (flags & MDB_RDONLY)?0:MDB_CREATE;
+  int rc;
+
+  if((rc = mdb_env_create(&env))) return rc;
+  mdb_env_set_maxdbs(env, 3);
+  mdb_env_set_maxreaders(env, CACHE_LMDB_READERS);
+  mdb_env_set_mapsize(env, CACHE_LMDB_MAP_SIZE);
+
+  D1("Connection to: %s", options->db_path);
+  if(!(flags & MDB_RDONLY)) _share_lock_file();
+  if((rc = mdb_env_open(env, options->db_path, flags | MDB_NOSUBDIR | MDB_NOTLS | MDB_NORDAHEAD, 0644))) goto BAILOUT;
+
+  /* The handles are valid in all the later transactions */
+  if((rc = mdb_txn_begin(env, NULL, flags & MDB_RDONLY, &txn))) goto BAILOUT;
+  rc = mdb_dbi_open(txn, "users", create, &users_dbi);
+  if(!rc) rc = mdb_dbi_open(txn, "uids", create | MDB_INTEGERKEY, &uids_dbi);
+  if(!rc) rc = mdb_dbi_open(txn, "dns", create, &dns_dbi);
+  if(rc){ mdb_txn_abort(txn); goto BAILOUT; }
+  if((rc = mdb_txn_commit(txn))) goto BAILOUT;
+  return 0;
+
+BAILOUT:
+  mdb_env_close(env);
+  env = NULL;
+  return rc;
+}
+
+static bool
+lmdb_open(void)
+{
+  pid_t pid = getpid();
+  int rc, dead = 0;
+
+  if(__atomic_load_n(&env_pid, __ATOMIC_ACQUIRE) == pid){ D3("Cache already opened"); return true; }
+
+  pthread_mutex_lock(&env_lock);
+  if(env_pid == pid) goto DONE; /* another thread was faster */
+
+  /*
+   * A forked child can not use the environment of its parent (sshd forks after loading us).
+   * We leave it be, as closing it might touch the parent's reader slots, and open our own.
+   */
+  if(env) D2("Opening the cache again, in the child %d", pid);
+  env = NULL;
+
+  D2("Opening cache");
+  rc = _open_env(0);
+  if(rc == EACCES) rc = _open_env(MDB_RDONLY); /* not root: the lookups only */
+  if(rc){
+    D1("Failed to open %s: %s", options->db_path, mdb_strerror(rc));
+    pthread_mutex_unlock(&env_lock);
+    return false;
+  }
+
+  /* Frees the slots of the processes killed in a lookup (sshd kills its children) */
+  mdb_reader_check(env, &dead);
+  if(dead) D2("%d stale readers cleared", dead);
+
+  __atomic_store_n(&env_pid, pid, __ATOMIC_RELEASE);
+DONE:
+  pthread_mutex_unlock(&env_lock);
+  return true;
+}
+
+static void
+lmdb_close(void)
+{
+  D2("Closing database cache");
+  if(env && env_pid == getpid()) mdb_env_close(env);
+  env = NULL;
+  env_pid = 0;
+}
+
+static inline MDB_txn*
+_reader(void)
+{
+  MDB_txn* txn = NULL;
+  int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+  if(rc){ D1("Could not begin a read transaction: %s", mdb_strerror(rc)); return NULL; }
+  return txn;
+}
+
+static bool
+_parse_user(const MDB_val* val, struct lmdb_record* r)
+{
+  const char *p = (const char*)val->mv_data + sizeof(struct lmdb_user);
+
+  if(val->mv_size <= sizeof(struct lmdb_user)) return false;
+  memcpy(&r->h, val->mv_data, sizeof(struct lmdb_user)); /* the values are only 2-byte aligned */
+  r->end = (const char*)val->mv_data + val->mv_size;
+  if(r->end[-1] != '\0') return false;
+
+  r->pwdh = p;
+  p += strlen(p) + 1;
+  if(p >= r->end) return false;
+  r->gecos = p;
+  r->keys = p + strlen(p) + 1;
+
+  if(r->h.nulls & LMDB_NULL_PWDH) r->pwdh = NULL;
+  if(r->h.nulls & LMDB_NULL_GECOS) r->gecos = NULL;
+  return true;
+}
+
+/* Same return codes as the lookups: 0, 1 (miss) or 2 (expired) */
+static int
+_get_user(MDB_txn* txn, const char* username, struct lmdb_record* r, bool allow_stale)
+{
+  MDB_val key = { strlen(username) + 1, (void*)username }, val;
+  int rc = mdb_get(txn, users_dbi, &key, &val);
+
+  if(rc){
+    if(rc != MDB_NOTFOUND) D1("Lookup error: %s", mdb_strerror(rc));
+    D2("No entry for %s", username);
+    return 1;
+  }
+  if(!_parse_user(&val, r)){ D1("Invalid record for %s", username); return 1; }
+  if(!allow_stale && r->h.expires <= time(NULL)){ D2("Expired entry"); return 2; }
+  return 0;
+}
+
+/* The next key of the record, with its fingerprint. NULL at the end */
+static inline const char*
+_next_key(const struct lmdb_record* r, const char** p, const char** fp)
+{
+  const char* key;
+  if(*p >= r->end) return NULL;
+  *fp = *p;
+  key = *fp + strlen(*fp) + 1;
+  if(key >= r->end) return NULL;
+  *p = key + strlen(key) + 1;
+  return key;
+}
+
+static inline int
+_txt2buffer(const char* s, char** data, char **buffer, size_t* buflen)
+{
+  if(s == NULL){ D1("NULL string"); return 1; }
+  if( copy2buffer(s, data, buffer, buflen) < 0 ) { return -1; }
+  return 0;
+}
+
+static int
+_fill_passwd(const char* username, const struct lmdb_record* r, struct passwd *pw, char **buffer, size_t* buflen)
+{
+  int rc;
+  if( copy2buffer("x", &(pw->pw_passwd), buffer, buflen) < 0 ) return -1;
+  pw->pw_uid = r->h.uid;
+  pw->pw_gid = options->gid;
+  if( (rc = _txt2buffer(r->gecos, &(pw->pw_gecos), buffer, buflen)) ) return rc;
+
+  char* homedir = strjoina(options->homedir_prefix, "/", username);
+  D3("Username %s [%s]", username, homedir);
+  if( copy2buffer(homedir, &(pw->pw_dir), buffer, buflen) < 0 ) return -1;
+  if( copy2buffer(options->shell, &(pw->pw_shell), buffer, buflen) < 0 ) return -1;
+  return 0;
+}
+
+static int
+_fill_spwd(const char* username, const struct lmdb_record* r, struct spwd *sp, char **buffer, size_t* buflen)
+{
+  int rc;
+  sp->sp_namp = (char*)username;
+  if( (rc = _txt2buffer(r->pwdh, &(sp->sp_pwdp), buffer, buflen)) ) return rc;
+  sp->sp_lstchg = r->h.last_changed;
+
+  sp->sp_min = options->sp_min;
+  sp->sp_max = options->sp_max;
+  sp->sp_warn = options->sp_warn;
+  sp->sp_inact = options->sp_inact;
+  sp->sp_expire = options->sp_expire;
+  return 0;
+}
+
+/*
+ * Same return codes as the SQLite backend (see there)
+ */
+
+static int
+lmdb_getpwnam_r(const char* username, struct passwd *result, char* buffer, size_t buflen, bool allow_stale)
+{
+  struct lmdb_record r;
+  MDB_txn* txn = _reader();
+  int rc = 1; /* cache miss */
+
+  if(!txn) return rc;
+  if(!(rc = _get_user(txn, username, &r, allow_stale))){
+    result->pw_name = (char*)username;
+    rc = _fill_passwd(username, &r, result, &buffer, &buflen);
+  }
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+static int
+lmdb_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, bool allow_stale)
+{
+  struct lmdb_record r;
+  unsigned int u = uid;
+  MDB_val key = { sizeof(u), &u }, val;
+  MDB_txn* txn = _reader();
+  int rc = 1; /* cache miss */
+
+  if(!txn) return rc;
+  if(mdb_get(txn, uids_dbi, &key, &val) || !val.mv_size || ((const char*)val.mv_data)[val.mv_size - 1] != '\0'){
+    D2("No entry for uid %u", uid);
+    goto BAILOUT;
+  }
+  const char* username = (const char*)val.mv_data;
+  if((rc = _get_user(txn, username, &r, allow_stale))) goto BAILOUT;
+  if(r.h.uid != uid){ D2("%s has another uid now", username); rc = 1; goto BAILOUT; }
+
+  if( (rc = _txt2buffer(username, &(result->pw_name), &buffer, &buflen)) ) goto BAILOUT;
+  rc = _fill_passwd(result->pw_name, &r, result, &buffer, &buflen);
+
+BAILOUT:
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+static int
+lmdb_getspnam_r(const char* username, struct spwd *result, char* buffer, size_t buflen, bool allow_stale)
+{
+  struct lmdb_record r;
+  MDB_txn* txn = _reader();
+  int rc = 1; /* cache miss */
+
+  if(!txn) return rc;
+  if(!(rc = _get_user(txn, username, &r, allow_stale)))
+    rc = _fill_spwd(username, &r, result, &buffer, &buflen);
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+static int
+lmdb_getuser_r(const char* username, struct passwd *pw, struct spwd *sp, char* buffer, size_t buflen, bool allow_stale)
+{
+  struct lmdb_record r;
+  MDB_txn* txn = _reader();
+  int rc = 1; /* cache miss */
+
+  if(!txn) return rc;
+  if(!(rc = _get_user(txn, username, &r, allow_stale))){
+    pw->pw_name = (char*)username;
+    rc = _fill_passwd(username, &r, pw, &buffer, &buflen);
+    if(!rc) rc = _fill_spwd(username, &r, sp, &buffer, &buflen);
+  }
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+/* The keys of the record, newline-separated. NULL when it has none, or on error */
+static char*
+_join_keys(const struct lmdb_record* r)
+{
+  const char *p = r->keys, *fp, *key;
+  size_t len = 0;
+  char *pubkeys, *q;
+
+  while((key = _next_key(r, &p, &fp))) len += strlen(key) + 1;
+  if(!len || !(pubkeys = q = malloc(len))) return NULL;
+
+  p = r->keys;
+  while((key = _next_key(r, &p, &fp))){
+    if(q != pubkeys) *q++ = '\n';
+    q = stpcpy(q, key);
+  }
+  return pubkeys;
+}
+
+static int
+lmdb_foreach_pubkeys(const char* username, int (*cb)(const char* username, const char* pubkeys))
+{
+  struct lmdb_record r;
+  MDB_cursor* cursor = NULL;
+  MDB_val key, val;
+  MDB_txn* txn = _reader();
+  int count = 0, rc, stop = 0;
+
+  if(!txn) return -1;
+  D2("select pubkeys for %s", (username)?username:"all users");
+
+  if(username){
+    if(!_get_user(txn, username, &r, false) && r.h.nkeys){
+      char* pubkeys = _join_keys(&r);
+      if(!pubkeys){ D1("Memory allocation error"); count = -1; goto BAILOUT; }
+      count++;
+      cb(username, pubkeys);
+      free(pubkeys);
+    }
+    goto BAILOUT;
+  }
+
+  /* In the order of the usernames, as memcmp sorts them */
+  if((rc = mdb_cursor_open(txn, users_dbi, &cursor))){ D1("Cursor error: %s", mdb_strerror(rc)); count = -1; goto BAILOUT; }
+  time_t now = time(NULL);
+  for(rc = mdb_cursor_get(cursor, &key, &val, MDB_FIRST); !rc; rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT)){
+    const char* name = (const char*)key.mv_data;
+    if(!key.mv_size || name[key.mv_size - 1] != '\0' || !_parse_user(&val, &r)){ D1("Invalid record"); continue; }
+    if(r.h.expires <= now || !r.h.nkeys) continue;
+    char* pubkeys = _join_keys(&r);
+    if(!pubkeys){ D1("Memory allocation error"); count = -1; goto BAILOUT; }
+    count++;
+    stop = cb(name, pubkeys);
+    free(pubkeys);
+    if(stop) break;
+  }
+  if(!stop && rc != MDB_NOTFOUND){ D1("Cursor error: %s", mdb_strerror(rc)); count = -1; }
+
+BAILOUT:
+  if(cursor) mdb_cursor_close(cursor);
+  mdb_txn_abort(txn);
+  return count;
+}
+
+static int
+lmdb_find_pubkey(const char* username, const char* fingerprint, int (*cb)(const char* pubkey))
+{
+  struct lmdb_record r;
+  const char *p, *fp, *key;
+  MDB_txn* txn = _reader();
+  int rc;
+
+  if(!txn) return -1;
+  D2("select the pubkey %s of %s", fingerprint, username);
+  if(!(rc = _get_user(txn, username, &r, false))){
+    for(p = r.keys; (key = _next_key(&r, &p, &fp));)
+      if(!strcmp(fp, fingerprint) && cb(key)) break;
+  }
+  mdb_txn_abort(txn);
+  return (rc)?1:0;
+}
+
+static int
+_cmp_keys(const void* a, const void* b)
+{
+  return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+static inline char*
+_append(char* p, const char* s)
+{
+  size_t len = strlen(s) + 1;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+/*
+ * Returns 1 when the user is not inserted: on our own checks (nothing written),
+ * or on an LMDB error, in *err (the transaction must be aborted)
+ */
+static int
+_put_user(MDB_txn* txn, const struct fega_user *user, int* err)
+{
+  const char *pwdh = (user->pwdh)?user->pwdh:"", *gecos = (user->gecos)?user->gecos:"";
+  size_t klen = strlen(user->username) + 1;
+  size_t len = sizeof(struct lmdb_user) + strlen(pwdh) + strlen(gecos) + 2;
+  const char** keys = NULL;
+  char (*fps)[FINGERPRINT_LENGTH] = NULL;
+  unsigned int n = 0, nkeys = 0, i;
+  struct pbk *k;
+  int rc = 1;
+
+  D1("Insert %s into cache", user->username);
+  *err = 0;
+  if(user->uid <= options->uid_shift){ D1("Invalid uid %u for %s", user->uid, user->username); return 1; }
+  if(klen > (size_t)mdb_env_get_maxkeysize(env)){ D1("Username too long: %s", user->username); return 1; }
+
+  /* The keys sorted and distinct, as in the keys' table of SQLite */
+  for(k = user->pubkeys; k; k = k->next) n++;
+  if(n > UINT16_MAX){ D1("Too many keys for %s", user->username); return 1; }
+  if(n && (!(keys = malloc(n * sizeof(char*))) || !(fps = malloc(n * FINGERPRINT_LENGTH)))){ D1("Memory allocation error"); goto BAILOUT; }
+  for(i = 0, k = user->pubkeys; k; k = k->next) keys[i++] = k->pbk;
+  qsort(keys, n, sizeof(char*), _cmp_keys);
+  for(i = 0; i < n; i++){
+    if(nkeys && !strcmp(keys[nkeys - 1], keys[i])) continue;
+    keys[nkeys] = keys[i];
+    if(!fingerprint_pubkey(keys[nkeys], fps[nkeys])) fps[nkeys][0] = '\0';
+    len += strlen(fps[nkeys]) + strlen(keys[nkeys]) + 2;
+    nkeys++;
+  }
+
+  /* Written in place, in the map: the entry is replaced if already present */
+  MDB_val key = { klen, (void*)user->username }, val = { len, NULL };
+  if((*err = mdb_put(txn, users_dbi, &key, &val, MDB_RESERVE))){ D1("Execution error: %s", mdb_strerror(*err)); goto BAILOUT; }
+
+  struct lmdb_user h = {
+    .expires = (user->expires)?user->expires:time(NULL) + options->cache_ttl,
+    .last_changed = user->last_changed,
+    .uid = user->uid,
+    .nulls = ((user->pwdh)?0:LMDB_NULL_PWDH) | ((user->gecos)?0:LMDB_NULL_GECOS),
+    .nkeys = nkeys,
+  };
+  D2("Setting expiration date to %ld", (long)h.expires);
+  memcpy(val.mv_data, &h, sizeof(h));
+  char* p = (char*)val.mv_data + sizeof(h);
+  p = _append(p, pwdh);
+  p = _append(p, gecos);
+  for(i = 0; i < nkeys; i++){
+    p = _append(p, fps[i]);
+    p = _append(p, keys[i]);
+  }
+
+  /* The route of its uid */
+  unsigned int u = user->uid;
+  MDB_val ukey = { sizeof(u), &u }, uval = { klen, (void*)user->username };
+  if((*err = mdb_put(txn, uids_dbi, &ukey, &uval, 0))){ D1("Execution error: %s", mdb_strerror(*err)); goto BAILOUT; }
+
+  D1("%s inserted into cache", user->username);
+  rc = 0;
+BAILOUT:
+  free(keys);
+  free(fps);
+  return rc;
+}
+
+/* One write transaction, ie one sync, for all of them */
+static int
+lmdb_add_users(const struct fega_user *users, size_t count)
+{
+  MDB_txn* txn = NULL;
+  int rc, err, failed = 0;
+  size_t i;
+
+  /* The other writers wait here (the readers do not) */
+  if((rc = mdb_txn_begin(env, NULL, 0, &txn))){ D1("Could not begin: %s", mdb_strerror(rc)); return -1; }
+
+  for(i = 0; i < count; i++){
+    if(_put_user(txn, &users[i], &err)) failed++;
+    if(err){ mdb_txn_abort(txn); return -1; }
+  }
+
+  if((rc = mdb_txn_commit(txn))){ D1("Could not commit: %s", mdb_strerror(rc)); return -1; }
+  D1("%zu users committed to the cache, %d failed", count, failed);
+  return failed;
+}
+
+/*
+ * Pinned DNS results
+ */
+
+static inline bool
+_dns_key(const char* host, int port, char* key, size_t len)
+{
+  return snprintf(key, len, "%s:%d", host, port) < (int)len;
+}
+
+static int
+lmdb_get_addresses(const char* host, int port, char* buffer, size_t buflen)
+{
+  char k[512];
+  struct lmdb_dns h;
+  MDB_val key, val;
+  MDB_txn* txn = NULL;
+  int rc = 1; /* cache miss */
+
+  if(!_dns_key(host, port, k, sizeof(k)) || !(txn = _reader())) return rc;
+  key.mv_size = strlen(k) + 1;
+  key.mv_data = k;
+
+  D2("select addresses for %s:%d", host, port);
+  if(mdb_get(txn, dns_dbi, &key, &val) || val.mv_size <= sizeof(h)){ D2("No entry"); goto BAILOUT; }
+  memcpy(&h, val.mv_data, sizeof(h));
+  const char* addresses = (const char*)val.mv_data + sizeof(h);
+  if(addresses[val.mv_size - sizeof(h) - 1] != '\0' || h.expires <= time(NULL)){ D2("No entry"); goto BAILOUT; }
+  rc = _txt2buffer(addresses, NULL, &buffer, &buflen);
+
+BAILOUT:
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+static int
+lmdb_add_addresses(const char* host, int port, const char* addresses, unsigned int ttl)
+{
+  char k[512];
+  struct lmdb_dns h = { .expires = time(NULL) + ttl };
+  size_t len = strlen(addresses) + 1;
+  MDB_val key = { 0, k }, val = { sizeof(h) + len, NULL };
+  MDB_txn* txn = NULL;
+  int rc;
+
+  if(!_dns_key(host, port, k, sizeof(k))) return 1;
+  key.mv_size = strlen(k) + 1;
+
+  D2("Pinning %s:%d to %s for %us", host, port, addresses, ttl);
+  if((rc = mdb_txn_begin(env, NULL, 0, &txn))) goto BAILOUT;
+  if((rc = mdb_put(txn, dns_dbi, &key, &val, MDB_RESERVE))){ mdb_txn_abort(txn); goto BAILOUT; }
+  memcpy(val.mv_data, &h, sizeof(h));
+  memcpy((char*)val.mv_data + sizeof(h), addresses, len);
+  rc = mdb_txn_commit(txn);
+
+BAILOUT:
+  if(rc) D1("Execution error: %s", mdb_strerror(rc));
+  return (rc)?1:0;
+}
+
+static int
+lmdb_del_addresses(const char* host, int port)
+{
+  char k[512];
+  MDB_val key = { 0, k };
+  MDB_txn* txn = NULL;
+  int rc;
+
+  if(!_dns_key(host, port, k, sizeof(k))) return 1;
+  key.mv_size = strlen(k) + 1;
+
+  D2("Unpinning %s:%d", host, port);
+  if((rc = mdb_txn_begin(env, NULL, 0, &txn))) goto BAILOUT;
+  rc = mdb_del(txn, dns_dbi, &key, NULL);
+  if(rc && rc != MDB_NOTFOUND){ mdb_txn_abort(txn); goto BAILOUT; }
+  rc = mdb_txn_commit(txn);
+
+BAILOUT:
+  if(rc) D1("Execution error: %s", mdb_strerror(rc));
+  return (rc)?1:0;
+}
+
+const struct cache_backend cache_lmdb = {
+  .name            = "lmdb",
+  .open            = lmdb_open,
+  .close           = lmdb_close,
+  .add_users       = lmdb_add_users,
+  .getpwnam_r      = lmdb_getpwnam_r,
+  .getpwuid_r      = lmdb_getpwuid_r,
+  .getspnam_r      = lmdb_getspnam_r,
+  .getuser_r       = lmdb_getuser_r,
+  .foreach_pubkeys = lmdb_foreach_pubkeys,
+  .find_pubkey     = lmdb_find_pubkey,
+  .get_addresses   = lmdb_get_addresses,
+  .add_addresses   = lmdb_add_addresses,
+  .del_addresses   = lmdb_del_addresses,
+};
+
+#endif /* HAS_LMDB */
@@ -0,0 +1,770 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#if SQLITE_VERSION_NUMBER < 3024000
+  #error Only SQLite 3.24+ supported
+#endif
+#include <sys/stat.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "utils.h"
+#include "cache.h"
+#include "fingerprint.h"
+
+/*
+ * With cache_shards = N > 1, the users are spread over N database files,
+ * by a hash of their username: db_path for the shard 0, and db_path.<i> for the others.
+ * The writers of different users then mostly lock different files.
+ *
+ * A uid lookup goes through a route, uids(uid, username), kept in the shard of uid % N:
+ * one indexed query there, then one in the shard of the username.
+ * The pinned DNS results live in the shard 0.
+ *
+ * The shard 0 is opened with the cache, the others on their first use.
+ */
+static sqlite3* shards[CACHE_SHARDS_MAX] = { NULL };
+
+#define CACHE_BUSY_TIMEOUT 2000 /* ms */
+
+/*
+ * Caches from before the fingerprints: adds the column, and fills it.
+ * In a write transaction, so that only one process does it.
+ */
+static void
+_add_fingerprints(sqlite3* db)
+{
+  sqlite3_stmt *select = NULL, *update = NULL;
+  char fp[FINGERPRINT_LENGTH];
+  int rc, count = 0;
+
+  if(sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK){ D1("ERROR locking the cache: %s", sqlite3_errmsg(db)); return; }
+
+  /* Another process might have done it while we waited */
+  if(sqlite3_table_column_metadata(db, NULL, "keys", "fingerprint", NULL, NULL, NULL, NULL, NULL) == SQLITE_OK) goto COMMIT;
+
+  D1("Adding the fingerprints of the keys");
+  if(sqlite3_exec(db, "ALTER TABLE keys ADD COLUMN fingerprint TEXT;", NULL, NULL, NULL) != SQLITE_OK) goto BAILOUT;
+
+  sqlite3_prepare_v2(db, "SELECT rowid, pubkey FROM keys;", -1, &select, NULL);
+  sqlite3_prepare_v2(db, "UPDATE keys SET fingerprint = ?2 WHERE rowid = ?1;", -1, &update, NULL);
+  if(!select || !update) goto BAILOUT;
+
+  while((rc = sqlite3_step(select)) == SQLITE_ROW){
+    const char* pubkey = (const char*)sqlite3_column_text(select, 1);
+    if(!pubkey || !fingerprint_pubkey(pubkey, fp)) continue; /* never matches */
+    sqlite3_bind_int64(update, 1, sqlite3_column_int64(select, 0));
+    sqlite3_bind_text(update,  2, fp, -1, SQLITE_STATIC);
+    if(sqlite3_step(update) != SQLITE_DONE) goto BAILOUT;
+    sqlite3_reset(update);
+    count++;
+  }
+  if(rc != SQLITE_DONE) goto BAILOUT;
+  D1("%d keys fingerprinted", count);
+
+COMMIT:
+  sqlite3_finalize(select); select = NULL;
+  sqlite3_finalize(update); update = NULL;
+  if(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK) return;
+
+BAILOUT:
+  D1("ERROR adding the fingerprints: %s", sqlite3_errmsg(db));
+  sqlite3_finalize(select);
+  sqlite3_finalize(update);
+  sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+}
+
+static sqlite3*
+_open_shard(unsigned int shard)
+{
+  sqlite3* db = NULL;
+  char path[PATH_MAX];
+
+  if(shard == 0) snprintf(path, sizeof(path), "%s", options->db_path);
+  else if(snprintf(path, sizeof(path), "%s.%u", options->db_path, shard) >= (int)sizeof(path)) return NULL;
+
+  D1("Connection to: %s", path);
+  sqlite3_open(path, &db); /* owned by the caller (usually root) and rw-r--r-- */
+  if (db == NULL){ D1("Failed to allocate database handle"); return NULL; }
+  D3("DB Connection: %p", db);
+  
+  if( sqlite3_errcode(db) != SQLITE_OK) {
+    D1("Failed to open DB: [%d] %s", sqlite3_extended_errcode(db), sqlite3_errstr(sqlite3_extended_errcode(db)));
+    sqlite3_close(db);
+    return NULL;
+  }
+
+  /* Wait for the other processes' writes (and schema checks), instead of failing the lookup */
+  sqlite3_busy_timeout(db, CACHE_BUSY_TIMEOUT);
+  
+  /* create table */
+  D2("Creating the database schema");
+  char schema[1000]; /* Laaaarge enough! */
+  sqlite3_stmt *stmt_users;
+  sprintf(schema,
+	  "CREATE TABLE IF NOT EXISTS users ("
+	  "  username TEXT UNIQUE PRIMARY KEY ON CONFLICT REPLACE,"
+	  "  uid      INTEGER CHECK (uid > %d)," // strictly greater
+	  "  pwdh     BLOB,"
+	  "  last_changed INTEGER,"
+	  "  gecos    TEXT,"
+	  "  expires  REAL" /* Not using "inserted REAL DEFAULT (strftime('%%s','now'))" */
+	  ") WITHOUT ROWID;", options->uid_shift); /* WITHOUT ROWID works only from 3.8.2 */
+
+  sqlite3_prepare_v2(db, schema, -1, &stmt_users, NULL);
+  if (!stmt_users || sqlite3_step(stmt_users) != SQLITE_DONE) { D1("ERROR creating users' table: %s", sqlite3_errmsg(db)); }
+  sqlite3_finalize(stmt_users);
+
+  sqlite3_stmt *stmt_keys;
+  sqlite3_prepare_v2(db,
+		     "CREATE TABLE IF NOT EXISTS keys ("
+		     "  uid      INTEGER NOT NULL,"
+		     "  pubkey   TEXT NOT NULL,"
+		     "  fingerprint TEXT," /* SHA256:..., as sshd passes it with %f */
+		     "  PRIMARY KEY (uid, pubkey),"
+		     "  FOREIGN KEY (uid) REFERENCES users(uid)"
+		     "                    ON DELETE CASCADE ON UPDATE NO ACTION"
+		     ");", -1, &stmt_keys, NULL);
+  if (!stmt_keys || sqlite3_step(stmt_keys) != SQLITE_DONE) { D1("ERROR creating keys' table: %s", sqlite3_errmsg(db)); }
+  sqlite3_finalize(stmt_keys);
+
+  if(sqlite3_table_column_metadata(db, NULL, "keys", "fingerprint", NULL, NULL, NULL, NULL, NULL) != SQLITE_OK)
+    _add_fingerprints(db);
+
+  if(sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS keys_fingerprint ON keys(uid, fingerprint);", NULL, NULL, NULL) != SQLITE_OK)
+    D1("ERROR creating the fingerprints' index: %s", sqlite3_errmsg(db));
+
+  if(options->cache_shards > 1 &&
+     sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS uids (uid INTEGER PRIMARY KEY, username TEXT NOT NULL);", NULL, NULL, NULL) != SQLITE_OK)
+    D1("ERROR creating uids' table: %s", sqlite3_errmsg(db));
+
+  if(shard > 0) return db;
+
+  sqlite3_stmt *stmt_dns;
+  sqlite3_prepare_v2(db,
+		     "CREATE TABLE IF NOT EXISTS dns ("
+		     "  host      TEXT NOT NULL,"
+		     "  port      INTEGER NOT NULL,"
+		     "  addresses TEXT NOT NULL," /* comma-separated, as for CURLOPT_RESOLVE */
+		     "  expires   INTEGER,"
+		     "  PRIMARY KEY (host, port) ON CONFLICT REPLACE"
+		     ") WITHOUT ROWID;", -1, &stmt_dns, NULL);
+  if (!stmt_dns || sqlite3_step(stmt_dns) != SQLITE_DONE) { D1("ERROR creating dns' table: %s", sqlite3_errmsg(db)); }
+  sqlite3_finalize(stmt_dns);
+  return db;
+}
+
+/* Opened on first use. NULL when it can not be */
+static sqlite3*
+_shard(unsigned int shard)
+{
+  sqlite3* db = __atomic_load_n(&shards[shard], __ATOMIC_ACQUIRE);
+  if(db) return db;
+
+  db = _open_shard(shard);
+  sqlite3* expected = NULL;
+  if(db && !__atomic_compare_exchange_n(&shards[shard], &expected, db, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+    sqlite3_close(db); /* another thread was faster */
+    db = expected;
+  }
+  return db;
+}
+
+/* FNV-1a: stable across versions and nodes (the shards might be copied) */
+static inline unsigned int
+_shard_of_name(const char* username)
+{
+  uint32_t h = 2166136261U;
+  if(options->cache_shards <= 1) return 0;
+  for(; *username; username++) h = (h ^ (unsigned char)*username) * 16777619U;
+  return h % options->cache_shards;
+}
+
+static inline unsigned int
+_shard_of_uid(uid_t uid)
+{
+  return (options->cache_shards <= 1)?0:uid % options->cache_shards;
+}
+
+static bool
+sqlite_open(void)
+{
+  if(__atomic_load_n(&shards[0], __ATOMIC_ACQUIRE)){ D3("Cache already opened"); return true; }
+
+  D2("Opening cache");
+  return _shard(0) != NULL;
+}
+
+static void
+sqlite_close(void)
+{
+  unsigned int i;
+  D2("Closing database cache");
+  for(i = 0; i < CACHE_SHARDS_MAX; i++){
+    if(shards[i]) sqlite3_close(shards[i]);
+    shards[i] = NULL;
+  }
+}
+
+
+/*
+ * Writes need a RESERVED lock (see https://www.sqlite.org/lockingv3.html#writing)
+ * and the database returns SQLITE_BUSY when another process holds it.
+ *
+ * A statement which got SQLITE_BUSY is paused, not halted: it keeps its SHARED lock,
+ * and a writer of another process, waiting for the readers to leave, never gets its
+ * EXCLUSIVE lock. SQLite sees the deadlock and does not call the busy handler: a plain
+ * busy-loop then spins forever. So we reset the statement (releasing the lock) first.
+ * The retries are paced by the busy timeout.
+ */
+static int
+_step(sqlite3_stmt *stmt)
+{
+  int rc;
+  while( (rc = sqlite3_step(stmt)) == SQLITE_BUSY ) sqlite3_reset(stmt);
+  return rc;
+}
+
+/*
+ * Assumes config file already loaded and cache open, and the write transactions begun
+ */
+static int
+_insert_user(const struct fega_user *user)
+{
+  sqlite3_stmt *stmt = NULL;
+  sqlite3* db = _shard(_shard_of_name(user->username));
+
+  D1("Insert %s into cache", user->username);
+  if(!db) return 1;
+
+  /* The entry will be updated if already present */
+  sqlite3_prepare_v2(db, "INSERT INTO users (username,uid,pwdh,last_changed,gecos,expires) VALUES(?1,?2,?3,?4,?5,?6);", -1, &stmt, NULL);
+  if(!stmt){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return 1; }
+
+  sqlite3_bind_text(stmt,   1, user->username, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt,    2, user->uid                        );
+  sqlite3_bind_blob(stmt,   3, user->pwdh    , -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt,    4, user->last_changed               );
+  sqlite3_bind_text(stmt,   5, user->gecos   , -1, SQLITE_STATIC);
+  
+  unsigned int now = (unsigned int)time(NULL);
+  unsigned int expiration = (user->expires)?(unsigned int)user->expires:now + options->cache_ttl;
+  D2("           Current time to %u", now);
+  D2("Setting expiration date to %u", expiration);
+  sqlite3_bind_int(stmt, 6, expiration);
+
+  /* Execute the query. */
+  int rc = (_step(stmt) == SQLITE_DONE)?0:1;
+  if(rc) D1("Execution error: %s", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  /* Adding the keys */
+  if(user->pubkeys){
+
+    struct pbk *pubkeys = user->pubkeys;
+
+
+    for(; pubkeys; pubkeys = pubkeys->next){
+      D2("Insert key %s for user %u", pubkeys->pbk, user->uid);
+      sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO keys (uid,pubkey,fingerprint) VALUES(?1,?2,?3);", -1, &stmt, NULL);
+      if(!stmt){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return 1; }
+      sqlite3_bind_int(stmt,    1, user->uid                        );
+      sqlite3_bind_text(stmt,   2, pubkeys->pbk    , -1, SQLITE_STATIC);
+      char fp[FINGERPRINT_LENGTH];
+      if(fingerprint_pubkey(pubkeys->pbk, fp)) sqlite3_bind_text(stmt, 3, fp, -1, SQLITE_TRANSIENT); /* else NULL */
+      /* Execute the query. */
+      int rc = (_step(stmt) == SQLITE_DONE)?0:1;
+      if(rc) D1("Execution error: %s", sqlite3_errmsg(db));
+      sqlite3_finalize(stmt);
+      stmt = NULL;
+    }
+  }
+
+  /* The route of its uid */
+  if(options->cache_shards > 1 && !rc){
+    sqlite3* routes = _shard(_shard_of_uid(user->uid));
+    if(!routes) return 1;
+    sqlite3_prepare_v2(routes, "INSERT OR REPLACE INTO uids (uid,username) VALUES(?1,?2);", -1, &stmt, NULL);
+    if(!stmt){ D1("Prepared statement error: %s", sqlite3_errmsg(routes)); return 1; }
+    sqlite3_bind_int(stmt,  1, user->uid);
+    sqlite3_bind_text(stmt, 2, user->username, -1, SQLITE_STATIC);
+    rc = (_step(stmt) == SQLITE_DONE)?0:1;
+    if(rc) D1("Execution error: %s", sqlite3_errmsg(routes));
+    sqlite3_finalize(stmt);
+  }
+
+  D1("%s inserted into cache", user->username);
+
+  return rc;
+}
+
+/*
+ * Group commit: all the users in one transaction per shard they touch, ie one journal sync each.
+ * The shards are locked in order, so that two writers never wait for each other.
+ * Returns the number of users which could not be inserted, or -1 when nothing was committed.
+ */
+static int
+sqlite_add_users(const struct fega_user *users, size_t count)
+{
+  bool touched[CACHE_SHARDS_MAX] = { false };
+  int failed = 0;
+  unsigned int s, begun = 0;
+  size_t i;
+
+  for(i = 0; i < count; i++){
+    touched[_shard_of_name(users[i].username)] = true;
+    touched[_shard_of_uid(users[i].uid)] = true;
+  }
+
+  /* Takes the RESERVED locks now, waiting for the other writers (busy timeout) */
+  for(s = 0; s < options->cache_shards; s++, begun++){
+    if(!touched[s]) continue;
+    sqlite3* db = _shard(s);
+    if(!db || sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK){
+      D1("Could not begin on shard %u: %s", s, (db)?sqlite3_errmsg(db):"not opened");
+      failed = -1;
+      break;
+    }
+  }
+
+  if(!failed) for(i = 0; i < count; i++) if(_insert_user(&users[i])) failed++;
+
+  /* The shards are separate files: a user and the route of its uid are committed apart */
+  for(s = 0; s < begun; s++){
+    if(!touched[s]) continue;
+    sqlite3* db = shards[s];
+    if(failed >= 0 && sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK) continue;
+    D1("Could not commit on shard %u: %s", s, sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    failed = -1;
+  }
+  if(failed >= 0) D1("%zu users committed to the cache, %d failed", count, failed);
+  return failed;
+}
+
+static inline int
+_col2uid(sqlite3_stmt *stmt, int col, uid_t *uid)
+{
+  if(sqlite3_column_type(stmt, col) != SQLITE_INTEGER){ D1("Column %d is not a int", col); return 1; }
+  *uid = (uid_t)sqlite3_column_int(stmt, col);
+  return 0;
+}
+
+static inline int
+_col2longint(sqlite3_stmt *stmt, int col, long int *i)
+{
+  if(sqlite3_column_type(stmt, col) != SQLITE_INTEGER){ D1("Column %d is not a int", col); return 1; }
+  *i = (long int)sqlite3_column_int64(stmt, col);
+  return 0;
+}
+
+static inline int
+_col2txt(sqlite3_stmt *stmt, int col, char** data, char **buffer, size_t* buflen)
+{
+  char* s = NULL;
+  int type = sqlite3_column_type(stmt, col);
+  switch(type){
+  case SQLITE_TEXT:
+    s = (char*)sqlite3_column_text(stmt, col);
+    break;
+  case SQLITE_BLOB:
+    s = (char*)sqlite3_column_blob(stmt, col);
+    break;
+  default:
+    D1("The colum %d is not a string/blob | got %d", col, type);
+    return 1;
+    break;
+  }
+  if( s == NULL ){ D1("Memory allocation error"); return 1; }
+  if( copy2buffer(s, data, buffer, buflen) < 0 ) { return -1; }
+  return 0;
+}
+
+/*
+ * 'convert' to struct passwd
+ *
+ * We use -1 in case the buffer is too small
+ *         0 on success
+ *         1 on cache miss / user not found
+ *         2 when the entry has expired (unless stale entries are allowed)
+ *         error otherwise
+ *
+ * Stale entries are used when CentralEGA requests are throttled.
+ */
+
+/* The username of that uid, from its route. Returns 1 when there is none */
+static int
+_route(uid_t uid, char* username, size_t len)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc = 1;
+  sqlite3* db = _shard(_shard_of_uid(uid));
+
+  if(!db) return rc;
+  sqlite3_prepare_v2(db, "select username from uids where uid = ?1", -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return rc; }
+  sqlite3_bind_int(stmt, 1, uid);
+  if(sqlite3_step(stmt) == SQLITE_ROW){
+    const char* name = (const char*)sqlite3_column_text(stmt, 0);
+    if(name && strlen(name) < len){ strcpy(username, name); rc = 0; }
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+static int
+sqlite_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, bool allow_stale)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc = 1; /* cache miss */
+  sqlite3* db = _shard(0);
+  char username[256]; /* LOGIN_NAME_MAX */
+
+  if(options->cache_shards > 1){
+    if(_route(uid, username, sizeof(username))){ D2("No route for uid %u", uid); return rc; }
+    db = _shard(_shard_of_name(username));
+  }
+  if(!db) return rc;
+
+  D2("select username,uid,gecos from users where uid = %u", uid);
+  sqlite3_prepare_v2(db,
+		     (options->cache_shards > 1)
+		     ?"select username,uid,gecos,expires > strftime('%s', 'now') from users where username = ?2 AND uid = ?1"
+		     :"select username,uid,gecos,expires > strftime('%s', 'now') from users where uid = ?1 ORDER BY expires DESC LIMIT 1",
+		     -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return rc; }
+  sqlite3_bind_int(stmt, 1, uid);
+  if(options->cache_shards > 1) sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
+
+  /* cache miss */
+  if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; }
+  if(!allow_stale && !sqlite3_column_int(stmt, 3)) { D2("Expired entry"); rc = 2; goto BAILOUT; }
+
+  /* Convert to struct PWD */
+  if( (rc = _col2txt(stmt, 0, &(result->pw_name), &buffer, &buflen)) ) goto BAILOUT;
+  if( copy2buffer("x", &(result->pw_passwd), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+  result->pw_uid = uid;
+  result->pw_gid = options->gid;
+  if( (rc = _col2txt(stmt, 2, &(result->pw_gecos), &buffer, &buflen)) ) goto BAILOUT;
+
+  char* homedir = strjoina(options->homedir_prefix, "/", result->pw_name);
+  D3("Username %s [%s]", result->pw_name, homedir);
+  if( copy2buffer(homedir, &(result->pw_dir), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+  if( copy2buffer(options->shell, &(result->pw_shell), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+
+  /* success */ rc = 0;
+BAILOUT:
+  sqlite3_finalize(stmt);
+  return rc;
+};
+
+static int
+sqlite_getpwnam_r(const char* username, struct passwd *result, char* buffer, size_t buflen, bool allow_stale)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc = 1; /* cache miss */
+  sqlite3* db = _shard(_shard_of_name(username));
+  if(!db) return rc;
+  D2("select uid,gecos from users where username = '%s'", username);
+  sqlite3_prepare_v2(db, "select uid,gecos,expires > strftime('%s', 'now') from users where username = ?1 LIMIT 1",
+		     -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return rc; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+  /* cache miss */
+  if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; }
+  if(!allow_stale && !sqlite3_column_int(stmt, 2)) { D2("Expired entry"); rc = 2; goto BAILOUT; }
+
+  /* Convert to struct PWD */
+  result->pw_name = (char*)username;
+  if( copy2buffer("x"     , &(result->pw_passwd), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+  if( (rc = _col2uid(stmt, 0, &(result->pw_uid))) ) goto BAILOUT;
+  result->pw_gid = options->gid;
+  if( (rc = _col2txt(stmt, 1, &(result->pw_gecos), &buffer, &buflen)) ) goto BAILOUT;
+
+  char* homedir = strjoina(options->homedir_prefix, "/", username);
+  D3("Username %s [%s]", username, homedir);
+  if( copy2buffer(homedir, &(result->pw_dir), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+  if( copy2buffer(options->shell, &(result->pw_shell), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+
+  /* success */ rc = 0;
+BAILOUT:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+static int
+sqlite_getspnam_r(const char* username, struct spwd *result, char* buffer, size_t buflen, bool allow_stale)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc = 1; /* cache miss */
+  sqlite3* db = _shard(_shard_of_name(username));
+  if(!db) return rc;
+  D2("select pwdh, last_changed from users where username = '%s'", username);
+  sqlite3_prepare_v2(db, "select pwdh, last_changed, expires > strftime('%s', 'now') from users where username = ?1 LIMIT 1",
+		     -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return rc; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+  /* cache miss */
+  if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; }
+  if(!allow_stale && !sqlite3_column_int(stmt, 2)) { D2("Expired entry"); rc = 2; goto BAILOUT; }
+
+  /* Convert to struct PWD */
+  result->sp_namp = (char*)username;
+  if( (rc = _col2txt(stmt, 0, &(result->sp_pwdp), &buffer, &buflen)) ) goto BAILOUT;
+  if( (rc = _col2longint(stmt, 1, &(result->sp_lstchg))) ) goto BAILOUT;
+
+  result->sp_min = options->sp_min;
+  result->sp_max = options->sp_max;
+  result->sp_warn = options->sp_warn;
+  result->sp_inact = options->sp_inact;
+  result->sp_expire = options->sp_expire;
+
+  /* success */ rc = 0;
+BAILOUT:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/* Both entries from a single row, for the PAM modules in direct mode */
+static int
+sqlite_getuser_r(const char* username, struct passwd *pw, struct spwd *sp, char* buffer, size_t buflen, bool allow_stale)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc = 1; /* cache miss */
+  sqlite3* db = _shard(_shard_of_name(username));
+  if(!db) return rc;
+  D2("select uid,gecos,pwdh,last_changed from users where username = '%s'", username);
+  sqlite3_prepare_v2(db, "select uid,gecos,pwdh,last_changed,expires > strftime('%s', 'now') from users where username = ?1 LIMIT 1",
+		     -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return rc; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+  /* cache miss */
+  if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; }
+  if(!allow_stale && !sqlite3_column_int(stmt, 4)) { D2("Expired entry"); rc = 2; goto BAILOUT; }
+
+  /* Convert to struct PWD */
+  pw->pw_name = (char*)username;
+  if( copy2buffer("x"     , &(pw->pw_passwd), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+  if( (rc = _col2uid(stmt, 0, &(pw->pw_uid))) ) goto BAILOUT;
+  pw->pw_gid = options->gid;
+  if( (rc = _col2txt(stmt, 1, &(pw->pw_gecos), &buffer, &buflen)) ) goto BAILOUT;
+
+  char* homedir = strjoina(options->homedir_prefix, "/", username);
+  D3("Username %s [%s]", username, homedir);
+  if( copy2buffer(homedir, &(pw->pw_dir), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+  if( copy2buffer(options->shell, &(pw->pw_shell), &buffer, &buflen) < 0 ){ rc = -1; goto BAILOUT; }
+
+  /* and to struct SPWD */
+  sp->sp_namp = (char*)username;
+  if( (rc = _col2txt(stmt, 2, &(sp->sp_pwdp), &buffer, &buflen)) ) goto BAILOUT;
+  if( (rc = _col2longint(stmt, 3, &(sp->sp_lstchg))) ) goto BAILOUT;
+
+  sp->sp_min = options->sp_min;
+  sp->sp_max = options->sp_max;
+  sp->sp_warn = options->sp_warn;
+  sp->sp_inact = options->sp_inact;
+  sp->sp_expire = options->sp_expire;
+
+  /* success */ rc = 0;
+BAILOUT:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/*
+ *
+ * The following functions do check the expiration date (in SQL)
+ *
+ */
+
+static int
+_foreach_pubkeys(sqlite3* db, const char* username, int (*cb)(const char* username, const char* pubkeys), bool* stopped)
+{
+  sqlite3_stmt *stmt = NULL;
+  int count = 0, rc;
+
+  if(!db) return -1;
+
+  D2("select pubkeys for %s", (username)?username:"all users");
+  sqlite3_prepare_v2(db,
+		     (username)
+		     ?"select username, group_concat(pubkey, char(10)) from ("
+		      "  select distinct username, pubkey from users inner join keys on keys.uid = users.uid "
+		      "  where username = ?1 AND expires > strftime('%s', 'now') order by pubkey"
+		      ") group by username"
+		     :"select username, group_concat(pubkey, char(10)) from ("
+		      "  select distinct username, pubkey from users inner join keys on keys.uid = users.uid "
+		      "  where expires > strftime('%s', 'now') order by username, pubkey"
+		      ") group by username order by username",
+		     -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return -1; }
+  if(username) sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+  while((rc = sqlite3_step(stmt)) == SQLITE_ROW){
+    const unsigned char* name = sqlite3_column_text(stmt, 0); /* do not free */
+    const unsigned char* pubkeys = sqlite3_column_text(stmt, 1);
+    if(!name || !pubkeys){ D1("Memory allocation error"); count = -1; goto BAILOUT; }
+    count++;
+    if(cb((const char*)name, (const char*)pubkeys)){ *stopped = true; break; }
+  }
+  if(rc != SQLITE_ROW && rc != SQLITE_DONE){ D1("Execution error: %s", sqlite3_errmsg(db)); count = -1; }
+
+BAILOUT:
+  sqlite3_finalize(stmt);
+  return count;
+}
+
+/*
+ * The public keys of a user (or of all the users, when username is NULL, in order, shard by shard),
+ * newline-separated, for the entries that have not expired.
+ * Returns the number of users, or -1 on error. Stops when cb returns non-zero.
+ */
+static int
+sqlite_foreach_pubkeys(const char* username, int (*cb)(const char* username, const char* pubkeys))
+{
+  unsigned int s;
+  int count = 0, n;
+  bool stopped = false;
+
+  if(username) return _foreach_pubkeys(_shard(_shard_of_name(username)), username, cb, &stopped);
+
+  for(s = 0; s < options->cache_shards && !stopped; s++){
+    if((n = _foreach_pubkeys(_shard(s), NULL, cb, &stopped)) < 0) return -1;
+    count += n;
+  }
+  return count;
+}
+
+/*
+ * The keys of a user with that fingerprint (usually one, but the same key might come
+ * with different options), for the entry that has not expired. Uses keys_fingerprint.
+ * Returns 0 when the user is in the cache, whether a key matched or not,
+ * 1 when not (or expired), and -1 on error. Stops when cb returns non-zero.
+ */
+static int
+sqlite_find_pubkey(const char* username, const char* fingerprint, int (*cb)(const char* pubkey))
+{
+  sqlite3_stmt *stmt = NULL;
+  int count = 0, rc;
+  sqlite3* db = _shard(_shard_of_name(username));
+
+  if(!db) return -1;
+
+  D2("select the pubkey %s of %s", fingerprint, username);
+  sqlite3_prepare_v2(db,
+		     "select keys.pubkey from users left join keys on keys.uid = users.uid and keys.fingerprint = ?2 "
+		     "where username = ?1 AND expires > strftime('%s', 'now')",
+		     -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return -1; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, fingerprint, -1, SQLITE_STATIC);
+
+  while((rc = sqlite3_step(stmt)) == SQLITE_ROW){
+    const unsigned char* pubkey = sqlite3_column_text(stmt, 0); /* NULL: none matched */
+    count++;
+    if(pubkey && cb((const char*)pubkey)) break;
+  }
+  if(rc != SQLITE_ROW && rc != SQLITE_DONE){ D1("Execution error: %s", sqlite3_errmsg(db)); count = -1; }
+
+  sqlite3_finalize(stmt);
+  return (count < 0)?-1:(count)?0:1;
+}
+
+/*
+ *
+ * Pinned DNS results for CentralEGA, shared by all processes
+ *
+ */
+
+static int
+sqlite_get_addresses(const char* host, int port, char* buffer, size_t buflen)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc = 1; /* cache miss */
+  sqlite3* db = _shard(0);
+
+  if(!db) return 1;
+
+  D2("select addresses for %s:%d", host, port);
+  sqlite3_prepare_v2(db, "select addresses from dns where host = ?1 AND port = ?2 AND expires > strftime('%s', 'now') LIMIT 1",
+		     -1, &stmt, NULL);
+  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return rc; }
+  sqlite3_bind_text(stmt, 1, host, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt,  2, port);
+
+  if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; } /* cache miss */
+  rc = _col2txt(stmt, 0, NULL, &buffer, &buflen);
+
+BAILOUT:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+static int
+sqlite_add_addresses(const char* host, int port, const char* addresses, unsigned int ttl)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc;
+  sqlite3* db = _shard(0);
+
+  if(!db) return 1;
+
+  D2("Pinning %s:%d to %s for %us", host, port, addresses, ttl);
+  sqlite3_prepare_v2(db, "INSERT INTO dns (host,port,addresses,expires) VALUES(?1,?2,?3,?4);", -1, &stmt, NULL);
+  if(!stmt){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return 1; }
+
+  sqlite3_bind_text(stmt, 1, host, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt,  2, port);
+  sqlite3_bind_text(stmt, 3, addresses, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt,  4, (unsigned int)time(NULL) + ttl);
+
+  rc = (_step(stmt) == SQLITE_DONE)?0:1;
+  if(rc) D1("Execution error: %s", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+static int
+sqlite_del_addresses(const char* host, int port)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc;
+  sqlite3* db = _shard(0);
+
+  if(!db) return 1;
+
+  D2("Unpinning %s:%d", host, port);
+  sqlite3_prepare_v2(db, "DELETE FROM dns WHERE host = ?1 AND port = ?2;", -1, &stmt, NULL);
+  if(!stmt){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return 1; }
+
+  sqlite3_bind_text(stmt, 1, host, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt,  2, port);
+
+  rc = (_step(stmt) == SQLITE_DONE)?0:1;
+  if(rc) D1("Execution error: %s", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+const struct cache_backend cache_sqlite = {
+  .name            = "sqlite",
+  .open            = sqlite_open,
+  .close           = sqlite_close,
+  .add_users       = sqlite_add_users,
+  .getpwnam_r      = sqlite_getpwnam_r,
+  .getpwuid_r      = sqlite_getpwuid_r,
+  .getspnam_r      = sqlite_getspnam_r,
+  .getuser_r       = sqlite_getuser_r,
+  .foreach_pubkeys = sqlite_foreach_pubkeys,
+  .find_pubkey     = sqlite_find_pubkey,
+  .get_addresses   = sqlite_get_addresses,
+  .add_addresses   = sqlite_add_addresses,
+  .del_addresses   = sqlite_del_addresses,
+};
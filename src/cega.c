@@ -5,29 +5,84 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <pwd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "utils.h"
 #include "cache.h"
 #include "cega.h"
+#include "dns.h"
+#include "shm.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "trace.h"
 
 struct curl_res_s {
   char *body;
-  size_t size;
+  size_t size;     /* bytes received so far */
+  size_t capacity; /* bytes allocated for body */
+  size_t max;      /* upper bound on size */
+  CURL *curl;
+
+  const char *url;
+  unsigned int endpoint;      /* index in the configured list */
+  struct curl_slist *resolve; /* pinned addresses */
+  bool pinned;
+  bool retried;               /* after a failed connection to pinned addresses */
+  bool active;                /* added to the multi handle */
+  uint64_t start;             /* in us */
 };
 
+#define CEGA_BODY_CHUNK 1024
+
+/*
+ * Grows the body geometrically, so that a response arriving in many small chunks
+ * does not cost one realloc per chunk. The capacity never goes beyond max+1 (for the \0):
+ * readconfig keeps max at most CEGA_MAX_RESPONSE_SIZE_MAX, so that does not wrap.
+ */
+static inline int
+curl_res_reserve(struct curl_res_s *r, size_t needed)
+{
+  if(needed <= r->capacity) return 0;
 
-/* callback for curl fetch */
+  size_t capacity = (r->capacity)?r->capacity:CEGA_BODY_CHUNK;
+  while(capacity < needed) capacity <<= 1;
+  if(capacity > r->max + 1) capacity = r->max + 1;
+
+  D3("Resizing the cURL buffer from %zu to %zu bytes", r->capacity, capacity);
+  char *body = (char *) realloc(r->body, capacity);
+  if (body == NULL) { D1("ERROR: Failed to expand buffer for cURL"); return 1; }
+  r->body = body;
+  r->capacity = capacity;
+  return 0;
+}
+
+/* callback for curl fetch
+ *
+ * Returning anything else than realsize makes cURL abort the transfer (with CURLE_WRITE_ERROR).
+ */
 size_t
 curl_callback (void* contents, size_t size, size_t nmemb, void* userdata) {
   const size_t realsize = size * nmemb;                      /* calculate buffer size */
   struct curl_res_s *r = (struct curl_res_s*) userdata;   /* cast pointer to fetch struct */
 
-  /* expand buffer */
-  r->body = (char *) realloc(r->body, r->size + realsize + 1);
+  if (realsize > r->max - r->size) { D1("Response too large: more than %zu bytes", r->max); return 0; }
+
+  /* first chunk: presize from the Content-Length, if any */
+  if (r->body == NULL) {
+    curl_off_t cl = -1;
+    if(curl_easy_getinfo(r->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl) == CURLE_OK && cl > 0){
+      if((curl_off_t)r->max < cl){ D1("Content-Length too large: %ld bytes", (long)cl); return 0; }
+      if(curl_res_reserve(r, (size_t)cl + 1)) return 0;
+    }
+  }
 
-  /* check buffer */
-  if (r->body == NULL) { D1("ERROR: Failed to expand buffer for cURL"); return -1; }
+  /* expand buffer */
+  if (curl_res_reserve(r, r->size + realsize + 1)) return 0;
 
   /* copy contents to buffer */
   memcpy(&(r->body[r->size]), contents, realsize);
@@ -37,37 +92,236 @@ curl_callback (void* contents, size_t size, size_t nmemb, void* userdata) {
   return realsize;
 }
 
-int
-cega_resolve(const char *endpoint, int (*cb)(struct fega_user *user))
+/*
+ * Response times of the CentralEGA endpoints, shared by all processes on the node.
+ *
+ * For each lookup type, we keep an EWMA per endpoint (to pick the fastest one first)
+ * and a histogram of the response times (to decide when to send a hedged request).
+ * Those are statistics: updates may race and lose a sample, which is fine.
+ */
+#define CEGA_SHM_NAME "/ega-cega-endpoints.v1"
+
+#define CEGA_HIST_BUCKETS 160          /* 4 per power of 2, up to 2^40 us */
+#define CEGA_HIST_DECAY 1024           /* halve the histogram every that many samples */
+#define CEGA_HIST_MIN_SAMPLES 16       /* before that, use CEGA_HEDGE_DEFAULT_DELAY */
+#define CEGA_HEDGE_DEFAULT_DELAY 50000 /* in us */
+#define CEGA_HEDGE_MIN_DELAY 1000      /* in us */
+#define CEGA_EWMA_HALFLIFE 60          /* in seconds, so that a penalized endpoint gets tried again */
+
+struct cega_endpoint_stats {
+  uint64_t ewma;    /* in us */
+  int64_t updated;  /* in seconds */
+};
+
+struct cega_lookup_stats {
+  struct cega_endpoint_stats endpoints[CEGA_ENDPOINTS_MAX];
+  uint32_t hist[CEGA_HIST_BUCKETS];
+  uint32_t count;
+};
+
+static struct cega_lookup_stats *cega_stats = NULL; /* [CEGA_BY_USERNAME, CEGA_BY_UID] */
+
+static inline uint64_t
+now_us(void)
 {
-  int rc = 1; /* error */
-  struct curl_res_s* cres = NULL;
-  CURL* curl = NULL;
-  struct fega_user user;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-  D2("Contacting %s", endpoint);
-  memset(&user, 0, sizeof(user));
-  user.uid = -1;
+static inline unsigned int
+hist_bucket(uint64_t us)
+{
+  if(us < 4) return (unsigned int)us;
+  unsigned int msb = 63 - __builtin_clzll(us);
+  unsigned int b = msb * 4 + ((us >> (msb - 2)) & 3);
+  return (b < CEGA_HIST_BUCKETS)?b:(CEGA_HIST_BUCKETS - 1);
+}
 
-  /* Preparing cURL */
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-  curl = curl_easy_init();
+/* upper bound of the bucket */
+static inline uint64_t
+hist_value(unsigned int b)
+{
+  if(b < 4) return b + 1;
+  return (uint64_t)(4 + (b & 3) + 1) << (b / 4 - 2);
+}
+
+static void
+cega_stats_attach(void)
+{
+  if(cega_stats) return;
+  cega_stats = shm_attach(CEGA_SHM_NAME, 2 * sizeof(struct cega_lookup_stats), 0644, NULL);
+}
+
+/* The EWMA fades with age, so that endpoints are measured again */
+static inline uint64_t
+cega_ewma(struct cega_endpoint_stats *e, int64_t now)
+{
+  uint64_t ewma = __atomic_load_n(&e->ewma, __ATOMIC_RELAXED);
+  int64_t age = now - __atomic_load_n(&e->updated, __ATOMIC_RELAXED);
+  if(age <= 0) return ewma;
+  age /= CEGA_EWMA_HALFLIFE;
+  return (age >= 64)?0:(ewma >> age);
+}
+
+static void
+cega_stats_record(enum cega_lookup type, unsigned int endpoint, uint64_t elapsed, bool answered)
+{
+  if(!cega_stats) return;
+  struct cega_lookup_stats *s = &cega_stats[type];
+  struct cega_endpoint_stats *e = &s->endpoints[endpoint];
+  int64_t now = (int64_t)time(NULL);
 
-  if(!curl) { D1("libcurl init failed"); goto BAILOUT; }
+  /* EWMA, with alpha = 1/8 */
+  uint64_t ewma = cega_ewma(e, now);
+  ewma = (ewma == 0)?elapsed:(ewma - ewma / 8 + elapsed / 8);
+  __atomic_store_n(&e->ewma, ewma, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->updated, now, __ATOMIC_RELAXED);
 
-  /* Preparing result */
-  cres = (struct curl_res_s*)malloc(sizeof(struct curl_res_s));
-  if(!cres){ D1("memory allocation failure for the cURL result"); goto BAILOUT; }
-  cres->body = NULL;
-  cres->size = 0;
+  if(!answered) return;
+
+  __atomic_fetch_add(&s->hist[hist_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+  uint32_t count = __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+  if(count >= CEGA_HIST_DECAY &&
+     __atomic_compare_exchange_n(&s->count, &count, count / 2, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    unsigned int i;
+    for(i = 0; i < CEGA_HIST_BUCKETS; i++)
+      __atomic_store_n(&s->hist[i], __atomic_load_n(&s->hist[i], __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+  }
+}
+
+/* Endpoints, fastest first */
+static void
+cega_order_endpoints(enum cega_lookup type, unsigned int *order, unsigned int n)
+{
+  uint64_t ewma[CEGA_ENDPOINTS_MAX];
+  int64_t now = (int64_t)time(NULL);
+  unsigned int i, j;
+
+  for(i = 0; i < n; i++){
+    order[i] = i;
+    ewma[i] = (cega_stats)?cega_ewma(&cega_stats[type].endpoints[i], now):0;
+  }
+  /* insertion sort: there are only a few */
+  for(i = 1; i < n; i++){
+    for(j = i; j > 0 && ewma[order[j]] < ewma[order[j-1]]; j--){
+      unsigned int tmp = order[j]; order[j] = order[j-1]; order[j-1] = tmp;
+    }
+  }
+}
+
+/* Delay before a hedged request: the configured percentile of the recent response times */
+static uint64_t
+cega_hedge_delay(enum cega_lookup type)
+{
+  if(!cega_stats) return CEGA_HEDGE_DEFAULT_DELAY;
+
+  struct cega_lookup_stats *s = &cega_stats[type];
+  uint64_t total = 0, seen = 0;
+  unsigned int i;
+  uint32_t hist[CEGA_HIST_BUCKETS];
+
+  for(i = 0; i < CEGA_HIST_BUCKETS; i++){
+    hist[i] = __atomic_load_n(&s->hist[i], __ATOMIC_RELAXED);
+    total += hist[i];
+  }
+  if(total < CEGA_HIST_MIN_SAMPLES) return CEGA_HEDGE_DEFAULT_DELAY;
+
+  uint64_t target = (total * options->cega_hedge_percentile + 99) / 100;
+  for(i = 0; i < CEGA_HIST_BUCKETS; i++){
+    seen += hist[i];
+    if(seen >= target) break;
+  }
+  uint64_t delay = hist_value(i);
+  return (delay < CEGA_HEDGE_MIN_DELAY)?CEGA_HEDGE_MIN_DELAY:delay;
+}
+
+/*
+ * Pins the CentralEGA host to the addresses found in the cache,
+ * or freshly resolved (and then cached for the DNS TTL), so that
+ * all processes share the result of one resolver lookup.
+ *
+ * With refresh, the pinned addresses are discarded and the host resolved again.
+ * The entries are appended to *resolve, which must outlive the request.
+ *
+ * Returns true if the request will go to pinned addresses.
+ * Times the lookup (cache or resolver), as STATS_DNS and TRACE_DNS.
+ */
+static bool
+cega_pin_addresses(CURL* curl, const char* endpoint, bool refresh, struct curl_slist **resolve)
+{
+  CURLU *url = curl_url();
+  char *host = NULL, *port = NULL;
+  char addresses[1024];
+  struct in_addr ipv4;
+  bool pinned = false;
+  int ttl, dns = -2; /* TRACE_DNS code, -2: no lookup */
+  uint64_t start = 0;
+
+  if(!url) return false;
+  if(curl_url_set(url, CURLUPART_URL, endpoint, 0) != CURLUE_OK ||
+     curl_url_get(url, CURLUPART_HOST, &host, 0) != CURLUE_OK ||
+     curl_url_get(url, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) != CURLUE_OK){
+    D2("Could not parse the endpoint");
+    goto BAILOUT;
+  }
+
+  /* IP literals: nothing to resolve */
+  if(*host == '[' || inet_pton(AF_INET, host, &ipv4) == 1) goto BAILOUT;
+
+  start = now_us();
+  dns = 0;
+  if(refresh){
+    cache_del_addresses(host, atoi(port));
+    *resolve = curl_slist_append(*resolve, strjoina("-", host, ":", port));
+  } else if(!cache_get_addresses(host, atoi(port), addresses, sizeof(addresses))){
+    D2("Using pinned addresses for %s:%s: %s", host, port, addresses);
+    goto PIN;
+  }
+
+  ttl = dns_resolve(host, addresses, sizeof(addresses));
+  dns = (ttl > 0)?1:-1;
+  D1("DNS lookup for %s: %lu us", host, (unsigned long)(now_us() - start));
+
+  if(ttl <= 0) goto BAILOUT; /* cURL resolves it as usual */
+  cache_add_addresses(host, atoi(port), addresses, ttl);
+
+PIN:
+  *resolve = curl_slist_append(*resolve, strjoina(host, ":", port, ":", addresses));
+  pinned = true;
+
+BAILOUT:
+  if(dns > -2){
+    uint64_t elapsed = now_us() - start;
+    stats_time(STATS_DNS, elapsed);
+    trace_event(TRACE_DNS, dns, elapsed);
+  }
+  if(*resolve) curl_easy_setopt(curl, CURLOPT_RESOLVE, *resolve);
+  if(host) curl_free(host);
+  if(port) curl_free(port);
+  curl_url_cleanup(url);
+  return pinned;
+}
+
+static CURL*
+cega_easy_init(struct curl_res_s *r)
+{
+  CURL* curl = curl_easy_init();
+  if(!curl) { D1("libcurl init failed"); return NULL; }
+
+  r->curl = curl;
 
   /* Preparing the request */
-  curl_easy_setopt(curl, CURLOPT_URL           , endpoint         );
+  curl_easy_setopt(curl, CURLOPT_URL           , r->url           );
+  curl_easy_setopt(curl, CURLOPT_PRIVATE       , (void*)r         );
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION , curl_callback    );
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA     , (void*)cres      );
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA     , (void*)r         );
   curl_easy_setopt(curl, CURLOPT_FAILONERROR   , 1L               ); /* when not 200 */
   curl_easy_setopt(curl, CURLOPT_HTTPAUTH      , CURLAUTH_BASIC);
   curl_easy_setopt(curl, CURLOPT_USERPWD       , options->cega_creds);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL      , 1L               );
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT       , options->cega_timeout); /* includes slow-drip responses */
+  curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)options->cega_max_response_size); /* from Content-Length */
   /* curl_easy_setopt(curl, CURLOPT_NOPROGRESS    , 0L               ); */ /* enable progress meter */
 
   if ( options->verify_peer && options->cacertfile ){
@@ -99,15 +353,222 @@ cega_resolve(const char *endpoint, int (*cb)(struct fega_user *user))
     curl_easy_setopt(curl, CURLOPT_SSLKEYTYPE   , "PEM"           );
   }
 
-  /* Perform the request */
-  CURLcode res = curl_easy_perform(curl);
-  if(res != CURLE_OK){ D2("curl_easy_perform() failed: %s", curl_easy_strerror(res)); goto BAILOUT; }
+  if ( options->cega_unix_socket ){
+    D2("Connecting through %s", options->cega_unix_socket);
+    curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, options->cega_unix_socket); /* nothing to resolve */
+  } else if ( options->cega_dns_pinning && options->use_cache && cache_open() ){
+    r->pinned = cega_pin_addresses(curl, r->url, false, &r->resolve);
+  }
+
+  return curl;
+}
+
+static void
+cega_launch(CURLM *multi, struct curl_res_s *r)
+{
+  D2("Contacting %s", r->url);
+  r->start = now_us();
+  if(curl_multi_add_handle(multi, r->curl) == CURLM_OK) r->active = true;
+  stats_count(STATS_CEGA_REQUESTS);
+  trace_event(TRACE_CEGA_REQUEST, r->endpoint, 0);
+}
+
+/*
+ * The phases of a finished request, from cURL's timings (in us since the start).
+ * In the trace, they are backdated to when they happened.
+ */
+static void
+cega_http_stats(struct curl_res_s *r, CURLcode res, long code)
+{
+  curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+
+  curl_easy_getinfo(r->curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+  curl_easy_getinfo(r->curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(r->curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+  curl_easy_getinfo(r->curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+  curl_easy_getinfo(r->curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+  curl_easy_getinfo(r->curl, CURLINFO_TOTAL_TIME_T, &total);
+
+  if(!r->pinned && !options->cega_unix_socket && namelookup > 0) stats_time(STATS_DNS, namelookup);
+  if(connect > namelookup) stats_time(STATS_HTTP_CONNECT, connect - namelookup);
+  if(appconnect > connect) stats_time(STATS_HTTP_TLS, appconnect - connect);
+  if(pretransfer > 0 && total >= pretransfer) stats_time(STATS_HTTP_TRANSFER, total - pretransfer);
+
+  if(!r->pinned && !options->cega_unix_socket && namelookup > 0 && total >= namelookup)
+    trace_event_ago(TRACE_DNS, 2, namelookup, total - namelookup);
+  if(connect > 0 && total >= connect) trace_event_ago(TRACE_HTTP_CONNECTED, r->endpoint, connect, total - connect);
+  if(appconnect > 0 && total >= appconnect) trace_event_ago(TRACE_HTTP_TLS, r->endpoint, appconnect, total - appconnect);
+  if(starttransfer > 0 && total >= starttransfer) trace_event_ago(TRACE_HTTP_FIRST_BYTE, r->endpoint, starttransfer, total - starttransfer);
+  if(res != CURLE_OK && res != CURLE_HTTP_RETURNED_ERROR) trace_event(TRACE_HTTP_ERROR, res, total);
+  else trace_event(TRACE_HTTP_DONE, code, total);
+}
+
+/*
+ * Sends the request to the fastest endpoint first.
+ * If it has not answered after the hedge delay, a second request goes to the next endpoint,
+ * and the first answer wins. When a request fails, the next endpoint is tried right away.
+ *
+ * Returns the winning request (with a complete response), or NULL
+ */
+static struct curl_res_s*
+cega_fetch(CURLM *multi, enum cega_lookup type, struct curl_res_s *reqs, unsigned int n, bool stale_ok, CURLcode *result)
+{
+  struct curl_res_s *winner = NULL;
+  unsigned int launched = 0, running = 0, hedged = 0;
+  uint64_t hedge_at = UINT64_MAX;
+  int still, queued;
+  CURLMsg *msg;
+
+  if(n > 1 && options->cega_hedge_percentile > 0){
+    uint64_t delay = cega_hedge_delay(type);
+    D2("Hedging after %lu us", (unsigned long)delay);
+    hedge_at = now_us() + delay;
+  }
+
+  cega_launch(multi, &reqs[launched++]);
+  running++;
+
+  while(running > 0){
+
+    curl_multi_perform(multi, &still);
+
+    while( !winner && (msg = curl_multi_info_read(multi, &queued)) ){
+      if(msg->msg != CURLMSG_DONE) continue;
+
+      struct curl_res_s *r = NULL;
+      CURLcode res = msg->data.result;
+      long code = 0;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&r);
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+      curl_multi_remove_handle(multi, r->curl);
+      r->active = false;
+      running--;
+
+      /* The retry is a new request: it takes a token too, else it fails as any other */
+      if(res == CURLE_COULDNT_CONNECT && r->pinned && !r->retried && ratelimit_acquire(stale_ok)){
+	D1("Could not connect to the pinned addresses for %s: resolving again", r->url);
+	stats_count(STATS_CEGA_ERRORS);
+	trace_event(TRACE_HTTP_ERROR, res, now_us() - r->start);
+	r->retried = true;
+	r->pinned = cega_pin_addresses(r->curl, r->url, true, &r->resolve);
+	r->size = 0;
+	cega_launch(multi, r);
+	running++;
+	continue;
+      }
+
+      uint64_t elapsed = now_us() - r->start;
+      cega_http_stats(r, res, code);
+
+#ifdef DEBUG
+      curl_off_t namelookup = 0;
+      curl_easy_getinfo(r->curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+      D1("%s: %s [HTTP %ld] in %lu us | Name lookup: %ld us [%s]", r->url, curl_easy_strerror(res), code,
+	 (unsigned long)elapsed, (long)namelookup, (r->pinned)?"pinned":"resolver");
+#endif
+
+      /* A 4xx is an answer (eg user not found). Anything else lets another endpoint try */
+      if(res == CURLE_OK || (res == CURLE_HTTP_RETURNED_ERROR && code < 500)){
+	cega_stats_record(type, r->endpoint, elapsed, true);
+	*result = res;
+	winner = r;
+	break;
+      }
+
+      stats_count(STATS_CEGA_ERRORS);
+      cega_stats_record(type, r->endpoint, options->cega_timeout * 1000000ULL, false); /* penalty */
+      if(launched < n && ratelimit_acquire(stale_ok)){ cega_launch(multi, &reqs[launched++]); running++; }
+    }
+
+    if(winner) break;
+
+    if(launched < n && !hedged && now_us() >= hedge_at){
+      hedged++;
+      if(ratelimit_acquire(true)){ /* hedges are first to go when throttled */
+	D1("No answer yet from %s: hedging with %s", reqs[0].url, reqs[launched].url);
+	cega_launch(multi, &reqs[launched++]);
+	running++;
+      }
+    }
+
+    if(running == 0) break;
+
+    int timeout = 1000; /* ms */
+    if(launched < n && !hedged){
+      uint64_t now = now_us();
+      timeout = (hedge_at <= now)?0:(int)((hedge_at - now + 999) / 1000);
+      if(timeout > 1000) timeout = 1000;
+    }
+    curl_multi_poll(multi, NULL, 0, timeout, NULL);
+  }
+
+  /* Losers: they were slower than the winner, at least */
+  unsigned int i;
+  for(i = 0; i < launched; i++){
+    if(!reqs[i].active) continue;
+    if(winner) cega_stats_record(type, reqs[i].endpoint, now_us() - reqs[i].start, false);
+    curl_multi_remove_handle(multi, reqs[i].curl);
+    reqs[i].active = false;
+  }
+
+  return winner;
+}
+
+static int
+cega_resolve(enum cega_lookup type, char** urls, unsigned int n, bool stale_ok, int (*cb)(struct fega_user *user))
+{
+  int rc = CEGA_FAILED;
+  struct curl_res_s reqs[CEGA_ENDPOINTS_MAX];
+  struct curl_res_s *cres = NULL;
+  unsigned int order[CEGA_ENDPOINTS_MAX], i;
+  CURLM *multi = NULL;
+  CURLcode res = CURLE_OK;
+  struct fega_user user;
+
+  memset(&user, 0, sizeof(user));
+  user.uid = -1;
+  memset(reqs, 0, sizeof(reqs));
+
+  if(!ratelimit_acquire(stale_ok)) return CEGA_THROTTLED;
+
+  /* Preparing cURL */
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  multi = curl_multi_init();
+  if(!multi) { D1("libcurl init failed"); goto BAILOUT; }
+
+  cega_stats_attach();
+  cega_order_endpoints(type, order, n);
+
+  /* Preparing the requests */
+  for(i = 0; i < n; i++){
+    struct curl_res_s *r = &reqs[i];
+    r->url = urls[order[i]];
+    r->endpoint = order[i];
+    r->max = options->cega_max_response_size;
+    if(!cega_easy_init(r)) goto BAILOUT;
+  }
+
+  /* Perform the request(s) */
+  cres = cega_fetch(multi, type, reqs, n, stale_ok, &res);
+  if(!cres){ D2("No answer from CentralEGA"); goto BAILOUT; }
+  if(res != CURLE_OK){
+    long code = 0;
+    curl_easy_getinfo(cres->curl, CURLINFO_RESPONSE_CODE, &code);
+    D2("%s failed: %s (HTTP %ld)", cres->url, curl_easy_strerror(res), code);
+    if(res == CURLE_HTTP_RETURNED_ERROR && code >= 400 && code < 500) rc = 1; /* not an EGA user */
+    goto BAILOUT;
+  }
 
   /* Successful cURL */
+  if(!cres->body){ D1("Empty response"); goto BAILOUT; }
   D1("JSON string [size %zu]: %s", cres->size, cres->body);
   
   D2("Parsing the JSON response");
-  rc = parse_json(cres->body, cres->size, &user);
+  uint64_t start = now_us();
+  rc = parse_json(cres->body, cres->size, options->cega_max_tokens, &user);
+  uint64_t elapsed = now_us() - start;
+  stats_time(STATS_PARSE, elapsed);
+  trace_event(TRACE_PARSE, rc, elapsed);
 
   if(rc) { D1("We found %d errors", rc); goto BAILOUT; }
 
@@ -126,25 +587,77 @@ cega_resolve(const char *endpoint, int (*cb)(struct fega_user *user))
   rc = cb(&user);
 
 BAILOUT:
-  if(cres->body)free(cres->body);
-  if(cres)free(cres);
+  for(i = 0; i < n; i++){
+    if(reqs[i].body) free(reqs[i].body);
+    if(reqs[i].resolve) curl_slist_free_all(reqs[i].resolve);
+    if(reqs[i].curl) curl_easy_cleanup(reqs[i].curl);
+  }
 
   /* cleanup */
-  if(user.username) free(user.username);
-  if(user.pwdh) free(user.pwdh);
-  if(user.gecos) free(user.gecos);
+  fega_user_free(&user);
+
+  if(multi) curl_multi_cleanup(multi);
+  curl_global_cleanup();
+  return rc;
+}
+
+static char*
+cega_format(const char* fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if(len < 0) return NULL;
+
+  char* url = (char*)malloc((len + 1) * sizeof(char));
+  if(!url) return NULL;
 
-  struct pbk *current = user.pubkeys;
-  struct pbk *next = NULL;
-  while( current ){
-    //D3("Freeing pubkey at %p", current);
-    next = current->next;
-    if(current->pbk) free(current->pbk);
-    free(current);
-    current = next;
+  va_start(ap, fmt);
+  vsnprintf(url, len + 1, fmt, ap);
+  va_end(ap);
+  return url;
+}
+
+/*
+ * The endpoints are formatted, in the configured order,
+ * with the username (%s) or the user id (%u)
+ *
+ * stale_ok tells the rate limiter that the caller has an expired cache entry to fall back on,
+ * so the request has a lower priority.
+ */
+int
+cega_resolve_username(const char *username, bool stale_ok, int (*cb)(struct fega_user *user))
+{
+  char* urls[CEGA_ENDPOINTS_MAX];
+  unsigned int i, n = options->cega_endpoint_username_count;
+  int rc = CEGA_FAILED;
+
+  memset(urls, 0, sizeof(urls));
+  for(i = 0; i < n; i++){
+    if( !(urls[i] = cega_format(options->cega_endpoint_username[i], username)) ){ D1("Error formatting the endpoint"); goto BAILOUT; }
   }
+  rc = cega_resolve(CEGA_BY_USERNAME, urls, n, stale_ok, cb);
 
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
+BAILOUT:
+  for(i = 0; i < n; i++) if(urls[i]) free(urls[i]);
+  return rc;
+}
+
+int
+cega_resolve_uid(uid_t uid, bool stale_ok, int (*cb)(struct fega_user *user))
+{
+  char* urls[CEGA_ENDPOINTS_MAX];
+  unsigned int i, n = options->cega_endpoint_uid_count;
+  int rc = CEGA_FAILED;
+
+  memset(urls, 0, sizeof(urls));
+  for(i = 0; i < n; i++){
+    if( !(urls[i] = cega_format(options->cega_endpoint_uid[i], uid)) ){ D1("Error formatting the endpoint"); goto BAILOUT; }
+  }
+  rc = cega_resolve(CEGA_BY_UID, urls, n, stale_ok, cb);
+
+BAILOUT:
+  for(i = 0; i < n; i++) if(urls[i]) free(urls[i]);
   return rc;
 }
@@ -1,10 +1,20 @@
 #ifndef __FEGA_CENTRAL_H_INCLUDED__
 #define __FEGA_CENTRAL_H_INCLUDED__
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 #include "json.h"
 
-int cega_resolve(const char *endpoint, int (*cb)(struct fega_user *));
+enum cega_lookup {
+  CEGA_BY_USERNAME = 0,
+  CEGA_BY_UID      = 1
+};
+
+#define CEGA_THROTTLED -2 /* rate-limited: no request was sent */
+#define CEGA_FAILED    -4 /* no answer (transport error, an HTTP status other than 4xx), or out of memory */
+
+int cega_resolve_username(const char *username, bool stale_ok, int (*cb)(struct fega_user *));
+int cega_resolve_uid(uid_t uid, bool stale_ok, int (*cb)(struct fega_user *));
 
 #endif /* !__FEGA_CENTRAL_H_INCLUDED__ */
@@ -1,8 +1,10 @@
+#define _GNU_SOURCE /* secure_getenv */
 #include <ctype.h>
 #include <errno.h>
 #include <grp.h>
 #include <strings.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <sys/stat.h>
 
 #include "utils.h"
@@ -11,9 +13,17 @@
 #define CFGFILE "/etc/ega/auth.conf"
 
 #define CACHE_TTL 3600 // 1h in seconds.
+#define CACHE_REFRESH_AHEAD 300 // 5 min
 #define EGA_UID_SHIFT 10000
 #define EGA_SHELL "/bin/bash"
 
+#define CEGA_MAX_RESPONSE_SIZE 65536 // 64kB
+#define CEGA_MAX_TOKENS 1024
+#define CEGA_TIMEOUT 10 // in seconds
+#define CEGA_HEDGE_PERCENTILE 95
+#define CEGA_RATE_BURST 10
+#define CEGA_RATE_MAX_WAIT 200 // in ms
+
 #define VERIFY_PEER false
 #define VERIFY_HOSTNAME false
 
@@ -22,6 +32,17 @@ char* syslog_name = "EGA-auth";
 
 static inline void set_yes_no_option(char* key, char* val, char* name, bool* loc);
 
+/*
+ * EGA_AUTH_CONFIG points to another config file, for tests and benchmarks.
+ * It is ignored in setuid and setgid programs.
+ */
+static const char*
+config_path(void)
+{
+  const char* path = secure_getenv("EGA_AUTH_CONFIG");
+  return (path && *path)?path:CFGFILE;
+}
+
 void
 cleanconfig(void)
 {
@@ -30,9 +51,20 @@ cleanconfig(void)
 
   if(options->buffer){ free((char*)options->buffer); }
   free(options);
+  options = NULL;
   return;
 }
 
+/* In every build (D1 compiles away): a setting we could not use is worth a line in the logs */
+static void
+config_warning(const char* fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsyslog(LOG_MAKEPRI(LOG_AUTHPRIV, LOG_WARNING), fmt, ap);
+  va_end(ap);
+}
+
 
 bool
 valid_options(void)
@@ -44,6 +76,10 @@ valid_options(void)
   if(options->cache_ttl < 0.0    ) { D3("Invalid cache_ttl");        valid = false; }
   if(options->uid_shift < 0      ) { D3("Invalid uid_shift");    valid = false; }
   if(options->gid < 0            ) { D3("Invalid gid");          valid = false; }
+  if(options->cache_shards < 1 ||
+     options->cache_shards > CACHE_SHARDS_MAX) { D3("Invalid cache_shards (1 to %d)", CACHE_SHARDS_MAX); valid = false; }
+  if(options->cache_refresh_budget &&
+     options->cache_refresh_ahead >= options->cache_ttl) { D3("Invalid cache_refresh_ahead (less than cache_ttl)"); valid = false; }
 
   if(!options->shell             ) { D3("Invalid shell");            valid = false; }
 
@@ -52,8 +88,14 @@ valid_options(void)
   if(!options->db_path           ) { D3("Invalid db_path");          valid = false; }
 
   if(!options->cega_creds        ) { D3("Invalid cega_creds");       valid = false; }
-  if(!options->cega_endpoint_username) { D3("Invalid cega_endpoint for usernames");    valid = false; }
-  if(!options->cega_endpoint_uid ) { D3("Invalid cega_endpoint for user ids");    valid = false; }
+  if(!options->cega_endpoint_username_count) { D3("Invalid cega_endpoint for usernames");    valid = false; }
+  if(!options->cega_endpoint_uid_count ) { D3("Invalid cega_endpoint for user ids");    valid = false; }
+  if(options->cega_hedge_percentile > 100) { D3("Invalid cega_hedge_percentile"); valid = false; }
+  if(options->cega_rate_limit > 1000000) { D3("Invalid cega_rate_limit"); valid = false; }
+  if(options->cega_rate_limit && !options->cega_rate_burst) { D3("Invalid cega_rate_burst"); valid = false; }
+  if(options->cega_max_response_size == 0) { D3("Invalid cega_max_response_size"); valid = false; }
+  if(options->cega_max_tokens < 7) { D3("Invalid cega_max_tokens");  valid = false; }
+  if(options->cega_timeout <= 0  ) { D3("Invalid cega_timeout");     valid = false; }
 
   if(options->verify_peer &&
      !options->cacertfile){ D3("Missing cacertfile, when using verify_peer"); valid = false; }
@@ -68,6 +110,9 @@ valid_options(void)
 }
 
 #define INJECT_OPTION(key,ckey,val,loc) do { if(!strcmp(key, ckey) && copy2buffer(val, loc, &buffer, &buflen) < 0 ){ return -1; } } while(0)
+#define APPEND_OPTION(key,ckey,val,arr,count) do { if(!strcmp(key, ckey)){                                   \
+                                                   if((count) >= ELEMENTSOF(arr)){ D1("Too many %s", ckey); break; } \
+                                                   if(copy2buffer(val, &(arr)[(count)++], &buffer, &buflen) < 0){ return -1; } } } while(0)
 #define COPYVAL(val,dest,b,blen) do { if( copy2buffer(val, dest, b, blen) < 0 ){ return -1; } } while(0)
 
 static inline int
@@ -83,6 +128,21 @@ readconfig(FILE* fp, char* buffer, size_t buflen)
   options->gid = -1;
   options->cache_ttl = CACHE_TTL;
   options->use_cache = true;
+  options->cache_write_behind = false;
+  options->cache_shards = 1;
+  options->cache_refresh_budget = 0;
+  options->cache_refresh_ahead = CACHE_REFRESH_AHEAD;
+  options->keys_dir = NULL;
+  options->cache_backend = NULL;
+
+  options->cega_max_response_size = CEGA_MAX_RESPONSE_SIZE;
+  options->cega_max_tokens = CEGA_MAX_TOKENS;
+  options->cega_timeout = CEGA_TIMEOUT;
+  options->cega_dns_pinning = true;
+  options->cega_unix_socket = NULL;
+  options->cega_rate_limit = 0;
+  options->cega_rate_burst = CEGA_RATE_BURST;
+  options->cega_rate_max_wait = CEGA_RATE_MAX_WAIT;
 
   options->sp_min = 0;
   options->sp_max = 0;
@@ -97,11 +157,12 @@ readconfig(FILE* fp, char* buffer, size_t buflen)
   options->certfile = NULL;
   options->keyfile = NULL;
 
-  COPYVAL(CFGFILE   , &(options->cfgfile), &buffer, &buflen );
+  COPYVAL(config_path(), &(options->cfgfile), &buffer, &buflen );
   COPYVAL(EGA_SHELL , &(options->shell)  , &buffer, &buflen );
 
-  options->cega_endpoint_username_len = 0;
-  options->cega_endpoint_uid_len = 0;
+  options->cega_endpoint_username_count = 0;
+  options->cega_endpoint_uid_count = 0;
+  options->cega_hedge_percentile = CEGA_HEDGE_PERCENTILE;
 
   /* Parse line by line */
   while (getline(&line, &len, fp) > 0) {
@@ -131,20 +192,70 @@ readconfig(FILE* fp, char* buffer, size_t buflen)
 	
     if(!strcmp(key, "ega_uid_shift" )) { if( !sscanf(val, "%u" , &(options->uid_shift) )) options->uid_shift = -1; }
     if(!strcmp(key, "cache_ttl"     )) { if( !sscanf(val, "%u" , &(options->cache_ttl) )) options->cache_ttl = -1; }
+    if(!strcmp(key, "cache_shards"  )) {
+      /* Indexes arrays of CACHE_SHARDS_MAX: checked here, as valid_options only runs in debug builds */
+      if( !sscanf(val, "%u" , &(options->cache_shards) ) || options->cache_shards < 1){
+	config_warning("%s: invalid cache_shards '%s', using 1", options->cfgfile, val);
+	options->cache_shards = 1;
+      } else if(options->cache_shards > CACHE_SHARDS_MAX){
+	config_warning("%s: cache_shards %u is more than %d, using %d", options->cfgfile, options->cache_shards, CACHE_SHARDS_MAX, CACHE_SHARDS_MAX);
+	options->cache_shards = CACHE_SHARDS_MAX;
+      }
+    }
+    if(!strcmp(key, "cache_refresh_budget")) { if( !sscanf(val, "%u" , &(options->cache_refresh_budget) )) options->cache_refresh_budget = 0; }
+    if(!strcmp(key, "cache_refresh_ahead" )) { if( !sscanf(val, "%u" , &(options->cache_refresh_ahead)  )) options->cache_refresh_ahead = CACHE_REFRESH_AHEAD; }
     if(!strcmp(key, "gid"           )) { if( !sscanf(val, "%u" , &(options->gid)   )) options->gid = -1; }
 
+    if(!strcmp(key, "cega_max_response_size")) {
+      if( !sscanf(val, "%zu" , &(options->cega_max_response_size) ) || options->cega_max_response_size == 0){
+	config_warning("%s: invalid cega_max_response_size '%s', using %d", options->cfgfile, val, CEGA_MAX_RESPONSE_SIZE);
+	options->cega_max_response_size = CEGA_MAX_RESPONSE_SIZE;
+      } else if(options->cega_max_response_size > CEGA_MAX_RESPONSE_SIZE_MAX){
+	config_warning("%s: cega_max_response_size %zu is more than %d, using %d", options->cfgfile, options->cega_max_response_size,
+		       CEGA_MAX_RESPONSE_SIZE_MAX, CEGA_MAX_RESPONSE_SIZE_MAX);
+	options->cega_max_response_size = CEGA_MAX_RESPONSE_SIZE_MAX;
+      }
+    }
+    if(!strcmp(key, "cega_max_tokens"       )) {
+      if( !sscanf(val, "%u"  , &(options->cega_max_tokens) ) || options->cega_max_tokens < 7){
+	config_warning("%s: invalid cega_max_tokens '%s', using %d", options->cfgfile, val, CEGA_MAX_TOKENS);
+	options->cega_max_tokens = CEGA_MAX_TOKENS;
+      }
+    }
+    if(!strcmp(key, "cega_timeout"          )) {
+      if( !sscanf(val, "%ld" , &(options->cega_timeout) ) || options->cega_timeout <= 0){
+	config_warning("%s: invalid cega_timeout '%s', using %d", options->cfgfile, val, CEGA_TIMEOUT);
+	options->cega_timeout = CEGA_TIMEOUT;
+      }
+    }
+    if(!strcmp(key, "cega_hedge_percentile" )) { if( !sscanf(val, "%u"  , &(options->cega_hedge_percentile)  )) options->cega_hedge_percentile = CEGA_HEDGE_PERCENTILE; }
+    if(!strcmp(key, "cega_rate_limit"       )) { if( !sscanf(val, "%u"  , &(options->cega_rate_limit)        )) options->cega_rate_limit = 0; }
+    if(!strcmp(key, "cega_rate_burst"       )) { if( !sscanf(val, "%u"  , &(options->cega_rate_burst)        )) options->cega_rate_burst = CEGA_RATE_BURST; }
+    if(!strcmp(key, "cega_rate_max_wait"    )) { if( !sscanf(val, "%u"  , &(options->cega_rate_max_wait)     )) options->cega_rate_max_wait = CEGA_RATE_MAX_WAIT; }
+
     if(!strcmp(key, "shadow_min"       )) { if( !sscanf(val, "%ld" , &(options->sp_min)   )) options->sp_min = 0; }
     if(!strcmp(key, "shadow_max"       )) { if( !sscanf(val, "%ld" , &(options->sp_max)   )) options->sp_max = 0; }
     if(!strcmp(key, "shadow_warn"       )) { if( !sscanf(val, "%ld" , &(options->sp_warn)   )) options->sp_warn = -1l; }
     if(!strcmp(key, "shadow_inact"       )) { if( !sscanf(val, "%ld" , &(options->sp_inact)   )) options->sp_inact = -1l; }
     if(!strcmp(key, "shadow_expire"       )) { if( !sscanf(val, "%ld" , &(options->sp_expire)   )) options->sp_expire = -1l; }
    
+    if(!strcmp(key, "cache_backend")) {
+      /* cache_open would find no backend, and run without the cache: checked here, as REPORT compiles away */
+      if(val && (!strcmp(val, "sqlite")
+#ifdef HAS_LMDB
+		 || !strcmp(val, "lmdb")
+#endif
+		 )) INJECT_OPTION(key, "cache_backend", val, &(options->cache_backend));
+      else config_warning("%s: unknown cache_backend '%s' (not compiled in?), using sqlite", options->cfgfile, (val)?val:"");
+    }
     INJECT_OPTION(key, "db_path"           , val, &(options->db_path)          );
     INJECT_OPTION(key, "homedir_prefix"    , val, &(options->homedir_prefix)   );
+    INJECT_OPTION(key, "authorized_keys_dir", val, &(options->keys_dir)        );
     INJECT_OPTION(key, "shell"             , val, &(options->shell)            );
-    INJECT_OPTION(key, "cega_endpoint_username", val, &(options->cega_endpoint_username));
-    INJECT_OPTION(key, "cega_endpoint_uid" , val, &(options->cega_endpoint_uid));
+    APPEND_OPTION(key, "cega_endpoint_username", val, options->cega_endpoint_username, options->cega_endpoint_username_count);
+    APPEND_OPTION(key, "cega_endpoint_uid"     , val, options->cega_endpoint_uid     , options->cega_endpoint_uid_count     );
     INJECT_OPTION(key, "cega_creds"        , val, &(options->cega_creds)       );
+    INJECT_OPTION(key, "cega_unix_socket"  , val, &(options->cega_unix_socket) );
     INJECT_OPTION(key, "cacertfile"        , val, &(options->cacertfile)       );
     INJECT_OPTION(key, "certfile"          , val, &(options->certfile)         );
     INJECT_OPTION(key, "keyfile"           , val, &(options->keyfile)          );
@@ -153,16 +264,15 @@ readconfig(FILE* fp, char* buffer, size_t buflen)
     set_yes_no_option(key, val, "verify_peer", &(options->verify_peer));
     set_yes_no_option(key, val, "verify_hostname", &(options->verify_hostname));
     set_yes_no_option(key, val, "use_cache", &(options->use_cache));
+    set_yes_no_option(key, val, "cache_write_behind", &(options->cache_write_behind));
+    set_yes_no_option(key, val, "cega_dns_pinning", &(options->cega_dns_pinning));
   }
 
   D3("verify_peer: %s", ((options->verify_peer)?"yes":"no"));
   D3("verify_hostname: %s", ((options->verify_hostname)?"yes":"no"));
   D3("use_cache: %s", ((options->use_cache)?"yes":"no"));
-
-  if(options->cega_endpoint_username)
-    options->cega_endpoint_username_len = strlen(options->cega_endpoint_username) - 1; /* count away %u, add \0 */
-  if(options->cega_endpoint_uid)
-    options->cega_endpoint_uid_len = strlen(options->cega_endpoint_uid) - 1; /* count away %u, add \0 */
+  D3("cache_write_behind: %s", ((options->cache_write_behind)?"yes":"no"));
+  D3("cega_dns_pinning: %s", ((options->cega_dns_pinning)?"yes":"no"));
 
   if(line) free(line);
 
@@ -174,12 +284,13 @@ loadconfig(void)
 {
   if(options){ D3("Config already loaded [@ %p]", options); return true; }
 
-  D1("Loading configuration %s", CFGFILE);
+  const char* cfgfile = config_path();
+  D1("Loading configuration %s", cfgfile);
   FILE* fp = NULL;
   size_t size = 1024;
 
   /* read or re-read */
-  fp = fopen(CFGFILE, "r");
+  fp = fopen(cfgfile, "r");
   if (fp == NULL || errno == EACCES) { D2("Error accessing the config file: %s", strerror(errno)); goto fail; }
 
   options = (options_t*)malloc(sizeof(options_t));
@@ -187,7 +298,7 @@ loadconfig(void)
   options->buffer = NULL;
 
   struct stat info;
-  stat(CFGFILE, &info);
+  stat(cfgfile, &info);
   options->shadow_gid = info.st_gid;
   D1("Config file gid: %u", options->shadow_gid);
 
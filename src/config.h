@@ -5,6 +5,10 @@
 #include <stdbool.h>
 #include <sys/types.h> 
 
+#define CEGA_ENDPOINTS_MAX 8
+#define CACHE_SHARDS_MAX 64
+#define CEGA_MAX_RESPONSE_SIZE_MAX (1 << 30) /* the response buffer holds max + 1 bytes */
+
 struct options_s {
   char* cfgfile;
   char* buffer;
@@ -26,19 +30,38 @@ struct options_s {
 
   /* Cache */
   bool use_cache;           /* use it / bypass it */
+  char* cache_backend;     /* sqlite (default) | lmdb, when compiled in */
   char* db_path;           /* db file path */
   unsigned int cache_ttl;  /* How long a cache entry is valid (in seconds) */
+  bool cache_write_behind; /* hand the inserts to ega_cache_writer, through the journal */
+  unsigned int cache_shards; /* db files, split by username (db_path, db_path.1, ...) */
+  unsigned int cache_refresh_budget; /* CentralEGA requests per minute, for ega_cache_refresher | 0 to disable */
+  unsigned int cache_refresh_ahead;  /* seconds before they expire, the hot entries are fetched again */
+  char* keys_dir;          /* ega_ssh_keys leaves authorized_keys files there, for sshd | NULL to disable */
 
 
   /* Contacting Central EGA (via a REST call) */
-  char* cega_endpoint_username; /* string format with one %s, replaced by username | returns a triplet in JSON format */
-  size_t cega_endpoint_username_len; /* its length, -2 (for %s) */
+  /* Several replicas: one line per endpoint in the config file */
+  char* cega_endpoint_username[CEGA_ENDPOINTS_MAX]; /* string format with one %s, replaced by username | returns a triplet in JSON format */
+  unsigned int cega_endpoint_username_count;
+
+  char* cega_endpoint_uid[CEGA_ENDPOINTS_MAX];      /* string format with one %u, replaced by uid      | idem */
+  unsigned int cega_endpoint_uid_count;
 
-  char* cega_endpoint_uid;      /* string format with one %s, replaced by uid      | idem */
-  size_t cega_endpoint_uid_len; /* its length, -2 (for %s) */
+  unsigned int cega_hedge_percentile; /* hedge when no answer after that percentile of the response times | 0 to disable */
 
   char* cega_creds;        /* for authentication: user:password */
 
+  size_t cega_max_response_size; /* responses larger than that are dropped (in bytes) */
+  unsigned int cega_max_tokens;  /* JSON responses with more tokens are dropped */
+  long int cega_timeout;         /* for the whole request (in seconds) */
+  bool cega_dns_pinning;         /* share the resolved CentralEGA addresses, via the cache */
+  char* cega_unix_socket;        /* send the requests through that unix socket (eg to a local proxy) */
+
+  unsigned int cega_rate_limit;    /* requests per second to CentralEGA, for the whole node | 0 for no limit */
+  unsigned int cega_rate_burst;    /* requests allowed in a burst */
+  unsigned int cega_rate_max_wait; /* how long a request may queue when throttled (in ms) | 0 to fail fast */
+
   char* cacertfile;        /* path to the Root certificate to contact Central EGA */
   char* certfile;          /* For client verification */
   char* keyfile;
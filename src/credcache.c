@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "utils.h"
+#include "shm.h"
+#include "sha2.h"
+#include "credcache.h"
+
+/*
+ * Cache of successful password verifications, for clients which reconnect
+ * many times a minute with the same password (sftp, aspera).
+ *
+ * Nothing in the (root-only) region is the password or derived from it without a secret:
+ * an entry holds HMAC(secret, user, password hash, password), the secret being drawn
+ * when the region is created, ie once per boot.
+ * Since the password hash is part of the MAC, a password change
+ * (or a different hash for the same password) never matches an old entry.
+ *
+ * One entry per user, found from a keyed hash of the name, and overwritten at
+ * every successful verification. Entries expire <ttl> seconds after they were stored,
+ * hits do not extend them.
+ *
+ * Entries are written under a per-entry sequence lock: odd while being written.
+ * Writers give up if another one holds it, readers skip it: the cache is only a shortcut.
+ */
+#define CREDCACHE_SHM_NAME "/ega-credcache.v1"
+#define CREDCACHE_ENTRIES 4096
+#define CREDCACHE_PROBES  4
+
+struct credcache_entry {
+  uint32_t seq;
+  uint32_t pad;
+  uint64_t user;     /* keyed hash of the username, 0 when free */
+  uint64_t expires;  /* ms, boot time */
+  uint64_t tag[SHA256_DIGEST_LENGTH / 8];
+};
+
+struct credcache_s {
+  uint8_t secret[32];
+  struct credcache_entry entries[CREDCACHE_ENTRIES];
+};
+
+static struct credcache_s *credcache = NULL;
+
+static inline uint64_t
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts); /* keeps counting during suspend */
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void
+credcache_init(void* region)
+{
+  struct credcache_s *c = (struct credcache_s*)region;
+  if(getrandom(c->secret, sizeof(c->secret), 0) != sizeof(c->secret)){
+    D1("Could not draw the credential cache secret: %s", strerror(errno));
+    memset(c->secret, 0, sizeof(c->secret)); /* see credcache_attach */
+  }
+}
+
+static bool
+credcache_attach(void)
+{
+  if(!__atomic_load_n(&credcache, __ATOMIC_ACQUIRE)){
+    struct credcache_s *region = shm_attach(CREDCACHE_SHM_NAME, sizeof(struct credcache_s), 0600, credcache_init);
+    struct credcache_s *expected = NULL;
+    if(region){
+      /* A region without a secret is useless */
+      uint8_t zeros[sizeof(region->secret)] = { 0 };
+      if(!memcmp(region->secret, zeros, sizeof(zeros))){
+	D1("No secret in the credential cache: ignoring it");
+	shm_detach(region, sizeof(struct credcache_s));
+	return false;
+      }
+    }
+    if(region && !__atomic_compare_exchange_n(&credcache, &expected, region, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      shm_detach(region, sizeof(struct credcache_s)); /* another thread was faster */
+  }
+  if(!credcache) D2("No credential cache");
+  return credcache != NULL;
+}
+
+/* Keyed hash of the username, never 0 */
+static uint64_t
+user_key(const char* user)
+{
+  struct hmac_sha256_ctx ctx;
+  uint8_t mac[SHA256_DIGEST_LENGTH];
+  uint64_t key;
+
+  hmac_sha256_init(&ctx, credcache->secret, sizeof(credcache->secret));
+  hmac_sha256_update(&ctx, "u", 2);
+  hmac_sha256_update(&ctx, user, strlen(user));
+  hmac_sha256_final(&ctx, mac);
+  memcpy(&key, mac, sizeof(key));
+  return (key)?key:1;
+}
+
+static void
+credential_tag(const char* user, const char* pwdh, const char* password, uint64_t tag[SHA256_DIGEST_LENGTH / 8])
+{
+  struct hmac_sha256_ctx ctx;
+
+  hmac_sha256_init(&ctx, credcache->secret, sizeof(credcache->secret));
+  hmac_sha256_update(&ctx, "c", 2);
+  hmac_sha256_update(&ctx, user, strlen(user) + 1);
+  hmac_sha256_update(&ctx, pwdh, strlen(pwdh) + 1);
+  hmac_sha256_update(&ctx, password, strlen(password));
+  hmac_sha256_final(&ctx, (uint8_t*)tag);
+}
+
+bool
+credcache_check(unsigned int ttl, const char* user, const char* pwdh, const char* password)
+{
+  uint64_t tag[SHA256_DIGEST_LENGTH / 8], seen[SHA256_DIGEST_LENGTH / 8];
+  unsigned int i, j;
+  bool hit = false;
+
+  if(!ttl || !user || !pwdh || !password || !credcache_attach()) return false;
+  if(ttl > CREDCACHE_TTL_MAX) ttl = CREDCACHE_TTL_MAX;
+
+  uint64_t key = user_key(user), now = now_ms();
+
+  for(i = 0; i < CREDCACHE_PROBES && !hit; i++){
+    struct credcache_entry *e = &credcache->entries[(key + i) % CREDCACHE_ENTRIES];
+
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if(seq & 1) continue;
+    if(__atomic_load_n(&e->user, __ATOMIC_RELAXED) != key) continue;
+    uint64_t expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+    for(j = 0; j < ELEMENTSOF(seen); j++) seen[j] = __atomic_load_n(&e->tag[j], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue; /* torn */
+
+    if(now >= expires || expires - now > ttl * 1000ULL) break; /* the user's entry, but stale (or stored with a longer ttl) */
+
+    credential_tag(user, pwdh, password, tag);
+    uint64_t diff = 0;
+    for(j = 0; j < ELEMENTSOF(tag); j++) diff |= tag[j] ^ seen[j];
+    hit = (diff == 0);
+    break;
+  }
+
+  explicit_bzero(tag, sizeof(tag));
+  D2("Credential cache %s for %s", (hit)?"hit":"miss", user);
+  return hit;
+}
+
+void
+credcache_store(unsigned int ttl, const char* user, const char* pwdh, const char* password)
+{
+  struct credcache_entry *victim = NULL;
+  uint64_t victim_expires = UINT64_MAX;
+  uint64_t tag[SHA256_DIGEST_LENGTH / 8];
+  unsigned int i, j;
+
+  if(!ttl || !user || !pwdh || !password || !credcache_attach()) return;
+  if(ttl > CREDCACHE_TTL_MAX) ttl = CREDCACHE_TTL_MAX;
+
+  uint64_t key = user_key(user), now = now_ms();
+
+  /* The user's own entry, else the one expiring first */
+  for(i = 0; i < CREDCACHE_PROBES; i++){
+    struct credcache_entry *e = &credcache->entries[(key + i) % CREDCACHE_ENTRIES];
+    if(__atomic_load_n(&e->user, __ATOMIC_RELAXED) == key){ victim = e; break; }
+    uint64_t expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+    if(expires < victim_expires){ victim = e; victim_expires = expires; }
+  }
+
+  credential_tag(user, pwdh, password, tag);
+
+  uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+  if((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+    D2("Credential cache entry busy: not storing");
+    explicit_bzero(tag, sizeof(tag));
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  __atomic_store_n(&victim->user, key, __ATOMIC_RELAXED);
+  __atomic_store_n(&victim->expires, now + ttl * 1000ULL, __ATOMIC_RELAXED);
+  for(j = 0; j < ELEMENTSOF(tag); j++) __atomic_store_n(&victim->tag[j], tag[j], __ATOMIC_RELAXED);
+
+  __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+  explicit_bzero(tag, sizeof(tag));
+  D2("Credential cached for %s, for %u seconds", user, ttl);
+}
@@ -0,0 +1,18 @@
+#ifndef __FEGA_CREDCACHE_H_INCLUDED__
+#define __FEGA_CREDCACHE_H_INCLUDED__
+
+#include <stdbool.h>
+
+#define CREDCACHE_TTL_MAX 600 /* seconds */
+
+/*
+ * Short-lived cache of successful password verifications, shared by the node.
+ *
+ * An entry only proves that <password> matched <pwdh> for <user> less than <ttl> seconds ago.
+ * A new password hash (any change of sp_pwdp) makes the entry useless.
+ * <ttl> 0 disables the cache, and it is clamped to CREDCACHE_TTL_MAX.
+ */
+bool credcache_check(unsigned int ttl, const char* user, const char* pwdh, const char* password);
+void credcache_store(unsigned int ttl, const char* user, const char* pwdh, const char* password);
+
+#endif /* !__FEGA_CREDCACHE_H_INCLUDED__ */
@@ -0,0 +1,112 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "utils.h"
+#include "dns.h"
+
+/*
+ * Returns the smallest TTL of the answer section of a DNS answer
+ * (CNAME records count too),
+ *         -1 on error
+ */
+static int
+dns_parse_ttl(const unsigned char* answer, int len)
+{
+  ns_msg msg;
+  ns_rr rr;
+  int i, count, ttl = -1;
+
+  if(ns_initparse(answer, len, &msg) < 0){ D2("Invalid DNS answer"); return -1; }
+
+  count = ns_msg_count(msg, ns_s_an);
+  for(i = 0; i < count; i++){
+    if(ns_parserr(&msg, ns_s_an, i, &rr) < 0){ D2("Invalid DNS record %d", i); return -1; }
+    if(ttl < 0 || (int)ns_rr_ttl(rr) < ttl) ttl = (int)ns_rr_ttl(rr);
+  }
+  return ttl;
+}
+
+/*
+ * Asks DNS directly for the A and AAAA records of host, only for their TTL.
+ *
+ * Returns the smallest TTL, -1 when host is not in DNS
+ */
+static int
+dns_ttl(const char* host)
+{
+  struct __res_state rs; /* on the stack: thread-safe */
+  unsigned char answer[NS_PACKETSZ * 4];
+  int i, len, ttl = -1, types[2] = { ns_t_a, ns_t_aaaa };
+
+  memset(&rs, 0, sizeof(rs));
+  if(res_ninit(&rs)){ D2("Could not initialize the resolver"); return -1; }
+
+  for(i = 0; i < 2; i++){
+    len = res_nsearch(&rs, host, ns_c_in, types[i], answer, sizeof(answer));
+    if(len <= 0) continue;
+    int t = dns_parse_ttl(answer, len);
+    if(t >= 0 && (ttl < 0 || t < ttl)) ttl = t;
+  }
+
+  res_nclose(&rs);
+  return ttl;
+}
+
+/*
+ * Resolves host as cURL would, with getaddrinfo, so /etc/hosts and the hosts:
+ * line of nsswitch.conf apply. The addresses are written comma-separated into buffer,
+ * IPv6 ones in brackets, as cURL expects them in CURLOPT_RESOLVE.
+ * The TTL comes from DNS: getaddrinfo does not tell it.
+ *
+ * Returns the smallest TTL of the DNS answers,
+ *         -1 on failure, including when the host is not in DNS (for example only in /etc/hosts),
+ *            in which case cURL resolves it as usual
+ */
+int
+dns_resolve(const char* host, char* buffer, size_t buflen)
+{
+  struct addrinfo hints, *res = NULL, *ai;
+  char addr[INET6_ADDRSTRLEN + 3]; /* [ ] and , */
+  char* p = buffer;
+  int rc, ttl;
+
+  if(buflen == 0) return -1;
+  *buffer = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM; /* one entry per address */
+  if((rc = getaddrinfo(host, NULL, &hints, &res))){ D2("Could not resolve %s: %s", host, gai_strerror(rc)); return -1; }
+
+  for(ai = res; ai; ai = ai->ai_next){
+    char* q = addr;
+    if(ai->ai_family == AF_INET){
+      if(!inet_ntop(AF_INET, &((struct sockaddr_in*)ai->ai_addr)->sin_addr, q, INET6_ADDRSTRLEN)) continue;
+    } else if(ai->ai_family == AF_INET6){
+      *q++ = '[';
+      if(!inet_ntop(AF_INET6, &((struct sockaddr_in6*)ai->ai_addr)->sin6_addr, q, INET6_ADDRSTRLEN)) continue;
+      strcat(q, "]");
+    } else continue;
+
+    size_t alen = strlen(addr);
+    if(buflen < alen + 2){ D2("Buffer too small for the addresses of %s", host); freeaddrinfo(res); return -1; }
+    p = stpcpy(p, addr);
+    p = stpcpy(p, ",");
+    buflen -= alen + 1;
+  }
+  freeaddrinfo(res);
+
+  if(p == buffer){ D2("No address for %s", host); return -1; }
+  *(p - 1) = '\0'; /* remove the trailing comma */
+
+  ttl = dns_ttl(host);
+  if(ttl < 0){ D2("No DNS record for %s", host); *buffer = '\0'; return -1; }
+
+  D2("%s resolved to %s [TTL: %ds]", host, buffer, ttl);
+  return ttl;
+}
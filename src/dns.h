@@ -0,0 +1,8 @@
+#ifndef __FEGA_DNS_H_INCLUDED__
+#define __FEGA_DNS_H_INCLUDED__
+
+#include <stddef.h>
+
+int dns_resolve(const char* host, char* buffer, size_t buflen);
+
+#endif /* !__FEGA_DNS_H_INCLUDED__ */
@@ -0,0 +1,179 @@
+/*
+ * Fetches again, before they expire, the cache entries of the users looked up the most
+ * (see hotset.h), so that they never miss. For cache_refresh_budget > 0.
+ *
+ * Runs in the foreground, as root (eg as a systemd service), one per node.
+ * Every second, it picks the entries expiring within cache_refresh_ahead seconds
+ * which had at least REFRESH_MIN_HITS hits since they were fetched, the most hits first,
+ * and fetches as many as the budget (cache_refresh_budget requests per minute) allows.
+ * The others are left to expire. Its requests count as stale-able for the node-wide
+ * CentralEGA rate limit: they never wait, and leave half the burst to the lookups.
+ * They show under the "refresh" source in ega_stats.
+ *
+ * On SIGTERM or SIGINT, it exits.
+ *
+ * Usage: ega_cache_refresher
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "cega.h"
+#include "stats.h"
+#include "hotset.h"
+
+#define REFRESH_TICK 1000   /* ms */
+#define REFRESH_MIN_HITS 2  /* since fetched: once is a cold entry */
+
+struct candidate {
+  struct hotset_entry *e;
+  uint32_t hits;
+  int64_t expires;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+on_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+/* Most hits first, then the earliest to expire */
+static int
+by_hits(const void *a, const void *b)
+{
+  const struct candidate *x = a, *y = b;
+  if(x->hits != y->hits) return (x->hits < y->hits)?1:-1;
+  return (x->expires > y->expires) - (x->expires < y->expires);
+}
+
+/* The username, if the entry still holds the one it was claimed for */
+static bool
+read_name(struct hotset_entry *e, uint32_t hash, char name[HOTSET_NAME_MAX])
+{
+  memcpy(name, e->username, HOTSET_NAME_MAX);
+  name[HOTSET_NAME_MAX - 1] = '\0';
+  return __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE) == hash && hotset_hash(name) == hash;
+}
+
+/* 0: refreshed, 1: not an EGA user anymore, CEGA_FAILED, CEGA_THROTTLED, -1 on cache errors, 2 when recycled */
+static int
+refresh(struct hotset_entry *e)
+{
+  uint32_t hash = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+  char username[HOTSET_NAME_MAX];
+  time_t expires = 0;
+
+  if(!hash || !read_name(e, hash, username)) return 2; /* recycled meanwhile: no request */
+
+  int store(struct fega_user *user){
+    if(strcmp(username, user->username)){ D1("Requested username %s not matching username response %s", username, user->username); return 1; }
+    expires = time(NULL) + options->cache_ttl;
+    user->expires = expires;
+    return (cache_add_user(user))?-1:0;
+  }
+
+  int rc = cega_resolve_username(username, true, store);
+  if(rc == 0){
+    /* Counted again from now on, unless recycled meanwhile */
+    if(__atomic_load_n(&e->hash, __ATOMIC_ACQUIRE) == hash){
+      __atomic_store_n(&e->hits, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&e->expires, (int64_t)expires, __ATOMIC_RELEASE);
+    }
+  } else if(rc == 1){
+    __atomic_store_n(&e->hits, 0, __ATOMIC_RELAXED); /* tried again only if it gets hits again, else left to expire */
+  }
+  D1("Refreshing %s: %d", username, rc);
+  return rc;
+}
+
+int
+main(int argc, char** argv)
+{
+  static struct candidate candidates[HOTSET_ENTRIES];
+  unsigned long refreshed = 0, missed = 0, failed = 0, throttled = 0;
+  struct timespec tick = { REFRESH_TICK / 1000, (REFRESH_TICK % 1000) * 1000000L };
+  double tokens = 0.0;
+  unsigned int i;
+
+  if(argc > 1){ fprintf(stderr, "Usage: %s\n", argv[0]); return 2; }
+  if(!loadconfig()){ fprintf(stderr, "Invalid configuration\n"); return 1; }
+  if(!options->cache_refresh_budget){ fprintf(stderr, "cache_refresh_budget is 0 in %s: nothing to do\n", options->cfgfile); return 1; }
+  if(!options->use_cache || !cache_open()){ fprintf(stderr, "No cache to refresh\n"); return 1; }
+
+  struct hotset_region *h = hotset_open();
+  if(!h){ fprintf(stderr, "Could not open the access counts %s (root only)\n", HOTSET_SHM_NAME); return 1; }
+
+  /* One refresher per node, or they share the budget twice */
+  pid_t other = __atomic_load_n(&h->refresher, __ATOMIC_ACQUIRE);
+  if(other && other != getpid() && !(kill(other, 0) && errno == ESRCH)){
+    fprintf(stderr, "Another refresher is running (pid %d)\n", (int)other);
+    return 1;
+  }
+  __atomic_store_n(&h->refresher, getpid(), __ATOMIC_RELEASE);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal; /* no SA_RESTART: wakes nanosleep */
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  stats_set_source(STATS_REFRESH);
+  fprintf(stderr, "Refreshing %s, %u seconds ahead, %u requests per minute at most\n",
+	  options->db_path, options->cache_refresh_ahead, options->cache_refresh_budget);
+
+  while(!stop){
+    int64_t now = time(NULL);
+    unsigned int n = 0;
+
+    /* At most a minute worth of budget, saved up */
+    tokens += options->cache_refresh_budget * (REFRESH_TICK / 60000.0);
+    if(tokens > options->cache_refresh_budget) tokens = options->cache_refresh_budget;
+
+    for(i = 0; i < HOTSET_ENTRIES; i++){
+      struct hotset_entry *e = &h->entries[i];
+      uint32_t hash = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+      int64_t expires = __atomic_load_n(&e->expires, __ATOMIC_ACQUIRE);
+      uint32_t hits = __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+      if(!hash || !expires) continue;
+      if(expires <= now){
+	/* Expired, and not fetched again: cold. Frees the entry */
+	__atomic_compare_exchange_n(&e->hash, &hash, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	continue;
+      }
+      if(expires - now > options->cache_refresh_ahead || hits < REFRESH_MIN_HITS) continue;
+      candidates[n].e = e;
+      candidates[n].hits = hits;
+      candidates[n].expires = expires;
+      n++;
+    }
+    qsort(candidates, n, sizeof(struct candidate), by_hits);
+
+    for(i = 0; i < n && !stop; i++){
+      if(tokens < 1.0) break; /* the next ones, next time, if they have not expired */
+      int rc = refresh(candidates[i].e);
+      if(rc == 2) continue;
+      if(rc == CEGA_THROTTLED){ throttled++; break; } /* the lookups need the room */
+      tokens -= 1.0;
+      if(rc == 0) refreshed++;
+      else if(rc == 1 || rc == CEGA_FAILED) missed++; /* failed: tried again next time, if still expiring */
+      else failed++;
+    }
+
+    if(!stop) nanosleep(&tick, NULL);
+  }
+
+  __atomic_store_n(&h->refresher, 0, __ATOMIC_RELEASE);
+  fprintf(stderr, "%lu users refreshed, %lu not found (or no answer), %lu not stored, %lu passes throttled\n",
+	  refreshed, missed, failed, throttled);
+  return 0;
+}
@@ -0,0 +1,437 @@
+/*
+ * Saves the cache to a snapshot, and restores it, so that a node does not start
+ * with an empty cache (db_path is usually on a tmpfs) after a reboot, or when it is new.
+ *
+ * export: copies the SQLite shards with the online backup API, a few pages at a time,
+ *         so that the lookups and the writers go on meanwhile. Only the entries which
+ *         have not expired go in the snapshot: a small SQLite file, without the DNS
+ *         entries, prefixed with a line holding its size and its SHA256.
+ *         The file is written next to the destination, synced, then renamed.
+ * import: checks the size, the SHA256 and the SQLite file, before anything is written,
+ *         and adds the users to the cache, in small transactions (any backend).
+ *         An entry keeps the lifetime it had left at the export, from the import on
+ *         (at most cache_ttl). Users with a fresh entry in the cache are left alone.
+ *
+ * Usage: ega_cache_snapshot export <file|->
+ *        ega_cache_snapshot import [-a max_age] <file|->
+ *
+ *   -a  refuses snapshots older than max_age seconds (default: cache_ttl)
+ *
+ * For example, at boot, before sshd: ega_cache_snapshot import /var/lib/ega/cache.snapshot
+ * and from cron, or at shutdown:     ega_cache_snapshot export /var/lib/ega/cache.snapshot
+ * or to a peer: ega_cache_snapshot export - | ssh peer ega_cache_snapshot import -
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "sha2.h"
+
+#define SNAPSHOT_MAGIC "EGA-CACHE-SNAPSHOT"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BACKUP_PAGES 1024 /* per step of the backup, between which the writers get in */
+#define SNAPSHOT_BACKUP_PAUSE 5    /* ms */
+#define SNAPSHOT_BATCH 256         /* users per transaction, at the import */
+
+static const char* snapshot_schema =
+  "CREATE TABLE IF NOT EXISTS snap.users ("
+  "  username TEXT PRIMARY KEY,"
+  "  uid      INTEGER,"
+  "  pwdh     BLOB,"
+  "  last_changed INTEGER,"
+  "  gecos    TEXT,"
+  "  expires  INTEGER"
+  ") WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS snap.keys ("
+  "  username TEXT NOT NULL,"
+  "  pubkey   TEXT NOT NULL,"
+  "  PRIMARY KEY (username, pubkey)"
+  ") WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS snap.snapshot (created INTEGER NOT NULL);";
+
+static void
+usage(const char* prog)
+{
+  fprintf(stderr, "Usage: %s export <file|->\n"
+	          "       %s import [-a max_age] <file|->\n", prog, prog);
+}
+
+static char*
+temp_file(void)
+{
+  const char* dir = getenv("TMPDIR");
+  char* path = malloc(PATH_MAX);
+  if(!path) return NULL;
+  if(snprintf(path, PATH_MAX, "%s/ega-snapshot.XXXXXX", (dir && *dir)?dir:"/tmp") >= PATH_MAX){ free(path); return NULL; }
+  int fd = mkstemp(path); /* 0600 */
+  if(fd < 0){ perror(path); free(path); return NULL; }
+  close(fd);
+  return path;
+}
+
+/*
+ * The online backup, in steps: a writer in between restarts it, so we give up
+ * on the steps after a while, and copy the rest at once (the writers wait for it).
+ */
+static bool
+backup(sqlite3* src, sqlite3* copy)
+{
+  sqlite3_backup* b = sqlite3_backup_init(copy, "main", src, "main");
+  unsigned int steps = 0, max_steps = 0;
+  int rc;
+
+  if(!b){ fprintf(stderr, "Backup error: %s\n", sqlite3_errmsg(copy)); return false; }
+  do {
+    rc = sqlite3_backup_step(b, (max_steps && steps > max_steps)?-1:SNAPSHOT_BACKUP_PAGES);
+    if(!max_steps) max_steps = 16 * (sqlite3_backup_pagecount(b) / SNAPSHOT_BACKUP_PAGES + 1);
+    steps++;
+    if(rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) sqlite3_sleep(SNAPSHOT_BACKUP_PAUSE);
+  } while(rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+  sqlite3_backup_finish(b);
+
+  if(rc != SQLITE_DONE){ fprintf(stderr, "Backup error: %s\n", sqlite3_errstr(rc)); return false; }
+  return true;
+}
+
+/* One shard: copied in memory, and its fresh entries appended to the snapshot */
+static int
+export_shard(unsigned int shard, const char* snapfile, time_t now)
+{
+  sqlite3 *src = NULL, *copy = NULL;
+  char path[PATH_MAX], sql[512];
+  int count = -1;
+
+  if(shard == 0) snprintf(path, sizeof(path), "%s", options->db_path);
+  else if(snprintf(path, sizeof(path), "%s.%u", options->db_path, shard) >= (int)sizeof(path)) return -1;
+
+  if(sqlite3_open_v2(path, &src, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK){
+    D1("No shard %s: %s", path, sqlite3_errmsg(src));
+    sqlite3_close(src);
+    return 0; /* never used */
+  }
+  sqlite3_busy_timeout(src, 2000);
+
+  if(sqlite3_open(":memory:", &copy) != SQLITE_OK || !backup(src, copy)) goto BAILOUT;
+  sqlite3_close(src); src = NULL;
+
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_prepare_v2(copy, "ATTACH ?1 AS snap;", -1, &stmt, NULL);
+  if(!stmt) goto BAILOUT;
+  sqlite3_bind_text(stmt, 1, snapfile, -1, SQLITE_STATIC);
+  int rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if(rc != SQLITE_DONE) goto BAILOUT;
+
+  snprintf(sql, sizeof(sql),
+	   "BEGIN;"
+	   "INSERT OR REPLACE INTO snap.users SELECT username, uid, pwdh, last_changed, gecos, CAST(expires AS INTEGER)"
+	   "  FROM main.users WHERE expires > %ld;"
+	   "INSERT OR IGNORE INTO snap.keys SELECT DISTINCT username, pubkey"
+	   "  FROM main.users INNER JOIN main.keys ON keys.uid = users.uid WHERE expires > %ld;"
+	   "COMMIT;", (long)now, (long)now);
+  if(sqlite3_exec(copy, snapshot_schema, NULL, NULL, NULL) != SQLITE_OK ||
+     sqlite3_exec(copy, sql, NULL, NULL, NULL) != SQLITE_OK) goto BAILOUT;
+  count = 0;
+
+  sqlite3_prepare_v2(copy, "SELECT count(*) FROM main.users WHERE expires > ?1;", -1, &stmt, NULL);
+  if(stmt){
+    sqlite3_bind_int64(stmt, 1, now);
+    if(sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+  D1("%d users from %s", count, path);
+
+BAILOUT:
+  if(count < 0) fprintf(stderr, "Could not export %s: %s\n", path, sqlite3_errmsg((copy)?copy:src));
+  sqlite3_close(src);
+  sqlite3_close(copy);
+  return count;
+}
+
+/* The header, then the SQLite file */
+static bool
+write_snapshot(const char* snapfile, FILE* out)
+{
+  struct sha256_ctx ctx;
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  char buf[65536];
+  struct stat st;
+  size_t n;
+  unsigned int i;
+
+  FILE* in = fopen(snapfile, "r");
+  if(!in || fstat(fileno(in), &st)){ perror(snapfile); if(in) fclose(in); return false; }
+
+  sha256_init(&ctx);
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0) sha256_update(&ctx, buf, n);
+  sha256_final(&ctx, digest);
+
+  fprintf(out, "%s %d %lu ", SNAPSHOT_MAGIC, SNAPSHOT_VERSION, (unsigned long)st.st_size);
+  for(i = 0; i < SHA256_DIGEST_LENGTH; i++) fprintf(out, "%02x", digest[i]);
+  fputc('\n', out);
+
+  rewind(in);
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    if(fwrite(buf, 1, n, out) != n) break;
+  bool ok = !ferror(in) && !ferror(out);
+  fclose(in);
+  return ok;
+}
+
+static int
+export(const char* dest)
+{
+  time_t now = time(NULL);
+  unsigned int shard;
+  int users = 0, rc = 1;
+  char *snapfile = NULL, tmp[PATH_MAX] = "";
+  FILE* out = NULL;
+
+  if(strcmp(cache_backend_name(), "sqlite")){ fprintf(stderr, "Only the sqlite backend can be exported\n"); return 1; }
+  if(!(snapfile = temp_file())) return 1;
+
+  for(shard = 0; shard < options->cache_shards; shard++){
+    int count = export_shard(shard, snapfile, now);
+    if(count < 0) goto BAILOUT;
+    users += count;
+  }
+
+  /* The time the lifetimes are counted from, then compacted */
+  sqlite3* db = NULL;
+  sqlite3_stmt* stmt = NULL;
+  char sql[128];
+  snprintf(sql, sizeof(sql), "INSERT INTO snap.snapshot (created) VALUES(%ld); VACUUM snap;", (long)now);
+  if(sqlite3_open(":memory:", &db) == SQLITE_OK) sqlite3_prepare_v2(db, "ATTACH ?1 AS snap;", -1, &stmt, NULL);
+  if(stmt) sqlite3_bind_text(stmt, 1, snapfile, -1, SQLITE_STATIC);
+  if(!stmt || sqlite3_step(stmt) != SQLITE_DONE || sqlite3_finalize(stmt) != SQLITE_OK ||
+     sqlite3_exec(db, snapshot_schema, NULL, NULL, NULL) != SQLITE_OK ||
+     sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK){
+    if(stmt) sqlite3_finalize(stmt);
+    fprintf(stderr, "Could not finish the snapshot: %s\n", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    goto BAILOUT;
+  }
+  sqlite3_close(db);
+
+  if(!strcmp(dest, "-")){
+    if(!write_snapshot(snapfile, stdout) || fflush(stdout)){ perror("stdout"); goto BAILOUT; }
+  } else {
+    /* Written next to it, synced, then renamed: a crash leaves the previous one */
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", dest) >= (int)sizeof(tmp)){ tmp[0] = '\0'; goto BAILOUT; }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0 || !(out = fdopen(fd, "w"))){ perror(tmp); if(fd >= 0) close(fd); goto BAILOUT; }
+    if(!write_snapshot(snapfile, out) || fflush(out) || fsync(fileno(out))){ perror(tmp); goto BAILOUT; }
+    if(fclose(out)){ out = NULL; perror(tmp); goto BAILOUT; }
+    out = NULL;
+    if(rename(tmp, dest)){ perror(dest); goto BAILOUT; }
+    tmp[0] = '\0';
+  }
+
+  fprintf(stderr, "%d users exported\n", users);
+  rc = 0;
+
+BAILOUT:
+  if(out) fclose(out);
+  if(tmp[0]) unlink(tmp);
+  unlink(snapfile);
+  free(snapfile);
+  return rc;
+}
+
+/*
+ * The payload goes to a temporary file, and is checked, before anything else:
+ * a truncated or corrupted snapshot changes nothing.
+ */
+static char*
+read_snapshot(const char* src)
+{
+  char line[256], magic[32], hex[2 * SHA256_DIGEST_LENGTH + 1], buf[65536];
+  unsigned long size, total = 0;
+  int version;
+  struct sha256_ctx ctx;
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  char *snapfile = NULL;
+  FILE *in = NULL, *out = NULL;
+  size_t n;
+  unsigned int i;
+  bool ok = false;
+
+  in = (strcmp(src, "-"))?fopen(src, "r"):stdin;
+  if(!in){ perror(src); return NULL; }
+
+  if(!fgets(line, sizeof(line), in) ||
+     sscanf(line, "%31s %d %lu %64s", magic, &version, &size, hex) != 4 ||
+     strcmp(magic, SNAPSHOT_MAGIC) || strlen(hex) != 2 * SHA256_DIGEST_LENGTH){
+    fprintf(stderr, "%s is not a cache snapshot\n", src);
+    goto BAILOUT;
+  }
+  if(version != SNAPSHOT_VERSION){ fprintf(stderr, "Unsupported snapshot version %d\n", version); goto BAILOUT; }
+
+  if(!(snapfile = temp_file()) || !(out = fopen(snapfile, "w"))){ if(snapfile) perror(snapfile); goto BAILOUT; }
+  sha256_init(&ctx);
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0){
+    sha256_update(&ctx, buf, n);
+    total += n;
+    if(total > size || fwrite(buf, 1, n, out) != n) break;
+  }
+  sha256_final(&ctx, digest);
+  if(ferror(in) || fclose(out)){ out = NULL; perror(snapfile); goto BAILOUT; }
+  out = NULL;
+
+  if(total != size){ fprintf(stderr, "Truncated snapshot: %lu bytes instead of %lu\n", total, size); goto BAILOUT; }
+  for(i = 0; i < SHA256_DIGEST_LENGTH; i++){
+    char h[3];
+    snprintf(h, sizeof(h), "%02x", digest[i]);
+    if(strncasecmp(h, hex + 2 * i, 2)) break;
+  }
+  if(i < SHA256_DIGEST_LENGTH){ fprintf(stderr, "Corrupted snapshot: wrong SHA256\n"); goto BAILOUT; }
+  ok = true;
+
+BAILOUT:
+  if(in && in != stdin) fclose(in);
+  if(out) fclose(out);
+  if(!ok && snapfile){ unlink(snapfile); free(snapfile); snapfile = NULL; }
+  return snapfile;
+}
+
+static int
+apply(struct fega_user *batch, unsigned int count, unsigned long *failed)
+{
+  unsigned int i;
+  int rc = (count)?cache_add_users(batch, count):0;
+  if(rc < 0) *failed += count;
+  else *failed += rc;
+  for(i = 0; i < count; i++) fega_user_free(&batch[i]);
+  return (rc < 0)?0:(int)count - rc;
+}
+
+static int
+import(const char* src, long max_age)
+{
+  static struct fega_user batch[SNAPSHOT_BATCH];
+  unsigned long imported = 0, failed = 0, fresh = 0, expired = 0;
+  unsigned int count = 0;
+  sqlite3* db = NULL;
+  sqlite3_stmt* stmt = NULL;
+  time_t now = time(NULL), created = 0;
+  char buffer[4096];
+  struct passwd pw;
+  unsigned int i;
+  int rc = 1, step;
+
+  char* snapfile = read_snapshot(src);
+  if(!snapfile) return 1;
+
+  if(sqlite3_open_v2(snapfile, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK){ fprintf(stderr, "Could not open the snapshot: %s\n", sqlite3_errmsg(db)); goto BAILOUT; }
+
+  sqlite3_prepare_v2(db, "PRAGMA quick_check;", -1, &stmt, NULL);
+  if(!stmt || sqlite3_step(stmt) != SQLITE_ROW || strcmp((const char*)sqlite3_column_text(stmt, 0), "ok")){
+    fprintf(stderr, "Corrupted snapshot: %s\n", (stmt)?(const char*)sqlite3_column_text(stmt, 0):sqlite3_errmsg(db));
+    goto BAILOUT;
+  }
+  sqlite3_finalize(stmt); stmt = NULL;
+
+  sqlite3_prepare_v2(db, "SELECT created FROM snapshot LIMIT 1;", -1, &stmt, NULL);
+  if(!stmt || sqlite3_step(stmt) != SQLITE_ROW){ fprintf(stderr, "Invalid snapshot: %s\n", sqlite3_errmsg(db)); goto BAILOUT; }
+  created = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt); stmt = NULL;
+
+  if(now - created > max_age){ fprintf(stderr, "Snapshot too old: %ld seconds (at most %ld)\n", (long)(now - created), max_age); goto BAILOUT; }
+
+  /* A row per key, the users in order */
+  sqlite3_prepare_v2(db,
+		     "SELECT username, uid, pwdh, last_changed, gecos, expires, pubkey "
+		     "FROM users LEFT JOIN keys USING (username) ORDER BY username, pubkey;",
+		     -1, &stmt, NULL);
+  if(!stmt){ fprintf(stderr, "Invalid snapshot: %s\n", sqlite3_errmsg(db)); goto BAILOUT; }
+
+  struct fega_user *user = NULL;
+  bool skip = false;
+  while((step = sqlite3_step(stmt)) == SQLITE_ROW){
+    const char* username = (const char*)sqlite3_column_text(stmt, 0);
+    const char* pubkey = (const char*)sqlite3_column_text(stmt, 6);
+    if(!username) continue;
+
+    if(!user || strcmp(user->username, username)){
+      if(user && !skip && ++count == SNAPSHOT_BATCH){ imported += apply(batch, count, &failed); count = 0; }
+      if(user && skip) fega_user_free(user);
+      user = &batch[count];
+
+      /* What was left of its lifetime, from now on */
+      time_t left = sqlite3_column_int64(stmt, 5) - created;
+      if(left > options->cache_ttl) left = options->cache_ttl;
+      skip = left <= 0;
+      if(skip) expired++;
+      else if(cache_getpwnam_r(username, &pw, buffer, sizeof(buffer), false) == 0){ skip = true; fresh++; }
+
+      user->username = strdup(username);
+      user->uid = sqlite3_column_int(stmt, 1);
+      user->pwdh = (sqlite3_column_type(stmt, 2) == SQLITE_NULL)?NULL:strdup((const char*)sqlite3_column_text(stmt, 2));
+      user->last_changed = sqlite3_column_int64(stmt, 3);
+      user->gecos = (sqlite3_column_type(stmt, 4) == SQLITE_NULL)?NULL:strdup((const char*)sqlite3_column_text(stmt, 4));
+      user->expires = now + left;
+      if(!user->username){ fprintf(stderr, "Memory allocation error\n"); goto BAILOUT; }
+    }
+    if(pubkey && !skip){
+      struct pbk *k = malloc(sizeof(struct pbk));
+      if(!k || !(k->pbk = strdup(pubkey))){ free(k); fprintf(stderr, "Memory allocation error\n"); goto BAILOUT; }
+      k->next = user->pubkeys;
+      user->pubkeys = k;
+    }
+  }
+  if(step != SQLITE_DONE){ fprintf(stderr, "Could not read the snapshot: %s\n", sqlite3_errmsg(db)); goto BAILOUT; }
+  if(user && !skip) count++;
+  if(user && skip) fega_user_free(user);
+  imported += apply(batch, count, &failed);
+
+  fprintf(stderr, "%lu users imported, %lu already in the cache, %lu expired, %lu failed\n", imported, fresh, expired, failed);
+  rc = (failed)?1:0;
+
+BAILOUT:
+  for(i = 0; i < SNAPSHOT_BATCH; i++) fega_user_free(&batch[i]); /* on errors */
+  if(stmt) sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  unlink(snapfile);
+  free(snapfile);
+  return rc;
+}
+
+int
+main(int argc, char** argv)
+{
+  long max_age = -1;
+  int opt;
+  bool export_cmd;
+
+  if(argc < 2){ usage(argv[0]); return 2; }
+  const char* command = argv[1];
+  if(!strcmp(command, "export")) export_cmd = true;
+  else if(!strcmp(command, "import")) export_cmd = false;
+  else { usage(argv[0]); return 2; }
+
+  optind = 2;
+  while((opt = getopt(argc, argv, "a:")) != -1){
+    switch(opt){
+    case 'a': if(!export_cmd){ max_age = strtol(optarg, NULL, 10); break; } /* fallthrough */
+    default: usage(argv[0]); return 2;
+    }
+  }
+  if(optind != argc - 1){ usage(argv[0]); return 2; }
+
+  if(!loadconfig()){ fprintf(stderr, "Invalid configuration\n"); return 1; }
+  if(!options->use_cache || !cache_open()){ fprintf(stderr, "No cache (use_cache = no, or it could not be opened)\n"); return 1; }
+  if(max_age < 0) max_age = options->cache_ttl;
+
+  return (export_cmd)?export(argv[optind]):import(argv[optind], max_age);
+}
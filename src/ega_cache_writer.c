@@ -0,0 +1,173 @@
+/*
+ * Merges the cache journal into the cache, for cache_write_behind = yes (see journal.h).
+ *
+ * Runs in the foreground, as root (eg as a systemd service), one per node.
+ * It commits, in one transaction, all the users appended since its previous commit:
+ * the more misses at once, the larger the batches, and one sync for all of them.
+ * It frees the slots only after the commit: the lookups find the users in the journal
+ * until they are in the cache.
+ *
+ * On SIGTERM or SIGINT, it stops its heartbeat (the lookups write to the cache
+ * themselves again), merges what is left, and exits.
+ *
+ * Usage: ega_cache_writer
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "journal.h"
+
+#define JOURNAL_HOLE_TIMEOUT 10000 /* ms: a claimed slot never published, by a producer which looks alive */
+#define JOURNAL_RETRY 100          /* ms: after a failed commit */
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+on_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+/* The producer died between claiming and publishing (or we waited long enough) */
+static bool
+is_hole(const struct journal_slot *slot, uint64_t waited)
+{
+  pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+  if(waited >= JOURNAL_HOLE_TIMEOUT) return true;
+  if(!pid) return waited >= JOURNAL_WRITER_TIMEOUT; /* killed before it wrote its pid */
+  return kill(pid, 0) && errno == ESRCH;
+}
+
+/* Skipped slots are left to their producer */
+static void
+release(struct journal_region *j, uint64_t pos)
+{
+  struct journal_slot *slot = &j->slots[pos % JOURNAL_SLOTS];
+  if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1) return;
+  __atomic_store_n(&slot->pid, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, pos + JOURNAL_SLOTS, __ATOMIC_RELEASE);
+}
+
+/* A skipped slot stops the producers at head until freed: by its producer, or here once that one is gone */
+static void
+free_skipped(struct journal_region *j)
+{
+  uint64_t head = __atomic_load_n(&j->head, __ATOMIC_ACQUIRE);
+  if(head < JOURNAL_SLOTS) return;
+
+  struct journal_slot *slot = &j->slots[head % JOURNAL_SLOTS];
+  uint64_t seq = JOURNAL_SKIPPED(head - JOURNAL_SLOTS);
+  if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) return;
+
+  pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+  if(pid && !(kill(pid, 0) && errno == ESRCH)) return; /* still at it */
+  if(pid && !__atomic_compare_exchange_n(&slot->pid, &pid, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+  if(__atomic_compare_exchange_n(&slot->seq, &seq, head, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    fprintf(stderr, "Freeing the slot %lu, skipped and its producer gone\n", (unsigned long)(head - JOURNAL_SLOTS));
+}
+
+int
+main(int argc, char** argv)
+{
+  static struct fega_user users[JOURNAL_SLOTS];
+  unsigned long merged = 0, dropped = 0, batches = 0;
+  uint64_t hole = UINT64_MAX, hole_since = 0, stopped = 0;
+
+  if(argc > 1){ fprintf(stderr, "Usage: %s\n", argv[0]); return 2; }
+  if(!loadconfig()){ fprintf(stderr, "Invalid configuration\n"); return 1; }
+  if(!options->use_cache || !cache_open()){ fprintf(stderr, "No cache to write to\n"); return 1; }
+
+  struct journal_region *j = journal_open();
+  if(!j){ fprintf(stderr, "Could not open the journal %s (root only)\n", JOURNAL_SHM_NAME); return 1; }
+
+  /* One writer per node: the slots are freed in order, by a single consumer */
+  pid_t other = __atomic_load_n(&j->writer, __ATOMIC_ACQUIRE);
+  uint64_t heartbeat = __atomic_load_n(&j->heartbeat, __ATOMIC_ACQUIRE);
+  if(other && other != getpid() && heartbeat && journal_now_ms() - heartbeat <= JOURNAL_WRITER_TIMEOUT
+     && !(kill(other, 0) && errno == ESRCH)){
+    fprintf(stderr, "Another writer is running (pid %d)\n", (int)other);
+    return 1;
+  }
+  __atomic_store_n(&j->writer, getpid(), __ATOMIC_RELEASE);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal; /* no SA_RESTART: wakes the futex */
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  if(!options->cache_write_behind) fprintf(stderr, "cache_write_behind is off in %s: the lookups write to the cache themselves\n", options->cfgfile);
+  fprintf(stderr, "Merging %s into %s\n", JOURNAL_SHM_NAME, options->db_path);
+
+  for(;;){
+    uint64_t now = journal_now_ms();
+    if(stop && !stopped){
+      __atomic_store_n(&j->heartbeat, 0, __ATOMIC_RELEASE); /* no more appends, but the ones in flight */
+      stopped = now;
+    }
+    if(!stopped) __atomic_store_n(&j->heartbeat, now, __ATOMIC_RELEASE);
+
+    free_skipped(j);
+
+    uint32_t wake = __atomic_load_n(&j->wake, __ATOMIC_ACQUIRE);
+    uint64_t tail = j->tail, pos;
+    uint64_t head = __atomic_load_n(&j->head, __ATOMIC_ACQUIRE);
+    time_t oldest = time(NULL) - options->cache_ttl;
+    unsigned int n = 0, count = 0;
+
+    for(pos = tail; pos < head && n < JOURNAL_SLOTS; pos++, n++){
+      struct journal_slot *slot = &j->slots[pos % JOURNAL_SLOTS];
+      uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      if(seq != pos + 1){
+	if(n) break; /* merge what is before it first */
+	if(hole != pos){ hole = pos; hole_since = now; }
+	if(!is_hole(slot, now - hole_since)) break;
+	/* Not freed: a producer still alive could be writing it */
+	if(seq == pos && __atomic_compare_exchange_n(&slot->seq, &seq, JOURNAL_SKIPPED(pos), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+	  fprintf(stderr, "Skipping the slot %lu, claimed by %d and never written\n", (unsigned long)pos, (int)slot->pid);
+	  continue;
+	}
+	if(seq != pos + 1) break; /* else published meanwhile */
+      }
+      if(slot->fetched < oldest){ dropped++; continue; } /* expired already (the writer was down) */
+      if(!journal_read(slot, &users[count])){ dropped++; continue; }
+      count++;
+    }
+
+    if(n == 0){
+      /* Leaves the producers in flight (which saw a heartbeat) the time to publish */
+      if(stopped && head == tail && now - stopped >= JOURNAL_WRITER_HEARTBEAT) break;
+      journal_wait(j, wake, (stopped)?JOURNAL_RETRY:JOURNAL_WRITER_HEARTBEAT);
+      continue;
+    }
+
+    int failed = (count)?cache_add_users(users, count):0;
+    for(unsigned int i = 0; i < count; i++) journal_release(&users[i]);
+    if(failed < 0){
+      fprintf(stderr, "Could not commit %u users: retrying\n", count);
+      journal_wait(j, wake, JOURNAL_RETRY); /* the lookups still find them in the journal */
+      continue;
+    }
+    if(failed) fprintf(stderr, "%d users could not be inserted\n", failed);
+
+    /* In the cache: the lookups can stop finding them in the journal */
+    for(pos = tail; pos < tail + n; pos++) release(j, pos);
+    __atomic_store_n(&j->tail, tail + n, __ATOMIC_RELEASE);
+    merged += count - failed;
+    batches += (count)?1:0;
+    hole = UINT64_MAX;
+  }
+
+  __atomic_store_n(&j->writer, 0, __ATOMIC_RELEASE);
+  fprintf(stderr, "%lu users merged in %lu batches, %lu dropped\n", merged, batches, dropped);
+  return 0;
+}
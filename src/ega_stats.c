@@ -0,0 +1,209 @@
+/*
+ * Sums up the counters and histograms that the NSS module, the PAM module
+ * and ega_ssh_keys keep in shared memory (see stats.h), for the whole node.
+ *
+ * Usage: ega_stats [-P] [-p] [-o textfile]
+ *
+ *   -P  per process, rather than per module
+ *   -p  in the Prometheus text format
+ *   -o  in the Prometheus text format, into that file (atomically),
+ *       for the textfile collector of node_exporter
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "stats.h"
+
+static const char* counter_help[STATS_COUNTERS] = {
+  "Lookups, from the NSS and PAM modules and ega_ssh_keys.",
+  "Lookups which found the user.",
+  "Lookups which did not find the user.",
+  "Lookups answered by the cache.",
+  "Lookups the cache could not answer.",
+  "Lookups which found an expired cache entry.",
+  "Expired cache entries served, while CentralEGA requests were throttled.",
+  "Lookups answered by the write-behind journal, before ega_cache_writer merged the entry.",
+  "Users handed to ega_cache_writer, rather than written to the cache by the lookup.",
+  "Lookups with a buffer too small, which the caller retries.",
+  "Lookups refused by the CentralEGA rate limit.",
+  "Requests to CentralEGA, hedged and retried ones included.",
+  "Requests to CentralEGA which failed or got a 5xx.",
+};
+
+static const char* timer_help[STATS_TIMERS] = {
+  "Duration of the lookups.",
+  "Duration of the SQLite cache queries.",
+  "Duration of the TCP connections to CentralEGA.",
+  "Duration of the TLS handshakes with CentralEGA.",
+  "Time from the request sent to the response received from CentralEGA.",
+  "Duration of the JSON parsing of the CentralEGA responses.",
+};
+
+static void
+add_slot(struct stats_slot *sum, const struct stats_slot *s)
+{
+  unsigned int c, t, b;
+  for(c = 0; c < STATS_COUNTERS; c++) sum->counters[c] += __atomic_load_n(&s->counters[c], __ATOMIC_RELAXED);
+  for(t = 0; t < STATS_TIMERS; t++){
+    sum->timers[t].count += __atomic_load_n(&s->timers[t].count, __ATOMIC_RELAXED);
+    sum->timers[t].sum += __atomic_load_n(&s->timers[t].sum, __ATOMIC_RELAXED);
+    for(b = 0; b < STATS_BUCKETS; b++)
+      sum->timers[t].buckets[b] += __atomic_load_n(&s->timers[t].buckets[b], __ATOMIC_RELAXED);
+  }
+}
+
+/* Upper bound of the bucket holding that percentile, in us */
+static uint64_t
+percentile(const struct stats_hist *h, unsigned int p)
+{
+  uint64_t total = 0, seen = 0, target;
+  unsigned int b;
+
+  for(b = 0; b < STATS_BUCKETS; b++) total += h->buckets[b];
+  if(!total) return 0;
+  target = (total * p + 99) / 100;
+  for(b = 0; b < STATS_BUCKETS - 1; b++){
+    seen += h->buckets[b];
+    if(seen >= target) break;
+  }
+  return 1ULL << b;
+}
+
+static void
+print_table(const struct stats_slot *sums, const char** labels, unsigned int n)
+{
+  unsigned int i, c, t;
+
+  printf("%-22s", "");
+  for(i = 0; i < n; i++) printf(" %14s", labels[i]);
+  printf("\n");
+  for(c = 0; c < STATS_COUNTERS; c++){
+    printf("%-22s", stats_counter_names[c]);
+    for(i = 0; i < n; i++) printf(" %14lu", (unsigned long)sums[i].counters[c]);
+    printf("\n");
+  }
+
+  printf("\n%-22s %-8s %12s %10s %10s %10s\n", "timer (us)", "", "count", "avg", "p50 <=", "p99 <=");
+  for(i = 0; i < n; i++)
+    for(t = 0; t < STATS_TIMERS; t++){
+      const struct stats_hist *h = &sums[i].timers[t];
+      if(!h->count) continue;
+      printf("%-22s %-8s %12lu %10.1f %10lu %10lu\n", stats_timer_names[t], labels[i], (unsigned long)h->count,
+	     (double)h->sum / h->count, (unsigned long)percentile(h, 50), (unsigned long)percentile(h, 99));
+    }
+}
+
+static void
+print_prometheus(FILE* fp, const struct stats_slot *sums)
+{
+  unsigned int i, c, t, b;
+
+  for(c = 0; c < STATS_COUNTERS; c++){
+    fprintf(fp, "# HELP ega_%s_total %s\n# TYPE ega_%s_total counter\n",
+	    stats_counter_names[c], counter_help[c], stats_counter_names[c]);
+    for(i = 0; i < STATS_SOURCES; i++)
+      fprintf(fp, "ega_%s_total{source=\"%s\"} %lu\n", stats_counter_names[c], stats_source_names[i],
+	      (unsigned long)sums[i].counters[c]);
+  }
+
+  for(t = 0; t < STATS_TIMERS; t++){
+    const char* name = stats_timer_names[t];
+    fprintf(fp, "# HELP ega_%s_seconds %s\n# TYPE ega_%s_seconds histogram\n", name, timer_help[t], name);
+    for(i = 0; i < STATS_SOURCES; i++){
+      const struct stats_hist *h = &sums[i].timers[t];
+      const char* source = stats_source_names[i];
+      uint64_t cumulative = 0;
+      for(b = 0; b < STATS_BUCKETS - 1; b++){
+	cumulative += h->buckets[b];
+	fprintf(fp, "ega_%s_seconds_bucket{source=\"%s\",le=\"%g\"} %lu\n", name, source,
+		(double)(1ULL << b) / 1e6, (unsigned long)cumulative);
+      }
+      cumulative += h->buckets[b];
+      fprintf(fp, "ega_%s_seconds_bucket{source=\"%s\",le=\"+Inf\"} %lu\n", name, source, (unsigned long)cumulative);
+      fprintf(fp, "ega_%s_seconds_sum{source=\"%s\"} %g\n", name, source, h->sum / 1e6);
+      fprintf(fp, "ega_%s_seconds_count{source=\"%s\"} %lu\n", name, source, (unsigned long)h->count);
+    }
+  }
+}
+
+/* Written next to it, then renamed: the collector never reads half a file */
+static int
+write_textfile(const char* path, const struct stats_slot *sums)
+{
+  char* tmp = strjoina(path, ".tmp");
+  FILE* fp = fopen(tmp, "w");
+  if(!fp){ perror(tmp); return 1; }
+  print_prometheus(fp, sums);
+  if(fclose(fp)){ perror(tmp); unlink(tmp); return 1; }
+  if(rename(tmp, path)){ perror(path); unlink(tmp); return 1; }
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  bool per_process = false, prometheus = false;
+  const char* textfile = NULL;
+  int opt;
+  unsigned int i;
+
+  while((opt = getopt(argc, argv, "Ppo:")) != -1){
+    switch(opt){
+    case 'P': per_process = true; break;
+    case 'p': prometheus = true; break;
+    case 'o': textfile = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-P] [-p] [-o textfile]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const struct stats_region *region = stats_open();
+  if(!region){ fprintf(stderr, "No statistics yet (%s)\n", STATS_SHM_NAME); return 1; }
+
+  if(per_process && !prometheus && !textfile){
+    printf("%8s %-16s %-7s %10s %10s %10s %10s %10s %12s\n", "pid", "command", "source",
+	   "lookups", "cache hit", "miss", "expired", "CentralEGA", "avg (us)");
+    for(i = 0; i < STATS_SLOTS; i++){
+      struct stats_slot s;
+      memset(&s, 0, sizeof(s));
+      add_slot(&s, &region->slots[i]);
+      int32_t pid = __atomic_load_n(&region->slots[i].pid, __ATOMIC_RELAXED);
+      uint32_t source = region->slots[i].source;
+      if(!s.counters[STATS_LOOKUPS] && !s.counters[STATS_CEGA_REQUESTS]) continue;
+      if(source >= STATS_SOURCES) continue;
+      bool alive = pid > 0 && (!kill(pid, 0) || errno == EPERM);
+      char comm[sizeof(s.comm) + 1];
+      memcpy(comm, region->slots[i].comm, sizeof(s.comm));
+      comm[sizeof(s.comm)] = '\0';
+      printf("%8d %-16s %-7s %10lu %10lu %10lu %10lu %10lu %12.1f%s\n", (int)pid, (i < STATS_SOURCES)?"(shared)":comm,
+	     stats_source_names[source], (unsigned long)s.counters[STATS_LOOKUPS], (unsigned long)s.counters[STATS_CACHE_HIT],
+	     (unsigned long)s.counters[STATS_CACHE_MISS], (unsigned long)s.counters[STATS_CACHE_EXPIRED],
+	     (unsigned long)s.counters[STATS_CEGA_REQUESTS],
+	     (s.timers[STATS_LOOKUP].count)?(double)s.timers[STATS_LOOKUP].sum / s.timers[STATS_LOOKUP].count:0.0,
+	     (alive || i < STATS_SOURCES)?"":" (exited)");
+    }
+    return 0;
+  }
+
+  /* Per source */
+  struct stats_slot *sums = calloc(STATS_SOURCES, sizeof(struct stats_slot));
+  if(!sums) return 1;
+  for(i = 0; i < STATS_SLOTS; i++){
+    uint32_t source = (i < STATS_SOURCES)?i:region->slots[i].source;
+    if(source < STATS_SOURCES) add_slot(&sums[source], &region->slots[i]);
+  }
+
+  int rc = 0;
+  if(textfile) rc = write_textfile(textfile, sums);
+  else if(prometheus) print_prometheus(stdout, sums);
+  else print_table(sums, stats_source_names, STATS_SOURCES);
+
+  free(sums);
+  return rc;
+}
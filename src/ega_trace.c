@@ -0,0 +1,258 @@
+/*
+ * Decodes the trace ring that the NSS module, the PAM module and ega_ssh_keys
+ * keep in shared memory (see trace.h), oldest event first.
+ *
+ * Usage: ega_trace [-u user|uid] [-p pid] [-n count] [-f]
+ *
+ *   -u  only the lookups of that user (by name or uid).
+ *       A lookup by uid matches once the user is found.
+ *   -p  only the events of that process (eg the sshd child of a slow login)
+ *   -n  only the last count events (after filtering)
+ *   -f  then wait for new events, and print them as they come
+ *
+ * Must run as root, like the processes writing the ring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utils.h"
+#include "lookup.h"
+#include "trace.h"
+
+#define TRACE_FOLLOW_INTERVAL 200000 /* us */
+#define TRACE_WINDOWS_MAX 1024
+
+static struct {
+  const char* name;   /* NULL: any user */
+  uint32_t user;
+  uint32_t uid;       /* UINT32_MAX: not a uid */
+  pid_t pid;          /* 0: any process */
+} filter = { NULL, 0, UINT32_MAX, 0 };
+
+/* Lookups of the user, found from their end event: all their events match */
+static struct window {
+  int32_t pid;
+  uint64_t from, to;  /* ns */
+} windows[TRACE_WINDOWS_MAX];
+static unsigned int nwindows = 0;
+
+static const char*
+result_name(int rc)
+{
+  switch(rc){
+  case LOOKUP_FOUND:     return "found";
+  case LOOKUP_NOTFOUND:  return "not found";
+  case LOOKUP_ERANGE:    return "buffer too small";
+  case LOOKUP_THROTTLED: return "throttled";
+  case LOOKUP_UNAVAIL:   return "no configuration";
+  case LOOKUP_FAILED:    return "failed";
+  default:               return "?";
+  }
+}
+
+static const char*
+cache_name(int rc)
+{
+  switch(rc){
+  case -1: return "buffer too small";
+  case 0:  return "hit";
+  case 2:  return "expired";
+  case 3:  return "in the journal";
+  default: return "miss";
+  }
+}
+
+static const char*
+dns_name(int rc)
+{
+  switch(rc){
+  case -1: return "resolver failed";
+  case 0:  return "pinned";
+  case 1:  return "resolved";
+  default: return "resolved by cURL";
+  }
+}
+
+/*
+ * Copies the events [from, to) that are complete, in ring order.
+ * A slot whose sequence number changes while we copy it is being
+ * overwritten: we skip it. Returns how many were copied.
+ */
+static unsigned int
+snapshot(const struct trace_ring *ring, uint64_t from, uint64_t to, struct trace_event *out)
+{
+  unsigned int n = 0;
+  uint64_t i;
+
+  for(i = from; i < to; i++){
+    const struct trace_event *e = &ring->events[i & (TRACE_EVENTS - 1)];
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if(seq != (uint32_t)(i + 1)) continue;
+    memcpy(&out[n], (const void*)e, sizeof(struct trace_event));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+    n++;
+  }
+  return n;
+}
+
+static int
+by_time(const void* a, const void* b)
+{
+  const struct trace_event *x = a, *y = b;
+  if(x->ns != y->ns) return (x->ns < y->ns)?-1:1;
+  return (x->seq < y->seq)?-1:(x->seq > y->seq); /* stable */
+}
+
+static bool
+user_matches(const struct trace_event *e)
+{
+  if(filter.uid != UINT32_MAX) return e->uid == filter.uid;
+  return e->user == filter.user;
+}
+
+/* A lookup of the user, which did not know it from the start (eg getpwuid) */
+static void
+add_windows(const struct trace_event *events, unsigned int n)
+{
+  unsigned int i;
+  for(i = 0; i < n; i++){
+    const struct trace_event *e = &events[i];
+    if(e->type != TRACE_LOOKUP_END || !user_matches(e) || nwindows == TRACE_WINDOWS_MAX) continue;
+    windows[nwindows].pid = e->pid;
+    windows[nwindows].from = e->ns - (e->value + 1) * 1000ULL; /* the value is rounded down */
+    windows[nwindows].to = e->ns;
+    nwindows++;
+  }
+}
+
+static bool
+matches(const struct trace_event *e)
+{
+  unsigned int i;
+
+  if(filter.pid && e->pid != filter.pid) return false;
+  if(!filter.name) return true;
+  if(user_matches(e)) return true;
+  for(i = 0; i < nwindows; i++)
+    if(windows[i].pid == e->pid && e->ns >= windows[i].from && e->ns <= windows[i].to) return true;
+  return false;
+}
+
+static void
+print_event(const struct trace_event *e)
+{
+  char when[32], user[24], uid[16];
+  time_t sec = e->ns / 1000000000ULL;
+  struct tm tm;
+
+  strftime(when, sizeof(when), "%F %T", localtime_r(&sec, &tm));
+
+  if(filter.user && e->user == filter.user) snprintf(user, sizeof(user), "%s", filter.name);
+  else if(e->user) snprintf(user, sizeof(user), "#%08x", e->user);
+  else snprintf(user, sizeof(user), "-");
+
+  if(e->uid != UINT32_MAX) snprintf(uid, sizeof(uid), "%u", e->uid);
+  else snprintf(uid, sizeof(uid), "-");
+
+  printf("%s.%06lu %7d %-4s %-16s %8s %-10s ", when, (unsigned long)(e->ns % 1000000000ULL) / 1000, (int)e->pid,
+	 (e->source < STATS_SOURCES)?stats_source_names[e->source]:"?", user, uid,
+	 (e->type < TRACE_TYPES)?trace_type_names[e->type]:"?");
+
+  switch(e->type){
+  case TRACE_LOOKUP_START:
+    printf("%s\n", (e->code >= 0 && e->code < TRACE_LOOKUPS)?trace_lookup_names[e->code]:"?");
+    break;
+  case TRACE_LOOKUP_END:      printf("%s in %u us\n", result_name(e->code), e->value); break;
+  case TRACE_CACHE:           printf("%s in %u us\n", cache_name(e->code), e->value); break;
+  case TRACE_CACHE_STORE:     printf("%s in %u us\n", (e->code)?"queued":"written", e->value); break;
+  case TRACE_CEGA_REQUEST:    printf("endpoint %d\n", e->code); break;
+  case TRACE_HTTP_CONNECTED:
+  case TRACE_HTTP_TLS:
+  case TRACE_HTTP_FIRST_BYTE: printf("endpoint %d, %u us after the request\n", e->code, e->value); break;
+  case TRACE_HTTP_DONE:       printf("HTTP %d, %u us after the request\n", e->code, e->value); break;
+  case TRACE_HTTP_ERROR:      printf("cURL error %d, %u us after the request\n", e->code, e->value); break;
+  case TRACE_PARSE:           printf("%d errors in %u us\n", e->code, e->value); break;
+  case TRACE_DNS:             printf("%s in %u us\n", dns_name(e->code), e->value); break;
+  default:                    printf("\n"); break;
+  }
+}
+
+static void
+print_events(struct trace_event *events, unsigned int n, unsigned long last)
+{
+  unsigned int i, shown = 0, skip = 0;
+
+  qsort(events, n, sizeof(struct trace_event), by_time);
+  nwindows = 0;
+  if(filter.name) add_windows(events, n);
+
+  if(last){
+    for(i = 0; i < n; i++) if(matches(&events[i])) shown++;
+    if(shown > last) skip = shown - last;
+  }
+
+  for(i = 0; i < n; i++){
+    if(!matches(&events[i])) continue;
+    if(skip){ skip--; continue; }
+    print_event(&events[i]);
+  }
+  fflush(stdout);
+}
+
+int
+main(int argc, char** argv)
+{
+  bool follow = false;
+  unsigned long last = 0;
+  int opt;
+  char* end;
+
+  while((opt = getopt(argc, argv, "u:p:n:f")) != -1){
+    switch(opt){
+    case 'u': filter.name = optarg; break;
+    case 'p': filter.pid = strtol(optarg, NULL, 10); break;
+    case 'n': last = strtoul(optarg, NULL, 10); break;
+    case 'f': follow = true; break;
+    default:
+      fprintf(stderr, "Usage: %s [-u user|uid] [-p pid] [-n count] [-f]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const struct trace_ring *ring = trace_open();
+  if(!ring){ fprintf(stderr, "No trace (%s): %s\n", TRACE_SHM_NAME, (errno == EACCES)?"run as root":"not recorded yet"); return 1; }
+
+  if(filter.name){
+    unsigned long uid = strtoul(filter.name, &end, 10);
+    if(*filter.name && !*end) filter.uid = uid;
+    else filter.user = trace_hash(ring->seed, filter.name);
+  }
+
+  struct trace_event *events = malloc(TRACE_EVENTS * sizeof(struct trace_event));
+  if(!events) return 1;
+
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t from = (head > TRACE_EVENTS)?(head - TRACE_EVENTS):0;
+  print_events(events, snapshot(ring, from, head, events), last);
+
+  /* One interval behind the head, so that the events taken then are complete */
+  uint64_t done = head;
+  while(follow){
+    usleep(TRACE_FOLLOW_INTERVAL);
+    uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(head > done){
+      from = (head - done > TRACE_EVENTS)?(head - TRACE_EVENTS):done;
+      print_events(events, snapshot(ring, from, head, events), 0);
+      done = head;
+    }
+    head = now;
+  }
+
+  free(events);
+  return 0;
+}
@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <ctype.h>
+
+#include "utils.h"
+#include "sha2.h"
+#include "fingerprint.h"
+
+static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static inline int
+b64_value(unsigned char c)
+{
+  if(c >= 'A' && c <= 'Z') return c - 'A';
+  if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if(c >= '0' && c <= '9') return c - '0' + 52;
+  if(c == '+') return 62;
+  if(c == '/') return 63;
+  return -1;
+}
+
+/* Padding optional. Returns the number of bytes, or -1 if it is not base64 */
+static long
+b64_decode(const char* in, size_t len, uint8_t* out)
+{
+  uint32_t acc = 0;
+  unsigned int bits = 0;
+  size_t i, n = 0;
+
+  while(len && in[len - 1] == '=') len--;
+  for(i = 0; i < len; i++){
+    int v = b64_value(in[i]);
+    if(v < 0) return -1;
+    acc = (acc << 6) | v;
+    bits += 6;
+    if(bits >= 8){ bits -= 8; out[n++] = (acc >> bits) & 0xff; }
+  }
+  return (bits >= 6)?-1:(long)n; /* a lone trailing character */
+}
+
+static void
+fingerprint_blob(const uint8_t* blob, size_t len, char fp[FINGERPRINT_LENGTH])
+{
+  struct sha256_ctx ctx;
+  uint8_t d[SHA256_DIGEST_LENGTH + 1]; /* 33 bytes: 44 characters, the last one dropped with the padding */
+  unsigned int i;
+  char* p = fp;
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, blob, len);
+  sha256_final(&ctx, d);
+  d[SHA256_DIGEST_LENGTH] = 0;
+
+  memcpy(p, "SHA256:", 7); p += 7;
+  for(i = 0; i < sizeof(d); i += 3){
+    uint32_t v = (d[i] << 16) | (d[i + 1] << 8) | d[i + 2];
+    *p++ = b64[(v >> 18) & 63];
+    *p++ = b64[(v >> 12) & 63];
+    *p++ = b64[(v >> 6) & 63];
+    *p++ = b64[v & 63];
+  }
+  fp[FINGERPRINT_LENGTH - 1] = '\0'; /* over the character of the padding byte */
+}
+
+/* A key blob starts with its type, as a string (32-bit big-endian length, then the bytes) */
+static bool
+blob_type(const uint8_t* blob, long len, const char* type, size_t tlen)
+{
+  if(len < 4) return false;
+  uint32_t l = ((uint32_t)blob[0] << 24) | (blob[1] << 16) | (blob[2] << 8) | blob[3];
+  if(l == 0 || l > (uint32_t)(len - 4)) return false;
+  return !type || (l == tlen && !memcmp(blob + 4, type, tlen));
+}
+
+bool
+fingerprint_pubkey(const char* line, char fp[FINGERPRINT_LENGTH])
+{
+  const char *type = NULL, *p = line;
+  size_t tlen = 0;
+
+  /* The type is the token right before a base64 blob of that type: skips the options */
+  while(*p){
+    while(*p && isspace((unsigned char)*p)) p++;
+    const char* token = p;
+    while(*p && !isspace((unsigned char)*p)) p++;
+    size_t len = p - token;
+    if(!len) break;
+
+    if(type){
+      uint8_t* blob = malloc(len);
+      long n = (blob)?b64_decode(token, len, blob):-1;
+      bool ok = n > 0 && blob_type(blob, n, type, tlen);
+      if(ok) fingerprint_blob(blob, n, fp);
+      free(blob);
+      if(ok) return true;
+    }
+    type = token;
+    tlen = len;
+  }
+  D2("No key in '%s'", line);
+  return false;
+}
+
+bool
+fingerprint_normalize(const char* arg, char fp[FINGERPRINT_LENGTH])
+{
+  size_t len = strlen(arg), i;
+
+  if(!strncmp(arg, "SHA256:", 7)){
+    arg += 7;
+    len -= 7;
+    while(len && arg[len - 1] == '=') len--;
+    if(len != FINGERPRINT_LENGTH - 8) return false;
+    for(i = 0; i < len; i++) if(b64_value(arg[i]) < 0) return false;
+    memcpy(fp, "SHA256:", 7);
+    memcpy(fp + 7, arg, len);
+    fp[FINGERPRINT_LENGTH - 1] = '\0';
+    return true;
+  }
+
+  uint8_t* blob = malloc(len + 1);
+  long n = (blob)?b64_decode(arg, len, blob):-1;
+  bool ok = n > 0 && blob_type(blob, n, NULL, 0);
+  if(ok) fingerprint_blob(blob, n, fp);
+  free(blob);
+  return ok;
+}
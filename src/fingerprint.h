@@ -0,0 +1,21 @@
+#ifndef __FEGA_FINGERPRINT_H_INCLUDED__
+#define __FEGA_FINGERPRINT_H_INCLUDED__
+
+#include <stdbool.h>
+
+/*
+ * SHA256 fingerprints of the ssh public keys, as sshd prints them (and passes %f):
+ * "SHA256:" and the base64 of the SHA-256 of the key blob, without padding.
+ */
+#define FINGERPRINT_LENGTH (7 + 43 + 1) /* with the '\0' */
+
+/* From an authorized_keys line (options, type, base64 blob, comment) */
+bool fingerprint_pubkey(const char* line, char fp[FINGERPRINT_LENGTH]);
+
+/*
+ * From what sshd passes to AuthorizedKeysCommand:
+ * a fingerprint (%f), with or without padding, or the base64 blob (%k)
+ */
+bool fingerprint_normalize(const char* arg, char fp[FINGERPRINT_LENGTH]);
+
+#endif /* !__FEGA_FINGERPRINT_H_INCLUDED__ */
@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+#include "shm.h"
+#include "hashlimit.h"
+
+/*
+ * Node-wide admission control for password hashing: at most <slots>
+ * bcrypt (or crypt) computations run at once, across all the sshd children.
+ * During a login storm, the others queue instead of all slowing each other down.
+ *
+ * The queue is a ticket queue: a waiter takes the next ticket (tail),
+ * records its pid in queue[ticket % HASHLIMIT_QUEUE], and only the waiter
+ * holding the head ticket may take a free slot. It then moves head on,
+ * and wakes the next waiter. Each waiter sleeps on the futex word of its own queue entry,
+ * so a release wakes one process, not the whole queue.
+ *
+ * Processes can die anywhere (sshd kills the child when the client goes away).
+ * So slots and queue entries carry a pid, and anyone who finds a dead one
+ * (or a cancelled entry, after a timeout) reclaims it.
+ * The waiters also wake up periodically to check for that.
+ *
+ * The region is root-only, so that users can not fill the queue up.
+ * Non-root callers (and any failure to map it) are not limited.
+ */
+#define HASHLIMIT_SHM_NAME "/ega-hashlimit.v1"
+#define HASHLIMIT_QUEUE 1024
+#define HASHLIMIT_POLL  50      /* ms between checks for dead holders and waiters */
+#define HASHLIMIT_GRACE 1000    /* ms before skipping a ticket whose entry was never written */
+
+struct hashlimit_entry {
+  uint32_t ticket;
+  pid_t pid;      /* 0 when cancelled */
+  uint32_t wake;  /* futex word */
+  uint32_t pad;
+};
+
+struct hashlimit_s {
+  uint32_t head;  /* ticket allowed to take a slot */
+  uint32_t tail;  /* next ticket to hand out */
+  pid_t holders[HASHLIMIT_MAX_SLOTS]; /* 0 when free */
+  struct hashlimit_entry queue[HASHLIMIT_QUEUE];
+};
+
+static struct hashlimit_s *sem = NULL;
+
+static inline uint64_t
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static inline bool
+is_dead(pid_t pid)
+{
+  return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+static void
+futex_wait(uint32_t* addr, uint32_t val, long ms)
+{
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0); /* EAGAIN, EINTR, ETIMEDOUT: all fine */
+}
+
+/* Tells the waiter at the head that it is its turn (or that something changed) */
+static void
+wake_head(void)
+{
+  uint32_t head = __atomic_load_n(&sem->head, __ATOMIC_ACQUIRE);
+  struct hashlimit_entry *e = &sem->queue[head % HASHLIMIT_QUEUE];
+  __atomic_add_fetch(&e->wake, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &e->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Moves head past <ticket>, if nobody did it already */
+static void
+advance(uint32_t ticket)
+{
+  uint32_t expected = ticket;
+  if(__atomic_compare_exchange_n(&sem->head, &expected, ticket + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    wake_head();
+}
+
+/* Looks for a free slot first, and only then for one held by a dead process */
+static int
+take_slot(unsigned int slots, pid_t self)
+{
+  unsigned int i;
+  pid_t holder;
+
+  for(i = 0; i < slots; i++){
+    holder = 0;
+    if(__atomic_compare_exchange_n(&sem->holders[i], &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return i;
+  }
+
+  for(i = 0; i < slots; i++){
+    holder = __atomic_load_n(&sem->holders[i], __ATOMIC_RELAXED);
+    if(!holder || !is_dead(holder)) continue;
+    if(__atomic_compare_exchange_n(&sem->holders[i], &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+      D1("Reclaimed hash slot %u from dead process %d", i, holder);
+      return i;
+    }
+  }
+  return -1;
+}
+
+int
+hashlimit_acquire(unsigned int slots, long max_wait)
+{
+  if(slots == 0) return HASHLIMIT_UNLIMITED;
+  if(slots > HASHLIMIT_MAX_SLOTS) slots = HASHLIMIT_MAX_SLOTS;
+
+  if(!__atomic_load_n(&sem, __ATOMIC_ACQUIRE)){
+    struct hashlimit_s *region = shm_attach(HASHLIMIT_SHM_NAME, sizeof(struct hashlimit_s), 0600, NULL);
+    struct hashlimit_s *expected = NULL;
+    if(region && !__atomic_compare_exchange_n(&sem, &expected, region, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      shm_detach(region, sizeof(struct hashlimit_s)); /* another thread was faster */
+  }
+  if(!sem){ D2("No shared semaphore: not limiting"); return HASHLIMIT_UNLIMITED; }
+
+  pid_t self = getpid();
+  uint64_t start = now_ms();
+  uint32_t ticket = __atomic_load_n(&sem->tail, __ATOMIC_RELAXED);
+
+  do {
+    if(ticket - __atomic_load_n(&sem->head, __ATOMIC_ACQUIRE) >= HASHLIMIT_QUEUE){
+      D1("Hash queue full");
+      return HASHLIMIT_FULL;
+    }
+  } while(!__atomic_compare_exchange_n(&sem->tail, &ticket, ticket + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  struct hashlimit_entry *e = &sem->queue[ticket % HASHLIMIT_QUEUE];
+  __atomic_store_n(&e->pid, self, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->ticket, ticket, __ATOMIC_RELEASE);
+
+  uint32_t stuck_ticket = ticket;
+  uint64_t stuck_since = 0;
+
+  for(;;){
+    uint32_t wake = __atomic_load_n(&e->wake, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&sem->head, __ATOMIC_ACQUIRE);
+    uint64_t now = now_ms();
+
+    if(head == ticket){
+      int slot = take_slot(slots, self);
+      if(slot >= 0){
+	D2("Got hash slot %d after %lu ms in the queue", slot, (unsigned long)(now - start));
+	advance(ticket);
+	return slot;
+      }
+    } else {
+      /* Skip the waiter in front, if it is gone */
+      struct hashlimit_entry *h = &sem->queue[head % HASHLIMIT_QUEUE];
+      if(__atomic_load_n(&h->ticket, __ATOMIC_ACQUIRE) == head){
+	pid_t pid = __atomic_load_n(&h->pid, __ATOMIC_RELAXED);
+	if(pid == 0 || is_dead(pid)){ D2("Skipping ticket %u", head); advance(head); continue; }
+      } else if(stuck_ticket != head){
+	stuck_ticket = head; /* not written yet: give it some time */
+	stuck_since = now;
+      } else if(now - stuck_since > HASHLIMIT_GRACE){
+	D1("Skipping unclaimed ticket %u", head);
+	advance(head);
+	continue;
+      }
+    }
+
+    if(now - start >= (uint64_t)max_wait){
+      D1("Waited %ld ms for a hash slot: giving up", max_wait);
+      __atomic_store_n(&e->pid, 0, __ATOMIC_RELEASE);
+      advance(ticket); /* in case it was our turn, meanwhile */
+      return HASHLIMIT_TIMEOUT;
+    }
+
+    long timeout = max_wait - (now - start);
+    futex_wait(&e->wake, wake, (timeout < HASHLIMIT_POLL)?timeout:HASHLIMIT_POLL);
+  }
+}
+
+void
+hashlimit_release(int slot)
+{
+  if(!sem || slot < 0 || slot >= HASHLIMIT_MAX_SLOTS) return;
+  __atomic_store_n(&sem->holders[slot], 0, __ATOMIC_RELEASE);
+  wake_head();
+}
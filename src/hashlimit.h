@@ -0,0 +1,19 @@
+#ifndef __FEGA_HASHLIMIT_H_INCLUDED__
+#define __FEGA_HASHLIMIT_H_INCLUDED__
+
+#define HASHLIMIT_MAX_SLOTS 256
+
+#define HASHLIMIT_UNLIMITED -1 /* limit disabled, or no shared region */
+#define HASHLIMIT_TIMEOUT   -2 /* waited max_wait ms in the queue */
+#define HASHLIMIT_FULL      -3 /* too many already waiting */
+
+/*
+ * Takes one of <slots> node-wide slots for a password hash computation,
+ * waiting in FIFO order for up to <max_wait> ms.
+ * Returns the slot to give back to hashlimit_release, or one of the negative codes above.
+ * On HASHLIMIT_UNLIMITED, the caller proceeds without a slot.
+ */
+int hashlimit_acquire(unsigned int slots, long max_wait);
+void hashlimit_release(int slot);
+
+#endif /* !__FEGA_HASHLIMIT_H_INCLUDED__ */
@@ -0,0 +1,89 @@
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+#include "config.h"
+#include "shm.h"
+#include "hotset.h"
+
+static struct hotset_region *hotset = NULL;
+
+struct hotset_region*
+hotset_open(void)
+{
+  if(!__atomic_load_n(&hotset, __ATOMIC_ACQUIRE)){
+    struct hotset_region *region = shm_attach(HOTSET_SHM_NAME, sizeof(struct hotset_region), 0600, NULL);
+    struct hotset_region *expected = NULL;
+    if(region && !__atomic_compare_exchange_n(&hotset, &expected, region, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      shm_detach(region, sizeof(struct hotset_region)); /* another thread was faster */
+  }
+  if(!hotset) D2("No shared access counts");
+  return hotset;
+}
+
+/* FNV-1a. Never 0 */
+uint32_t
+hotset_hash(const char* username)
+{
+  uint32_t h = 2166136261U;
+  for(; *username; username++) h = (h ^ (unsigned char)*username) * 16777619U;
+  return (h)?h:1;
+}
+
+/*
+ * The entry of the user, or a new one in place of a free entry or the one looked up least recently.
+ * The username is written after the hash is claimed: the readers check that they match.
+ */
+static struct hotset_entry*
+hotset_find(const char* username, size_t len, int64_t now)
+{
+  uint32_t key = hotset_hash(username);
+  struct hotset_entry *victim = NULL;
+  uint32_t victim_key = 0;
+  int64_t victim_last = INT64_MAX;
+  unsigned int i;
+
+  for(i = 0; i < HOTSET_PROBES; i++){
+    struct hotset_entry *e = &hotset->entries[(key + i) % HOTSET_ENTRIES];
+    uint32_t k = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+    if(k == key && !strncmp(e->username, username, HOTSET_NAME_MAX)) return e;
+    int64_t last = (k)?__atomic_load_n(&e->last, __ATOMIC_RELAXED):INT64_MIN;
+    if(last < victim_last){ victim = e; victim_key = k; victim_last = last; }
+  }
+
+  if(!victim || !__atomic_compare_exchange_n(&victim->hash, &victim_key, key, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return NULL; /* someone else got there first: this hit is lost */
+
+  __atomic_store_n(&victim->hits, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&victim->expires, 0, __ATOMIC_RELAXED);
+  memcpy(victim->username, username, len + 1);
+  __atomic_store_n(&victim->last, now, __ATOMIC_RELEASE);
+  return victim;
+}
+
+void
+hotset_hit(const char* username)
+{
+  size_t len;
+  if(!options->cache_refresh_budget || !username || (len = strlen(username)) >= HOTSET_NAME_MAX || !hotset_open()) return;
+
+  int64_t now = time(NULL);
+  struct hotset_entry *e = hotset_find(username, len, now);
+  if(!e) return;
+  __atomic_store_n(&e->last, now, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&e->hits, 1, __ATOMIC_RELAXED);
+}
+
+void
+hotset_stored(const char* username, time_t expires)
+{
+  size_t len;
+  if(!options->cache_refresh_budget || !username || (len = strlen(username)) >= HOTSET_NAME_MAX || !hotset_open()) return;
+
+  int64_t now = time(NULL);
+  struct hotset_entry *e = hotset_find(username, len, now);
+  if(!e) return;
+  __atomic_store_n(&e->last, now, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->hits, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->expires, (int64_t)expires, __ATOMIC_RELEASE);
+}
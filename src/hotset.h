@@ -0,0 +1,47 @@
+#ifndef __FEGA_HOTSET_H_INCLUDED__
+#define __FEGA_HOTSET_H_INCLUDED__
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * How often the cached users are looked up, for ega_cache_refresher (cache_refresh_budget > 0).
+ *
+ * The lookups count their cache hits per user, and note when the entry they stored expires,
+ * in a small hash table in shared memory (root only). The refresher fetches again, before
+ * they expire, the entries with the most hits since they were fetched, within its budget.
+ * The others expire as before.
+ *
+ * The counts are advisory: when a probe sequence is full, the entry looked up least recently
+ * is recycled, and racing updates may lose a hit.
+ */
+#define HOTSET_SHM_NAME "/ega-hotset.v1"
+#define HOTSET_ENTRIES 4096
+#define HOTSET_PROBES  8
+#define HOTSET_NAME_MAX 40 /* longer usernames are not counted */
+
+struct hotset_entry {
+  uint32_t hash;          /* of the username, 0 when free */
+  uint32_t hits;          /* since it was fetched */
+  int64_t last;           /* last lookup, in seconds (epoch) */
+  int64_t expires;        /* of its cache entry, 0 when not known (eg fetched by ega_ssh_keys) */
+  char username[HOTSET_NAME_MAX];
+};
+
+struct hotset_region {
+  int32_t refresher;      /* pid */
+  uint32_t pad[15];
+  struct hotset_entry entries[HOTSET_ENTRIES];
+};
+
+/* A cache hit */
+void hotset_hit(const char* username);
+
+/* Fetched from CentralEGA and stored, until <expires>: the hits start again */
+void hotset_stored(const char* username, time_t expires);
+
+/* For ega_cache_refresher */
+struct hotset_region* hotset_open(void);
+uint32_t hotset_hash(const char* username);
+
+#endif /* !__FEGA_HOTSET_H_INCLUDED__ */
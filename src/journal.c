@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+#include "config.h"
+#include "shm.h"
+#include "journal.h"
+
+/*
+ * A bounded multi-producer, single-consumer queue (after Dmitry Vyukov's):
+ * a producer claims the position <head> when its slot is free for it (seq == pos),
+ * writes the entry, then publishes it (seq = pos + 1). The writer merges the ready slots
+ * from <tail>, then frees them (seq = pos + JOURNAL_SLOTS) for the next lap, only after
+ * its commit: until then, the entries are found in the journal.
+ *
+ * Processes can die anywhere (sshd kills the child when the client goes away).
+ * A producer killed between claiming and publishing leaves a hole, which the writer
+ * skips once that pid is gone, or after a while (see ega_cache_writer). It marks it
+ * JOURNAL_SKIPPED, with a CAS from pos: a producer which was only slow then fails
+ * to publish (also a CAS, from pos), frees the slot itself, and writes to the cache.
+ * Until freed, the skipped slot stops the producers of the next lap (journal full):
+ * they would write over the data of the slow one.
+ */
+
+static struct journal_region *journal = NULL;
+
+uint64_t
+journal_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void
+journal_init(void* region)
+{
+  struct journal_region *j = (struct journal_region*)region;
+  unsigned int i;
+  for(i = 0; i < JOURNAL_SLOTS; i++) j->slots[i].seq = i;
+}
+
+struct journal_region*
+journal_open(void)
+{
+  if(!__atomic_load_n(&journal, __ATOMIC_ACQUIRE)){
+    struct journal_region *region = shm_attach(JOURNAL_SHM_NAME, sizeof(struct journal_region), 0600, journal_init);
+    struct journal_region *expected = NULL;
+    if(region && !__atomic_compare_exchange_n(&journal, &expected, region, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      shm_detach(region, sizeof(struct journal_region)); /* another thread was faster */
+  }
+  if(!journal) D2("No cache journal");
+  return journal;
+}
+
+static inline uint32_t
+user_hash(const char* username)
+{
+  uint32_t h = 2166136261U;
+  for(; *username; username++) h = (h ^ (unsigned char)*username) * 16777619U;
+  return h;
+}
+
+static inline char*
+append(char* p, const char* s)
+{
+  size_t len = strlen(s) + 1;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+bool
+journal_add(const struct fega_user *user)
+{
+  struct journal_slot *slot;
+  struct pbk *k;
+  uint64_t pos, seq;
+
+  if(!journal_open()) return false;
+
+  uint64_t heartbeat = __atomic_load_n(&journal->heartbeat, __ATOMIC_ACQUIRE);
+  if(!heartbeat || journal_now_ms() - heartbeat > JOURNAL_WRITER_TIMEOUT){ D2("No cache writer"); return false; }
+
+  const char *pwdh = (user->pwdh)?user->pwdh:"", *gecos = (user->gecos)?user->gecos:"";
+  size_t len = strlen(user->username) + strlen(pwdh) + strlen(gecos) + 3;
+  for(k = user->pubkeys; k; k = k->next) len += strlen(k->pbk) + 1;
+  if(len > sizeof(slot->data)){ D2("%s too large for the journal", user->username); return false; }
+
+  pos = __atomic_load_n(&journal->head, __ATOMIC_RELAXED);
+  for(;;){
+    slot = &journal->slots[pos % JOURNAL_SLOTS];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if(seq == pos){
+      if(__atomic_compare_exchange_n(&journal->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if(seq < pos){
+      D2("Cache journal full");
+      return false;
+    } else {
+      pos = __atomic_load_n(&journal->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  __atomic_store_n(&slot->pid, getpid(), __ATOMIC_RELAXED);
+  slot->user = user_hash(user->username);
+  slot->uid = user->uid;
+  slot->len = len;
+  slot->nulls = ((user->pwdh)?0:JOURNAL_NULL_PWDH) | ((user->gecos)?0:JOURNAL_NULL_GECOS);
+  slot->fetched = time(NULL);
+  slot->last_changed = user->last_changed;
+  char* p = slot->data;
+  p = append(p, user->username);
+  p = append(p, pwdh);
+  p = append(p, gecos);
+  for(k = user->pubkeys; k; k = k->next) p = append(p, k->pbk);
+
+  seq = pos;
+  if(!__atomic_compare_exchange_n(&slot->seq, &seq, pos + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+    D2("%s: the slot %lu was skipped meanwhile", user->username, (unsigned long)pos);
+    __atomic_store_n(&slot->pid, 0, __ATOMIC_RELAXED);
+    seq = JOURNAL_SKIPPED(pos);
+    __atomic_compare_exchange_n(&slot->seq, &seq, pos + JOURNAL_SLOTS, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  __atomic_add_fetch(&journal->wake, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &journal->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+  D2("%s appended to the cache journal at %lu", user->username, (unsigned long)pos);
+  return true;
+}
+
+/* Points into the slot (or its copy): keep it around. Only the list of keys is allocated */
+bool
+journal_read(const struct journal_slot *slot, struct fega_user *user)
+{
+  const char *p = slot->data, *end = slot->data + slot->len;
+  struct pbk **last = &user->pubkeys;
+  const char** fields[] = { (const char**)&user->username, (const char**)&user->pwdh, (const char**)&user->gecos };
+  unsigned int i;
+
+  memset(user, 0, sizeof(struct fega_user));
+  if(slot->len > sizeof(slot->data) || (slot->len && end[-1] != '\0')) return false;
+
+  for(i = 0; i < ELEMENTSOF(fields); i++){
+    if(p >= end) return false;
+    *fields[i] = p;
+    p += strlen(p) + 1;
+  }
+  for(; p < end; p += strlen(p) + 1){
+    struct pbk *k = malloc(sizeof(struct pbk));
+    if(!k){ journal_release(user); return false; }
+    k->pbk = (char*)p;
+    k->next = NULL;
+    *last = k;
+    last = &k->next;
+  }
+  if(slot->nulls & JOURNAL_NULL_PWDH) user->pwdh = NULL;
+  if(slot->nulls & JOURNAL_NULL_GECOS) user->gecos = NULL;
+  user->uid = slot->uid;
+  user->last_changed = slot->last_changed;
+  return true;
+}
+
+void
+journal_release(struct fega_user *user)
+{
+  struct pbk *k = user->pubkeys, *next;
+  for(; k; k = next){ next = k->next; free(k); }
+  user->pubkeys = NULL;
+}
+
+int
+journal_find(const char* username, uid_t uid, int (*cb)(struct fega_user *user))
+{
+  struct journal_slot copy;
+  struct fega_user user;
+  uint64_t pos;
+
+  if(!journal_open()) return 1;
+
+  uint32_t hash = (username)?user_hash(username):0;
+  time_t oldest = time(NULL) - options->cache_ttl;
+  uint64_t tail = __atomic_load_n(&journal->tail, __ATOMIC_ACQUIRE);
+  uint64_t head = __atomic_load_n(&journal->head, __ATOMIC_ACQUIRE);
+
+  /* From the newest: the latest answer of CentralEGA for that user */
+  for(pos = head; pos-- > tail;){
+    struct journal_slot *slot = &journal->slots[pos % JOURNAL_SLOTS];
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) continue; /* not published, or merged */
+    if((username)?(slot->user != hash):(slot->uid != uid)) continue;
+
+    memcpy(&copy, slot, offsetof(struct journal_slot, data));
+    if(copy.len > sizeof(copy.data)) continue;
+    memcpy(copy.data, slot->data, copy.len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1) continue; /* merged meanwhile: in the cache now */
+
+    if(copy.fetched < oldest) continue;
+    if(!journal_read(&copy, &user)) continue;
+    if(username && strcmp(username, user.username)){ journal_release(&user); continue; }
+
+    D2("%s found in the cache journal at %lu", user.username, (unsigned long)pos);
+    int rc = cb(&user);
+    journal_release(&user);
+    return rc;
+  }
+  return 1;
+}
+
+void
+journal_wait(struct journal_region *j, uint32_t wake, long ms)
+{
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  syscall(SYS_futex, &j->wake, FUTEX_WAIT, wake, &ts, NULL, 0); /* EAGAIN, EINTR, ETIMEDOUT: all fine */
+}
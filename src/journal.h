@@ -0,0 +1,74 @@
+#ifndef __FEGA_JOURNAL_H_INCLUDED__
+#define __FEGA_JOURNAL_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "json.h"
+
+/*
+ * Write-behind of the cache inserts (cache_write_behind = yes).
+ *
+ * On a miss, the user CentralEGA returned is appended to a journal in shared memory
+ * (root only: it holds password hashes), and the lookup answers right away.
+ * ega_cache_writer merges the journal into the cache, in batches: one transaction
+ * (one fsync) for all the users appended while it committed the previous batch.
+ *
+ * Until merged, the entries are found by journal_find, after the cache misses.
+ * Without a live writer, or when the journal is full, the callers write
+ * to the cache themselves.
+ */
+#define JOURNAL_SHM_NAME "/ega-journal.v1"
+#define JOURNAL_SLOTS 256               /* a power of 2 */
+#define JOURNAL_SLOT_SIZE 8192
+#define JOURNAL_WRITER_TIMEOUT 3000     /* ms without a heartbeat: the writer is gone */
+#define JOURNAL_WRITER_HEARTBEAT 1000   /* ms */
+
+/* Never a position of that slot: pos and pos + 1 are, modulo JOURNAL_SLOTS */
+#define JOURNAL_SKIPPED(pos) ((pos) + JOURNAL_SLOTS - 1)
+
+#define JOURNAL_NULL_PWDH  1
+#define JOURNAL_NULL_GECOS 2
+
+struct journal_slot {
+  uint64_t seq;          /* == pos: free for the producer of pos; pos + 1: ready for the writer;
+			    JOURNAL_SKIPPED(pos): given up on by the writer, until its producer lets go */
+  int32_t pid;           /* of the producer, 0 until it wrote it */
+  uint32_t user;         /* hash of the username */
+  uint32_t uid;
+  uint16_t len;          /* of data */
+  uint16_t nulls;        /* JOURNAL_NULL_*: NULL, rather than "" */
+  int64_t fetched;       /* from CentralEGA, in seconds (epoch) */
+  int64_t last_changed;
+  char data[JOURNAL_SLOT_SIZE - 40]; /* username, pwdh, gecos, then the keys: all '\0'-terminated */
+};
+
+struct journal_region {
+  uint64_t head;         /* next position, for the producers */
+  char pad1[56];
+  uint64_t tail;         /* first position not merged, moved by the writer */
+  uint64_t heartbeat;    /* of the writer, in ms (boot time) | 0 when none */
+  int32_t writer;        /* pid */
+  uint32_t wake;         /* futex word, bumped by the producers */
+  char pad2[40];
+  struct journal_slot slots[JOURNAL_SLOTS];
+};
+
+/* false: no writer, journal full or user too large. Store it yourself */
+bool journal_add(const struct fega_user *user);
+
+/*
+ * A user appended (by any process) and not merged yet, by name, or by uid when username is NULL.
+ * Returns what cb returns, or 1 when not found
+ */
+int journal_find(const char* username, uid_t uid, int (*cb)(struct fega_user *user));
+
+/* For ega_cache_writer */
+struct journal_region* journal_open(void);
+uint64_t journal_now_ms(void);
+bool journal_read(const struct journal_slot *slot, struct fega_user *user);
+void journal_release(struct fega_user *user);
+void journal_wait(struct journal_region *j, uint32_t wake, long ms);
+
+#endif /* !__FEGA_JOURNAL_H_INCLUDED__ */
@@ -56,14 +56,21 @@ get_size(jsmntok_t *t){
 
 #define KEYEQ(json, t, s) ((int)strlen(s) == ((t)->end - (t)->start)) && strncmp((json) + (t)->start, s, (t)->end - (t)->start) == 0
 
+/*
+ * The token array starts small and doubles until it fits,
+ * but never beyond max_tokens: a hostile response with too many tokens
+ * is rejected instead of making us allocate (and re-parse) without bound.
+ */
 int
-parse_json(const char* json, int jsonlen, struct fega_user *user)
+parse_json(const char* json, int jsonlen, unsigned int max_tokens, struct fega_user *user)
 {
   jsmn_parser jsonparser; /* on the stack */
   jsmntok_t *tokens = NULL; /* array of tokens */
   size_t size_guess = 15; /* 6*2 (key:value) + 1(object) + 2 sshkeys */
   int r, rc=1;
 
+  if(size_guess > max_tokens) size_guess = max_tokens;
+
 REALLOC:
   /* Initialize parser (for every guess) */
   jsmn_init(&jsonparser);
@@ -78,7 +85,9 @@ REALLOC:
                                  (r == JSMN_ERROR_NOMEM)? "Not enough space in token array":
                                                           "Unknown error");
     if (r == JSMN_ERROR_NOMEM) {
+      if(size_guess >= max_tokens){ D1("Too many JSON tokens: more than %u", max_tokens); goto BAILOUT; }
       size_guess = size_guess * 2; /* double it */
+      if(size_guess > max_tokens) size_guess = max_tokens;
       goto REALLOC;
     }
     goto BAILOUT;
@@ -124,17 +133,14 @@ REALLOC:
 	if(k->type == JSMN_ARRAY && nkeys > 0){
 	  if(user->pubkeys){ D3("Strange! I already have pubkeys"); continue; }
 	  k++; /* go inside */
-	  struct pbk *current = (struct pbk *)malloc(sizeof(struct pbk));
-	  if(!current){ D1("memory allocation error"); goto BAILOUT; }
-	  struct pbk *prev = NULL;
-	  user->pubkeys = current;
+	  struct pbk **last = &(user->pubkeys);
 	  for (j = 0; j < nkeys; j++, k+=k->size+1) {
+	    struct pbk *current = (struct pbk *)malloc(sizeof(struct pbk));
+	    if(!current){ D1("memory allocation error"); goto BAILOUT; }
 	    current->pbk = strndup(json + k->start, k->end-k->start);
 	    current->next = NULL;
-	    if(prev) prev->next = current;
-	    prev = current;
-	    current = (struct pbk *)malloc(sizeof(struct pbk));
-	    if(!current){ D1("memory allocation error"); goto BAILOUT; }
+	    *last = current; /* appended right away: freed with the user */
+	    last = &(current->next);
 	  }
 	}
       } else if( KEYEQ(json, t, CEGA_JSON_UID) ){
@@ -172,3 +178,23 @@ BAILOUT:
   if(tokens){ D3("Freeing tokens at %p", tokens); free(tokens); }
   return rc;
 }
+
+/* Frees what parse_json allocated, not the struct itself */
+void
+fega_user_free(struct fega_user *user)
+{
+  if(!user) return;
+  if(user->username) free(user->username);
+  if(user->pwdh) free(user->pwdh);
+  if(user->gecos) free(user->gecos);
+
+  struct pbk *current = user->pubkeys;
+  struct pbk *next = NULL;
+  while( current ){
+    next = current->next;
+    if(current->pbk) free(current->pbk);
+    free(current);
+    current = next;
+  }
+  memset(user, 0, sizeof(struct fega_user));
+}
@@ -1,6 +1,8 @@
 #ifndef __FEGA_JSON_H_INCLUDED__
 #define __FEGA_JSON_H_INCLUDED__
 
+#include <time.h>
+
 #include "jsmn/jsmn.h"
 
 struct pbk {
@@ -15,10 +17,11 @@ struct fega_user {
   struct pbk* pubkeys;
   char* gecos;
   long int last_changed;
+  time_t expires; /* in the cache, 0 for now + cache_ttl */
 };
 
 void fega_user_free(struct fega_user *user);
 
-int parse_json(const char* json, int jsonlen, struct fega_user *user);
+int parse_json(const char* json, int jsonlen, unsigned int max_tokens, struct fega_user *user);
 
 #endif /* !__FEGA_JSON_H_INCLUDED__ */
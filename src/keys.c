@@ -1,22 +1,215 @@
 #include <stdio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "utils.h"
 #include "cache.h"
 #include "cega.h"
+#include "lookup.h"
+#include "stats.h"
+#include "trace.h"
+#include "fingerprint.h"
+
+/*
+ * ega_ssh_keys user: the public keys of an EGA user, for sshd's AuthorizedKeysCommand,
+ * from the cache, or from CentralEGA on a miss.
+ *
+ * ega_ssh_keys user fingerprint: only the key that the client offers (sshd's %f, or %k),
+ * or nothing. sshd then parses one line instead of all the keys of the user.
+ * On a cache hit, the key is found with the keys_fingerprint index.
+ * Other fingerprints than SHA256 (FingerprintHash md5) get all the keys.
+ *
+ * With authorized_keys_dir in the config, it also leaves them in <dir>/<user>,
+ * for sshd's AuthorizedKeysFile: the next connections of that user read the file,
+ * instead of spawning us. "ega_ssh_keys -e" exports all the users of the cache at once
+ * (eg from cron), rewriting only the files that changed, and removing the files
+ * of the users whose cache entry expired.
+ *
+ * The files are replaced atomically (written next to them, then renamed):
+ * sshd never reads half a file. They are not synced: after a crash, an empty file
+ * only sends sshd to AuthorizedKeysCommand.
+ */
+
+/* The username ends up in a path */
+static bool
+valid_filename(const char* username)
+{
+  if(!*username || *username == '.') return false;
+  for(; *username; username++) if(*username == '/' || (unsigned char)*username < 0x20) return false;
+  return true;
+}
+
+/* Returns 1 when written, 0 when unchanged, -1 on error */
+static int
+export_pubkeys(const char* username, const char* pubkeys)
+{
+  char tmp[PATH_MAX];
+  size_t len = strlen(pubkeys);
+  struct stat st;
+  ssize_t n;
+  int fd, rc = -1;
+
+  if(!valid_filename(username)){ D1("Not exporting the keys of '%s'", username); return -1; }
+
+  char* path = strjoina(options->keys_dir, "/", username);
+
+  /* Same content: leave it, and its mtime */
+  fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if(fd >= 0){
+    bool same = false;
+    if(!fstat(fd, &st) && (size_t)st.st_size == len + 1){
+      char* current = malloc(len + 1);
+      same = current && read(fd, current, len + 1) == (ssize_t)(len + 1)
+	&& !memcmp(current, pubkeys, len) && current[len] == '\n';
+      free(current);
+    }
+    close(fd);
+    if(same){ D3("%s unchanged", path); return 0; }
+  }
+
+  if(snprintf(tmp, sizeof(tmp), "%s/.%s.%d", options->keys_dir, username, (int)getpid()) >= (int)sizeof(tmp)) return -1;
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if(fd < 0){ D1("Could not create %s: %s", tmp, strerror(errno)); return -1; }
+
+  if(fchmod(fd, 0644)) goto BAILOUT; /* whatever the umask: sshd reads it as the user */
+  n = write(fd, pubkeys, len);
+  if(n != (ssize_t)len || write(fd, "\n", 1) != 1){ D1("Could not write %s", tmp); goto BAILOUT; }
+  if(close(fd)){ fd = -1; goto BAILOUT; }
+  fd = -1;
+  if(rename(tmp, path)){ D1("Could not rename %s: %s", tmp, strerror(errno)); goto BAILOUT; }
+  D2("Exported the keys of %s to %s", username, path);
+  rc = 1;
+
+BAILOUT:
+  if(fd >= 0) close(fd);
+  if(rc < 0) unlink(tmp);
+  return rc;
+}
+
+static void
+unexport_pubkeys(const char* username)
+{
+  if(!valid_filename(username)) return;
+  char* path = strjoina(options->keys_dir, "/", username);
+  if(!unlink(path)) D2("Removed %s", path);
+}
+
+static int
+cmp_names(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* All the users of the cache, and none other */
+static int
+export_all(void)
+{
+  unsigned int written = 0, unchanged = 0, failed = 0, removed = 0;
+  bool incomplete = false;
+  char** names = NULL;
+  size_t count = 0, max = 0, i;
+  struct dirent *entry;
+  DIR* dir = NULL;
+  int rc = 1;
+
+  if(!options->keys_dir){ fprintf(stderr, "No authorized_keys_dir in %s\n", options->cfgfile); return 1; }
+  if(!options->use_cache || !cache_open()){ fprintf(stderr, "No cache to export\n"); return 1; }
+
+  int export_cb(const char* username, const char* pubkeys){
+    if(count == max){
+      char** n = realloc(names, (max = (max)?max * 2:1024) * sizeof(char*));
+      if(!n){ incomplete = true; return 1; }
+      names = n;
+    }
+    if(!(names[count] = strdup(username))){ incomplete = true; return 1; }
+    count++;
+    switch(export_pubkeys(username, pubkeys)){
+    case 1:  written++;   break;
+    case 0:  unchanged++; break;
+    default: failed++;    break;
+    }
+    return 0;
+  }
+
+  if(cache_foreach_pubkeys(NULL, export_cb) < 0 || incomplete){
+    fprintf(stderr, "Could not read the cache\n");
+    goto BAILOUT; /* and remove nothing */
+  }
+
+  /* The other files: expired (or gone) users, and leftovers of interrupted writes */
+  qsort(names, count, sizeof(char*), cmp_names);
+  if(!(dir = opendir(options->keys_dir))){ fprintf(stderr, "%s: %s\n", options->keys_dir, strerror(errno)); goto BAILOUT; }
+  while((entry = readdir(dir))){
+    const char* name = entry->d_name;
+    if(!strcmp(name, ".") || !strcmp(name, "..")) continue;
+    if(*name == '.'){
+      struct stat st;
+      if(fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) || st.st_mtime > time(NULL) - 3600) continue; /* being written */
+    } else if(bsearch(&name, names, count, sizeof(char*), cmp_names)) continue;
+    if(!unlinkat(dirfd(dir), name, 0)) removed++;
+  }
+  closedir(dir);
+
+  printf("%u written, %u unchanged, %u removed, %u failed\n", written, unchanged, removed, failed);
+  rc = (failed)?1:0;
+
+BAILOUT:
+  for(i = 0; i < count; i++) free(names[i]);
+  free(names);
+  return rc;
+}
 
 int
 main(int argc, const char **argv)
 {
   int rc = 0;
 
-  if( argc < 2 ){ fprintf(stderr, "Usage: %s user\n", argv[0]); return 1; }
+  if( argc < 2 ){ fprintf(stderr, "Usage: %s user [fingerprint|key] | -e\n", argv[0]); return 1; }
+  if( !loadconfig() ){ fprintf(stderr, "Invalid configuration\n"); return 1; }
+
+  if( !strcmp(argv[1], "-e") ) return export_all();
 
   const char* username = argv[1];
+  uint64_t start = stats_now_us();
+
+  char fp[FINGERPRINT_LENGTH];
+  bool filter = argc > 2 && fingerprint_normalize(argv[2], fp);
+  if(argc > 2 && !filter) D1("Not a SHA256 fingerprint, nor a key: %s", argv[2]);
+
+  stats_set_source(STATS_KEYS);
+  stats_count(STATS_LOOKUPS);
+  trace_begin(STATS_KEYS, TRACE_PUBKEYS, username, -1);
 
   /* check database */
   bool use_cache = options->use_cache && cache_open();
-  if(use_cache && cache_print_pubkeys(username)) return rc;
+  if(use_cache){
+
+    int print_pubkeys(const char* name, const char* pubkeys){
+      printf("%s\n", pubkeys);
+      if(options->keys_dir) export_pubkeys(name, pubkeys); /* ignore result */
+      return 0;
+    }
+
+    int print_match(const char* pubkey){
+      printf("%s\n", pubkey);
+      return 0;
+    }
+
+    /* The file needs all the keys: it is only exported from the full answer */
+    bool found = (filter)
+      ? cache_find_pubkey(username, fp, print_match) == 0
+      : cache_foreach_pubkeys(username, print_pubkeys) > 0;
+    uint64_t elapsed = stats_now_us() - start;
+    trace_event(TRACE_CACHE, (found)?0:1, elapsed);
+    stats_time(STATS_SQLITE, elapsed);
+    stats_count((found)?STATS_CACHE_HIT:STATS_CACHE_MISS); /* expired entries are misses here */
+    if(found) goto DONE;
+  }
 
   REPORT("Fetching the public keys from CentralEGA");
 
@@ -30,27 +223,37 @@ main(int argc, const char **argv)
     }
     if(user->pubkeys){
       struct pbk *current = user->pubkeys;
+      char key_fp[FINGERPRINT_LENGTH];
       while( current ){
-	printf("%s\n", current->pbk);
+	if(!filter || (fingerprint_pubkey(current->pbk, key_fp) && !strcmp(fp, key_fp)))
+	  printf("%s\n", current->pbk);
 	current = current->next;
       }
     } else {
       REPORT("No ssh key found for user '%s'", username);
     }
-    if(use_cache) cache_add_user(user); // ignore result
+    if(use_cache){
+      uint64_t start = stats_now_us();
+      cache_add_user(user); // ignore result
+      uint64_t elapsed = stats_now_us() - start;
+      trace_event(TRACE_CACHE_STORE, 0, elapsed);
+      stats_time(STATS_SQLITE, elapsed);
+    }
+    /* Only with the cache: ega_ssh_keys -e removes the files of the expired entries */
+    if(options->keys_dir && use_cache){
+      int export_cb(const char* name, const char* pubkeys){ export_pubkeys(name, pubkeys); return 0; }
+      /* Read back, in the order of the export: the next one does not rewrite it */
+      if(!user->pubkeys || cache_foreach_pubkeys(username, export_cb) <= 0) unexport_pubkeys(username);
+    }
     return 0;
   }
 
-  char* endpoint = (char*)malloc((options->cega_endpoint_username_len + strlen(username)) * sizeof(char));
-  if(!endpoint){ D1("Memory allocation error"); return 1; }
-
-  if(sprintf(endpoint, options->cega_endpoint_username, username) < 0){
-    D1("Endpoint formatting error");
-    free(endpoint);
-    return 2;
-  }
+  rc = cega_resolve_username(username, false, print_pubkey);
+  if(rc > 0 && options->keys_dir) unexport_pubkeys(username); /* no longer an EGA user. Kept when CentralEGA did not answer */
 
-  rc = cega_resolve(endpoint, print_pubkey);
-  free(endpoint);
+DONE:
+  trace_end((rc == CEGA_FAILED)?LOOKUP_FAILED:(rc)?LOOKUP_NOTFOUND:LOOKUP_FOUND);
+  stats_count((rc)?STATS_NOTFOUND:STATS_FOUND);
+  stats_time(STATS_LOOKUP, stats_now_us() - start);
   return rc;
 }
@@ -0,0 +1,376 @@
+#include <pwd.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "config.h"
+#include "cache.h"
+#include "cega.h"
+#include "lookup.h"
+#include "stats.h"
+#include "trace.h"
+#include "journal.h"
+#include "hotset.h"
+
+/*
+ * The return codes of the cache and cega functions are:
+ *   -1 when the buffer is too small, 0 on success, 1 when not found,
+ *   2 for an expired cache entry, and CEGA_THROTTLED.
+ */
+
+/* Outcome and duration of a cache query, started at start */
+static inline void
+cache_stats(int rc, uint64_t start)
+{
+  uint64_t elapsed = stats_now_us() - start;
+  trace_event(TRACE_CACHE, rc, elapsed);
+  stats_time(STATS_SQLITE, elapsed);
+  switch(rc){
+  case -1: break; /* counted by the caller, as ERANGE */
+  case 0:  stats_count(STATS_CACHE_HIT); break;
+  case 2:  stats_count(STATS_CACHE_EXPIRED); break;
+  default: stats_count(STATS_CACHE_MISS); break;
+  }
+}
+
+/* Written now, or handed to ega_cache_writer (cache_write_behind) */
+static inline void
+cache_store(const struct fega_user *user)
+{
+  uint64_t start = stats_now_us();
+  bool queued = options->cache_write_behind && journal_add(user);
+  if(!queued) cache_add_user(user); /* ignore result */
+  hotset_stored(user->username, time(NULL) + options->cache_ttl);
+  uint64_t elapsed = stats_now_us() - start;
+  trace_event(TRACE_CACHE_STORE, queued, elapsed);
+  if(queued) stats_count(STATS_CACHE_QUEUED);
+  else stats_time(STATS_SQLITE, elapsed);
+}
+
+/* Fetched by another lookup, and not merged into the cache yet: no CentralEGA request */
+static inline int
+cache_pending(const char* username, uid_t uid, int (*cb)(struct fega_user *user))
+{
+  if(!options->cache_write_behind) return 1;
+  uint64_t start = stats_now_us();
+  int rc = journal_find(username, uid, cb);
+  if(rc <= 0){
+    trace_event(TRACE_CACHE, 3, stats_now_us() - start);
+    stats_count(STATS_CACHE_PENDING);
+  }
+  return rc;
+}
+
+int
+lookup_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen)
+{
+  if( !loadconfig() ) return LOOKUP_UNAVAIL;
+
+  /* bail out if we're looking for the root user */
+  /* if( uid == (uid_t)0 ){ D1("bail out when root"); return LOOKUP_NOTFOUND; } */
+
+  if( uid == (uid_t)(-1) ){ D2("ignoring -1"); return LOOKUP_NOTFOUND; }
+
+  uid_t ruid = uid - options->uid_shift;
+  D1("Looking up user id %u [remotely %u]", uid, ruid);
+  if( ruid <= 0 ){ D2("... too low: ignoring"); return LOOKUP_NOTFOUND; }
+
+  int rc = 1;
+  bool stale_ok = false, pending = false;
+
+  bool use_cache = options->use_cache && cache_open();
+  if(use_cache){
+
+    uint64_t start = stats_now_us();
+    rc = cache_getpwuid_r(uid, result, buffer, buflen, false);
+    cache_stats(rc, start);
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User id %u found in cache", uid); hotset_hit(result->pw_name); return LOOKUP_FOUND; }
+    stale_ok = (rc == 2); /* expired: we can fall back on it if CentralEGA requests are throttled */
+  }
+
+  D1("Fetching user from CentralEGA");
+
+  /* Defining the callback */
+  int cega_callback(struct fega_user *user){
+
+    /* assert same name */
+    if( user->uid != uid ){
+      REPORT("Requested user id %u not matching user id response %u", uid, user->uid);
+      return 1;
+    }
+
+    /* Add to database. Ignore result.
+     In case the buffer is too small later, it'll fetch the same data from the cache, next time. */
+    if(use_cache && !pending) cache_store(user);
+
+    /* Prepare the answer */
+    char* homedir = strjoina(options->homedir_prefix, "/", user->username);
+    D1("User id %u [Username %s] [Homedir %s]", user->uid, user->username, homedir);
+    if( copy2buffer(user->username, &(result->pw_name)   , &buffer, &buflen) < 0 ) { return -1; }
+    if( copy2buffer("x", &(result->pw_passwd), &buffer, &buflen) < 0 ){ return -1; }
+    result->pw_uid = user->uid;
+    result->pw_gid = options->gid;
+    if( copy2buffer(homedir, &(result->pw_dir)   , &buffer, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(user->gecos,   &(result->pw_gecos) , &buffer, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(options->shell, &(result->pw_shell), &buffer, &buflen) < 0 ) { return -1; }
+
+    return 0;
+  }
+
+  if(use_cache){
+    pending = true;
+    rc = cache_pending(NULL, uid, cega_callback);
+    pending = false;
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User id %u found in the cache journal", uid); return LOOKUP_FOUND; }
+  }
+
+  rc = cega_resolve_uid(ruid, stale_ok, cega_callback);
+  if( rc == CEGA_THROTTLED && stale_ok ){
+    REPORT("User id %u served stale from cache", uid);
+    stats_count(STATS_CACHE_STALE);
+    trace_event(TRACE_CACHE_STALE, 0, 0);
+    rc = cache_getpwuid_r(uid, result, buffer, buflen, true);
+  }
+  if( rc == CEGA_THROTTLED ){ D1("Throttled"); return LOOKUP_THROTTLED; }
+  if( rc == CEGA_FAILED ){ D1("No answer from CentralEGA"); return LOOKUP_FAILED; }
+  if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+  if( rc > 0 ) { D1("User id %u not found in CentralEGA", uid); return LOOKUP_NOTFOUND; }
+  return LOOKUP_FOUND;
+}
+
+int
+lookup_getpwnam_r(const char *username, struct passwd *result, char *buffer, size_t buflen)
+{
+  if( !loadconfig() ) return LOOKUP_UNAVAIL;
+
+  /* bail out if we're looking for the root user */
+  /* if( !strcmp(username, "root") ){ D1("bail out when root"); return LOOKUP_NOTFOUND; } */
+
+  D1("Looking up '%s'", username);
+  /* memset(buffer, '\0', buflen); */
+
+  int rc = 1;
+  bool stale_ok = false, pending = false;
+
+  bool use_cache = options->use_cache && cache_open();
+  if(use_cache){
+
+    uint64_t start = stats_now_us();
+    rc = cache_getpwnam_r(username, result, buffer, buflen, false);
+    cache_stats(rc, start);
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User %s found in cache", username); hotset_hit(username); return LOOKUP_FOUND; }
+    stale_ok = (rc == 2); /* expired: we can fall back on it if CentralEGA requests are throttled */
+  }
+
+  D1("Fetching user from CentralEGA");
+
+  /* Defining the callback */
+  int cega_callback(struct fega_user *user){
+
+    /* assert same name */
+    if( strcmp(username, user->username) ){
+      REPORT("Requested username %s not matching username response %s", username, user->username);
+      return 1;
+    }
+
+    /* Add to database. Ignore result.
+     In case the buffer is too small later, it'll fetch the same data from the cache, next time. */
+    if(use_cache && !pending) cache_store(user);
+
+    /* Prepare the answer */
+    char* homedir = strjoina(options->homedir_prefix, "/", username);
+    D1("Username %s [Homedir %s]", user->username, homedir);
+    result->pw_name = (char*)username; /* no need to copy to buffer */
+    if( copy2buffer("x", &(result->pw_passwd), &buffer, &buflen) < 0 ){ return -1; }
+    result->pw_uid = user->uid;
+    result->pw_gid = options->gid;
+    if( copy2buffer(homedir, &(result->pw_dir)   , &buffer, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(user->gecos,   &(result->pw_gecos) , &buffer, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(options->shell, &(result->pw_shell), &buffer, &buflen) < 0 ) { return -1; }
+
+    return 0;
+  }
+
+  if(use_cache){
+    pending = true;
+    rc = cache_pending(username, 0, cega_callback);
+    pending = false;
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User %s found in the cache journal", username); return LOOKUP_FOUND; }
+  }
+
+  rc = cega_resolve_username(username, stale_ok, cega_callback);
+  if( rc == CEGA_THROTTLED && stale_ok ){
+    REPORT("User %s served stale from cache", username);
+    stats_count(STATS_CACHE_STALE);
+    trace_event(TRACE_CACHE_STALE, 0, 0);
+    rc = cache_getpwnam_r(username, result, buffer, buflen, true);
+  }
+  if( rc == CEGA_THROTTLED ){ D1("Throttled"); return LOOKUP_THROTTLED; }
+  if( rc == CEGA_FAILED ){ D1("No answer from CentralEGA"); return LOOKUP_FAILED; }
+  if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+  if( rc > 0 ) { D1("User %s not found in CentralEGA", username); return LOOKUP_NOTFOUND; }
+  REPORT("User %s found in CentralEGA", username);
+  return LOOKUP_FOUND;
+}
+
+int
+lookup_getspnam_r(const char *username, struct spwd *result, char *buffer, size_t buflen)
+{
+  if( !loadconfig() ) return LOOKUP_UNAVAIL;
+
+  /* bail out if we're looking for the root user */
+  /* if( !strcmp(username, "root") ){ D1("bail out when root"); return LOOKUP_NOTFOUND; } */
+
+  D1("Looking up '%s'", username);
+  /* memset(buffer, '\0', buflen); */
+
+  int rc = 1;
+  bool stale_ok = false, pending = false;
+
+  bool use_cache = options->use_cache && cache_open();
+  if(use_cache){
+
+    uint64_t start = stats_now_us();
+    rc = cache_getspnam_r(username, result, buffer, buflen, false);
+    cache_stats(rc, start);
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User %s found in cache", username); hotset_hit(username); return LOOKUP_FOUND; }
+    stale_ok = (rc == 2); /* expired: we can fall back on it if CentralEGA requests are throttled */
+  }
+
+
+  D1("Fetching user from CentralEGA");
+
+  /* Defining the callback */
+  int cega_callback(struct fega_user *user){
+
+    /* assert same name */
+    if( strcmp(username, user->username) ){
+      REPORT("Requested username %s not matching username response %s", username, user->username);
+      return 1;
+    }
+
+    /* Add to database. Ignore result.
+     In case the buffer is too small later, it'll fetch the same data from the cache, next time. */
+    if(use_cache && !pending) cache_store(user);
+
+    /* Prepare the answer */
+    result->sp_namp = (char*)username; /* no need to copy to buffer */
+    if( copy2buffer(user->pwdh, &(result->sp_pwdp), &buffer, &buflen) < 0 ){ return -1; }
+    result->sp_lstchg = user->last_changed;
+    result->sp_min = options->sp_min;
+    result->sp_max = options->sp_max;
+    result->sp_warn = options->sp_warn;
+    result->sp_inact = options->sp_inact;
+    result->sp_expire = options->sp_expire;
+
+    return 0;
+  }
+
+  if(use_cache){
+    pending = true;
+    rc = cache_pending(username, 0, cega_callback);
+    pending = false;
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User %s found in the cache journal", username); return LOOKUP_FOUND; }
+  }
+
+  rc = cega_resolve_username(username, stale_ok, cega_callback);
+  if( rc == CEGA_THROTTLED && stale_ok ){
+    REPORT("User %s served stale from cache", username);
+    stats_count(STATS_CACHE_STALE);
+    trace_event(TRACE_CACHE_STALE, 0, 0);
+    rc = cache_getspnam_r(username, result, buffer, buflen, true);
+  }
+  if( rc == CEGA_THROTTLED ){ D1("Throttled"); return LOOKUP_THROTTLED; }
+  if( rc == CEGA_FAILED ){ D1("No answer from CentralEGA"); return LOOKUP_FAILED; }
+  if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+  if( rc > 0 ) { D1("User %s not found in CentralEGA", username); return LOOKUP_NOTFOUND; }
+  REPORT("User %s found in CentralEGA", username);
+  return LOOKUP_FOUND;
+}
+
+int
+lookup_getuser_r(const char *username, struct passwd *pw, struct spwd *sp, char *buffer, size_t buflen)
+{
+  if( !loadconfig() ) return LOOKUP_UNAVAIL;
+
+  D1("Looking up '%s'", username);
+
+  int rc = 1;
+  bool stale_ok = false, pending = false;
+
+  bool use_cache = options->use_cache && cache_open();
+  if(use_cache){
+
+    uint64_t start = stats_now_us();
+    rc = cache_getuser_r(username, pw, sp, buffer, buflen, false);
+    cache_stats(rc, start);
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User %s found in cache", username); hotset_hit(username); return LOOKUP_FOUND; }
+    stale_ok = (rc == 2); /* expired: we can fall back on it if CentralEGA requests are throttled */
+  }
+
+  D1("Fetching user from CentralEGA");
+
+  /* Defining the callback */
+  int cega_callback(struct fega_user *user){
+
+    /* assert same name */
+    if( strcmp(username, user->username) ){
+      REPORT("Requested username %s not matching username response %s", username, user->username);
+      return 1;
+    }
+
+    /* Add to database. Ignore result.
+     In case the buffer is too small later, it'll fetch the same data from the cache, next time. */
+    if(use_cache && !pending) cache_store(user);
+
+    /* Prepare the answer */
+    char* homedir = strjoina(options->homedir_prefix, "/", username);
+    D1("Username %s [Homedir %s]", user->username, homedir);
+    pw->pw_name = (char*)username; /* no need to copy to buffer */
+    if( copy2buffer("x", &(pw->pw_passwd), &buffer, &buflen) < 0 ){ return -1; }
+    pw->pw_uid = user->uid;
+    pw->pw_gid = options->gid;
+    if( copy2buffer(homedir, &(pw->pw_dir)   , &buffer, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(user->gecos,   &(pw->pw_gecos) , &buffer, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(options->shell, &(pw->pw_shell), &buffer, &buflen) < 0 ) { return -1; }
+
+    sp->sp_namp = (char*)username;
+    if( copy2buffer(user->pwdh, &(sp->sp_pwdp), &buffer, &buflen) < 0 ){ return -1; }
+    sp->sp_lstchg = user->last_changed;
+    sp->sp_min = options->sp_min;
+    sp->sp_max = options->sp_max;
+    sp->sp_warn = options->sp_warn;
+    sp->sp_inact = options->sp_inact;
+    sp->sp_expire = options->sp_expire;
+
+    return 0;
+  }
+
+  if(use_cache){
+    pending = true;
+    rc = cache_pending(username, 0, cega_callback);
+    pending = false;
+    if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+    if( rc == 0  ){ REPORT("User %s found in the cache journal", username); return LOOKUP_FOUND; }
+  }
+
+  rc = cega_resolve_username(username, stale_ok, cega_callback);
+  if( rc == CEGA_THROTTLED && stale_ok ){
+    REPORT("User %s served stale from cache", username);
+    stats_count(STATS_CACHE_STALE);
+    trace_event(TRACE_CACHE_STALE, 0, 0);
+    rc = cache_getuser_r(username, pw, sp, buffer, buflen, true);
+  }
+  if( rc == CEGA_THROTTLED ){ D1("Throttled"); return LOOKUP_THROTTLED; }
+  if( rc == CEGA_FAILED ){ D1("No answer from CentralEGA"); return LOOKUP_FAILED; }
+  if( rc == -1 ){ D1("Buffer too small"); return LOOKUP_ERANGE; }
+  if( rc > 0 ) { D1("User %s not found in CentralEGA", username); return LOOKUP_NOTFOUND; }
+  REPORT("User %s found in CentralEGA", username);
+  return LOOKUP_FOUND;
+}
@@ -0,0 +1,29 @@
+#ifndef __FEGA_LOOKUP_H_INCLUDED__
+#define __FEGA_LOOKUP_H_INCLUDED__
+
+#include <pwd.h>
+#include <shadow.h>
+#include <sys/types.h>
+
+/*
+ * The EGA user lookups: the cache first, then CentralEGA on a miss
+ * (storing the answer), and an expired cache entry when CentralEGA is throttled.
+ *
+ * Used by the NSS module, and directly by the PAM modules, bypassing nsswitch.
+ * No access control here: callers decide who may see the password hashes.
+ */
+#define LOOKUP_FOUND      0
+#define LOOKUP_NOTFOUND   1
+#define LOOKUP_ERANGE    -1 /* buffer too small */
+#define LOOKUP_THROTTLED -2 /* same as CEGA_THROTTLED */
+#define LOOKUP_UNAVAIL   -3 /* no (valid) configuration */
+#define LOOKUP_FAILED    -4 /* same as CEGA_FAILED: it can not tell whether the user exists */
+
+int lookup_getpwnam_r(const char *username, struct passwd *result, char *buffer, size_t buflen);
+int lookup_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen);
+int lookup_getspnam_r(const char *username, struct spwd *result, char *buffer, size_t buflen);
+
+/* Both entries at once, with a single cache query or CentralEGA request */
+int lookup_getuser_r(const char *username, struct passwd *pw, struct spwd *sp, char *buffer, size_t buflen);
+
+#endif /* !__FEGA_LOOKUP_H_INCLUDED__ */
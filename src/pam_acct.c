@@ -14,6 +14,7 @@
 #include <security/pam_modutil.h>
 
 #include "utils.h"
+#include "pam_user.h"
 
 #define EGA_OPT_SILENT	          (1)
 #define EGA_OPT_DEBUG	          (1 << 1)
@@ -66,11 +67,16 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char *argv[])
     return PAM_USER_UNKNOWN;
   }
 
-  /* Fetch home directory passwd entry (using NSS) */
+  /* Fetch home directory passwd entry (from the auth module, else using NSS) */
   D3("Looking for %s", username);
-  struct passwd* user = getpwnam(username);
-  //struct passwd* user = pam_modutil_getpwnam(pamh, username);
-  if( user == NULL ){ D1("EGA: Unknown user: %s", username); return PAM_ACCT_EXPIRED; }
+  const struct passwd* user = ega_pam_user_get(pamh, username);
+  if( user == NULL ){
+    struct passwd* pw = getpwnam(username);
+    //struct passwd* pw = pam_modutil_getpwnam(pamh, username);
+    if( pw == NULL ){ D1("EGA: Unknown user: %s", username); return PAM_ACCT_EXPIRED; }
+    (void)ega_pam_user_set(pamh, pw); /* for the session module */
+    user = pw;
+  }
 
   D1("Homedir for %s: %s", user->pw_name, user->pw_dir);
   errno = 0;
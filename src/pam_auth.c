@@ -22,17 +22,36 @@
 #include "blowfish/crypt_blowfish.h"
 
 #include "utils.h"
+#include "hashlimit.h"
+#include "tarpit.h"
+#include "shacrypt.h"
+#include "credcache.h"
+#include "lookup.h"
+#include "pam_user.h"
+#include "stats.h"
+#include "trace.h"
 
 #define EGA_DEFAULT_PROMPT "Please enter your EGA password: "
+#define EGA_DEFAULT_HASH_MAX_WAIT 10000 /* ms */
+#define EGA_DEFAULT_TARPIT_FREE   5
+#define EGA_DEFAULT_TARPIT_BASE   1000   /* ms */
+#define EGA_DEFAULT_TARPIT_MAX    900000 /* ms */
+#define EGA_DEFAULT_TARPIT_DELAY  1000   /* ms */
 
 #define PAM_OPT_DEBUG			0x01
 #define PAM_OPT_USE_FIRST_PASS		0x02
 #define	PAM_OPT_TRY_FIRST_PASS		0x04
 #define	PAM_OPT_ECHO_PASS		0x08
+#define	PAM_OPT_DIRECT			0x10
 
 struct options_s {
   int flags;
   char* prompt;
+  unsigned int hash_slots; /* concurrent hash computations on the node, 0 for no limit */
+  long hash_max_wait;      /* ms */
+  struct tarpit_conf tarpit;
+  long tarpit_delay;       /* ms, answer time for blocked attempts */
+  unsigned int cred_cache_ttl; /* seconds, 0 for no credential cache */
 };
 
 /*
@@ -53,8 +72,24 @@ void pam_options(struct options_s *opts, int argc, const char **argv)
       opts->flags |= PAM_OPT_TRY_FIRST_PASS;
     } else if (!strcmp(*args, "echo_pass")) {
       opts->flags |= PAM_OPT_ECHO_PASS;
+    } else if (!strcmp(*args, "direct")) {
+      opts->flags |= PAM_OPT_DIRECT;
     } else if (!strncmp(*args,"prompt=",7)) {
       opts->prompt = *args+7;
+    } else if (!strncmp(*args,"hash_slots=",11)) {
+      opts->hash_slots = strtoul(*args+11, NULL, 10);
+    } else if (!strncmp(*args,"hash_max_wait=",14)) {
+      opts->hash_max_wait = strtol(*args+14, NULL, 10);
+    } else if (!strncmp(*args,"tarpit_free=",12)) {
+      opts->tarpit.free = strtoul(*args+12, NULL, 10);
+    } else if (!strncmp(*args,"tarpit_base=",12)) {
+      opts->tarpit.base = strtol(*args+12, NULL, 10);
+    } else if (!strncmp(*args,"tarpit_max=",11)) {
+      opts->tarpit.max = strtol(*args+11, NULL, 10);
+    } else if (!strncmp(*args,"tarpit_delay=",13)) {
+      opts->tarpit_delay = strtol(*args+13, NULL, 10);
+    } else if (!strncmp(*args,"cred_cache_ttl=",15)) {
+      opts->cred_cache_ttl = strtoul(*args+15, NULL, 10);
     } else {
       D1("unknown option: %s", *args);
     }
@@ -63,6 +98,9 @@ void pam_options(struct options_s *opts, int argc, const char **argv)
 }
 
 static int timingsafe_bcmp(const void *b1, const void *b2, size_t n);
+static int verify_password(const char* password, const char* pwdh);
+static char* get_password_hash(pam_handle_t *pamh, const char* user, bool direct, int *outcome);
+static void sleep_until(const struct timespec* deadline);
 #define MIN(a,b) ((a)<(b))?(a):(b)
 /*
  * authenticate user
@@ -70,7 +108,7 @@ static int timingsafe_bcmp(const void *b1, const void *b2, size_t n);
 PAM_EXTERN int
 pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
-  const char *user = NULL, *password = NULL;
+  const char *user = NULL, *password = NULL, *rhost = NULL;
   const void *item;
   int rc;
   const struct pam_conv *conv;
@@ -81,6 +119,14 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
   opts.flags = 0;
   opts.prompt = EGA_DEFAULT_PROMPT;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  opts.hash_slots = (ncpu > 0)?ncpu:1;
+  opts.hash_max_wait = EGA_DEFAULT_HASH_MAX_WAIT;
+  opts.tarpit.free = EGA_DEFAULT_TARPIT_FREE;
+  opts.tarpit.base = EGA_DEFAULT_TARPIT_BASE;
+  opts.tarpit.max = EGA_DEFAULT_TARPIT_MAX;
+  opts.tarpit_delay = EGA_DEFAULT_TARPIT_DELAY;
+  opts.cred_cache_ttl = 0;
   
   D2("Getting auth PAM module options");
 
@@ -90,6 +136,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
   rc = pam_get_item(pamh, PAM_RHOST, &item);
   if ( rc != PAM_SUCCESS) { D1("EGA: Unknown rhost: %s", pam_strerror(pamh, rc)); }
   D1("Authenticating %s%s%s", user, (item)?" from ":"", (item)?((char*)item):"");
+  if (rc == PAM_SUCCESS && item && *(char*)item) rhost = (char*)item;
 
   pam_options(&opts, argc, argv);
 
@@ -144,33 +191,59 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
   /* Now, we have the password */
   D1("Authenticating user %s with password", user);
 
-  struct spwd *shadow = getspnam(user);
-  if(!shadow){ D1("Could not load the password hash of '%s'", user); return PAM_AUTH_ERR; }
-
-  size_t phlen = (shadow->sp_pwdp == NULL)?0:strlen(shadow->sp_pwdp);
+  /*
+   * Blocked attempts get no lookup and no hash. They are all answered
+   * after the same delay, whether the user exists or not, and whichever counter blocked them.
+   */
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  if(tarpit_blocked(&opts.tarpit, user, rhost)){
+    deadline.tv_sec += opts.tarpit_delay / 1000;
+    deadline.tv_nsec += (opts.tarpit_delay % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000){ deadline.tv_sec++; deadline.tv_nsec -= 1000000000; }
+    sleep_until(&deadline);
+    return PAM_AUTH_ERR;
+  }
 
-  if(!strncmp(shadow->sp_pwdp, "$2", 2)){
-    D2("Using Blowfish");
-    char pwdh_computed[64];
-    memset(pwdh_computed, '\0', 64);
+  int outcome;
+  char *pwdh = get_password_hash(pamh, user, opts.flags & PAM_OPT_DIRECT, &outcome);
+  if(!pwdh && outcome != LOOKUP_NOTFOUND){
+    /* Throttled, no answer or no memory: not the user's fault, not counted (as for hashlimit below) */
+    D1("Could not load the password hash of '%s' (%d): try again later", user, outcome);
+    return PAM_AUTHINFO_UNAVAIL;
+  }
+  if(!pwdh){
+    D1("No password hash for '%s'", user);
+    tarpit_failure(&opts.tarpit, user, rhost);
+    return PAM_AUTH_ERR;
+  }
 
-    if(_crypt_blowfish_rn(password, shadow->sp_pwdp, pwdh_computed, 64) == NULL){
-      D2("bcrypt failed: %s", strerror(errno));
-      return PAM_AUTH_ERR;
-    }
+  /* Same user, same hash, same password, a moment ago */
+  if(credcache_check(opts.cred_cache_ttl, user, pwdh, password)){
+    free(pwdh);
+    tarpit_success(&opts.tarpit, user);
+    return PAM_SUCCESS;
+  }
 
-    //if(!strcmp(password_hash, (char*)pwdh_computed)) { return PAM_SUCCESS; }
-    if(phlen == strlen(pwdh_computed) &&
-       !timingsafe_bcmp(shadow->sp_pwdp, (char*)pwdh_computed, phlen)) { return PAM_SUCCESS; }
+  /* Wait for our turn, during a login storm */
+  int slot = hashlimit_acquire(opts.hash_slots, opts.hash_max_wait);
+  if(slot == HASHLIMIT_TIMEOUT || slot == HASHLIMIT_FULL){
+    D1("Too many concurrent authentications: try again later");
+    free(pwdh);
+    return PAM_AUTHINFO_UNAVAIL;
+  }
 
-  } else {
-    D2("Using libc: supporting MD5, SHA256, SHA512");
-    char *pwdh_computed = crypt(password, shadow->sp_pwdp);
-    if(phlen == strlen(pwdh_computed) &&
-       !timingsafe_bcmp(shadow->sp_pwdp, pwdh_computed, phlen)) { return PAM_SUCCESS; }
+  rc = verify_password(password, pwdh);
+  hashlimit_release(slot);
+  if(rc == PAM_SUCCESS) credcache_store(opts.cred_cache_ttl, user, pwdh, password);
+  free(pwdh);
+  if(rc == PAM_SUCCESS){
+    tarpit_success(&opts.tarpit, user);
+    return PAM_SUCCESS;
   }
 
   D1("Authentication failed for %s", user);
+  tarpit_failure(&opts.tarpit, user, rhost);
   return PAM_AUTH_ERR;
 }
 
@@ -190,6 +263,143 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
   return PAM_SUCCESS;
 }
 
+/*
+ * Compares the password against the hash, in constant time
+ */
+static int
+verify_password(const char* password, const char* pwdh)
+{
+  size_t phlen = (pwdh == NULL)?0:strlen(pwdh);
+
+  if(!strncmp(pwdh, "$2", 2)){
+    D2("Using Blowfish");
+    char pwdh_computed[64];
+    memset(pwdh_computed, '\0', 64);
+
+    if(_crypt_blowfish_rn(password, pwdh, pwdh_computed, 64) == NULL){
+      D2("bcrypt failed: %s", strerror(errno));
+      return PAM_AUTH_ERR;
+    }
+
+    //if(!strcmp(password_hash, (char*)pwdh_computed)) { return PAM_SUCCESS; }
+    if(phlen == strlen(pwdh_computed) &&
+       !timingsafe_bcmp(pwdh, (char*)pwdh_computed, phlen)) { return PAM_SUCCESS; }
+
+  } else if(!strncmp(pwdh, "$5$", 3) || !strncmp(pwdh, "$6$", 3)){
+    D2("Using SHA-crypt");
+    char pwdh_computed[SHACRYPT_OUTPUT_SIZE];
+
+    if(shacrypt_rn(password, pwdh, pwdh_computed, sizeof(pwdh_computed)) == NULL){
+      D2("SHA-crypt declined (%s): falling back to libc", strerror(errno));
+      goto LIBC;
+    }
+
+    int rc = PAM_AUTH_ERR;
+    if(phlen == strlen(pwdh_computed) &&
+       !timingsafe_bcmp(pwdh, pwdh_computed, phlen)) { rc = PAM_SUCCESS; }
+    explicit_bzero(pwdh_computed, sizeof(pwdh_computed));
+    return rc;
+
+  } else {
+LIBC:
+    D2("Using libc: supporting MD5, SHA256, SHA512");
+    /* crypt_r and not crypt: several threads of the same process may be authenticating */
+    struct crypt_data *data = calloc(1, sizeof(struct crypt_data)); /* about 32kB: not on the stack */
+    if(!data){ D1("Could not allocate the crypt state"); return PAM_AUTH_ERR; }
+
+    int rc = PAM_AUTH_ERR;
+    char *pwdh_computed = crypt_r(password, pwdh, data);
+    if(pwdh_computed && phlen == strlen(pwdh_computed) &&
+       !timingsafe_bcmp(pwdh, pwdh_computed, phlen)) { rc = PAM_SUCCESS; }
+
+    explicit_bzero(data, sizeof(struct crypt_data));
+    free(data);
+    return rc;
+  }
+
+  return PAM_AUTH_ERR;
+}
+
+/*
+ * Returns a copy of the user's password hash, to be freed, or NULL.
+ * *outcome tells why: LOOKUP_NOTFOUND (no such user, or without a password hash)
+ * or a failure (LOOKUP_THROTTLED, LOOKUP_FAILED, also for no memory).
+ * Uses getspnam_r, as getspnam returns a static buffer.
+ *
+ * In direct mode, asks the EGA cache (and CentralEGA) itself, instead of going
+ * through nsswitch, the files module and then libnss_ega. Only when there is no
+ * usable EGA configuration does it fall back to NSS.
+ * The passwd entry comes with the same query, and is left on the handle
+ * for the account and session modules.
+ */
+static char*
+get_password_hash(pam_handle_t *pamh, const char* user, bool direct, int *outcome)
+{
+  struct spwd shadow, *result = NULL;
+  struct passwd pw;
+  size_t buflen = 1024;
+  char *buffer = NULL, *pwdh = NULL;
+  uint64_t start = stats_now_us();
+  int rc;
+
+  *outcome = LOOKUP_FAILED; /* until we know better */
+
+  stats_set_source(STATS_PAM);
+  stats_count(STATS_LOOKUPS);
+  trace_begin(STATS_PAM, TRACE_GETUSER, user, -1); /* through NSS, libnss_ega traces its own lookup too */
+
+  if(direct){
+    do {
+      free(buffer);
+      buffer = malloc(buflen);
+      if(!buffer) goto DONE;
+      rc = lookup_getuser_r(user, &pw, &shadow, buffer, buflen);
+      if(rc == LOOKUP_ERANGE) stats_count(STATS_ERANGE);
+      buflen *= 2;
+    } while(rc == LOOKUP_ERANGE && buflen <= 65536);
+
+    if(rc == LOOKUP_FOUND && shadow.sp_pwdp){
+      pwdh = strdup(shadow.sp_pwdp);
+      (void)ega_pam_user_set(pamh, &pw);
+    }
+    free(buffer);
+    if(rc == LOOKUP_NOTFOUND || (rc == LOOKUP_FOUND && !shadow.sp_pwdp)) *outcome = LOOKUP_NOTFOUND;
+    else if(rc == LOOKUP_THROTTLED) *outcome = rc; /* else failed, also for ERANGE past 64kB or strdup */
+    if(rc == LOOKUP_THROTTLED) stats_count(STATS_THROTTLED);
+    if(rc != LOOKUP_UNAVAIL) goto DONE;
+
+    D1("No EGA configuration: falling back to NSS");
+    buffer = NULL;
+    buflen = 1024;
+  }
+
+  do {
+    free(buffer);
+    buffer = malloc(buflen);
+    if(!buffer) goto DONE;
+    rc = getspnam_r(user, &shadow, buffer, buflen, &result);
+    if(rc == ERANGE) stats_count(STATS_ERANGE);
+    buflen *= 2;
+  } while(rc == ERANGE && buflen <= 65536);
+
+  if(rc == 0 && result && result->sp_pwdp) pwdh = strdup(result->sp_pwdp);
+  free(buffer);
+  /* Not found: 0 without a result (or ENOENT). Anything else (EAGAIN when throttled or no answer, ENOMEM) failed */
+  if((rc == 0 && (!result || !result->sp_pwdp)) || rc == ENOENT) *outcome = LOOKUP_NOTFOUND;
+
+DONE:
+  trace_end((pwdh)?LOOKUP_FOUND:*outcome);
+  stats_count((pwdh)?STATS_FOUND:STATS_NOTFOUND);
+  stats_time(STATS_LOOKUP, stats_now_us() - start);
+  return pwdh;
+}
+
+static void
+sleep_until(const struct timespec* deadline)
+{
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+}
+
 static int
 timingsafe_bcmp(const void *b1, const void *b2, size_t n)
 {
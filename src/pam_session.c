@@ -15,6 +15,7 @@
 #include <security/pam_modutil.h>
 
 #include "utils.h"
+#include "pam_user.h"
 
 struct options_s {
   int flags;
@@ -24,7 +25,7 @@ struct options_s {
 /*
  * Fetch module options
  */
-void pam_options(struct options_s *opts, int argc, const char **argv)
+static void pam_options(struct options_s *opts, int argc, const char **argv)
 {
   char** args = (char**)argv;
   /* Step through module arguments */
@@ -59,8 +60,9 @@ pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
   if ( (rc = pam_get_user(pamh, &username, NULL)) != PAM_SUCCESS) { D1("EGA: Unknown user: %s", pam_strerror(pamh, rc)); return rc; }
 
-  /* Get user and make sure the homedir is created */
-  struct passwd *user = getpwnam(username);
+  /* Get user (from the auth or account module, else using NSS) and make sure the homedir is created */
+  const struct passwd *user = ega_pam_user_get(pamh, username);
+  if(!user) user = getpwnam(username);
   if(!user){ D1("Could not find the user '%s'", username); return PAM_SESSION_ERR; }
 
   /* Handling umask */
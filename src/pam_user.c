@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "utils.h"
+#include "pam_user.h"
+
+static void
+cleanup(pam_handle_t *pamh, void *data, int error_status)
+{
+  struct ega_pam_user *u = (struct ega_pam_user*)data;
+  explicit_bzero(u, u->size);
+  free(u);
+}
+
+static inline char*
+copy(const char* s, char** p)
+{
+  char* d = *p;
+  *p = stpcpy(d, (s)?s:"") + 1;
+  return d;
+}
+
+int
+ega_pam_user_set(pam_handle_t *pamh, const struct passwd *pw)
+{
+  if(!pw || !pw->pw_name) return PAM_BUF_ERR;
+
+#define LEN(s) (((s)?strlen(s):0) + 1)
+  size_t size = sizeof(struct ega_pam_user) + LEN(pw->pw_name) + LEN(pw->pw_passwd)
+              + LEN(pw->pw_gecos) + LEN(pw->pw_dir) + LEN(pw->pw_shell);
+#undef LEN
+
+  struct ega_pam_user *u = malloc(size);
+  if(!u){ D1("Could not allocate the user record"); return PAM_BUF_ERR; }
+
+  char* p = u->buffer;
+  u->version = EGA_PAM_USER_VERSION;
+  u->size = (uint32_t)size;
+  u->pw.pw_uid = pw->pw_uid;
+  u->pw.pw_gid = pw->pw_gid;
+  u->pw.pw_name = copy(pw->pw_name, &p);
+  u->pw.pw_passwd = copy(pw->pw_passwd, &p);
+  u->pw.pw_gecos = copy(pw->pw_gecos, &p);
+  u->pw.pw_dir = copy(pw->pw_dir, &p);
+  u->pw.pw_shell = copy(pw->pw_shell, &p);
+
+  /* replaces (and cleans up) any previous one */
+  int rc = pam_set_data(pamh, EGA_PAM_USER_DATA, u, cleanup);
+  if(rc != PAM_SUCCESS){ D1("Could not store the user record: %s", pam_strerror(pamh, rc)); free(u); return rc; }
+  D2("User record stored for %s", u->pw.pw_name);
+  return PAM_SUCCESS;
+}
+
+const struct passwd*
+ega_pam_user_get(pam_handle_t *pamh, const char *username)
+{
+  const void *data = NULL;
+
+  if(pam_get_data(pamh, EGA_PAM_USER_DATA, &data) != PAM_SUCCESS || !data){ D2("No user record"); return NULL; }
+
+  const struct ega_pam_user *u = (const struct ega_pam_user*)data;
+  if(u->version != EGA_PAM_USER_VERSION || u->size < sizeof(struct ega_pam_user)){
+    D1("Ignoring a user record of version %u", u->version);
+    return NULL;
+  }
+
+  /* PAM_USER can change between the phases */
+  if(!username || strcmp(u->pw.pw_name, username)){ D1("User record for %s, not %s", u->pw.pw_name, username); return NULL; }
+
+  D2("Reusing the user record of %s", username);
+  return &u->pw;
+}
@@ -0,0 +1,36 @@
+#ifndef __FEGA_PAM_USER_H_INCLUDED__
+#define __FEGA_PAM_USER_H_INCLUDED__
+
+#include <stdint.h>
+#include <pwd.h>
+#include <security/pam_modules.h>
+
+/*
+ * The user's passwd entry, resolved once per login and kept on the PAM handle
+ * (pam_set_data), so that the auth, account and session modules do not each
+ * go through NSS, the cache and maybe CentralEGA for the same user.
+ *
+ * The first module to resolve the user stores it, the others reuse it.
+ * The data is visible to every module of the stack: never put the password hash in there.
+ *
+ * The modules are installed separately: a reader ignores a record of another version
+ * (or size), and looks the user up itself, as it would without one.
+ * Bump EGA_PAM_USER_VERSION whenever the layout changes.
+ */
+#define EGA_PAM_USER_DATA    "ega_user"
+#define EGA_PAM_USER_VERSION 1
+
+struct ega_pam_user {
+  uint32_t version;
+  uint32_t size;     /* of the whole record, strings included */
+  struct passwd pw;  /* strings pointing into buffer */
+  char buffer[];
+};
+
+/* Stores a copy of the entry. Returns a PAM status, failing is harmless */
+int ega_pam_user_set(pam_handle_t *pamh, const struct passwd *pw);
+
+/* The stored entry, if it is for <username>, NULL otherwise */
+const struct passwd* ega_pam_user_get(pam_handle_t *pamh, const char *username);
+
+#endif /* !__FEGA_PAM_USER_H_INCLUDED__ */
@@ -0,0 +1,76 @@
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "utils.h"
+#include "config.h"
+#include "shm.h"
+#include "ratelimit.h"
+
+/*
+ * Node-wide rate limit on the requests to CentralEGA,
+ * shared by all processes through a token bucket in shared memory.
+ *
+ * The bucket is implemented as a GCRA (generic cell rate algorithm):
+ * the only state is the theoretical arrival time (tat) of the next request,
+ * updated with a compare-and-swap. A request is allowed if tat is at most
+ * (burst - 1) intervals in the future. CLOCK_MONOTONIC is the same for all processes.
+ *
+ * Requests which can be served stale from the cache only get half the burst,
+ * and never wait, so that the others keep some room.
+ * The others reserve a future slot and wait for it, up to cega_rate_max_wait.
+ *
+ * Without the shared bucket (non-root processes, or no /dev/shm), a process is limited
+ * on its own bucket, as if it were alone on the node: never unlimited.
+ */
+#define RATELIMIT_SHM_NAME "/ega-cega-ratelimit.v1"
+
+struct ratelimit_s {
+  uint64_t tat; /* in us */
+};
+
+static struct ratelimit_s *bucket = NULL;
+static struct ratelimit_s local = { 0 };
+
+static inline uint64_t
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+bool
+ratelimit_acquire(bool stale_ok)
+{
+  if(!options->cega_rate_limit) return true; /* unlimited */
+
+  if(!bucket) bucket = shm_attach(RATELIMIT_SHM_NAME, sizeof(struct ratelimit_s), 0644, NULL);
+  struct ratelimit_s *b = (bucket)?bucket:&local;
+  if(!bucket) D2("No shared bucket: limiting this process only");
+
+  uint64_t interval = 1000000ULL / options->cega_rate_limit;
+  uint64_t burst = (options->cega_rate_burst)?options->cega_rate_burst:1;
+  uint64_t tolerance = interval * (burst - 1);
+  if(stale_ok) tolerance /= 2;
+
+  uint64_t now = now_us();
+  uint64_t old = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+  uint64_t tat, wait;
+
+  do {
+    tat = (old > now)?old:now;
+    wait = (tat - now > tolerance)?(tat - now - tolerance):0;
+
+    if(wait && stale_ok){ D2("Throttled: the cache can answer"); return false; }
+    if(wait > (uint64_t)options->cega_rate_max_wait * 1000){ D1("Throttled: the queue is %lu us long", (unsigned long)wait); return false; }
+
+  } while(!__atomic_compare_exchange_n(&b->tat, &old, tat + interval, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if(wait){
+    D2("Queued for %lu us", (unsigned long)wait);
+    struct timespec ts = { .tv_sec = wait / 1000000, .tv_nsec = (wait % 1000000) * 1000 };
+    while(nanosleep(&ts, &ts) && errno == EINTR); /* the slot is ours */
+  }
+  return true;
+}
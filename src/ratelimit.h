@@ -0,0 +1,8 @@
+#ifndef __FEGA_RATELIMIT_H_INCLUDED__
+#define __FEGA_RATELIMIT_H_INCLUDED__
+
+#include <stdbool.h>
+
+bool ratelimit_acquire(bool stale_ok);
+
+#endif /* !__FEGA_RATELIMIT_H_INCLUDED__ */
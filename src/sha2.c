@@ -0,0 +1,544 @@
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA2_X86 1
+#else
+#define SHA2_X86 0
+#endif
+
+#include "utils.h"
+#include "sha2.h"
+
+/*
+ * SHA-256 and SHA-512 (FIPS 180-4).
+ *
+ * Only the compression functions differ per CPU:
+ *  - SHA-256: SHA-NI (sha256rnds2 and friends), else portable C.
+ *  - SHA-512: portable C only. No x86 CPU we run on has the SHA-512 instructions, and
+ *    sha-crypt hashes one short message after the other, so there is nothing for AVX2
+ *    to work on in parallel. Compiling the same code for BMI2 (rorx) ran at libc speed.
+ *
+ * The first kernel in each list which the CPU supports and which passes
+ * the known-answer test is used for the rest of the process.
+ */
+
+struct sha256_kernel {
+  const char* name;
+  void (*compress)(uint32_t h[8], const uint8_t* blocks, size_t n);
+  bool (*usable)(void);
+};
+
+struct sha512_kernel {
+  const char* name;
+  void (*compress)(uint64_t h[8], const uint8_t* blocks, size_t n);
+  bool (*usable)(void);
+};
+
+static const uint32_t K256[64] __attribute__((aligned(16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint64_t K512[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static inline uint32_t ror32(uint32_t x, unsigned int n) { return (x >> n) | (x << (32 - n)); }
+static inline uint64_t ror64(uint64_t x, unsigned int n) { return (x >> n) | (x << (64 - n)); }
+
+static inline uint32_t load32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static inline uint64_t load64(const uint8_t* p) { return ((uint64_t)load32(p) << 32) | load32(p + 4); }
+
+static inline void store32(uint8_t* p, uint32_t x) { p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x; }
+static inline void store64(uint8_t* p, uint64_t x) { store32(p, x >> 32); store32(p + 4, x); }
+
+/*
+ * Portable kernels
+ */
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+static void
+sha256_compress_generic(uint32_t h[8], const uint8_t* blocks, size_t n)
+{
+  uint32_t w[64];
+  int i;
+
+  for(; n; n--, blocks += 64){
+    for(i = 0; i < 16; i++) w[i] = load32(blocks + 4 * i);
+    for(; i < 64; i++){
+      uint32_t s0 = ror32(w[i-15], 7) ^ ror32(w[i-15], 18) ^ (w[i-15] >> 3);
+      uint32_t s1 = ror32(w[i-2], 17) ^ ror32(w[i-2], 19) ^ (w[i-2] >> 10);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for(i = 0; i < 64; i++){
+      uint32_t t1 = k + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + CH(e, f, g) + K256[i] + w[i];
+      uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + MAJ(a, b, c);
+      k = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+  }
+}
+
+static void
+sha512_compress_generic(uint64_t h[8], const uint8_t* blocks, size_t n)
+{
+  uint64_t w[80];
+  int i;
+
+  for(; n; n--, blocks += 128){
+    for(i = 0; i < 16; i++) w[i] = load64(blocks + 8 * i);
+    for(; i < 80; i++){
+      uint64_t s0 = ror64(w[i-15], 1) ^ ror64(w[i-15], 8) ^ (w[i-15] >> 7);
+      uint64_t s1 = ror64(w[i-2], 19) ^ ror64(w[i-2], 61) ^ (w[i-2] >> 6);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint64_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for(i = 0; i < 80; i++){
+      uint64_t t1 = k + (ror64(e, 14) ^ ror64(e, 18) ^ ror64(e, 41)) + CH(e, f, g) + K512[i] + w[i];
+      uint64_t t2 = (ror64(a, 28) ^ ror64(a, 34) ^ ror64(a, 39)) + MAJ(a, b, c);
+      k = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+  }
+}
+
+#if SHA2_X86
+
+static bool
+cpu_has_leaf7(unsigned int ebx_bit)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+  return (ebx & ebx_bit) != 0;
+}
+
+static bool
+cpu_has_shani(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3)) return false;
+  return cpu_has_leaf7(bit_SHA);
+}
+
+/*
+ * SHA-NI works on the state as ABEF and CDGH, and does 2 rounds per sha256rnds2,
+ * 4 message words (and round constants) at a time.
+ * Group i of 4 rounds uses w[i % 4], and computes the message words 4 groups ahead:
+ * sha256msg1 and sha256msg2 do the sigma0 and sigma1 parts of the schedule.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_compress_shani(uint32_t h[8], const uint8_t* blocks, size_t n)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, tmp, msg, w[4];
+  int i;
+
+  tmp    = _mm_loadu_si128((const __m128i*)&h[0]);
+  state1 = _mm_loadu_si128((const __m128i*)&h[4]);
+  tmp    = _mm_shuffle_epi32(tmp, 0xB1);           /* CDAB */
+  state1 = _mm_shuffle_epi32(state1, 0x1B);        /* EFGH */
+  state0 = _mm_alignr_epi8(tmp, state1, 8);        /* ABEF */
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);     /* CDGH */
+
+  for(; n; n--, blocks += 64){
+    __m128i abef = state0, cdgh = state1;
+
+    for(i = 0; i < 4; i++)
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 16 * i)), mask);
+
+#pragma GCC unroll 16
+    for(i = 0; i < 16; i++){
+      __m128i *cur = &w[i & 3], *next = &w[(i + 1) & 3], *prev = &w[(i + 3) & 3];
+
+      msg = _mm_add_epi32(*cur, _mm_load_si128((const __m128i*)&K256[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if(i >= 3 && i <= 14){
+	tmp = _mm_alignr_epi8(*cur, *prev, 4);
+	*next = _mm_add_epi32(*next, tmp);
+	*next = _mm_sha256msg2_epu32(*next, *cur);
+      }
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+      if(i >= 1 && i <= 12)
+	*prev = _mm_sha256msg1_epu32(*prev, *cur);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp    = _mm_shuffle_epi32(state0, 0x1B);        /* FEBA */
+  state1 = _mm_shuffle_epi32(state1, 0xB1);        /* DCHG */
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);     /* DCBA */
+  state1 = _mm_alignr_epi8(state1, tmp, 8);        /* ABEF */
+
+  _mm_storeu_si128((__m128i*)&h[0], state0);
+  _mm_storeu_si128((__m128i*)&h[4], state1);
+}
+
+#endif /* SHA2_X86 */
+
+static const struct sha256_kernel sha256_kernels[] = {
+#if SHA2_X86
+  { "sha-ni", sha256_compress_shani, cpu_has_shani },
+#endif
+  { "generic", sha256_compress_generic, NULL },
+  { NULL, NULL, NULL }
+};
+
+static const struct sha512_kernel sha512_kernels[] = {
+  { "generic", sha512_compress_generic, NULL },
+  { NULL, NULL, NULL }
+};
+
+static const struct sha256_kernel *sha256_impl = NULL;
+static const struct sha512_kernel *sha512_impl = NULL;
+
+/*
+ * Known answers: the FIPS 180-2 two-block message,
+ * so that both the block chaining and the padding are exercised.
+ */
+static const char sha2_test_msg[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+static const uint8_t sha256_test_digest[SHA256_DIGEST_LENGTH] = {
+  0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+  0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1
+};
+
+static const char sha512_test_msg[] =
+  "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+
+static const uint8_t sha512_test_digest[SHA512_DIGEST_LENGTH] = {
+  0x8e, 0x95, 0x9b, 0x75, 0xda, 0xe3, 0x13, 0xda, 0x8c, 0xf4, 0xf7, 0x28, 0x14, 0xfc, 0x14, 0x3f,
+  0x8f, 0x77, 0x79, 0xc6, 0xeb, 0x9f, 0x7f, 0xa1, 0x72, 0x99, 0xae, 0xad, 0xb6, 0x88, 0x90, 0x18,
+  0x50, 0x1d, 0x28, 0x9e, 0x49, 0x00, 0xf7, 0xe4, 0x33, 0x1b, 0x99, 0xde, 0xc4, 0xb5, 0x43, 0x3a,
+  0xc7, 0xd3, 0x29, 0xee, 0xb6, 0xdd, 0x26, 0x54, 0x5e, 0x96, 0xe5, 0x5b, 0x87, 0x4b, 0xe9, 0x09
+};
+
+static void sha256_update_with(const struct sha256_kernel *kernel, struct sha256_ctx *ctx, const void *data, size_t len);
+static void sha256_final_with(const struct sha256_kernel *kernel, struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LENGTH]);
+static void sha512_update_with(const struct sha512_kernel *kernel, struct sha512_ctx *ctx, const void *data, size_t len);
+static void sha512_final_with(const struct sha512_kernel *kernel, struct sha512_ctx *ctx, uint8_t digest[SHA512_DIGEST_LENGTH]);
+
+/* On the kernel given, not the one in use: the other threads never see one that is not tested */
+static bool
+sha256_self_test(const struct sha256_kernel *kernel)
+{
+  struct sha256_ctx ctx;
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+
+  if(kernel->usable && !kernel->usable()) return false;
+
+  sha256_init(&ctx);
+  sha256_update_with(kernel, &ctx, sha2_test_msg, sizeof(sha2_test_msg) - 1);
+  sha256_final_with(kernel, &ctx, digest);
+
+  return !memcmp(digest, sha256_test_digest, sizeof(digest));
+}
+
+static bool
+sha512_self_test(const struct sha512_kernel *kernel)
+{
+  struct sha512_ctx ctx;
+  uint8_t digest[SHA512_DIGEST_LENGTH];
+
+  if(kernel->usable && !kernel->usable()) return false;
+
+  sha512_init(&ctx);
+  sha512_update_with(kernel, &ctx, sha512_test_msg, sizeof(sha512_test_msg) - 1);
+  sha512_final_with(kernel, &ctx, digest);
+
+  return !memcmp(digest, sha512_test_digest, sizeof(digest));
+}
+
+/*
+ * Concurrent first calls may each run the tests. They settle on the same kernel,
+ * published with an atomic store. Each call of update and final loads the kernel in use:
+ * all of them compute the same digests, so a context can go on with another one
+ * (after sha256_use_kernel).
+ */
+static const struct sha256_kernel*
+sha256_select(void)
+{
+  const struct sha256_kernel *kernel = __atomic_load_n(&sha256_impl, __ATOMIC_ACQUIRE);
+  if(kernel) return kernel;
+
+  for(kernel = sha256_kernels; kernel->name; kernel++)
+    if(sha256_self_test(kernel)) break;
+  if(!kernel->name) kernel = &sha256_kernels[ELEMENTSOF(sha256_kernels) - 2]; /* generic, regardless */
+
+  D2("Using the %s SHA-256 kernel", kernel->name);
+  __atomic_store_n(&sha256_impl, kernel, __ATOMIC_RELEASE);
+  return kernel;
+}
+
+static const struct sha512_kernel*
+sha512_select(void)
+{
+  const struct sha512_kernel *kernel = __atomic_load_n(&sha512_impl, __ATOMIC_ACQUIRE);
+  if(kernel) return kernel;
+
+  for(kernel = sha512_kernels; kernel->name; kernel++)
+    if(sha512_self_test(kernel)) break;
+  if(!kernel->name) kernel = &sha512_kernels[ELEMENTSOF(sha512_kernels) - 2];
+
+  D2("Using the %s SHA-512 kernel", kernel->name);
+  __atomic_store_n(&sha512_impl, kernel, __ATOMIC_RELEASE);
+  return kernel;
+}
+
+const char*
+sha256_kernel(void)
+{
+  return sha256_select()->name;
+}
+
+const char*
+sha512_kernel(void)
+{
+  return sha512_select()->name;
+}
+
+int
+sha256_use_kernel(const char* name)
+{
+  const struct sha256_kernel *kernel;
+  for(kernel = sha256_kernels; kernel->name; kernel++)
+    if(!strcmp(kernel->name, name)) break;
+  if(!kernel->name || !sha256_self_test(kernel)) return -1;
+  __atomic_store_n(&sha256_impl, kernel, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int
+sha512_use_kernel(const char* name)
+{
+  const struct sha512_kernel *kernel;
+  for(kernel = sha512_kernels; kernel->name; kernel++)
+    if(!strcmp(kernel->name, name)) break;
+  if(!kernel->name || !sha512_self_test(kernel)) return -1;
+  __atomic_store_n(&sha512_impl, kernel, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * Streaming interface
+ */
+void
+sha256_init(struct sha256_ctx *ctx)
+{
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(ctx->h, iv, sizeof(iv));
+  ctx->len = 0;
+  ctx->used = 0;
+}
+
+static void
+sha256_update_with(const struct sha256_kernel *kernel, struct sha256_ctx *ctx, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  void (*compress)(uint32_t*, const uint8_t*, size_t) = kernel->compress;
+
+  ctx->len += len;
+  if(ctx->used){
+    size_t room = 64 - ctx->used;
+    if(len < room){ memcpy(ctx->buf + ctx->used, p, len); ctx->used += len; return; }
+    memcpy(ctx->buf + ctx->used, p, room);
+    compress(ctx->h, ctx->buf, 1);
+    p += room; len -= room;
+    ctx->used = 0;
+  }
+  if(len >= 64){
+    compress(ctx->h, p, len / 64);
+    p += len & ~(size_t)63;
+    len &= 63;
+  }
+  if(len){ memcpy(ctx->buf, p, len); ctx->used = len; }
+}
+
+static void
+sha256_final_with(const struct sha256_kernel *kernel, struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+  void (*compress)(uint32_t*, const uint8_t*, size_t) = kernel->compress;
+  uint64_t bits = ctx->len * 8;
+  int i;
+
+  ctx->buf[ctx->used++] = 0x80;
+  if(ctx->used > 56){
+    memset(ctx->buf + ctx->used, 0, 64 - ctx->used);
+    compress(ctx->h, ctx->buf, 1);
+    ctx->used = 0;
+  }
+  memset(ctx->buf + ctx->used, 0, 56 - ctx->used);
+  store64(ctx->buf + 56, bits);
+  compress(ctx->h, ctx->buf, 1);
+
+  for(i = 0; i < 8; i++) store32(digest + 4 * i, ctx->h[i]);
+}
+
+void
+sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+  sha256_update_with(sha256_select(), ctx, data, len);
+}
+
+void
+sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+  sha256_final_with(sha256_select(), ctx, digest);
+}
+
+void
+sha512_init(struct sha512_ctx *ctx)
+{
+  static const uint64_t iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+  };
+  memcpy(ctx->h, iv, sizeof(iv));
+  ctx->len = 0;
+  ctx->used = 0;
+}
+
+static void
+sha512_update_with(const struct sha512_kernel *kernel, struct sha512_ctx *ctx, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  void (*compress)(uint64_t*, const uint8_t*, size_t) = kernel->compress;
+
+  ctx->len += len;
+  if(ctx->used){
+    size_t room = 128 - ctx->used;
+    if(len < room){ memcpy(ctx->buf + ctx->used, p, len); ctx->used += len; return; }
+    memcpy(ctx->buf + ctx->used, p, room);
+    compress(ctx->h, ctx->buf, 1);
+    p += room; len -= room;
+    ctx->used = 0;
+  }
+  if(len >= 128){
+    compress(ctx->h, p, len / 128);
+    p += len & ~(size_t)127;
+    len &= 127;
+  }
+  if(len){ memcpy(ctx->buf, p, len); ctx->used = len; }
+}
+
+static void
+sha512_final_with(const struct sha512_kernel *kernel, struct sha512_ctx *ctx, uint8_t digest[SHA512_DIGEST_LENGTH])
+{
+  void (*compress)(uint64_t*, const uint8_t*, size_t) = kernel->compress;
+  uint64_t bits = ctx->len * 8;
+  int i;
+
+  ctx->buf[ctx->used++] = 0x80;
+  if(ctx->used > 112){
+    memset(ctx->buf + ctx->used, 0, 128 - ctx->used);
+    compress(ctx->h, ctx->buf, 1);
+    ctx->used = 0;
+  }
+  memset(ctx->buf + ctx->used, 0, 120 - ctx->used);
+  store64(ctx->buf + 120, bits); /* the upper 64 bits of the length stay 0 */
+  compress(ctx->h, ctx->buf, 1);
+
+  for(i = 0; i < 8; i++) store64(digest + 8 * i, ctx->h[i]);
+}
+
+void
+sha512_update(struct sha512_ctx *ctx, const void *data, size_t len)
+{
+  sha512_update_with(sha512_select(), ctx, data, len);
+}
+
+void
+sha512_final(struct sha512_ctx *ctx, uint8_t digest[SHA512_DIGEST_LENGTH])
+{
+  sha512_final_with(sha512_select(), ctx, digest);
+}
+
+/*
+ * HMAC-SHA-256
+ */
+void
+hmac_sha256_init(struct hmac_sha256_ctx *ctx, const void *key, size_t len)
+{
+  uint8_t k[64], pad[64];
+  int i;
+
+  memset(k, 0, sizeof(k));
+  if(len > sizeof(k)){
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, key, len);
+    sha256_final(&ctx->inner, k);
+  } else {
+    memcpy(k, key, len);
+  }
+
+  for(i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+  sha256_init(&ctx->inner);
+  sha256_update(&ctx->inner, pad, sizeof(pad));
+
+  for(i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+  sha256_init(&ctx->outer);
+  sha256_update(&ctx->outer, pad, sizeof(pad));
+
+  explicit_bzero(k, sizeof(k));
+  explicit_bzero(pad, sizeof(pad));
+}
+
+void
+hmac_sha256_update(struct hmac_sha256_ctx *ctx, const void *data, size_t len)
+{
+  sha256_update(&ctx->inner, data, len);
+}
+
+void
+hmac_sha256_final(struct hmac_sha256_ctx *ctx, uint8_t mac[SHA256_DIGEST_LENGTH])
+{
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+
+  sha256_final(&ctx->inner, digest);
+  sha256_update(&ctx->outer, digest, sizeof(digest));
+  sha256_final(&ctx->outer, mac);
+
+  explicit_bzero(digest, sizeof(digest));
+  explicit_bzero(ctx, sizeof(*ctx));
+}
@@ -0,0 +1,56 @@
+#ifndef __FEGA_SHA2_H_INCLUDED__
+#define __FEGA_SHA2_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA-256 and SHA-512, for the sha-crypt verifier and the credential cache.
+ *
+ * The compression functions come in several kernels (portable C, SHA-NI, BMI2),
+ * the fastest one the CPU supports, and which passes a known-answer test,
+ * being picked on first use.
+ */
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA512_DIGEST_LENGTH 64
+
+struct sha256_ctx {
+  uint32_t h[8];
+  uint64_t len;      /* bytes */
+  size_t used;       /* bytes in buf */
+  uint8_t buf[64];
+};
+
+struct sha512_ctx {
+  uint64_t h[8];
+  uint64_t len;      /* bytes, enough for what we hash */
+  size_t used;
+  uint8_t buf[128];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+void sha512_init(struct sha512_ctx *ctx);
+void sha512_update(struct sha512_ctx *ctx, const void *data, size_t len);
+void sha512_final(struct sha512_ctx *ctx, uint8_t digest[SHA512_DIGEST_LENGTH]);
+
+/* HMAC-SHA-256 (RFC 2104) */
+struct hmac_sha256_ctx {
+  struct sha256_ctx inner;
+  struct sha256_ctx outer;
+};
+
+void hmac_sha256_init(struct hmac_sha256_ctx *ctx, const void *key, size_t len);
+void hmac_sha256_update(struct hmac_sha256_ctx *ctx, const void *data, size_t len);
+void hmac_sha256_final(struct hmac_sha256_ctx *ctx, uint8_t mac[SHA256_DIGEST_LENGTH]);
+
+/* The kernels in use, and a way to force one (for the benchmark). Returns 0 on success. */
+const char* sha256_kernel(void);
+const char* sha512_kernel(void);
+int sha256_use_kernel(const char* name);
+int sha512_use_kernel(const char* name);
+
+#endif /* !__FEGA_SHA2_H_INCLUDED__ */
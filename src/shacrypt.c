@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+#include "sha2.h"
+#include "shacrypt.h"
+
+/*
+ * See https://www.akkadia.org/drepper/SHA-crypt.txt
+ *
+ * Both variants share the algorithm, only the digest and the order
+ * in which its bytes are base64-encoded differ.
+ * The body is inlined into one function per variant, so the
+ * calls to the hash functions below are direct.
+ */
+#define SALT_LEN_MAX    16
+#define ROUNDS_DEFAULT  5000
+#define ROUNDS_MIN      1000
+#define ROUNDS_MAX      999999999
+#define ROUNDS_PREFIX   "rounds="
+
+static const char b64t[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+union sha_ctx {
+  struct sha256_ctx s256;
+  struct sha512_ctx s512;
+};
+
+struct shacrypt_alg {
+  const char* prefix;   /* "$5$" or "$6$" */
+  size_t len;           /* digest length */
+  void (*init)(union sha_ctx*);
+  void (*update)(union sha_ctx*, const void*, size_t);
+  void (*final)(union sha_ctx*, uint8_t*);
+  const uint8_t (*order)[3]; /* byte triplets, most significant first */
+  size_t groups;
+  int8_t last[3];       /* the final, partial group (-1 for a 0 byte) */
+  int last_chars;
+};
+
+static void s256_init(union sha_ctx* c) { sha256_init(&c->s256); }
+static void s256_update(union sha_ctx* c, const void* p, size_t n) { sha256_update(&c->s256, p, n); }
+static void s256_final(union sha_ctx* c, uint8_t* d) { sha256_final(&c->s256, d); }
+static void s512_init(union sha_ctx* c) { sha512_init(&c->s512); }
+static void s512_update(union sha_ctx* c, const void* p, size_t n) { sha512_update(&c->s512, p, n); }
+static void s512_final(union sha_ctx* c, uint8_t* d) { sha512_final(&c->s512, d); }
+
+static const uint8_t sha256_order[10][3] = {
+  {  0, 10, 20 }, { 21,  1, 11 }, { 12, 22,  2 }, {  3, 13, 23 }, { 24,  4, 14 },
+  { 15, 25,  5 }, {  6, 16, 26 }, { 27,  7, 17 }, { 18, 28,  8 }, {  9, 19, 29 }
+};
+
+static const uint8_t sha512_order[21][3] = {
+  {  0, 21, 42 }, { 22, 43,  1 }, { 44,  2, 23 }, {  3, 24, 45 }, { 25, 46,  4 },
+  { 47,  5, 26 }, {  6, 27, 48 }, { 28, 49,  7 }, { 50,  8, 29 }, {  9, 30, 51 },
+  { 31, 52, 10 }, { 53, 11, 32 }, { 12, 33, 54 }, { 34, 55, 13 }, { 56, 14, 35 },
+  { 15, 36, 57 }, { 37, 58, 16 }, { 59, 17, 38 }, { 18, 39, 60 }, { 40, 61, 19 },
+  { 62, 20, 41 }
+};
+
+static const struct shacrypt_alg sha256_alg = {
+  "$5$", SHA256_DIGEST_LENGTH, s256_init, s256_update, s256_final, sha256_order, 10, { -1, 31, 30 }, 3
+};
+
+static const struct shacrypt_alg sha512_alg = {
+  "$6$", SHA512_DIGEST_LENGTH, s512_init, s512_update, s512_final, sha512_order, 21, { -1, -1, 63 }, 2
+};
+
+static char*
+b64_from_24bit(char* p, unsigned int b2, unsigned int b1, unsigned int b0, int n)
+{
+  unsigned int w = (b2 << 16) | (b1 << 8) | b0;
+  while(n-- > 0){ *p++ = b64t[w & 0x3f]; w >>= 6; }
+  return p;
+}
+
+/*
+ * Parses "[rounds=N$]salt[$...]" after the prefix.
+ * Only the canonical forms are accepted, see shacrypt.h.
+ */
+static bool
+parse_setting(const char* s, unsigned long* rounds, bool* custom, const char** salt, size_t* salt_len)
+{
+  *rounds = ROUNDS_DEFAULT;
+  *custom = false;
+
+  if(!strncmp(s, ROUNDS_PREFIX, sizeof(ROUNDS_PREFIX) - 1)){
+    const char* num = s + sizeof(ROUNDS_PREFIX) - 1;
+    unsigned long r = 0;
+    if(*num < '1' || *num > '9') return false; /* no leading 0, sign nor space */
+    for(s = num; *s >= '0' && *s <= '9'; s++){
+      if(s - num >= 9) return false;
+      r = r * 10 + (*s - '0');
+    }
+    if(*s != '$' || r < ROUNDS_MIN || r > ROUNDS_MAX) return false;
+    *rounds = r;
+    *custom = true;
+    s++;
+  }
+
+  *salt = s;
+  for(*salt_len = 0; s[*salt_len] && s[*salt_len] != '$'; (*salt_len)++){
+    if(*salt_len >= SALT_LEN_MAX || !strchr(b64t, s[*salt_len])) return false;
+  }
+  return *salt_len > 0;
+}
+
+static inline __attribute__((always_inline)) char*
+shacrypt(const struct shacrypt_alg* alg, const char* key, const char* setting, char* output, int size)
+{
+  union sha_ctx ctx, alt;
+  uint8_t a[SHA512_DIGEST_LENGTH], b[SHA512_DIGEST_LENGTH];
+  uint8_t p_bytes[256], s_bytes[SALT_LEN_MAX];
+  const char* salt;
+  size_t salt_len, key_len = strlen(key), n;
+  unsigned long rounds, r;
+  bool custom;
+  char* res = NULL;
+
+  if(!parse_setting(setting + 3, &rounds, &custom, &salt, &salt_len)){ errno = EINVAL; return NULL; }
+  if(key_len > sizeof(p_bytes)){ errno = EINVAL; return NULL; } /* libc it is, for such keys */
+
+  /* Digest B: key, salt, key */
+  alg->init(&alt);
+  alg->update(&alt, key, key_len);
+  alg->update(&alt, salt, salt_len);
+  alg->update(&alt, key, key_len);
+  alg->final(&alt, b);
+
+  /* Digest A */
+  alg->init(&ctx);
+  alg->update(&ctx, key, key_len);
+  alg->update(&ctx, salt, salt_len);
+  for(n = key_len; n > alg->len; n -= alg->len) alg->update(&ctx, b, alg->len);
+  alg->update(&ctx, b, n);
+  for(n = key_len; n > 0; n >>= 1){
+    if(n & 1) alg->update(&ctx, b, alg->len);
+    else alg->update(&ctx, key, key_len);
+  }
+  alg->final(&ctx, a);
+
+  /* P: the digest of the key, key_len times, stretched to key_len bytes */
+  alg->init(&alt);
+  for(n = 0; n < key_len; n++) alg->update(&alt, key, key_len);
+  alg->final(&alt, b);
+  for(n = 0; n + alg->len <= key_len; n += alg->len) memcpy(p_bytes + n, b, alg->len);
+  memcpy(p_bytes + n, b, key_len - n);
+
+  /* S: the digest of the salt, 16 + A[0] times, cut to salt_len bytes */
+  alg->init(&alt);
+  for(n = 0; n < 16u + a[0]; n++) alg->update(&alt, salt, salt_len);
+  alg->final(&alt, b);
+  memcpy(s_bytes, b, salt_len);
+
+  /* The rounds */
+  for(r = 0; r < rounds; r++){
+    alg->init(&ctx);
+    if(r & 1) alg->update(&ctx, p_bytes, key_len);
+    else      alg->update(&ctx, a, alg->len);
+    if(r % 3) alg->update(&ctx, s_bytes, salt_len);
+    if(r % 7) alg->update(&ctx, p_bytes, key_len);
+    if(r & 1) alg->update(&ctx, a, alg->len);
+    else      alg->update(&ctx, p_bytes, key_len);
+    alg->final(&ctx, a);
+  }
+
+  /* The output */
+  int len = (custom)
+    ? snprintf(output, size, "%s" ROUNDS_PREFIX "%lu$%.*s$", alg->prefix, rounds, (int)salt_len, salt)
+    : snprintf(output, size, "%s%.*s$", alg->prefix, (int)salt_len, salt);
+  if(len < 0 || (size_t)len + (alg->len * 4 + 2) / 3 + 1 > (size_t)size){ errno = ERANGE; goto BAILOUT; }
+
+  char* p = output + len;
+  for(n = 0; n < alg->groups; n++)
+    p = b64_from_24bit(p, a[alg->order[n][0]], a[alg->order[n][1]], a[alg->order[n][2]], 4);
+#define LAST(i) ((alg->last[i] < 0)?0:a[alg->last[i]])
+  p = b64_from_24bit(p, LAST(0), LAST(1), LAST(2), alg->last_chars);
+#undef LAST
+  *p = '\0';
+  res = output;
+
+BAILOUT:
+  explicit_bzero(&ctx, sizeof(ctx));
+  explicit_bzero(&alt, sizeof(alt));
+  explicit_bzero(a, sizeof(a));
+  explicit_bzero(b, sizeof(b));
+  explicit_bzero(p_bytes, sizeof(p_bytes));
+  explicit_bzero(s_bytes, sizeof(s_bytes));
+  return res;
+}
+
+static char*
+shacrypt256(const char* key, const char* setting, char* output, int size)
+{
+  return shacrypt(&sha256_alg, key, setting, output, size);
+}
+
+static char*
+shacrypt512(const char* key, const char* setting, char* output, int size)
+{
+  return shacrypt(&sha512_alg, key, setting, output, size);
+}
+
+char*
+shacrypt_rn(const char* key, const char* setting, char* output, int size)
+{
+  if(!strncmp(setting, "$5$", 3)) return shacrypt256(key, setting, output, size);
+  if(!strncmp(setting, "$6$", 3)) return shacrypt512(key, setting, output, size);
+  errno = EINVAL;
+  return NULL;
+}
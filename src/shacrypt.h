@@ -0,0 +1,19 @@
+#ifndef __FEGA_SHACRYPT_H_INCLUDED__
+#define __FEGA_SHACRYPT_H_INCLUDED__
+
+/*
+ * SHA-crypt ($5$ and $6$, as specified by U. Drepper), in-tree,
+ * on top of sha2.c: SHA-NI makes $5$ faster than libc, $6$ runs at libc speed.
+ *
+ * Hashes <key> with the algorithm, rounds and salt of <setting>
+ * (a setting or a full hash) into <output>, and returns it.
+ * Returns NULL with errno set to EINVAL for anything outside the common forms
+ * (unknown prefix, salt longer than 16 or with odd characters, rounds= out of range
+ * or not canonical), and ERANGE when <size> is too small:
+ * callers then fall back to libc's crypt_r, which has the final word on those.
+ */
+#define SHACRYPT_OUTPUT_SIZE 123 /* "$6$rounds=999999999$" + 16 + "$" + 86 + NUL */
+
+char* shacrypt_rn(const char* key, const char* setting, char* output, int size);
+
+#endif /* !__FEGA_SHACRYPT_H_INCLUDED__ */
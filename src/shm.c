@@ -0,0 +1,83 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "shm.h"
+
+#define SHM_OPEN_TRIES 3 /* against another user removing or creating it at the same time */
+
+/*
+ * Only root creates the region. Root also removes one owned by another user (who made it first,
+ * eg with ls -l, or on purpose) instead of going without it, and creates it again (O_EXCL: not theirs).
+ */
+static int
+shm_open_owned(const char* name, mode_t mode)
+{
+  struct stat st;
+  unsigned int i;
+  bool root = (geteuid() == 0);
+
+  for(i = 0; i < SHM_OPEN_TRIES; i++){
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, mode);
+    if(fd < 0 && errno == ENOENT && root) fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if(fd < 0){
+      if(errno == EEXIST) continue; /* created meanwhile: open that one */
+      return -1;
+    }
+    if(!root) return fd;
+    if(fstat(fd, &st)){ close(fd); return -1; }
+    if(st.st_uid == 0) return fd;
+
+    D1("%s is owned by uid %u: creating it again", name, (unsigned int)st.st_uid);
+    close(fd);
+    if(shm_unlink(name) && errno != ENOENT) return -1;
+  }
+  errno = EBUSY;
+  return -1;
+}
+
+void*
+shm_attach(const char* name, size_t size, mode_t mode, void (*init)(void* region))
+{
+  struct stat st;
+  void* region = NULL;
+
+  int fd = shm_open_owned(name, mode);
+  if(fd < 0){ D2("Could not open %s: %s", name, strerror(errno)); return NULL; }
+
+  if(flock(fd, LOCK_EX)){ D2("Could not lock %s: %s", name, strerror(errno)); goto BAILOUT; }
+
+  if(fstat(fd, &st)){ D2("Could not stat %s: %s", name, strerror(errno)); goto BAILOUT; }
+
+  /* Do not trust a region someone else prepared for us */
+  if(st.st_uid != 0 && st.st_uid != geteuid()){ D1("%s is not owned by root: ignoring it", name); goto BAILOUT; }
+
+  if(st.st_size == 0){ /* we are first */
+    D2("Creating %s [%zu bytes]", name, size);
+    if(fchmod(fd, mode) || ftruncate(fd, size)){ D2("Could not size %s: %s", name, strerror(errno)); goto BAILOUT; }
+  } else if((size_t)st.st_size != size){
+    D1("%s has size %ld, expected %zu: ignoring it", name, (long)st.st_size, size);
+    goto BAILOUT;
+  }
+
+  region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(region == MAP_FAILED){ D2("Could not map %s: %s", name, strerror(errno)); region = NULL; goto BAILOUT; }
+
+  /* ftruncate zero-filled it */
+  if(st.st_size == 0 && init) init(region);
+
+BAILOUT:
+  flock(fd, LOCK_UN); /* the mapping keeps the open file, hence the lock, alive past close */
+  close(fd);
+  return region;
+}
+
+void
+shm_detach(void* region, size_t size)
+{
+  if(region) munmap(region, size);
+}
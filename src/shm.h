@@ -0,0 +1,23 @@
+#ifndef __FEGA_SHM_H_INCLUDED__
+#define __FEGA_SHM_H_INCLUDED__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Named shared memory regions, to share state between all the processes
+ * (sshd children, NSS and PAM consumers) on a node.
+ *
+ * A region is created, zeroed and initialized (with init, if not NULL) by the first root process,
+ * under an exclusive lock, so that the others never see it half-initialized.
+ * The other users never create one: root removes a region they created
+ * (in /dev/shm, anyone can), and creates it again.
+ *
+ * Returns NULL when the region can not be opened read-write,
+ * or when it is not owned by root or the current user.
+ * The callers then fall back to their per-process behaviour.
+ */
+void* shm_attach(const char* name, size_t size, mode_t mode, void (*init)(void* region));
+void shm_detach(void* region, size_t size);
+
+#endif /* !__FEGA_SHM_H_INCLUDED__ */
@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+
+#include "utils.h"
+#include "shm.h"
+#include "stats.h"
+
+const char* stats_source_names[STATS_SOURCES] = { "nss", "pam", "keys", "refresh" };
+
+const char* stats_counter_names[STATS_COUNTERS] = {
+  "lookups", "found", "notfound",
+  "cache_hit", "cache_miss", "cache_expired", "cache_stale", "cache_pending", "cache_queued",
+  "erange", "throttled",
+  "cega_requests", "cega_errors",
+};
+
+const char* stats_timer_names[STATS_TIMERS] = {
+  "lookup", "sqlite", "dns", "http_connect", "http_tls", "http_transfer", "parse",
+};
+
+static struct stats_region *region = NULL;
+static struct stats_slot *slot = NULL;      /* ours */
+static enum stats_source source = STATS_NSS;
+static bool failed = false;                  /* do not try again for every sample */
+static bool atfork = false;
+
+/* The child gets a slot of its own, on its first sample */
+static void
+stats_forked(void)
+{
+  slot = NULL;
+}
+
+static inline bool
+stats_claim(struct stats_slot *s, int32_t old, pid_t pid)
+{
+  if(!__atomic_compare_exchange_n(&s->pid, &old, (int32_t)pid, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+  if(old == 0) __atomic_store_n(&s->source, (uint32_t)source, __ATOMIC_RELAXED); /* for good */
+  prctl(PR_GET_NAME, s->comm);
+  return true;
+}
+
+/*
+ * Ours from an earlier attach (eg the module was loaded again), a free one,
+ * or one of a dead process of the same source, whose counts we carry on.
+ */
+static struct stats_slot*
+stats_slot(void)
+{
+  if(slot) return slot;
+  if(failed) return NULL;
+
+  if(!region) region = shm_attach(STATS_SHM_NAME, sizeof(struct stats_region), 0644, NULL);
+  if(!region){ D2("No shared stats: not recording"); failed = true; return NULL; }
+
+  if(!atfork){ pthread_atfork(NULL, NULL, stats_forked); atfork = true; }
+
+  pid_t pid = getpid();
+  unsigned int i;
+  struct stats_slot *s;
+
+  for(i = STATS_SOURCES; i < STATS_SLOTS; i++){
+    s = &region->slots[i];
+    if(__atomic_load_n(&s->pid, __ATOMIC_RELAXED) == pid && s->source == source) return (slot = s);
+  }
+  for(i = STATS_SOURCES; i < STATS_SLOTS; i++)
+    if(stats_claim(&region->slots[i], 0, pid)) return (slot = &region->slots[i]);
+  for(i = STATS_SOURCES; i < STATS_SLOTS; i++){
+    s = &region->slots[i];
+    int32_t old = __atomic_load_n(&s->pid, __ATOMIC_RELAXED);
+    if(s->source == source && old > 0 && kill(old, 0) && errno == ESRCH && stats_claim(s, old, pid)) return (slot = s);
+  }
+
+  D1("All the stats slots are taken: sharing one");
+  return (slot = &region->slots[source]);
+}
+
+void
+stats_set_source(enum stats_source s)
+{
+  if(s == source) return;
+  source = s;
+  slot = NULL;
+}
+
+void
+stats_count(enum stats_counter counter)
+{
+  struct stats_slot *s = stats_slot();
+  if(s) __atomic_fetch_add(&s->counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+void
+stats_time(enum stats_timer timer, uint64_t us)
+{
+  struct stats_slot *s = stats_slot();
+  if(!s) return;
+  struct stats_hist *h = &s->timers[timer];
+  __atomic_fetch_add(&h->buckets[stats_bucket(us)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+const struct stats_region*
+stats_open(void)
+{
+  struct stats_region *r = NULL;
+  struct stat st;
+
+  int fd = shm_open(STATS_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+  if(fd < 0){ D2("Could not open %s: %s", STATS_SHM_NAME, strerror(errno)); return NULL; }
+
+  if(fstat(fd, &st) || (size_t)st.st_size != sizeof(struct stats_region)){ D1("%s has an unexpected size", STATS_SHM_NAME); goto BAILOUT; }
+
+  /* Not the one the modules write (they only attach a root one): counts made up by its owner */
+  if(st.st_uid != 0){ D1("%s is owned by uid %u: ignoring it", STATS_SHM_NAME, (unsigned int)st.st_uid); goto BAILOUT; }
+
+  r = mmap(NULL, sizeof(struct stats_region), PROT_READ, MAP_SHARED, fd, 0);
+  if(r == MAP_FAILED){ D2("Could not map %s: %s", STATS_SHM_NAME, strerror(errno)); r = NULL; }
+
+BAILOUT:
+  close(fd);
+  return r;
+}
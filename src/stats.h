@@ -0,0 +1,108 @@
+#ifndef __FEGA_STATS_H_INCLUDED__
+#define __FEGA_STATS_H_INCLUDED__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * Always-on counters and latency histograms, per process, in shared memory.
+ * ega_stats sums them up for the node.
+ *
+ * Recording is a few relaxed atomic adds into the slot of the current process
+ * (one per process and module), so processes do not fight over cache lines.
+ * When the region can not be opened, nothing is recorded.
+ */
+#define STATS_SHM_NAME "/ega-stats.v4"
+#define STATS_SLOTS 256
+#define STATS_BUCKETS 25 /* powers of 2, in us: up to 2^23 us (8s), then +Inf */
+
+enum stats_source {
+  STATS_NSS = 0,  /* libnss_ega.so.2 */
+  STATS_PAM,      /* pam_ega_auth.so */
+  STATS_KEYS,     /* ega_ssh_keys */
+  STATS_REFRESH,  /* ega_cache_refresher */
+  STATS_SOURCES
+};
+
+enum stats_counter {
+  STATS_LOOKUPS = 0,
+  STATS_FOUND,
+  STATS_NOTFOUND,
+  STATS_CACHE_HIT,
+  STATS_CACHE_MISS,
+  STATS_CACHE_EXPIRED,
+  STATS_CACHE_STALE,     /* expired, but served as CentralEGA was throttled */
+  STATS_CACHE_PENDING,   /* found in the write-behind journal, not merged yet */
+  STATS_CACHE_QUEUED,    /* handed to ega_cache_writer, rather than written */
+  STATS_ERANGE,          /* buffer too small: the caller retries with a larger one */
+  STATS_THROTTLED,
+  STATS_CEGA_REQUESTS,
+  STATS_CEGA_ERRORS,     /* transport errors and 5xx */
+  STATS_COUNTERS
+};
+
+enum stats_timer {
+  STATS_LOOKUP = 0,      /* the whole lookup */
+  STATS_SQLITE,          /* cache queries, reads and writes */
+  STATS_DNS,             /* CentralEGA host: pinned addresses from the cache, or the resolver */
+  STATS_HTTP_CONNECT,    /* TCP connection to CentralEGA */
+  STATS_HTTP_TLS,        /* TLS handshake */
+  STATS_HTTP_TRANSFER,   /* request sent to response received */
+  STATS_PARSE,           /* parse_json */
+  STATS_TIMERS
+};
+
+struct stats_hist {
+  uint64_t count;
+  uint64_t sum;                    /* in us */
+  uint64_t buckets[STATS_BUCKETS]; /* not cumulative */
+};
+
+struct stats_slot {
+  int32_t pid;     /* 0: free. Dead processes leave their counts: the sums never go back */
+  uint32_t source;
+  char comm[16];
+  uint64_t counters[STATS_COUNTERS];
+  struct stats_hist timers[STATS_TIMERS];
+} __attribute__((aligned(64)));
+
+/* The first STATS_SOURCES slots are shared, for when all the others are taken */
+struct stats_region {
+  struct stats_slot slots[STATS_SLOTS];
+};
+
+extern const char* stats_source_names[STATS_SOURCES];
+extern const char* stats_counter_names[STATS_COUNTERS];
+extern const char* stats_timer_names[STATS_TIMERS];
+
+/*
+ * Hidden: sshd loads both libnss_ega.so.2 and pam_ega_auth.so, and each one
+ * must record into its own slot, not into the one of whichever came first.
+ */
+#define STATS_LOCAL __attribute__((visibility("hidden")))
+
+STATS_LOCAL void stats_set_source(enum stats_source source);
+STATS_LOCAL void stats_count(enum stats_counter counter);
+STATS_LOCAL void stats_time(enum stats_timer timer, uint64_t us);
+
+/* For ega_stats: read-only, NULL if it does not exist or is not owned by root */
+const struct stats_region* stats_open(void);
+
+static inline unsigned int
+stats_bucket(uint64_t us)
+{
+  unsigned int b = (us)?(64 - __builtin_clzll(us)):0; /* us < 2^b */
+  return (b < STATS_BUCKETS - 1)?b:(STATS_BUCKETS - 1);
+}
+
+static inline uint64_t
+stats_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+#endif /* !__FEGA_STATS_H_INCLUDED__ */
@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "utils.h"
+#include "shm.h"
+#include "tarpit.h"
+
+/*
+ * Tarpit for failed authentications, shared by all the sshd children on the node.
+ *
+ * Failures are counted per user and per remote host, in a small hash table in shared memory.
+ * After conf->free failures, the user (or host) is blocked for conf->base ms,
+ * doubling at every further failure, up to conf->max.
+ * A counter is forgotten after TARPIT_FORGET * conf->max ms without failures.
+ *
+ * The keys are hashed with a per-boot random seed, kept in the (root-only) region,
+ * so that one can not pick names that collide on purpose.
+ * The table is small and the counters are advisory: when a probe sequence is full,
+ * the entry with the oldest failure is recycled (preferably not a blocked one),
+ * and racing updates may lose a count.
+ */
+#define TARPIT_SHM_NAME "/ega-tarpit.v1"
+#define TARPIT_ENTRIES 4096
+#define TARPIT_PROBES  8
+#define TARPIT_FORGET  4
+
+struct tarpit_entry {
+  uint64_t key;      /* 0 when free */
+  uint64_t last;     /* ms, last failure */
+  uint64_t until;    /* ms, blocked until */
+  uint32_t failures;
+  uint32_t pad;
+};
+
+struct tarpit_s {
+  uint64_t seed[2];
+  struct tarpit_entry entries[TARPIT_ENTRIES];
+};
+
+static struct tarpit_s *tarpit = NULL;
+
+static inline uint64_t
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void
+tarpit_init(void* region)
+{
+  struct tarpit_s *t = (struct tarpit_s*)region;
+  if(getrandom(t->seed, sizeof(t->seed), 0) != sizeof(t->seed))
+    D1("Could not seed the tarpit: %s", strerror(errno));
+}
+
+static bool
+tarpit_attach(void)
+{
+  if(!__atomic_load_n(&tarpit, __ATOMIC_ACQUIRE)){
+    struct tarpit_s *region = shm_attach(TARPIT_SHM_NAME, sizeof(struct tarpit_s), 0600, tarpit_init);
+    struct tarpit_s *expected = NULL;
+    if(region && !__atomic_compare_exchange_n(&tarpit, &expected, region, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      shm_detach(region, sizeof(struct tarpit_s)); /* another thread was faster */
+  }
+  if(!tarpit) D2("No shared tarpit");
+  return tarpit != NULL;
+}
+
+/* Seeded FNV-1a, with a final mix. Never 0. */
+static uint64_t
+tarpit_key(char kind, const char* name)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ tarpit->seed[0];
+  h = (h ^ (unsigned char)kind) * 0x100000001b3ULL;
+  for(; *name; name++) h = (h ^ (unsigned char)*name) * 0x100000001b3ULL;
+  h ^= tarpit->seed[1];
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (h)?h:1;
+}
+
+static struct tarpit_entry*
+tarpit_find(uint64_t key, bool create, uint64_t now)
+{
+  struct tarpit_entry *victim = NULL;
+  uint64_t victim_key = 0, victim_last = UINT64_MAX;
+  unsigned int i;
+
+  for(i = 0; i < TARPIT_PROBES; i++){
+    struct tarpit_entry *e = &tarpit->entries[(key + i) % TARPIT_ENTRIES];
+    uint64_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+    if(k == key) return e;
+    uint64_t last = (k)?__atomic_load_n(&e->last, __ATOMIC_RELAXED):0;
+    if(k && now < __atomic_load_n(&e->until, __ATOMIC_RELAXED))
+      last += 1ULL << 62; /* recycle blocked entries last */
+    if(last < victim_last){ victim = e; victim_key = k; victim_last = last; }
+  }
+
+  if(!create || !victim) return NULL;
+
+  if(!__atomic_compare_exchange_n(&victim->key, &victim_key, key, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return (victim_key == key)?victim:NULL; /* someone else got there first */
+
+  __atomic_store_n(&victim->failures, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&victim->until, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&victim->last, now, __ATOMIC_RELEASE);
+  return victim;
+}
+
+static bool
+is_blocked(uint64_t key, uint64_t now)
+{
+  struct tarpit_entry *e = tarpit_find(key, false, now);
+  return e && now < __atomic_load_n(&e->until, __ATOMIC_ACQUIRE);
+}
+
+static void
+count_failure(const struct tarpit_conf* conf, uint64_t key, uint64_t now)
+{
+  struct tarpit_entry *e = tarpit_find(key, true, now);
+  if(!e) return;
+
+  uint64_t last = __atomic_exchange_n(&e->last, now, __ATOMIC_ACQ_REL);
+  if(now - last > (uint64_t)conf->max * TARPIT_FORGET)
+    __atomic_store_n(&e->failures, 0, __ATOMIC_RELAXED); /* a fresh start */
+
+  uint32_t failures = __atomic_add_fetch(&e->failures, 1, __ATOMIC_RELAXED);
+  if(failures <= conf->free) return;
+
+  unsigned int shift = failures - conf->free - 1;
+  uint64_t delay = (shift < 32)?((uint64_t)conf->base << shift):(uint64_t)conf->max;
+  if(delay > (uint64_t)conf->max) delay = conf->max;
+
+  D2("Failure %u: blocked for %lu ms", failures, (unsigned long)delay);
+  __atomic_store_n(&e->until, now + delay, __ATOMIC_RELEASE);
+}
+
+bool
+tarpit_blocked(const struct tarpit_conf* conf, const char* user, const char* rhost)
+{
+  if(!conf->free || !tarpit_attach()) return false;
+
+  uint64_t now = now_ms();
+  if(is_blocked(tarpit_key('u', user), now)){ D1("User %s is in the tarpit", user); return true; }
+  if(rhost && is_blocked(tarpit_key('h', rhost), now)){ D1("Host %s is in the tarpit", rhost); return true; }
+  return false;
+}
+
+void
+tarpit_failure(const struct tarpit_conf* conf, const char* user, const char* rhost)
+{
+  if(!conf->free || !tarpit_attach()) return;
+
+  uint64_t now = now_ms();
+  count_failure(conf, tarpit_key('u', user), now);
+  if(rhost) count_failure(conf, tarpit_key('h', rhost), now);
+}
+
+void
+tarpit_success(const struct tarpit_conf* conf, const char* user)
+{
+  if(!conf->free || !tarpit_attach()) return;
+
+  struct tarpit_entry *e = tarpit_find(tarpit_key('u', user), false, now_ms());
+  if(!e) return;
+  __atomic_store_n(&e->failures, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->until, 0, __ATOMIC_RELEASE);
+}
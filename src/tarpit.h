@@ -0,0 +1,24 @@
+#ifndef __FEGA_TARPIT_H_INCLUDED__
+#define __FEGA_TARPIT_H_INCLUDED__
+
+#include <stdbool.h>
+
+struct tarpit_conf {
+  unsigned int free; /* failures allowed before backing off, 0 disables the tarpit */
+  long base;         /* first block, in ms, then doubled at every failure */
+  long max;          /* longest block, in ms */
+};
+
+/*
+ * Is the user, or the remote host (may be NULL), currently blocked?
+ * Callers must not compute any hash when it is.
+ */
+bool tarpit_blocked(const struct tarpit_conf* conf, const char* user, const char* rhost);
+
+/* Counts a failed attempt against both */
+void tarpit_failure(const struct tarpit_conf* conf, const char* user, const char* rhost);
+
+/* Clears the user's counter. The host's is left alone, so one good account can not launder it */
+void tarpit_success(const struct tarpit_conf* conf, const char* user);
+
+#endif /* !__FEGA_TARPIT_H_INCLUDED__ */
@@ -0,0 +1,108 @@
+/*
+ * Checks of readconfig on settings that must never reach the rest of the code as they are,
+ * in release builds too (valid_options only runs with DEBUG).
+ *
+ * Usage: test_config   (make check)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "config.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)){ fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+                                           fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); failures++; } } while(0)
+
+static char path[] = "/tmp/ega-test-config-XXXXXX";
+
+/* The minimal config, plus <extra> */
+static bool
+load(const char* extra)
+{
+  FILE* fp = fopen(path, "w");
+  if(!fp){ perror(path); exit(2); }
+  fprintf(fp,
+	  "cega_endpoint_username = http://127.0.0.1:1/users/%%s?idType=username\n"
+	  "cega_endpoint_uid = http://127.0.0.1:1/users/%%u?idType=uid\n"
+	  "cega_creds = user:password\n"
+	  "gid = 1000\n"
+	  "homedir_prefix = /ega/inbox\n"
+	  "db_path = /tmp/ega-test-config.db\n"
+	  "%s\n", extra);
+  fclose(fp);
+  cleanconfig();
+  return loadconfig();
+}
+
+static void
+test_cache_shards(void)
+{
+  CHECK(load("") && options->cache_shards == 1, "default cache_shards: %u", options->cache_shards);
+  CHECK(load("cache_shards = 4") && options->cache_shards == 4, "cache_shards = 4: %u", options->cache_shards);
+  CHECK(load("cache_shards = 64") && options->cache_shards == CACHE_SHARDS_MAX, "cache_shards = 64: %u", options->cache_shards);
+  CHECK(load("cache_shards = 100") && options->cache_shards == CACHE_SHARDS_MAX, "cache_shards = 100: %u", options->cache_shards);
+  CHECK(load("cache_shards = -1") && options->cache_shards == CACHE_SHARDS_MAX, "cache_shards = -1: %u", options->cache_shards);
+  CHECK(load("cache_shards = 0") && options->cache_shards == 1, "cache_shards = 0: %u", options->cache_shards);
+  CHECK(load("cache_shards = lots") && options->cache_shards == 1, "cache_shards = lots: %u", options->cache_shards);
+}
+
+/* Reported and replaced, rather than silently taken as the default (or as 0) */
+static void
+test_cega_limits(void)
+{
+  CHECK(load("") && options->cega_max_response_size == 65536, "default cega_max_response_size: %zu", options->cega_max_response_size);
+  CHECK(load("cega_max_response_size = 1000") && options->cega_max_response_size == 1000, "cega_max_response_size = 1000: %zu", options->cega_max_response_size);
+  CHECK(load("cega_max_response_size = lots") && options->cega_max_response_size == 65536, "cega_max_response_size = lots: %zu", options->cega_max_response_size);
+  CHECK(load("cega_max_response_size = 0") && options->cega_max_response_size == 65536, "cega_max_response_size = 0: %zu", options->cega_max_response_size);
+  CHECK(load("cega_max_response_size = -1") && options->cega_max_response_size == CEGA_MAX_RESPONSE_SIZE_MAX,
+	"cega_max_response_size = -1: %zu", options->cega_max_response_size);
+  CHECK(load("cega_max_response_size = 18446744073709551615") && options->cega_max_response_size == CEGA_MAX_RESPONSE_SIZE_MAX,
+	"cega_max_response_size = SIZE_MAX: %zu", options->cega_max_response_size);
+
+  CHECK(load("cega_max_tokens = 200") && options->cega_max_tokens == 200, "cega_max_tokens = 200: %u", options->cega_max_tokens);
+  CHECK(load("cega_max_tokens = many") && options->cega_max_tokens == 1024, "cega_max_tokens = many: %u", options->cega_max_tokens);
+  CHECK(load("cega_max_tokens = 3") && options->cega_max_tokens == 1024, "cega_max_tokens = 3: %u", options->cega_max_tokens);
+
+  CHECK(load("cega_timeout = 30") && options->cega_timeout == 30, "cega_timeout = 30: %ld", options->cega_timeout);
+  CHECK(load("cega_timeout = soon") && options->cega_timeout == 10, "cega_timeout = soon: %ld", options->cega_timeout);
+  CHECK(load("cega_timeout = -5") && options->cega_timeout == 10, "cega_timeout = -5: %ld", options->cega_timeout);
+}
+
+/* Never left to cache_open, which would run without the cache */
+static void
+test_cache_backend(void)
+{
+  CHECK(load("") && options->cache_backend == NULL, "default cache_backend: %s", options->cache_backend);
+  CHECK(load("cache_backend = sqlite") && options->cache_backend && !strcmp(options->cache_backend, "sqlite"),
+	"cache_backend = sqlite: %s", options->cache_backend);
+  CHECK(load("cache_backend = berkeley") && options->cache_backend == NULL, "cache_backend = berkeley: %s", options->cache_backend);
+#ifdef HAS_LMDB
+  CHECK(load("cache_backend = lmdb") && options->cache_backend && !strcmp(options->cache_backend, "lmdb"),
+	"cache_backend = lmdb: %s", options->cache_backend);
+#else
+  CHECK(load("cache_backend = lmdb") && options->cache_backend == NULL, "cache_backend = lmdb, not compiled in: %s", options->cache_backend);
+#endif
+}
+
+int
+main(void)
+{
+  int fd = mkstemp(path);
+  if(fd < 0){ perror(path); return 2; }
+  close(fd);
+  setenv("EGA_AUTH_CONFIG", path, 1);
+
+  test_cache_shards();
+  test_cega_limits();
+  test_cache_backend();
+
+  cleanconfig();
+  unlink(path);
+  if(failures){ fprintf(stderr, "%d failures\n", failures); return 1; }
+  printf("test_config: ok\n");
+  return 0;
+}
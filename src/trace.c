@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include "utils.h"
+#include "shm.h"
+#include "trace.h"
+
+_Static_assert(sizeof(struct trace_event) == 32, "trace events are 32 bytes");
+_Static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0, "TRACE_EVENTS is a power of 2");
+
+const char* trace_type_names[TRACE_TYPES] = {
+  "?", "start", "end", "cache", "stale", "store",
+  "request", "connected", "tls", "first-byte", "done", "error", "parse", "dns",
+};
+
+const char* trace_lookup_names[TRACE_LOOKUPS] = {
+  "getpwnam", "getpwuid", "getspnam", "getuser", "pubkeys",
+};
+
+static struct trace_ring *ring = NULL;
+static bool failed = false;   /* do not try again for every event */
+static pid_t pid = 0;         /* getpid() is a system call */
+
+/* The lookup in progress, in this thread */
+static __thread struct {
+  uint32_t user;
+  uint32_t uid;
+  uint8_t source;
+  uint64_t start;
+} current = { 0, UINT32_MAX, STATS_NSS, 0 };
+
+static void
+trace_forked(void)
+{
+  pid = 0;
+}
+
+static void
+trace_init(void* region)
+{
+  struct trace_ring *r = (struct trace_ring*)region;
+  if(getrandom(&r->seed, sizeof(r->seed), 0) != sizeof(r->seed))
+    D1("Could not seed the trace: %s", strerror(errno));
+}
+
+static struct trace_ring*
+trace_ring(void)
+{
+  struct trace_ring *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+  if(r || failed) return r;
+
+  r = shm_attach(TRACE_SHM_NAME, sizeof(struct trace_ring), 0600, trace_init);
+  if(!r){ D2("No shared trace: not recording"); failed = true; return NULL; }
+
+  struct trace_ring *expected = NULL;
+  if(!__atomic_compare_exchange_n(&ring, &expected, r, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+    shm_detach(r, sizeof(struct trace_ring)); /* another thread was faster */
+    return expected;
+  }
+  pthread_atfork(NULL, NULL, trace_forked);
+  return r;
+}
+
+static inline uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+trace_record(enum trace_type type, int code, uint64_t value, uint64_t ns)
+{
+  struct trace_ring *r = trace_ring();
+  if(!r) return;
+  if(!pid) pid = getpid();
+
+  uint64_t idx = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+  struct trace_event *e = &r->events[idx & (TRACE_EVENTS - 1)];
+
+  /* Readers see a 0 (or another index) until the event is complete */
+  __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->ns = ns;
+  e->pid = pid;
+  e->user = current.user;
+  e->uid = current.uid;
+  e->type = type;
+  e->source = current.source;
+  e->code = code;
+  e->value = (value < UINT32_MAX)?value:UINT32_MAX;
+  __atomic_store_n(&e->seq, (uint32_t)(idx + 1), __ATOMIC_RELEASE);
+}
+
+void
+trace_event(enum trace_type type, int code, uint64_t value)
+{
+  trace_record(type, code, value, now_ns());
+}
+
+void
+trace_event_ago(enum trace_type type, int code, uint64_t value, uint64_t ago)
+{
+  trace_record(type, code, value, now_ns() - ago * 1000);
+}
+
+void
+trace_user(const char* username, uid_t uid)
+{
+  struct trace_ring *r = trace_ring();
+  if(!r) return;
+  if(username && !current.user) current.user = trace_hash(r->seed, username);
+  if(uid != (uid_t)-1) current.uid = uid;
+}
+
+void
+trace_begin(enum stats_source source, enum trace_lookup lookup, const char* username, uid_t uid)
+{
+  current.user = 0;
+  current.uid = UINT32_MAX;
+  current.source = source;
+  current.start = now_ns();
+  trace_user(username, uid);
+  trace_record(TRACE_LOOKUP_START, lookup, 0, current.start);
+}
+
+void
+trace_end(int rc)
+{
+  uint64_t now = now_ns();
+  trace_record(TRACE_LOOKUP_END, rc, (now - current.start) / 1000, now);
+  current.user = 0;
+  current.uid = UINT32_MAX;
+}
+
+const struct trace_ring*
+trace_open(void)
+{
+  struct trace_ring *r = NULL;
+  struct stat st;
+
+  int fd = shm_open(TRACE_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+  if(fd < 0){ D2("Could not open %s: %s", TRACE_SHM_NAME, strerror(errno)); return NULL; }
+
+  if(fstat(fd, &st) || (size_t)st.st_size != sizeof(struct trace_ring)){ D1("%s has an unexpected size", TRACE_SHM_NAME); goto BAILOUT; }
+
+  r = mmap(NULL, sizeof(struct trace_ring), PROT_READ, MAP_SHARED, fd, 0);
+  if(r == MAP_FAILED){ D2("Could not map %s: %s", TRACE_SHM_NAME, strerror(errno)); r = NULL; }
+
+BAILOUT:
+  close(fd);
+  return r;
+}
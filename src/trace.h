@@ -0,0 +1,98 @@
+#ifndef __FEGA_TRACE_H_INCLUDED__
+#define __FEGA_TRACE_H_INCLUDED__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+/*
+ * A node-wide ring of the last TRACE_EVENTS lookup events, in shared memory,
+ * to see what happened to one (slow) login after the fact. ega_trace decodes it.
+ *
+ * An event is 32 bytes, written without locks: a slot is taken with an atomic
+ * increment of the head, and its sequence number is written last, so that
+ * a reader can tell a complete event from one being (over)written.
+ *
+ * The region is root-only: the users are recorded as a hash of their name,
+ * keyed with a seed drawn when the region is created.
+ */
+#define TRACE_SHM_NAME "/ega-trace.v1"
+#define TRACE_EVENTS (1 << 16) /* a power of 2 */
+
+enum trace_type {
+  TRACE_LOOKUP_START = 1, /* code: enum trace_lookup */
+  TRACE_LOOKUP_END,       /* code: LOOKUP_* result, value: duration (us) */
+  TRACE_CACHE,            /* code: cache result (-1, 0 hit, 1 miss, 2 expired, 3 in the journal), value: duration (us) */
+  TRACE_CACHE_STALE,      /* an expired entry is served, CentralEGA being throttled */
+  TRACE_CACHE_STORE,      /* code: 0 written, 1 queued for ega_cache_writer, value: duration (us) */
+  TRACE_CEGA_REQUEST,     /* code: endpoint */
+  TRACE_HTTP_CONNECTED,   /* backdated, from cURL's timings. code: endpoint, value: since the request (us) */
+  TRACE_HTTP_TLS,         /* idem, handshake done */
+  TRACE_HTTP_FIRST_BYTE,  /* idem */
+  TRACE_HTTP_DONE,        /* code: HTTP status, value: since the request (us) */
+  TRACE_HTTP_ERROR,       /* code: CURLcode, value: since the request (us) */
+  TRACE_PARSE,            /* code: errors, value: duration (us) */
+  TRACE_DNS,              /* code: 0 pinned from the cache, 1 resolved, -1 resolver failed, 2 by cURL (backdated), value: duration (us) */
+  TRACE_TYPES
+};
+
+enum trace_lookup {
+  TRACE_GETPWNAM = 0,
+  TRACE_GETPWUID,
+  TRACE_GETSPNAM,
+  TRACE_GETUSER,          /* pam_ega_auth.so, password hash */
+  TRACE_PUBKEYS,          /* ega_ssh_keys */
+  TRACE_LOOKUPS
+};
+
+struct trace_event {
+  uint64_t ns;      /* CLOCK_REALTIME */
+  uint32_t seq;     /* index in the ring + 1, written last. 0: being written */
+  int32_t pid;
+  uint32_t user;    /* keyed hash of the username, 0 if not known (yet) */
+  uint32_t uid;     /* (uint32_t)-1 if not known (yet) */
+  uint8_t type;     /* enum trace_type */
+  uint8_t source;   /* enum stats_source */
+  int16_t code;
+  uint32_t value;
+};
+
+struct trace_ring {
+  uint64_t head;    /* events ever written */
+  uint64_t seed;
+  char pad[48];     /* head on its own cache line */
+  struct trace_event events[TRACE_EVENTS];
+};
+
+extern const char* trace_type_names[TRACE_TYPES];
+extern const char* trace_lookup_names[TRACE_LOOKUPS];
+
+/*
+ * The current lookup of the calling thread: the events in between are
+ * recorded with its user. The username and uid may be NULL and -1,
+ * and filled in with trace_user once known.
+ */
+STATS_LOCAL void trace_begin(enum stats_source source, enum trace_lookup lookup, const char* username, uid_t uid);
+STATS_LOCAL void trace_user(const char* username, uid_t uid);
+STATS_LOCAL void trace_end(int rc);
+
+STATS_LOCAL void trace_event(enum trace_type type, int code, uint64_t value);
+/* Backdated by ago us, for what we learn about afterwards */
+STATS_LOCAL void trace_event_ago(enum trace_type type, int code, uint64_t value, uint64_t ago);
+
+/* For ega_trace: read-only, NULL if it does not exist (or we are not root) */
+const struct trace_ring* trace_open(void);
+
+/* Seeded FNV-1a, never 0 */
+static inline uint32_t
+trace_hash(uint64_t seed, const char* username)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+  for(; *username; username++) h = (h ^ (unsigned char)*username) * 0x100000001b3ULL;
+  h ^= h >> 29; h *= 0xbf58476d1ce4e5b9ULL; h ^= h >> 32;
+  return ((uint32_t)h)?(uint32_t)h:1;
+}
+
+#endif /* !__FEGA_TRACE_H_INCLUDED__ */